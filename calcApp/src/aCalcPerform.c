@@ -21,6 +21,7 @@
 #include <math.h>
 
 #include "dbDefs.h"
+#include "epicsTypes.h"
 #include "epicsMath.h"
 #include "cvtFast.h"
 #include "epicsString.h"
@@ -28,22 +29,12 @@
 #define epicsExportSharedSymbols
 #include "aCalcPostfix.h"
 #include "aCalcPostfixPvt.h"
+#include "calcRandom.h"
 #include <iocsh.h>
 #include <epicsMutex.h>
-#include <epicsTime.h>
+#include <epicsThread.h>
 #include <epicsExport.h>
 
-/* base currently (3.15.0.1) does not have the freeList behavior needed to
- * manage a list of freeLists as aCalcPerform needs.  If it ever gets the
- * needed behavior, we should use it and get rid of myFreeList*.
- */
-#define USE_BASE_FREELIST 0
-#if USE_BASE_FREELIST
-#include <freeList.h>
-#else
-#include <myFreeList.h>
-#endif
-
 /* Note value much larger than this breaks MEDM's plot */
 #define	myMAXFLOAT	((float)1e+35)
 #define myNINT(a) ((int)((a) >= 0 ? (a)+0.5 : (a)-0.5))
@@ -54,8 +45,8 @@
 #define myMIN(a,b) (a)<(b)?(a):(b)
 #define SMALL 1.e-9
 
-static double local_random();
 static int cond_search(const unsigned char **ppinst, int match);
+static int op_length(const unsigned char *post);
 
 /* from calcUtil */
 extern int deriv(double *x, double *y, int n, double *d);
@@ -68,6 +59,8 @@ volatile int aCalcPerformDebug = 0;
 epicsExportAddress(int, aCalcPerformDebug);
 volatile int aCalcLoopMax = 1000;
 epicsExportAddress(int, aCalcLoopMax);
+volatile int aCalcFuse = 1;
+epicsExportAddress(int, aCalcFuse);
 
 typedef struct {
 	double d;
@@ -76,60 +69,310 @@ typedef struct {
 	int firstEl;
 	int numEl;
 	int sourceDouble; /* number of double argument from which this stack element was copied */
+	int sparse;		/* if nonzero, only a[0..stored-1] are stored; the rest have the value fill */
+	int stored;
+	double fill;
 } stackElement;
 
-#if DEBUG
-int aCalcStackHW = 0;	/* high-water mark */
-int aCalcStackLW = 0;	/* low-water mark */
-#define INC(ps) {							\
-	++ps;									\
-	if ((int)((ps)-top) > aCalcStackHW)		\
-		aCalcStackHW = (int)((ps)-top);		\
-	if ((ps-top)>ACALC_STACKSIZE) {			\
-		printf("aCalcPerform:stack overflow\n");	\
-		freeStack(flp, stack); return(-1);	\
-	} else {								\
-		(ps)->numEl = -1;					\
-		(ps)->sourceDouble=-1;				\
-	}										\
+void calcFirstLast(stackElement *ps, int *firstEl, int *lastEl, int arraySize);
+
+#define MAX_UNTIL_OP 10
+
+/* One instruction of a linked program: a postfix operator with its operand decoded,
+ * and the target of any jump resolved, so evaluation never has to search the postfix.
+ */
+typedef struct {
+	double d;		/* LITERAL_DOUBLE, LITERAL_INT: value */
+	int jump;		/* COND_IF, COND_ELSE: instruction to jump to (-1 if none)
+					 * UNTIL: loop number; UNTIL_END: instruction of matching UNTIL */
+	int fuse;		/* if nonzero, this instruction starts fused run number (fuse-1) */
+	int skip;		/* reuse: instruction that follows the subexpression */
+	unsigned char save;		/* joint programs: if nonzero, before this instruction runs, the
+							 * top of the stack is kept in ctx->shared[save-1] */
+	unsigned char reuse;	/* joint programs: if nonzero, this instruction begins a
+							 * subexpression whose value might be in ctx->shared[reuse-1] */
+	unsigned char op;
+	unsigned char scalar;	/* elementwise operator whose operands are always scalars:
+							 * number of operands */
+	unsigned char nargs;	/* VARARGS functions: number of arguments */
+} linkedOp;
+
+/* A run of instructions that can be evaluated one array element at a time (e.g.,
+ * "(AA-BB)*C/DD+E"), and that leaves a single array on the stack.  We evaluate such
+ * a run one tile of ACALC_TILE elements at a time, so intermediate results stay in
+ * cache, and only the run's result is written to a full-size stack-element array.
+ */
+typedef struct {
+	int end;		/* instruction following the run */
+	int depth;		/* greatest number of values the run holds on the stack */
+	int numArrays;	/* number of array arguments the run needs (highest FETCH_xx + 1) */
+} fusedRun;
+
+#define ACALC_TILE 256	/* doubles */
+
+/* A postfix expression, linked for evaluation.  We keep a copy of the postfix,
+ * so we can tell when the caller's expression has changed.  A joint program
+ * evaluates two expressions (see aCalcPerformJointCtx()): its postfix is the
+ * first expression's followed by the second's, and in prog, the instruction
+ * LINKED_RESULT separates them.
+ */
+typedef struct {
+	unsigned char *postfix;
+	int postLen;			/* bytes, including END_EXPRESSION */
+	int postLen1;			/* joint programs: bytes of the first expression; otherwise 0 */
+	linkedOp *prog;
+	fusedRun *runs;
+	aCalcShape shape;		/* stack depth, and stack elements that might hold arrays */
+	int numReductions;		/* AVG, STD, SUM, AMAX, IXMAX, etc. */
+	unsigned long lastUsed;
+} linkedProgram;
+
+#define NUM_PROGRAMS 2		/* e.g., acalcout's CALC and OCAL expressions */
+#define THREAD_PROGRAMS 16	/* aCalcPerform()'s context, shared by all of a thread's callers */
+
+/* Not an aCalc operator: ends the first expression of a joint program */
+#define LINKED_RESULT 0xff
+
+/* Values a joint program's first expression can keep for its second */
+#define ACALC_MAX_SHARED 8
+
+/* Everything aCalcPerformCtx() needs to keep from one evaluation to the next.
+ * The caller allocates one of these with aCalcContextCreate(), and uses it for
+ * every evaluation, so that (after the first few calls) an evaluation neither
+ * allocates memory nor takes a global lock.  A context must not be used by
+ * more than one thread at a time.
+ */
+struct aCalcContext {
+	stackElement stack[ACALC_STACKSIZE+1];	/* stack[0] is below the bottom of the stack */
+	int arraySize;		/* number of doubles in each stack element's array */
+	long allocated;		/* bytes held in stack-element arrays and tile buffer */
+	linkedProgram *programs;	/* the most recently used linked programs */
+	int numPrograms;
+	stackElement *until_ps[MAX_UNTIL_OP];	/* stack pointer at each UNTIL */
+	double *tiles;		/* intermediate results of fused runs, ACALC_TILE doubles per stack level */
+	int numTiles;
+	aCalcStats stats;	/* last reduction of a caller's array, for the next reduction */
+	const double *statsA;	/* first element of that reduction, or NULL */
+	int statsWhat;
+	calcRandomState rng;	/* RNDM, NRNDM, ARNDM, ANRNDM */
+	int stackHW;		/* high-water mark */
+	int stackLW;		/* low-water mark */
+	unsigned long numCalls;
+	int resultFirst[2];	/* elements of the caller's result arrays that the last call changed */
+	int resultNumEl[2];
+	stackElement shared[ACALC_MAX_SHARED];	/* subexpressions shared by a joint program */
+	int sharedValid;	/* bit i set if shared[i] holds this call's value */
+	int argType;		/* element type of the caller's arrays (ACALC_TYPE_xxx) */
+	int argSize;		/* bytes per element of the caller's arrays */
+};
+
+/* aCalcPostfixCheck() has made sure, when the expression was linked, that the stack
+ * can neither overflow nor underflow, so INC() and DEC() don't check.
+ */
+#define INC(ps) {++ps; (ps)->numEl = -1; (ps)->sourceDouble=-1; (ps)->sparse = 0;}
+#define DEC(ps) ps--
+
+/*** begin manage memory held by evaluation contexts ***/
+
+static epicsThreadOnceId ctxOnce = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId ctxMemLock=0;
+static long ctxMemTotal=0;
+static epicsUInt32 ctxCount=0;	/* contexts created, for default seeds */
+/* context used by aCalcPerform(), one per calling thread.  Thread-private storage
+ * has no destructor, so the context outlives its thread unless the thread calls
+ * aCalcPerformThreadCleanup().
+ */
+static epicsThreadPrivateId ctxPrivate=0;
+
+static void ctxInit(void *arg) {
+	ctxMemLock = epicsMutexMustCreate();
+	ctxPrivate = epicsThreadPrivateCreate();
 }
-#define DEC(ps) {							\
-	--ps;									\
-	if ((int)((ps)-top) < aCalcStackLW)		\
-		aCalcStackLW = (int)((ps)-top);		\
-	if ((ps-top)<-1) {						\
-		printf("aCalcPerform:stack underflow\n");	\
-		freeStack(flp, stack); return(-1);	\
-	}										\
+
+static void ctxMemAdjust(long bytes) {
+	epicsThreadOnce(&ctxOnce, ctxInit, NULL);
+	epicsMutexMustLock(ctxMemLock);
+	ctxMemTotal += bytes;
+	epicsMutexUnlock(ctxMemLock);
 }
 
-#else
-#define INC(ps) {++ps; (ps)->numEl = -1; (ps)->sourceDouble=-1;}
-#define DEC(ps) ps--
-#endif
+static void ctxFreeArrays(aCalcContext *ctx) {
+	int i;
+	for (i=0; i<ACALC_STACKSIZE+1; i++) {
+		if (ctx->stack[i].array) {
+			free(ctx->stack[i].array);
+			ctx->stack[i].array = NULL;
+		}
+		ctx->stack[i].a = NULL;
+	}
+	for (i=0; i<ACALC_MAX_SHARED; i++) {
+		free(ctx->shared[i].array);
+		ctx->shared[i].array = NULL;
+		ctx->shared[i].a = NULL;
+	}
+	ctx->sharedValid = 0;
+	free(ctx->tiles);
+	ctx->tiles = NULL;
+	ctx->numTiles = 0;
+	if (ctx->allocated) ctxMemAdjust(-ctx->allocated);
+	ctx->allocated = 0;
+}
+
+/* A context that keeps up to numPrograms linked programs */
+static aCalcContext *context_create(int arraySize, int numPrograms) {
+	aCalcContext *ctx;
+
+	ctx = (aCalcContext *)calloc(1, sizeof(aCalcContext));
+	if (ctx == NULL) return(NULL);
+	ctx->programs = (linkedProgram *)calloc(numPrograms, sizeof(linkedProgram));
+	if (ctx->programs == NULL) {
+		free(ctx);
+		return(NULL);
+	}
+	ctx->numPrograms = numPrograms;
+	ctx->arraySize = myMAX(arraySize, 1);
+	ctx->argType = ACALC_TYPE_DOUBLE;
+	ctx->argSize = sizeof(double);
+	/* Give every context its own random sequence. */
+	epicsThreadOnce(&ctxOnce, ctxInit, NULL);
+	epicsMutexMustLock(ctxMemLock);
+	calcRandomSeed(&ctx->rng, 0xa3bf + ctxCount++);
+	epicsMutexUnlock(ctxMemLock);
+	return(ctx);
+}
+
+aCalcContext *aCalcContextCreate(int arraySize) {
+	return(context_create(arraySize, NUM_PROGRAMS));
+}
+
+/* Restart the context's random-number sequence.  Equal seeds give equal sequences. */
+void aCalcContextSeed(aCalcContext *ctx, epicsUInt32 seed) {
+	if (ctx) calcRandomSeed(&ctx->rng, seed);
+}
+
+int aCalcTypeSize(int type) {
+	switch (type) {
+	case ACALC_TYPE_DOUBLE:		return(sizeof(double));
+	case ACALC_TYPE_FLOAT32:	return(sizeof(epicsFloat32));
+	case ACALC_TYPE_INT32:		return(sizeof(epicsInt32));
+	case ACALC_TYPE_UINT16:		return(sizeof(epicsUInt16));
+	default:					return(0);
+	}
+}
+
+int aCalcContextArgType(aCalcContext *ctx, int type) {
+	if ((ctx == NULL) || (aCalcTypeSize(type) == 0)) return(-1);
+	ctx->argType = type;
+	ctx->argSize = aCalcTypeSize(type);
+	ctx->statsA = NULL;
+	return(0);
+}
+
+static void free_program(linkedProgram *lp) {
+	free(lp->postfix);
+	free(lp->prog);
+	free(lp->runs);
+	lp->postfix = NULL;
+	lp->prog = NULL;
+	lp->runs = NULL;
+	lp->postLen = 0;
+	lp->postLen1 = 0;
+}
+
+void aCalcContextFree(aCalcContext *ctx) {
+	int i;
+	if (ctx == NULL) return;
+	ctxFreeArrays(ctx);
+	for (i=0; i<ctx->numPrograms; i++) free_program(&ctx->programs[i]);
+	free(ctx->programs);
+	free(ctx);
+}
+
+void aCalcContextResultRange(const aCalcContext *ctx, int *pfirstEl, int *pnumEl) {
+	*pfirstEl = ctx ? ctx->resultFirst[0] : 0;
+	*pnumEl = ctx ? ctx->resultNumEl[0] : 0;
+}
+
+void aCalcContextResultRange2(const aCalcContext *ctx, int *pfirstEl, int *pnumEl) {
+	*pfirstEl = ctx ? ctx->resultFirst[1] : 0;
+	*pnumEl = ctx ? ctx->resultNumEl[1] : 0;
+}
+
+void aCalcContextReport(const aCalcContext *ctx) {
+	if (ctx == NULL) return;
+	printf("aCalcContext %p: arraySize=%d, memory=%ld bytes, calls=%lu, stack lo=%d, hi=%d\n",
+		(void *)ctx, ctx->arraySize, ctx->allocated, ctx->numCalls, ctx->stackLW, ctx->stackHW);
+}
+
+long acalcTotalAllocatedMemory(void) {
+	long total;
+	epicsThreadOnce(&ctxOnce, ctxInit, NULL);
+	epicsMutexMustLock(ctxMemLock);
+	total = ctxMemTotal;
+	epicsMutexUnlock(ctxMemLock);
+	if (aCalcPerformDebug>1) printf("aCalcPerform:total memory %f MB\n", total/1.e6);
+	return(total);
+}
+
+/*** end manage memory held by evaluation contexts ***/
 
 /*** begin convert stack element between array and double ***/
 
 #define isDouble(ps) ((ps)->a==NULL)
 #define isArray(ps) ((ps)->a != NULL)
 
+/* Array-valued stack element that borrows someone else's array (e.g., one of the
+ * caller's array arguments), instead of holding its own.  We can read a borrowed
+ * array, but we must copy it before modifying it.
+ */
+#define isBorrowed(ps) (isArray(ps) && ((ps)->a != (ps)->array))
+
+/* If the caller's arrays hold doubles, a stack element can borrow them.  Otherwise,
+ * their elements are converted (see k_widen() and k_narrow()), and nothing on the
+ * stack ever refers to them.
+ */
+#define canBorrow(ctx) ((ctx)->argType == ACALC_TYPE_DOUBLE)
+
+/* address of element i of the caller's array pa */
+#define argElement(ctx, pa, i) ((char *)(pa) + (size_t)(i)*(ctx)->argSize)
+
+/* Array-valued stack element whose elements past ps->stored aren't in memory, but
+ * all have the value ps->fill (e.g., the zeros that follow a subrange).  Operators
+ * that can work with the stored elements alone keep the stack element sparse, so
+ * their cost is proportional to the subrange, rather than to the whole array.
+ * Other operators make it dense first.
+ */
+#define isSparse(ps) (isArray(ps) && (ps)->sparse)
+
 /* convert stack element of unknown type to double */
 #define toDouble(ps) {if (isArray(ps)) to_double(ps);}
 
 /* convert array-valued stack element to double */
-#define to_double(ps) {(ps)->d = (ps)->a[0]; (ps)->a = NULL;}
+#define to_double(ps) {													\
+	(ps)->d = ((ps)->sparse && (ps)->stored < 1) ? (ps)->fill : (ps)->a[0];	\
+	(ps)->a = NULL;														\
+	(ps)->sparse = 0;													\
+}
 
-/* convert double-valued stack element to array */
-int to_array(void *flp, stackElement *ps, int arraySize, int setValues) {
-	int ii;
+static int alloc_array(aCalcContext *ctx, stackElement *ps) {
 	if (ps->array == NULL) {
-		ps->array = (double *)freeListMalloc(flp);
+		ps->array = (double *)malloc(ctx->arraySize*sizeof(double));
 		if (ps->array == NULL) {
 			return(-1);
 		}
+		ctx->allocated += ctx->arraySize*sizeof(double);
+		ctxMemAdjust(ctx->arraySize*sizeof(double));
 	}
+	return(0);
+}
+
+/* convert double-valued stack element to array */
+static int to_array(aCalcContext *ctx, stackElement *ps, int arraySize, int setValues) {
+	int ii;
+	if (alloc_array(ctx, ps)) return(-1);
 	ps->a = &(ps->array[0]);
 	ps->numEl = -1;
+	ps->sparse = 0;
 
 	if (setValues) {
 		if (isnan(ps->d))
@@ -141,144 +384,838 @@ int to_array(void *flp, stackElement *ps, int arraySize, int setValues) {
 	return(0);
 }
 
-/* convert stack element of unknown type to array */
+/* give borrowed-array stack element its own array, copying values if copyValues */
+static int own_array(aCalcContext *ctx, stackElement *ps, int arraySize, int copyValues) {
+	if (alloc_array(ctx, ps)) return(-1);
+	if (copyValues) memcpy(ps->array, ps->a, (ps->sparse ? ps->stored : arraySize)*sizeof(double));
+	ps->a = &(ps->array[0]);
+	return(0);
+}
+
+/* give sparse stack element all of its elements */
+static int densify(aCalcContext *ctx, stackElement *ps, int arraySize) {
+	int i;
+	if (!isSparse(ps)) return(0);
+	if (isBorrowed(ps) && own_array(ctx, ps, arraySize, 1)) return(-1);
+	for (i=ps->stored; i<arraySize; i++) ps->a[i] = ps->fill;
+	ps->sparse = 0;
+	return(0);
+}
+
+/* convert stack element of unknown type to an array we can modify */
 #define toArray(ps, setValues) {									\
 	if (isDouble(ps)) {												\
-		if (to_array(flp, (ps), arraySize, (setValues)) == -1) {	\
+		if (to_array(ctx, (ps), arraySize, (setValues)) == -1) {	\
+			printf("aCalcPerform: Can't allocate array.\n");		\
+			return(-1);												\
+		}															\
+	} else if (isBorrowed(ps)) {									\
+		if (own_array(ctx, (ps), arraySize, (setValues)) == -1) {	\
 			printf("aCalcPerform: Can't allocate array.\n");		\
-			freeStack(flp, stack);									\
 			return(-1);												\
 		}															\
 	}																\
 }
 
+/* make array-valued stack element modifiable (copy on write) */
+#define toWritable(ps) {if (isArray(ps)) toArray(ps,1);}
+
+/* Before pd is overwritten, give every stack element from ps down that borrowed
+ * it (or part of it) a copy of its current values.
+ */
+static int unborrow(aCalcContext *ctx, stackElement *ps, const double *pd, int arraySize) {
+	for ( ; ps >= ctx->stack; ps--) {
+		if (isBorrowed(ps) && (ps->a >= pd) && (ps->a <= pd + arraySize)) {
+			if (own_array(ctx, ps, arraySize, 1)) return(-1);
+		}
+	}
+	return(0);
+}
+
 /*** end convert stack element between array and double ***/
 
-/*** begin manage an array of freeLists ***/
+/*** begin elementwise array kernels ***/
 
-/* an fList is a list of freeLists */
-epicsMutexId fListLock=0;
+/* Whole-array loops for elementwise operators, written without branches, and with
+ * restrict-qualified pointers (stack elements never share arrays), so the compiler
+ * can vectorize them.  With gcc on x86_64 linux, each kernel is also compiled for
+ * AVX2 and AVX-512, and the best version for the CPU is selected when the library
+ * is loaded.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 6) && \
+	defined(__x86_64__) && defined(__linux__)
+#define ACALC_KERNEL static __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define ACALC_KERNEL static
+#endif
 
-typedef struct {
-	void *freeListPvt;
-	int numDoubles;
-} fListElement;
-
-#define NLISTS 5
-fListElement fList[NLISTS] = {{0}};
-
-void *get_freeList(int nuse) {
-	int i, j, n;
-	void *flp;
-	epicsTimeStamp ts, ts1;
-
-	epicsMutexMustLock(fListLock);
-
-	/* exact size match? */
-	for (i=0; i<NLISTS; i++) {
-		if (fList[i].numDoubles == nuse) {
-			if (aCalcPerformDebug>10) printf("aCalcPerform:get_freeList found list of size %d\n", nuse);
-			epicsMutexUnlock(fListLock);
-			return(fList[i].freeListPvt);			
+#if defined(__GNUC__)
+#define RESTRICT __restrict__
+#elif defined(_MSC_VER)
+#define RESTRICT __restrict
+#else
+#define RESTRICT
+#endif
+
+/* a = a op b, for arithmetic, relational, logical, bitwise, MAX_VAL and MIN_VAL operators */
+ACALC_KERNEL void k_binary_aa(int op, double * RESTRICT a, const double * RESTRICT b, int n) {
+	int i;
+	switch (op) {
+	case ADD:			for (i=0; i<n; i++) a[i] += b[i]; break;
+	case SUB:			for (i=0; i<n; i++) a[i] -= b[i]; break;
+	case MULT:			for (i=0; i<n; i++) a[i] *= b[i]; break;
+	case DIV:			for (i=0; i<n; i++) a[i] = (b[i] == 0) ? myMAXFLOAT : a[i] / b[i]; break;
+	case MODULO:
+		for (i=0; i<n; i++) a[i] = ((int)b[i] == 0) ? myMAXFLOAT : (double)((int)a[i] % (int)b[i]);
+		break;
+	case GR_OR_EQ:		for (i=0; i<n; i++) a[i] = a[i] >= b[i]; break;
+	case GR_THAN:		for (i=0; i<n; i++) a[i] = a[i] > b[i]; break;
+	case LESS_OR_EQ:	for (i=0; i<n; i++) a[i] = a[i] <= b[i]; break;
+	case LESS_THAN:		for (i=0; i<n; i++) a[i] = a[i] < b[i]; break;
+	case NOT_EQ:		for (i=0; i<n; i++) a[i] = a[i] != b[i]; break;
+	case EQUAL:			for (i=0; i<n; i++) a[i] = a[i] == b[i]; break;
+	case MAX_VAL:		for (i=0; i<n; i++) a[i] = (a[i] < b[i]) ? b[i] : a[i]; break;
+	case MIN_VAL:		for (i=0; i<n; i++) a[i] = (a[i] > b[i]) ? b[i] : a[i]; break;
+	case REL_OR:		for (i=0; i<n; i++) a[i] = (a[i] != 0) | (b[i] != 0); break;
+	case REL_AND:		for (i=0; i<n; i++) a[i] = (a[i] != 0) & (b[i] != 0); break;
+	case BIT_OR:		for (i=0; i<n; i++) a[i] = (int)a[i] | (int)b[i]; break;
+	case BIT_AND:		for (i=0; i<n; i++) a[i] = (int)a[i] & (int)b[i]; break;
+	case BIT_EXCL_OR:	for (i=0; i<n; i++) a[i] = (int)a[i] ^ (int)b[i]; break;
+	}
+}
+
+ACALC_KERNEL void k_binary_as(int op, double * RESTRICT a, double b, int n) {
+	int i;
+	switch (op) {
+	case ADD:			for (i=0; i<n; i++) a[i] += b; break;
+	case SUB:			for (i=0; i<n; i++) a[i] -= b; break;
+	case MULT:			for (i=0; i<n; i++) a[i] *= b; break;
+	case DIV:
+		if (b == 0) {
+			for (i=0; i<n; i++) a[i] = myMAXFLOAT;
+		} else {
+			for (i=0; i<n; i++) a[i] /= b;
 		}
+		break;
+	case MODULO:
+		if ((int)b == 0) {
+			for (i=0; i<n; i++) a[i] = myMAXFLOAT;
+		} else {
+			for (i=0; i<n; i++) a[i] = (double)((int)a[i] % (int)b);
+		}
+		break;
+	case GR_OR_EQ:		for (i=0; i<n; i++) a[i] = a[i] >= b; break;
+	case GR_THAN:		for (i=0; i<n; i++) a[i] = a[i] > b; break;
+	case LESS_OR_EQ:	for (i=0; i<n; i++) a[i] = a[i] <= b; break;
+	case LESS_THAN:		for (i=0; i<n; i++) a[i] = a[i] < b; break;
+	case NOT_EQ:		for (i=0; i<n; i++) a[i] = a[i] != b; break;
+	case EQUAL:			for (i=0; i<n; i++) a[i] = a[i] == b; break;
+	case MAX_VAL:		for (i=0; i<n; i++) a[i] = (a[i] < b) ? b : a[i]; break;
+	case MIN_VAL:		for (i=0; i<n; i++) a[i] = (a[i] > b) ? b : a[i]; break;
+	case REL_OR:		for (i=0; i<n; i++) a[i] = (a[i] != 0) | (b != 0); break;
+	case REL_AND:		for (i=0; i<n; i++) a[i] = (a[i] != 0) & (b != 0); break;
+	case BIT_OR:		for (i=0; i<n; i++) a[i] = (int)a[i] | (int)b; break;
+	case BIT_AND:		for (i=0; i<n; i++) a[i] = (int)a[i] & (int)b; break;
+	case BIT_EXCL_OR:	for (i=0; i<n; i++) a[i] = (int)a[i] ^ (int)b; break;
 	}
+}
 
-	/* good enough size match? */
-	for (i=0; i<NLISTS; i++) {
-		n = fList[i].numDoubles;
-		if (n >= nuse && n <= nuse*2) {
-			if (aCalcPerformDebug>10) printf("aCalcPerform:get_freeList wanted size %d, found %d\n", nuse, n);
-			epicsMutexUnlock(fListLock);
-			return(fList[i].freeListPvt);			
+/* a = op(a), for unary operators that can't fail */
+ACALC_KERNEL void k_unary(int op, double * RESTRICT a, int n) {
+	int i;
+	switch (op) {
+	case ABS_VAL:	for (i=0; i<n; i++) a[i] = (a[i] < 0) ? -a[i] : a[i]; break;
+	case ANEG_VAL:	for (i=0; i<n; i++) a[i] = (a[i] < 0) ? 0 : a[i]; break;
+	case APOS_VAL:	for (i=0; i<n; i++) a[i] = (a[i] > 0) ? 0 : a[i]; break;
+	case UNARY_NEG:	for (i=0; i<n; i++) a[i] = -a[i]; break;
+	case CEIL:		for (i=0; i<n; i++) a[i] = ceil(a[i]); break;
+	case FLOOR:		for (i=0; i<n; i++) a[i] = floor(a[i]); break;
+	case ISINF:		for (i=0; i<n; i++) a[i] = isinf(a[i]) ? 1 : 0; break;
+	case NINT:		for (i=0; i<n; i++) a[i] = (double)(long)(a[i] >= 0 ? a[i]+0.5 : a[i]-0.5); break;
+	case REL_NOT:	for (i=0; i<n; i++) a[i] = (a[i] == 0); break;
+	case BIT_NOT:	for (i=0; i<n; i++) a[i] = ~(int)(a[i]); break;
+	case EXP:		for (i=0; i<n; i++) a[i] = exp(a[i]); break;
+	case ACOS:		for (i=0; i<n; i++) a[i] = acos(a[i]); break;
+	case ASIN:		for (i=0; i<n; i++) a[i] = asin(a[i]); break;
+	case ATAN:		for (i=0; i<n; i++) a[i] = atan(a[i]); break;
+	case COS:		for (i=0; i<n; i++) a[i] = cos(a[i]); break;
+	case SIN:		for (i=0; i<n; i++) a[i] = sin(a[i]); break;
+	case TAN:		for (i=0; i<n; i++) a[i] = tan(a[i]); break;
+	case COSH:		for (i=0; i<n; i++) a[i] = cosh(a[i]); break;
+	case SINH:		for (i=0; i<n; i++) a[i] = sinh(a[i]); break;
+	case TANH:		for (i=0; i<n; i++) a[i] = tanh(a[i]); break;
+	}
+}
+
+/* dst[i] = a[i], for the caller's array a of elements of the given type */
+ACALC_KERNEL void k_widen(int type, double * RESTRICT dst, const void * RESTRICT a, int n) {
+	const epicsFloat32 *pf = (const epicsFloat32 *)a;
+	const epicsInt32 *pl = (const epicsInt32 *)a;
+	const epicsUInt16 *pu = (const epicsUInt16 *)a;
+	int i;
+	switch (type) {
+	case ACALC_TYPE_FLOAT32:	for (i=0; i<n; i++) dst[i] = pf[i]; break;
+	case ACALC_TYPE_INT32:		for (i=0; i<n; i++) dst[i] = pl[i]; break;
+	case ACALC_TYPE_UINT16:		for (i=0; i<n; i++) dst[i] = pu[i]; break;
+	default:	memcpy(dst, a, n*sizeof(double)); break;
+	}
+}
+
+/* a[i] = src[i], or, if src is NULL, a[i] = d, for the caller's array a of elements
+ * of the given type.  Integers are truncated, as dbPut() would do it, but out-of-range
+ * values saturate, and NaN becomes zero.
+ */
+#define SATURATE(x, lo, hi) (((x) >= (lo)) ? (((x) <= (hi)) ? (x) : (hi)) : (((x) < (lo)) ? (lo) : 0.))
+ACALC_KERNEL void k_narrow(int type, void * RESTRICT a, const double * RESTRICT src, double d, int n) {
+	epicsFloat32 *pf = (epicsFloat32 *)a;
+	epicsInt32 *pl = (epicsInt32 *)a;
+	epicsUInt16 *pu = (epicsUInt16 *)a;
+	double *pd = (double *)a;
+	int i;
+	if (src == NULL) {
+		switch (type) {
+		case ACALC_TYPE_FLOAT32:
+			for (i=0; i<n; i++) pf[i] = (epicsFloat32)d;
+			break;
+		case ACALC_TYPE_INT32:
+			d = SATURATE(d, -2147483648., 2147483647.);
+			for (i=0; i<n; i++) pl[i] = (epicsInt32)d;
+			break;
+		case ACALC_TYPE_UINT16:
+			d = SATURATE(d, 0., 65535.);
+			for (i=0; i<n; i++) pu[i] = (epicsUInt16)d;
+			break;
+		default:
+			for (i=0; i<n; i++) pd[i] = d;
+			break;
 		}
+		return;
+	}
+	switch (type) {
+	case ACALC_TYPE_FLOAT32:
+		for (i=0; i<n; i++) pf[i] = (epicsFloat32)src[i];
+		break;
+	case ACALC_TYPE_INT32:
+		for (i=0; i<n; i++) pl[i] = (epicsInt32)SATURATE(src[i], -2147483648., 2147483647.);
+		break;
+	case ACALC_TYPE_UINT16:
+		for (i=0; i<n; i++) pu[i] = (epicsUInt16)SATURATE(src[i], 0., 65535.);
+		break;
+	default:
+		memcpy(pd, src, n*sizeof(double));
+		break;
 	}
+}
+#undef SATURATE
+
+/*** end elementwise array kernels ***/
+
+/*** begin evaluate fused runs ***/
+
+/* a op b, for scalars, exactly as aCalcPerformCtx() does it */
+static double fuse_binary(int op, double a, double b) {
+	switch (op) {
+	case ADD:			return(a + b);
+	case SUB:			return(a - b);
+	case MULT:			return(a * b);
+	case DIV:			return((b == 0) ? myMAXFLOAT : a / b);
+	case MODULO:		return(((int)b == 0) ? myMAXFLOAT : (double)((int)a % (int)b));
+	case GR_OR_EQ:		return(a >= b);
+	case GR_THAN:		return(a > b);
+	case LESS_OR_EQ:	return(a <= b);
+	case LESS_THAN:		return(a < b);
+	case NOT_EQ:		return(a != b);
+	case EQUAL:			return(a == b);
+	case MAX_VAL:		return((a < b) ? b : a);
+	case MIN_VAL:		return((a > b) ? b : a);
+	case REL_OR:		return(a || b);
+	case REL_AND:		return(a && b);
+	case BIT_OR:		return((int)a | (int)b);
+	case BIT_AND:		return((int)a & (int)b);
+	case BIT_EXCL_OR:	return((int)a ^ (int)b);
+	}
+	return(a);
+}
+
+/* op(d), for scalars, exactly as aCalcPerformCtx() does it */
+static double fuse_unary(int op, double d) {
+	switch (op) {
+	case ABS_VAL:	return((d < 0) ? -d : d);
+	case ANEG_VAL:	return((d < 0) ? 0 : d);
+	case APOS_VAL:	return((d > 0) ? 0 : d);
+	case UNARY_NEG:	return(d * -1);
+	case CEIL:		return(ceil(d));
+	case FLOOR:		return(floor(d));
+	case ISINF:		return(isinf(d));
+	case NINT:		return((double)(long)(d >= 0 ? d+0.5 : d-0.5));
+	case REL_NOT:	return(d ? 0 : 1);
+	case BIT_NOT:	return(~(int)(d));
+	case EXP:		return(exp(d));
+	case ACOS:		return(acos(d));
+	case ASIN:		return(asin(d));
+	case ATAN:		return(atan(d));
+	case COS:		return(cos(d));
+	case SIN:		return(sin(d));
+	case TAN:		return(tan(d));
+	case COSH:		return(cosh(d));
+	case SINH:		return(sinh(d));
+	case TANH:		return(tanh(d));
+	}
+	return(d);
+}
+
+typedef struct {
+	double d;
+	const double *a;	/* NULL if the value is a scalar */
+} tileElement;
+
+/* Evaluate the fused run of instructions [first, last), which holds at most depth
+ * values on the stack, writing arraySize results to result.  Array arguments are
+ * read in place, and each tile of ACALC_TILE elements goes through the whole run
+ * before we start on the next, so intermediate results never leave the tile buffer.
+ * Scalars combine with scalars, and with arrays, just as they do in unfused code.
+ */
+static int fused_eval(aCalcContext *ctx, const linkedOp *first, const linkedOp *last,
+	int depth, double *p_dArg, int num_dArgs, double **pp_aArg, int arraySize,
+	double *p_dresult, double *p_aresult, double *result)
+{
+	tileElement ts[ACALC_STACKSIZE+1], *pt, *pt1;
+	const linkedOp *pc;
+	double *dst, *tiles, d;
+	long bytes;
+	int base, n, i, op;
+
+	/* stack level 0 is evaluated directly into result */
+	if (depth > ctx->numTiles) {
+		tiles = (double *)realloc(ctx->tiles, depth*ACALC_TILE*sizeof(double));
+		if (tiles == NULL) return(-1);
+		bytes = (long)(depth - ctx->numTiles)*ACALC_TILE*sizeof(double);
+		ctx->tiles = tiles;
+		ctx->numTiles = depth;
+		ctx->allocated += bytes;
+		ctxMemAdjust(bytes);
+	}
+#define TILE(pt) (((pt) == ts) ? result+base : ctx->tiles + ((pt)-ts)*ACALC_TILE)
+
+	for (base=0; base<arraySize; base+=ACALC_TILE) {
+		n = myMIN(ACALC_TILE, arraySize-base);
+		pt = ts-1;
+		for (pc=first; pc<last; pc++) {
+			switch (op = pc->op) {
+			case FETCH_A: case FETCH_B: case FETCH_C: case FETCH_D: case FETCH_E: case FETCH_F:
+			case FETCH_G: case FETCH_H: case FETCH_I: case FETCH_J: case FETCH_K: case FETCH_L:
+			case FETCH_M: case FETCH_N: case FETCH_O: case FETCH_P:
+				++pt; pt->a = NULL;
+				pt->d = (num_dArgs > (op - FETCH_A)) ? p_dArg[op - FETCH_A] : 0.;
+				break;
+			case FETCH_VAL:			++pt; pt->a = NULL; pt->d = *p_dresult; break;
+			case LITERAL_DOUBLE:
+			case LITERAL_INT:		++pt; pt->a = NULL; pt->d = pc->d; break;
+			case CONST_PI:			++pt; pt->a = NULL; pt->d = PI; break;
+			case CONST_D2R:			++pt; pt->a = NULL; pt->d = PI/180.; break;
+			case CONST_R2D:			++pt; pt->a = NULL; pt->d = 180./PI; break;
+			case CONST_S2R:			++pt; pt->a = NULL; pt->d = PI/(180.*3600); break;
+			case CONST_R2S:			++pt; pt->a = NULL; pt->d = (180.*3600)/PI; break;
+			case FETCH_AA: case FETCH_BB: case FETCH_CC: case FETCH_DD: case FETCH_EE: case FETCH_FF:
+			case FETCH_GG: case FETCH_HH: case FETCH_II: case FETCH_JJ: case FETCH_KK: case FETCH_LL:
+				++pt;
+				if (pp_aArg[op - FETCH_AA] && canBorrow(ctx)) {
+					pt->a = pp_aArg[op - FETCH_AA] + base;
+				} else if (pp_aArg[op - FETCH_AA]) {
+					dst = TILE(pt);
+					k_widen(ctx->argType, dst, argElement(ctx, pp_aArg[op - FETCH_AA], base), n);
+					pt->a = dst;
+				} else {
+					dst = TILE(pt);
+					for (i=0; i<n; i++) dst[i] = 0.;
+					pt->a = dst;
+				}
+				break;
+			case FETCH_AVAL:		++pt; pt->a = p_aresult + base; break;
+			case CONST_IX:
+				++pt;
+				dst = TILE(pt);
+				for (i=0; i<n; i++) dst[i] = base + i;
+				pt->a = dst;
+				break;
 
-	/* if there is an unused fListElement, take it */
-	for (i=0; i<NLISTS; i++) {
-		if (fList[i].freeListPvt == 0) {
-			if (aCalcPerformDebug>10) printf("aCalcPerform:get_freeList new list of size %d\n", nuse);
-			freeListInitPvt(&fList[i].freeListPvt, nuse*sizeof(double), 1);
-			fList[i].numDoubles = nuse;
-			epicsMutexUnlock(fListLock);
-			return(fList[i].freeListPvt);
+			case ADD: case SUB: case MULT: case DIV: case MODULO:
+			case GR_OR_EQ: case GR_THAN: case LESS_OR_EQ: case LESS_THAN: case NOT_EQ: case EQUAL:
+			case MAX_VAL: case MIN_VAL: case REL_OR: case REL_AND:
+			case BIT_OR: case BIT_AND: case BIT_EXCL_OR:
+				pt1 = pt--;
+				if (pt->a == NULL && pt1->a == NULL) {
+					pt->d = fuse_binary(op, pt->d, pt1->d);
+					break;
+				}
+				dst = TILE(pt);
+				if (pt->a == NULL) {
+					/* as to_array() does it */
+					d = isnan(pt->d) ? 0. : pt->d;
+					for (i=0; i<n; i++) dst[i] = d;
+				} else if (pt->a != dst) {
+					memcpy(dst, pt->a, n*sizeof(double));
+				}
+				if (pt1->a) {
+					k_binary_aa(op, dst, pt1->a, n);
+				} else {
+					k_binary_as(op, dst, pt1->d, n);
+				}
+				pt->a = dst;
+				break;
+
+			default:	/* unary */
+				if (pt->a == NULL) {
+					pt->d = fuse_unary(op, pt->d);
+					break;
+				}
+				dst = TILE(pt);
+				if (pt->a != dst) memcpy(dst, pt->a, n*sizeof(double));
+				k_unary(op, dst, n);
+				pt->a = dst;
+				break;
+			}
 		}
 	}
+#undef TILE
+	return(0);
+}
+
+/*** end evaluate fused runs ***/
 
-	/* if there is an list with no outstanding memory, clean it up and alloc for caller */
-	/* if more than one, take least recently used */
-	epicsTimeGetCurrent(&ts);
-	for (i=0, j=-1; i<NLISTS; i++) {
-		flp = fList[i].freeListPvt;
-		if (flp && (freeListItemsAvail(flp) == freeListItemsTotal(flp))) {
-			ts1 = freeListTimeLastUsed(flp);
-			if (epicsTimeGreaterThan(&ts, &ts1)) {
-				j = i;
-				ts = ts1;
+/*** begin link postfix for evaluation ***/
+
+/* If op can be evaluated one array element at a time, return the change it makes
+ * in the depth of the value stack (1 for a value, 0 for a unary operator, -1 for a
+ * binary operator), and set *arrayArg to the number of the array argument it
+ * fetches (-2 for some other array, -1 for none).  Otherwise, return FUSE_NO.  Operators that can fail (SQU_RT, LOG_E, etc.)
+ * are excluded, because they report failure only once for the whole array.
+ */
+#define FUSE_NO -100
+static int fuse_class(int op, int *arrayArg) {
+	*arrayArg = -1;
+	switch (op) {
+	case FETCH_A: case FETCH_B: case FETCH_C: case FETCH_D: case FETCH_E: case FETCH_F:
+	case FETCH_G: case FETCH_H: case FETCH_I: case FETCH_J: case FETCH_K: case FETCH_L:
+	case FETCH_M: case FETCH_N: case FETCH_O: case FETCH_P:
+	case FETCH_VAL: case LITERAL_DOUBLE: case LITERAL_INT:
+	case CONST_PI: case CONST_D2R: case CONST_R2D: case CONST_S2R: case CONST_R2S:
+		return(1);
+	case FETCH_AA: case FETCH_BB: case FETCH_CC: case FETCH_DD: case FETCH_EE: case FETCH_FF:
+	case FETCH_GG: case FETCH_HH: case FETCH_II: case FETCH_JJ: case FETCH_KK: case FETCH_LL:
+		*arrayArg = op - FETCH_AA;
+		return(1);
+	case FETCH_AVAL: case CONST_IX:
+		*arrayArg = -2;
+		return(1);
+	case ABS_VAL: case ANEG_VAL: case APOS_VAL: case UNARY_NEG: case CEIL: case FLOOR:
+	case ISINF: case NINT: case REL_NOT: case BIT_NOT: case EXP: case ACOS: case ASIN:
+	case ATAN: case COS: case SIN: case TAN: case COSH: case SINH: case TANH:
+		return(0);
+	case ADD: case SUB: case MULT: case DIV: case MODULO:
+	case GR_OR_EQ: case GR_THAN: case LESS_OR_EQ: case LESS_THAN: case NOT_EQ: case EQUAL:
+	case MAX_VAL: case MIN_VAL: case REL_OR: case REL_AND:
+	case BIT_OR: case BIT_AND: case BIT_EXCL_OR:
+		return(-1);
+	}
+	return(FUSE_NO);
+}
+
+/* Find the fused runs in the n instructions of lp->prog.  From each starting point,
+ * take the longest stretch of elementwise instructions that leaves exactly one
+ * value on the stack, and that involves at least one array and one operator.  A
+ * jump never lands inside a run, because every jump target follows a COND or UNTIL
+ * operator.
+ */
+static void find_fused_runs(linkedProgram *lp, int n) {
+	int start, i, depth, maxDepth, arg, hasArray, numArrays, end, endDepth, endArrays;
+	int delta, numRuns=0;
+
+	for (start=0; start<n; ) {
+		depth = maxDepth = hasArray = numArrays = 0;
+		end = -1;
+		for (i=start; i<n; i++) {
+			/* a shared value is kept, or used, between instructions of a run */
+			if ((i > start) && (lp->prog[i].save || lp->prog[i].reuse)) break;
+			delta = fuse_class(lp->prog[i].op, &arg);
+			if (delta == FUSE_NO) break;
+			depth += delta;
+			if (depth < 1) break;
+			if (depth > maxDepth) maxDepth = depth;
+			if (arg != -1) hasArray = 1;
+			if (arg+1 > numArrays) numArrays = arg+1;
+			if (depth == 1 && hasArray && i > start) {
+				end = i+1;
+				endDepth = maxDepth;
+				endArrays = numArrays;
+			}
+		}
+		if (end < 0) {
+			start++;
+			continue;
+		}
+		if (lp->runs == NULL) {
+			lp->runs = (fusedRun *)calloc(n/2+1, sizeof(fusedRun));
+			if (lp->runs == NULL) return;	/* evaluate without fusing */
+		}
+		lp->runs[numRuns].end = end;
+		lp->runs[numRuns].depth = endDepth;
+		lp->runs[numRuns].numArrays = endArrays;
+		lp->prog[start].fuse = ++numRuns;
+		start = end;
+	}
+}
+
+/* Decode postfix into lp->prog, resolving the jumps done by COND_IF, COND_ELSE,
+ * and UNTIL_END.  Jumps are found exactly as they would be found at run time by
+ * cond_search(), so linking doesn't change the meaning of any expression.  We
+ * refuse an expression that aCalcPostfixCheck() finds would overflow or underflow
+ * the stack.
+ */
+static int link_program(linkedProgram *lp, const unsigned char *postfix) {
+	const unsigned char *post, *pinst;
+	int len, n, i, k, arg, *index = NULL;
+	int numUntils, until_loc[MAX_UNTIL_OP], until_claimed[MAX_UNTIL_OP];
+	unsigned char *opKinds = NULL;
+	linkedOp *pl;
+
+	free_program(lp);
+
+	for (post=postfix, n=0; *post != END_EXPRESSION; n++) post += op_length(post);
+	len = (int)(post - postfix) + 1;
+
+	lp->postfix = (unsigned char *)malloc(len);
+	lp->prog = (linkedOp *)calloc(n+1, sizeof(linkedOp));
+	/* instruction number at each byte offset into postfix */
+	index = (int *)calloc(len, sizeof(int));
+	opKinds = (unsigned char *)calloc(n+1, 1);
+	if (!lp->postfix || !lp->prog || !index || !opKinds) {
+		printf("aCalcPerform: Can't allocate linked program\n");
+		free(index);
+		free(opKinds);
+		free_program(lp);
+		return(-1);
+	}
+	k = aCalcPostfixCheck(postfix, &lp->shape, opKinds);
+	if (k) {
+		printf("aCalcPerform: %s\n", aCalcErrorStr(k));
+		free(index);
+		free(opKinds);
+		free_program(lp);
+		return(-1);
+	}
+	memcpy(lp->postfix, postfix, len);
+	lp->postLen = len;
+
+	for (post=postfix, i=0; i<=n; i++) {
+		index[post-postfix] = i;
+		pl = &lp->prog[i];
+		pl->op = *post;
+		pl->jump = -1;
+		switch (*post) {
+		case LITERAL_DOUBLE:
+			memcpy((void *)&(pl->d), post+1, sizeof(double));
+			break;
+		case LITERAL_INT:
+			memcpy((void *)&k, post+1, sizeof(int));
+			pl->d = (double)k;
+			break;
+		case MIN: case MAX: case FINITE: case ISNAN: case FITQ: case FITMQ:
+			pl->nargs = post[1];
+			break;
+		}
+		/* elementwise operators on scalars skip the array machinery */
+		if ((i < n) && (opKinds[i] == ACALC_KIND_SCALAR)) {
+			k = fuse_class(pl->op, &arg);
+			if ((k == 0) || (k == -1)) pl->scalar = 1-k;
+		}
+		if (*post != END_EXPRESSION) post += op_length(post);
+	}
+	free(opKinds);
+
+	lp->numReductions = 0;
+	for (post=postfix, i=0, numUntils=0; i<n; i++, post += op_length(post)) {
+		pl = &lp->prog[i];
+		switch (pl->op) {
+		case AVERAGE: case STD_DEV: case FWHM: case ARRSUM:
+		case AMAX: case AMIN: case IXMAX: case IXMIN:
+			lp->numReductions++;
+			break;
+		case COND_IF:
+		case COND_ELSE:
+			pinst = post+1;
+			if (cond_search(&pinst, pl->op == COND_IF ? COND_ELSE : COND_END) == 0)
+				pl->jump = index[pinst-postfix];
+			break;
+		case UNTIL:
+			if (numUntils >= MAX_UNTIL_OP-1) {
+				printf("aCalcPerform: too many UNTILs\n");
+				free(index);
+				free_program(lp);
+				return(-1);
+			}
+			pl->jump = numUntils;
+			until_loc[numUntils] = i;
+			until_claimed[numUntils++] = 0;
+			break;
+		case UNTIL_END:
+			/* match the most recent unclaimed UNTIL */
+			for (k=numUntils-1; k>=0 && until_claimed[k]; k--);
+			if (k<0) {
+				printf("aCalcPerform: unmatched UNTIL_END\n");
+				free(index);
+				free_program(lp);
+				return(-1);
 			}
+			until_claimed[k] = 1;
+			pl->jump = until_loc[k];
+			break;
 		}
 	}
-	if (j>=0) {
-		if (aCalcPerformDebug>10)
-			printf("aCalcPerform:get_freeList delete old list of %d; alloc new list of %d\n",
-				fList[j].numDoubles, nuse);
-		flp = fList[j].freeListPvt;
-		freeListCleanup(flp);
-		freeListInitPvt(&fList[j].freeListPvt, nuse*sizeof(double), 1);
-		fList[j].numDoubles = nuse;
-		epicsMutexUnlock(fListLock);
-		return(fList[j].freeListPvt);
+	free(index);
+	find_fused_runs(lp, n);
+	return(0);
+}
+
+/* Link postfix and postfix2 into one program that evaluates both, and in which
+ * the second expression uses the values of subexpressions the first computed.
+ */
+static int link_joint(linkedProgram *lp, const unsigned char *postfix,
+		const unsigned char *postfix2) {
+	linkedProgram lp1, lp2;
+	aCalcCommonExpr common[ACALC_MAX_SHARED];
+	linkedOp *pl;
+	int n1, n2, i, k, num, numShared = 0, status = -1;
+
+	free_program(lp);
+	memset(&lp1, 0, sizeof(lp1));
+	memset(&lp2, 0, sizeof(lp2));
+	if (link_program(&lp1, postfix) || link_program(&lp2, postfix2)) goto done;
+
+	for (n1=0; lp1.prog[n1].op != END_EXPRESSION; n1++);
+	for (n2=0; lp2.prog[n2].op != END_EXPRESSION; n2++);
+	lp->postfix = (unsigned char *)malloc(lp1.postLen + lp2.postLen);
+	lp->prog = (linkedOp *)calloc(n1+1+n2+1, sizeof(linkedOp));
+	if (!lp->postfix || !lp->prog) {
+		printf("aCalcPerform: Can't allocate linked program\n");
+		free_program(lp);
+		goto done;
+	}
+	memcpy(lp->postfix, lp1.postfix, lp1.postLen);
+	memcpy(lp->postfix + lp1.postLen, lp2.postfix, lp2.postLen);
+	lp->postLen = lp1.postLen + lp2.postLen;
+	lp->postLen1 = lp1.postLen;
+
+	memcpy(lp->prog, lp1.prog, n1*sizeof(linkedOp));
+	lp->prog[n1].op = LINKED_RESULT;
+	lp->prog[n1].jump = -1;
+	memcpy(lp->prog+n1+1, lp2.prog, (n2+1)*sizeof(linkedOp));
+	for (i=0; i<=n1+1+n2; i++) {
+		pl = &lp->prog[i];
+		pl->fuse = 0;
+		/* UNTIL's jump is a loop number, which the second expression starts over */
+		if ((i > n1) && (pl->jump >= 0) && (pl->op != UNTIL)) pl->jump += n1+1;
 	}
 
-	/* size match that will at least work? */
-	for (i=0; i<NLISTS; i++) {
-		n = fList[i].numDoubles;
-		if (n >= nuse) {
-			if (aCalcPerformDebug>10) printf("aCalcPerform:get_freeList wanted size %d, found %d\n", nuse, n);
-			epicsMutexUnlock(fListLock);
-			return(fList[i].freeListPvt);			
+	lp->shape = lp1.shape;
+	if (lp2.shape.maxDepth > lp->shape.maxDepth) lp->shape.maxDepth = lp2.shape.maxDepth;
+	if (lp2.shape.minDepth < lp->shape.minDepth) lp->shape.minDepth = lp2.shape.minDepth;
+	lp->shape.arraySlots |= lp2.shape.arraySlots;
+	lp->numReductions = lp1.numReductions + lp2.numReductions;
+
+	num = aCalcCommonExprs(postfix, postfix2, common, ACALC_MAX_SHARED);
+	for (k=0; k<num; k++) {
+		pl = &lp->prog[common[k].end1];
+		if (pl->save == 0) pl->save = ++numShared;
+		pl = &lp->prog[n1+1+common[k].start2];
+		pl->reuse = lp->prog[common[k].end1].save;
+		pl->skip = n1+1+common[k].end2;
+	}
+	if (aCalcPerformDebug>10) printf("aCalcPerform: %d shared subexpressions\n", num);
+
+	find_fused_runs(lp, n1+1+n2);
+	status = 0;
+
+done:
+	free_program(&lp1);
+	free_program(&lp2);
+	return(status);
+}
+
+/* Find the linked version of postfix (and postfix2, if it's not NULL), linking it
+ * if we haven't seen it recently.
+ */
+static linkedProgram *get_program(aCalcContext *ctx, const unsigned char *postfix,
+		const unsigned char *postfix2) {
+	linkedProgram *lp, *lru;
+	int i, j, len;
+
+	for (i=0, lru=&ctx->programs[0]; i<ctx->numPrograms; i++) {
+		lp = &ctx->programs[i];
+		if (lp->prog && ((lp->postLen1 != 0) == (postfix2 != NULL))) {
+			/* Stops at the first difference, so never reads past the end of postfix */
+			len = postfix2 ? lp->postLen1 : lp->postLen;
+			for (j=0; j<len && lp->postfix[j] == postfix[j]; j++);
+			if (postfix2 && (j == len)) {
+				for ( ; j<lp->postLen && lp->postfix[j] == postfix2[j-len]; j++);
+			}
+			if (j == lp->postLen) {
+				lp->lastUsed = ctx->numCalls;
+				return(lp);
+			}
 		}
+		if (lp->lastUsed < lru->lastUsed) lru = lp;
 	}
+	if (aCalcPerformDebug>10) printf("aCalcPerform: linking postfix\n");
+	if (postfix2 ? link_joint(lru, postfix, postfix2) : link_program(lru, postfix)) return(NULL);
+	lru->lastUsed = ctx->numCalls;
+	return(lru);
+}
+
+/*** end link postfix for evaluation ***/
+
+/*** begin operate on sparse arrays ***/
 
-	/* caller is out of luck */
-	epicsMutexUnlock(fListLock);
+/* Return nonzero if op can be given sparse stack elements.  Before any other
+ * operator, every sparse stack element is made dense.
+ */
+static int sparse_ok(int op) {
+	int arg;
+	if (fuse_class(op, &arg) != FUSE_NO) return(1);
+	switch (op) {
+	case SQU_RT: case LOG_10: case LOG_E:
+	case AMAX: case AMIN: case IXMAX: case IXMIN: case IXZ: case IXNZ:
+	case AVERAGE: case STD_DEV: case FWHM: case ARRSUM:
+	case SUBRANGE: case SUBRANGE_IP: case TO_DOUBLE:
+	case STORE_A: case STORE_B: case STORE_C: case STORE_D: case STORE_E: case STORE_F:
+	case STORE_G: case STORE_H: case STORE_I: case STORE_J: case STORE_K: case STORE_L:
+	case STORE_M: case STORE_N: case STORE_O: case STORE_P:
+	case A_STORE: case A_FETCH: case A_AFETCH:
+	case COND_IF: case COND_ELSE: case COND_END: case UNTIL: case UNTIL_END:
+	case RANDOM: case NORMAL_RNDM: case ARANDOM: case A_NORMAL_RNDM:
+		return(1);
+	}
 	return(0);
 }
 
-long acalcTotalAllocatedMemory(void) {
-	int i;
-	long blocks, total=0;
-	if (fListLock==0) fListLock = epicsMutexMustCreate();
-	epicsMutexMustLock(fListLock);
-	for (i=0; i<NLISTS; i++) {
-		if (fList[i].freeListPvt) {
-			blocks = freeListItemsTotal(fList[i].freeListPvt);
-			total += fList[i].numDoubles*8*blocks;
-			if (aCalcPerformDebug>1) printf("aCalcPerform:fList[%d].numDoubles=%d, blocks=%ld\n",
-				i, fList[i].numDoubles, blocks);
+/* Do unary operator op to sparse stack element ps.  Elementwise operators work on
+ * the stored elements and the fill value; reductions work as usual if the active
+ * range (firstEl, numEl) is stored.  Return 1 if op is done, 0 if the caller must
+ * do it (in which case ps may have been made dense), or -1 if we can't allocate.
+ */
+static int sparse_unary(aCalcContext *ctx, stackElement *ps, int op, int arraySize, int *pstatus) {
+	int i, n = ps->stored, firstEl, lastEl, status;
+	int outside = n < arraySize;	/* does fill value matter? */
+
+	switch (op) {
+	case ABS_VAL: case ANEG_VAL: case APOS_VAL: case UNARY_NEG: case CEIL: case FLOOR:
+	case ISINF: case NINT: case REL_NOT: case BIT_NOT: case EXP: case ACOS: case ASIN:
+	case ATAN: case COS: case SIN: case TAN: case COSH: case SINH: case TANH:
+		if (isBorrowed(ps) && own_array(ctx, ps, arraySize, 1)) return(-1);
+		k_unary(op, ps->a, n);
+		/* the fill stands for array elements, so do what k_unary() does */
+		k_unary(op, &ps->fill, 1);
+		return(1);
+
+	case SQU_RT:
+	case LOG_10:
+	case LOG_E:
+		if (isBorrowed(ps) && own_array(ctx, ps, arraySize, 1)) return(-1);
+		status = 0;
+		for (i=0; i<n; i++) {
+			if (ps->a[i] < 0) {
+				ps->a[i] = 0;
+				status = -1;
+			} else {
+				ps->a[i] = (op == SQU_RT) ? sqrt(ps->a[i]) : (op == LOG_10) ? log10(ps->a[i]) : log(ps->a[i]);
+			}
+		}
+		if (ps->fill < 0) {
+			ps->fill = 0;
+			if (outside) status = -1;
+		} else {
+			ps->fill = (op == SQU_RT) ? sqrt(ps->fill) : (op == LOG_10) ? log10(ps->fill) : log(ps->fill);
 		}
+		if (status) printf("aCalcPerform: attempt to take %s of negative number\n",
+			(op == SQU_RT) ? "sqrt" : "log");
+		*pstatus = status;
+		return(1);
+
+	case AMAX: case AMIN: case IXMAX: case IXMIN: case IXZ: case IXNZ:
+	case AVERAGE: case STD_DEV: case FWHM: case ARRSUM:
+		calcFirstLast(ps, &firstEl, &lastEl, arraySize);
+		/* even with an empty range, some read a[firstEl] */
+		if ((firstEl >= 0) && (firstEl < n) && (lastEl < n)) return(0);
+		break;
 	}
-	epicsMutexUnlock(fListLock);
-	if (aCalcPerformDebug>1) printf("aCalcPerform:total memory %f MB\n", total/1.e6);
-	return(total);
+	if (densify(ctx, ps, arraySize)) return(-1);
+	return(0);
 }
 
-/*** end manage an array of freeLists ***/
+/* Do binary elementwise operator op to ps and ps1, at least one of which is
+ * sparse, leaving the result in ps.  Return as sparse_unary() does.
+ */
+static int sparse_binary(aCalcContext *ctx, stackElement *ps, stackElement *ps1, int op, int arraySize) {
+	int i, n;
+	double d;
 
-/*******************************************************/
+	if (fuse_class(op, &i) == -1) {
+		if (isSparse(ps) && isDouble(ps1)) {
+			if (isBorrowed(ps) && own_array(ctx, ps, arraySize, 1)) return(-1);
+			k_binary_as(op, ps->a, ps1->d, ps->stored);
+			ps->fill = fuse_binary(op, ps->fill, ps1->d);
+			return(1);
+		}
+		if (isDouble(ps) && isSparse(ps1)) {
+			/* as toArray(ps,1) would, but only for the elements ps1 stores */
+			if (alloc_array(ctx, ps)) return(-1);
+			d = isnan(ps->d) ? 0. : ps->d;
+			ps->a = &(ps->array[0]);
+			ps->numEl = -1;
+			n = ps1->stored;
+			for (i=0; i<n; i++) ps->a[i] = d;
+			k_binary_aa(op, ps->a, ps1->a, n);
+			ps->sparse = 1;
+			ps->stored = n;
+			ps->fill = fuse_binary(op, d, ps1->fill);
+			return(1);
+		}
+		if (isSparse(ps) && isSparse(ps1) && (ps->stored == ps1->stored)) {
+			if (isBorrowed(ps) && own_array(ctx, ps, arraySize, 1)) return(-1);
+			k_binary_aa(op, ps->a, ps1->a, ps->stored);
+			ps->fill = fuse_binary(op, ps->fill, ps1->fill);
+			return(1);
+		}
+	}
+	if (densify(ctx, ps, arraySize) || densify(ctx, ps1, arraySize)) return(-1);
+	return(0);
+}
 
-struct until_struct {
-	const unsigned char *until_loc;
-	const unsigned char *until_end_loc;
-	double *pd;
-	stackElement *ps;
-};
+/*** end operate on sparse arrays ***/
 
-void freeStack(void *flp, stackElement *stack) {
-	int i;
-	for (i=0; i<ACALC_STACKSIZE; i++) {
-		if (stack[i].array) freeListFree(flp, stack[i].array);
+/*******************************************************/
+
+/* Statistics of ps->a[firstEl..lastEl] (see aCalcReduce()).  If the program has
+ * more than one reduction, and ps refers to the caller's array, compute all the
+ * statistics in one pass, and keep them for the next reduction of the same range,
+ * so, e.g., "AVG(AA);STD(AA);AMAX(AA)" reads AA once.
+ */
+static const aCalcStats *array_stats(aCalcContext *ctx, const linkedProgram *lp,
+		const stackElement *ps, int firstEl, int lastEl, int what) {
+	const double *a = &ps->a[firstEl];
+	int n = 1+lastEl-firstEl;
+
+	if ((lp->numReductions > 1) && isBorrowed(ps)) {
+		if ((ctx->statsA == a) && (ctx->stats.n == n) && ((ctx->statsWhat & what) == what))
+			return(&ctx->stats);
+		what = ACALC_MOMENTS|ACALC_MAX|ACALC_MIN;
+		ctx->statsA = a;
+	} else {
+		ctx->statsA = NULL;
 	}
-	free(stack);
+	aCalcReduce(a, n, what, &ctx->stats);
+	ctx->statsWhat = what;
+	return(&ctx->stats);
 }
 
 void calcFirstLast(stackElement *ps, int *firstEl, int *lastEl, int arraySize) {
@@ -289,111 +1226,301 @@ void calcFirstLast(stackElement *ps, int *firstEl, int *lastEl, int arraySize) {
 	}
 }
 
-#define MAX_UNTIL_OP 10
+/* Evaluate postfix using a context owned by the calling thread.  Existing
+ * callers get the same results as before, without allocating a value stack
+ * on every call.  The thread's callers may use many expressions (e.g., the
+ * optimizer's constant folding), so the context keeps more linked programs
+ * than a record's does.
+ */
 long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 	int num_aArgs, int arraySize, double *p_dresult, double *p_aresult,
 	const unsigned char *postfix, const int allocSize, epicsUInt32 *amask) {
 
-	stackElement *stack, *top;
-	stackElement *ps, *ps1, *ps2, *ps3;
-	int					i, j, k, found, status, op, nargs;
-	double				d, e, f, *pd;
-	const unsigned char *post = postfix;
-	struct until_struct	until_scratch[MAX_UNTIL_OP];
-	int					loopsDone = 0;
-	void *flp;
-	int firstEl, lastEl, firstEl1, lastEl1;
+	aCalcContext *ctx;
 
-	if (*postfix == END_EXPRESSION) {
-		return(-1);
+	epicsThreadOnce(&ctxOnce, ctxInit, NULL);
+	ctx = (aCalcContext *)epicsThreadPrivateGet(ctxPrivate);
+	if (ctx == NULL) {
+		ctx = context_create(arraySize, THREAD_PROGRAMS);
+		if (ctx == NULL) {
+			printf("aCalcPerform: Can't allocate value stack\n");
+			return(-1);
+		}
+		epicsThreadPrivateSet(ctxPrivate, ctx);
 	}
+	return(aCalcPerformCtx(ctx, p_dArg, num_dArgs, pp_aArg, num_aArgs, arraySize,
+		p_dresult, p_aresult, postfix, allocSize, amask));
+}
 
-	if (fListLock==0) fListLock = epicsMutexMustCreate();
-	flp = get_freeList(arraySize);
-	if (flp == 0) {
-		printf("aCalcPerform: Can't allocate value stack\n");
-		return(-1);
+/* Has aCalcPerform() made a context for the calling thread? */
+int aCalcPerformThreadState(void) {
+	epicsThreadOnce(&ctxOnce, ctxInit, NULL);
+	return(epicsThreadPrivateGet(ctxPrivate) != NULL);
+}
+
+/* Free the context aCalcPerform() made for the calling thread, if any */
+void aCalcPerformThreadCleanup(void) {
+	aCalcContext *ctx;
+
+	epicsThreadOnce(&ctxOnce, ctxInit, NULL);
+	ctx = (aCalcContext *)epicsThreadPrivateGet(ctxPrivate);
+	if (ctx == NULL) return;
+	epicsThreadPrivateSet(ctxPrivate, NULL);
+	aCalcContextFree(ctx);
+}
+
+/* Copy the result into the caller's array, writing only the elements that changed,
+ * and note which those were.  Elements are compared bit by bit, so that a new NaN,
+ * or a change in the sign of zero, counts as a change.
+ */
+static void store_result(aCalcContext *ctx, int which, double *p_aresult, const double *a,
+	int arraySize)
+{
+	int first, last;
+
+	for (first=0; first<arraySize; first++) {
+		if (memcmp(&p_aresult[first], &a[first], sizeof(double))) break;
+	}
+	if (first == arraySize) return;
+	for (last=arraySize-1; last>first; last--) {
+		if (memcmp(&p_aresult[last], &a[last], sizeof(double))) break;
 	}
+	memcpy(&p_aresult[first], &a[first], (last-first+1)*sizeof(double));
+	ctx->resultFirst[which] = first;
+	ctx->resultNumEl[which] = last-first+1;
+}
 
-	if (aCalcPerformDebug>10) printf("aCalcPerform: freeListItemsAvail=%ld of: %ld\n",
-		(long)freeListItemsAvail(flp), (long)freeListItemsTotal(flp));
+/* Keep a copy of the value at ps in ctx->shared[slot], for the second expression
+ * of a joint program.
+ */
+static int save_shared(aCalcContext *ctx, const stackElement *ps, int slot, int arraySize) {
+	stackElement *sv = &ctx->shared[slot];
 
-	*amask = 0; /* init bit mask that will record the array fields we wrote to. */
+	if (isArray(ps)) {
+		if (alloc_array(ctx, sv)) return(-1);
+		memcpy(sv->array, ps->a, (ps->sparse ? ps->stored : arraySize)*sizeof(double));
+		sv->a = sv->array;
+	} else {
+		sv->a = NULL;
+	}
+	sv->d = ps->d;
+	sv->firstEl = ps->firstEl;
+	sv->numEl = ps->numEl;
+	sv->sourceDouble = ps->sourceDouble;
+	sv->sparse = ps->sparse;
+	sv->stored = ps->stored;
+	sv->fill = ps->fill;
+	ctx->sharedValid |= 1<<slot;
+	return(0);
+}
 
-	stack = calloc(ACALC_STACKSIZE, sizeof(stackElement));
-	if (stack == NULL) {
-		printf("aCalcPerform: Can't allocate stack.\n");
-		return(-1);
+/* Put the value kept in ctx->shared[slot] at ps.  An array is borrowed, so it's
+ * copied only if it's to be modified.
+ */
+static void use_shared(aCalcContext *ctx, stackElement *ps, int slot) {
+	const stackElement *sv = &ctx->shared[slot];
+
+	ps->d = sv->d;
+	ps->a = sv->a;
+	ps->firstEl = sv->firstEl;
+	ps->numEl = sv->numEl;
+	ps->sourceDouble = sv->sourceDouble;
+	ps->sparse = sv->sparse;
+	ps->stored = sv->stored;
+	ps->fill = sv->fill;
+}
+
+/* Empty the value stack, and forget any loops, before an expression runs */
+static void reset_stack(aCalcContext *ctx) {
+	int i;
+
+	for (i=0; i<ACALC_STACKSIZE+1; i++) {
+		ctx->stack[i].a = NULL;
+		ctx->stack[i].firstEl = 0;
+		ctx->stack[i].numEl = 0;
+		ctx->stack[i].sourceDouble = 0;
+		ctx->stack[i].sparse = 0;
+	}
+	for (i=0; i<MAX_UNTIL_OP; i++) ctx->until_ps[i] = NULL;
+	ctx->stack[0].d = 1.23456;	/* telltale */
+}
+
+/* Give the value an expression left on the stack to the caller, as *p_dresult and
+ * p_aresult (result number which, for aCalcContextResultRange()), and return the
+ * expression's status.
+ */
+static long finish_result(aCalcContext *ctx, stackElement *ps, const stackElement *top,
+	int status, int arraySize, double *p_dresult, double *p_aresult, int which) {
+
+	int debug = aCalcPerformDebug;
+
+	if (debug>=20) printf("aCalcPerform:done with expression, status=%d\n", status);
+	if (status) {
+		return(status);
 	}
 
-#if 0
-	printf("aCalcPerform: stack=%p\n", stack);
-	printf("aCalcPerform: &(stack[0])=%p\n", &(stack[0]));
-	printf("aCalcPerform: &(stack[0].d)=%p\n", &(stack[0].d));
-	printf("aCalcPerform: &(stack[0].a)=%p\n", &(stack[0].a));
-	printf("aCalcPerform: &(stack[0].array)=%p\n", &(stack[0].array));
-	/*printf("aCalcPerform: &(stack[0].array[0])=%p\n", &(stack[0].array[0]));*/
-
-	printf("aCalcPerform: &(stack[1])=%p\n", &(stack[1]));
-	printf("aCalcPerform: &(stack[1].d)=%p\n", &(stack[1].d));
-	printf("aCalcPerform: &(stack[1].a)=%p\n", &(stack[1].a));
-	printf("aCalcPerform: &(stack[1].array)=%p\n", &(stack[1].array));
-	/*printf("aCalcPerform: &(stack[1].array[1])=%p\n", &(stack[1].array[1]));*/
+	/* if everything is peachy,the stack should end at its first position */
+	if (ps != top) {
+#if DEBUG
+		if (debug>=1) {
+			printf("aCalcPerform: stack error,ps=%p,top=%p\n", (void *)ps, (void *)top);
+			printf("aCalcPerform: stack error (ps-top=%d)\n", (int)(ps-top));
+			printf("aCalcPerform: ps->d=%f\n", ps->d);
+		}
 #endif
+		return(-1);
+	}
+	
+	if (densify(ctx, ps, arraySize)) {
+		printf("aCalcPerform: Can't allocate array.\n");
+		return(-1);
+	}
+	if (isDouble(ps)) {
+		if (debug>=20) printf("aCalcPerform:double result=%f\n", ps->d);
+		if (p_dresult) *p_dresult = ps->d;
+		if (p_aresult) {
+			toArray(ps,1);
+			store_result(ctx, which, p_aresult, ps->a, arraySize);
+		}
+	} else {
+		if (debug>=20) printf("aCalcPerform:array result a[0]=%f, a[1]=%f\n",
+			ps->a[0], ps->a[1]);
 
-	for (i=0; i<MAX_UNTIL_OP; i++) {
-		until_scratch[i].until_loc = NULL;
-		until_scratch[i].until_end_loc = NULL;
-		until_scratch[i].ps = NULL;
-		until_scratch[i].pd = NULL;
+		if (p_aresult) store_result(ctx, which, p_aresult, ps->a, arraySize);
+		if (p_dresult) {
+			to_double(ps);
+			*p_dresult = ps->d;
+		}
 	}
-	/* find all UNTIL operators in postfix, noting their locations */
-	for (i=0, post=postfix; *post != END_EXPRESSION; post++) {
-		if (aCalcPerformDebug > 10) printf("\tsCalcPerform: *post=%d\n", *post);
-		switch (*post) {
-		case LITERAL_DOUBLE:
-			post += sizeof(double);
-			break;
-		case LITERAL_INT:
-			post += sizeof(int);
-			break;
-		case UNTIL:
-			/*printf("sCalcPerform: UNTIL at index %d\n", (int)(post-postfix));*/
-			until_scratch[i].until_loc = post;
-			i++;
-			if (i > (MAX_UNTIL_OP-1)) {
-				printf("sCalcPerform: too many UNTILs\n");
-				freeStack(flp, stack);
-				return(-1);
-			}
-			break;
-		case UNTIL_END:
-			for (k=i-1; k>=0; k--) {
-				if (until_scratch[k].until_end_loc == NULL) {
-					/* found unclaimed UNTIL */
-					if (aCalcPerformDebug > 10) {
-						printf("sCalcPerform: UNTIL_END at index %d, matches UNTIL at index %d (k=%d)\n",
-							(int)(post-postfix), (int)(until_scratch[k].until_loc-postfix), k);
-					}
-					until_scratch[k].until_end_loc = post;
-					break;
-				}
-			}
-			if (k<0) {
-				printf("unmatched UNTIL_END\n");
-				freeStack(flp, stack);
-				return(-1);
-			}
-			break;
+
+	if (debug) printf("aCalcPerform:stack lo=%d, hi=%d\n",
+		ctx->stackLW, ctx->stackHW);
+
+	return(((isnan(*p_dresult)||isinf(*p_dresult)) ? -1 : 0));
+}
+
+/* Get ctx ready for an evaluation with arrays of arraySize elements */
+static void ctx_begin(aCalcContext *ctx, int arraySize) {
+	/* Stack-element arrays are sized for the largest arraySize seen so far. */
+	if (arraySize > ctx->arraySize) {
+		if (aCalcPerformDebug>10) printf("aCalcPerform: context array size %d -> %d\n",
+			ctx->arraySize, arraySize);
+		ctxFreeArrays(ctx);
+		ctx->arraySize = arraySize;
+	}
+	ctx->numCalls++;
+}
+
+static long perform(aCalcContext *ctx, const linkedProgram *lp, double *p_dArg, int num_dArgs,
+	double **pp_aArg, int num_aArgs, int arraySize, double *p_dresult, double *p_aresult,
+	double *p_dresult2, double *p_aresult2, const int allocSize, epicsUInt32 *amask);
+
+long aCalcPerformCtx(aCalcContext *ctx, double *p_dArg, int num_dArgs, double **pp_aArg,
+	int num_aArgs, int arraySize, double *p_dresult, double *p_aresult,
+	const unsigned char *postfix, const int allocSize, epicsUInt32 *amask) {
+
+	linkedProgram *lp;
+
+	ctx->resultFirst[0] = ctx->resultNumEl[0] = 0;
+	if (*postfix == END_EXPRESSION) {
+		return(-1);
+	}
+	ctx_begin(ctx, arraySize);
+	lp = get_program(ctx, postfix, NULL);
+	if (lp == NULL) return(-1);
+	return(perform(ctx, lp, p_dArg, num_dArgs, pp_aArg, num_aArgs, arraySize,
+		p_dresult, p_aresult, NULL, NULL, allocSize, amask));
+}
+
+/* Evaluate postfix, and then postfix2, as aCalcPerformCtx() would, but as one
+ * program, in which postfix2 uses the values of subexpressions that postfix
+ * computed.  If either expression is empty, or can't be linked, evaluate them
+ * one at a time.
+ */
+long aCalcPerformJointCtx(aCalcContext *ctx, double *p_dArg, int num_dArgs, double **pp_aArg,
+	int num_aArgs, int arraySize, double *p_dresult, double *p_aresult,
+	const unsigned char *postfix, double *p_dresult2, double *p_aresult2,
+	const unsigned char *postfix2, const int allocSize, epicsUInt32 *amask) {
+
+	linkedProgram *lp = NULL;
+	epicsUInt32 amask2 = 0;
+	int first, numEl;
+	long status;
+
+	*amask = 0;
+	if ((*postfix != END_EXPRESSION) && (*postfix2 != END_EXPRESSION)) {
+		ctx_begin(ctx, arraySize);
+		lp = get_program(ctx, postfix, postfix2);
+	}
+	if (lp) {
+		return(perform(ctx, lp, p_dArg, num_dArgs, pp_aArg, num_aArgs, arraySize,
+			p_dresult, p_aresult, p_dresult2, p_aresult2, allocSize, amask));
+	}
+
+	status = aCalcPerformCtx(ctx, p_dArg, num_dArgs, pp_aArg, num_aArgs, arraySize,
+		p_dresult, p_aresult, postfix, allocSize, amask);
+	first = ctx->resultFirst[0];
+	numEl = ctx->resultNumEl[0];
+	status |= aCalcPerformCtx(ctx, p_dArg, num_dArgs, pp_aArg, num_aArgs, arraySize,
+		p_dresult2, p_aresult2, postfix2, allocSize, &amask2);
+	*amask |= amask2;
+	ctx->resultFirst[1] = ctx->resultFirst[0];
+	ctx->resultNumEl[1] = ctx->resultNumEl[0];
+	ctx->resultFirst[0] = first;
+	ctx->resultNumEl[0] = numEl;
+	return(status);
+}
+
+/* Evaluate a linked program.  A joint program delivers its first result to
+ * p_dresult and p_aresult, and its second to p_dresult2 and p_aresult2.
+ */
+static long perform(aCalcContext *ctx, const linkedProgram *lp, double *p_dArg, int num_dArgs,
+	double **pp_aArg, int num_aArgs, int arraySize, double *p_dresult, double *p_aresult,
+	double *p_dresult2, double *p_aresult2, const int allocSize, epicsUInt32 *amask) {
+
+	stackElement *stack, *top;
+	stackElement *ps, *ps1, *ps2, *ps3;
+	int					i, j, k, found, status, op, nargs;
+	double				d, e, f, *pd;
+	const aCalcStats	*pst;
+	const linkedOp		*pc, *ip;
+	const fusedRun		*fr;
+	int					loopsDone = 0;
+	int firstEl, lastEl, firstEl1, lastEl1;
+	int debug = aCalcPerformDebug;
+	int fuse = aCalcFuse && (debug < 20);	/* fused runs don't trace each operator */
+	int haveSparse = 0;		/* might there be sparse elements on the stack? */
+	long status1 = 0;		/* status of a joint program's first expression */
+	double v[3];			/* debug: first elements of an array argument */
+
+	ctx->resultFirst[0] = ctx->resultNumEl[0] = 0;
+	ctx->resultFirst[1] = ctx->resultNumEl[1] = 0;
+	ctx->sharedValid = 0;
+
+	/* Give every stack element that might hold an array its array now */
+	stack = ctx->stack;
+	for (i=1; i<=lp->shape.maxDepth; i++) {
+		if ((lp->shape.arraySlots & (1<<i)) && alloc_array(ctx, &stack[i])) {
+			printf("aCalcPerform: Can't allocate array.\n");
+			return(-1);
 		}
 	}
+	if (lp->shape.maxDepth-1 > ctx->stackHW) ctx->stackHW = lp->shape.maxDepth-1;
+	if (lp->shape.minDepth-1 < ctx->stackLW) ctx->stackLW = lp->shape.minDepth-1;
 
-	post = postfix;
+	*amask = 0; /* init bit mask that will record the array fields we wrote to. */
+
+	reset_stack(ctx);
+	ctx->statsA = NULL;
 
 #if DEBUG
-	if (aCalcPerformDebug>=10) {
+	if (debug>=10) {
 		printf("aCalcPerform: postfix:\n");
-		aCalcExprDump(post);
+		aCalcExprDump(lp->postfix);
+		if (lp->postLen1) {
+			printf("aCalcPerform: second postfix:\n");
+			aCalcExprDump(lp->postfix + lp->postLen1);
+		}
 
 		printf("\naCalcPerform: args:\n");
 		for (i=0; i<num_dArgs; i++) {
@@ -403,8 +1530,8 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 		}
 		for (i=0; i<num_aArgs; i++) {
 			if (pp_aArg[i]) {
-				printf("%c%c=[%f %f %f...]\n",
-					'a'+i, 'a'+i, pp_aArg[i][0], pp_aArg[i][1], pp_aArg[i][2]);
+				k_widen(ctx->argType, v, pp_aArg[i], 3);
+				printf("%c%c=[%f %f %f...]\n", 'a'+i, 'a'+i, v[0], v[1], v[2]);
 			}
 		}
 	}
@@ -412,12 +1539,63 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 
 	top = ps = &stack[1];
 	ps--;  /* Expression handler assumes ps is pointing to a filled element */
-	ps->d = 1.23456; ps->a = NULL;	/* telltale */
 
 	status = 0;
-	while ((op = *post++) != END_EXPRESSION){
+	pc = lp->prog;
+	while ((op = (ip = pc++)->op) != END_EXPRESSION){
+
+		if (debug>=20) printf("aCalcPerform: op=%d\n", op);
+
+		if (ip->save && save_shared(ctx, ps, ip->save-1, arraySize)) {
+			printf("aCalcPerform: Can't allocate array.\n");
+			return(-1);
+		}
+		if (ip->reuse && (ctx->sharedValid & (1<<(ip->reuse-1)))) {
+			/* the first expression computed this subexpression */
+			INC(ps);
+			use_shared(ctx, ps, ip->reuse-1);
+			if (ps->sparse) haveSparse = 1;
+			pc = lp->prog + ip->skip;
+			continue;
+		}
+
+		if (ip->fuse && fuse) {
+			fr = &lp->runs[ip->fuse-1];
+			/* Otherwise, let the unfused code handle missing arrays */
+			if (num_aArgs >= fr->numArrays) {
+				INC(ps);
+				toArray(ps,0);
+				if (fused_eval(ctx, ip, lp->prog + fr->end, fr->depth, p_dArg, num_dArgs,
+						pp_aArg, arraySize, p_dresult, p_aresult, ps->a)) {
+					printf("aCalcPerform: Can't allocate array.\n");
+					return(-1);
+				}
+				pc = lp->prog + fr->end;
+				continue;
+			}
+		}
+
+		if (ip->scalar) {
+			/* scalar operands, and no need to check */
+			if (ip->scalar == 2) {
+				ps1 = ps;
+				DEC(ps);
+				ps->d = fuse_binary(op, ps->d, ps1->d);
+			} else {
+				ps->d = fuse_unary(op, ps->d);
+			}
+			continue;
+		}
 
-		if (aCalcPerformDebug>=20) printf("aCalcPerform: op=%d\n", op);
+		if (haveSparse && !sparse_ok(op)) {
+			for (ps1=top; ps1<=ps; ps1++) {
+				if (densify(ctx, ps1, arraySize)) {
+					printf("aCalcPerform: Can't allocate array.\n");
+					return(-1);
+				}
+			}
+			haveSparse = 0;
+		}
 
 		switch (op) {
 
@@ -436,18 +1614,22 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 		case FETCH_AA: case FETCH_BB: case FETCH_CC: case FETCH_DD: case FETCH_EE: case FETCH_FF:
 		case FETCH_GG: case FETCH_HH: case FETCH_II: case FETCH_JJ: case FETCH_KK: case FETCH_LL:
 			INC(ps);
-			toArray(ps,0);
-			ps->a[0] = 0.;
-			if (num_aArgs > (op - FETCH_AA)) {
-				if (pp_aArg[op - FETCH_AA]) {
-					for (i=0; i<arraySize; i++) ps->a[i] = pp_aArg[op - FETCH_AA][i];
-				} else {
+			if ((num_aArgs > (op - FETCH_AA)) && pp_aArg[op - FETCH_AA] && canBorrow(ctx)) {
+				/* borrow, rather than copy, the caller's array */
+				ps->a = pp_aArg[op - FETCH_AA];
+			} else if ((num_aArgs > (op - FETCH_AA)) && pp_aArg[op - FETCH_AA]) {
+				toArray(ps,0);
+				k_widen(ctx->argType, ps->a, pp_aArg[op - FETCH_AA], arraySize);
+			} else {
+				toArray(ps,0);
+				ps->a[0] = 0.;
+				if (num_aArgs > (op - FETCH_AA)) {
 					for (i=0; i<arraySize; i++) ps->a[i] = 0.0;
 				}
-				if (aCalcPerformDebug>=20)
-					printf("aCalcPerform:fetch array %d = [%f %f...]\n",
-						(int)*post, ps->a[0], ps->a[1]);
 			}
+			if (debug>=20 && (num_aArgs > (op - FETCH_AA)))
+				printf("aCalcPerform:fetch array %d = [%f %f...]\n",
+					op - FETCH_AA, ps->a[0], ps->a[1]);
 			break;
 
 		case STORE_A: case STORE_B: case STORE_C: case STORE_D: case STORE_E: case STORE_F:
@@ -466,21 +1648,28 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			if (num_aArgs > i) {
 				/* Careful.  It's possible the record has not allocated the array */
 				if (pp_aArg[i] == NULL) {
-					pp_aArg[i] = (double *)calloc(allocSize, sizeof(double));
+					pp_aArg[i] = (double *)calloc(allocSize, ctx->argSize);
 				}
 				pd = pp_aArg[i];
-				if (aCalcPerformDebug>=10) {
+				ctx->statsA = NULL;	/* the caller's arrays are about to change */
+				if (pd && canBorrow(ctx) && unborrow(ctx, ps-1, pd, arraySize)) {
+					printf("aCalcPerform: Can't allocate array.\n");
+					return(-1);
+				}
+				if (debug>=10) {
 					printf("aCalcPerform:store array to pointer %p \n", pd);
 				}
 				if (pd) {
-					if (isArray(ps)) {
+					if (!canBorrow(ctx)) {
+						k_narrow(ctx->argType, pd, isArray(ps) ? ps->a : NULL, ps->d, arraySize);
+					} else if (isArray(ps)) {
 						for (j=0; j<arraySize; j++) pd[j] = ps->a[j];
 					} else {
 						for (j=0; j<arraySize; j++) pd[j] = ps->d;
 					}
 					/* Mark this array so caller knows it has been changed. */
 					*amask |= 1<<i;
-					if (aCalcPerformDebug>=10) printf("amask=%x\n", *amask);
+					if (debug>=10) printf("amask=%x\n", *amask);
 				}
 			}
 			DEC(ps);
@@ -507,10 +1696,18 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			} else {
 				/* Careful.  It's possible the record has not allocated the array */
 				if (pp_aArg[i] == NULL) {
-					pp_aArg[i] = (double *)calloc(allocSize, sizeof(double));
+					pp_aArg[i] = (double *)calloc(allocSize, ctx->argSize);
+				}
+				ctx->statsA = NULL;
+				if (pp_aArg[i] && canBorrow(ctx) && unborrow(ctx, ps, pp_aArg[i], arraySize)) {
+					printf("aCalcPerform: Can't allocate array.\n");
+					return(-1);
 				}
 				if (pp_aArg[i]) {
-					if (isArray(ps1)) {
+					if (!canBorrow(ctx)) {
+						k_narrow(ctx->argType, pp_aArg[i], isArray(ps1) ? ps1->a : NULL, ps1->d,
+							arraySize);
+					} else if (isArray(ps1)) {
 						for (j=0; j<arraySize; j++) pp_aArg[i][j] = ps1->a[j];
 					} else {
 						for (j=0; j<arraySize; j++) pp_aArg[i][j] = ps1->d;
@@ -528,9 +1725,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 
 		case FETCH_AVAL:
 			INC(ps);
-			toArray(ps,0);
-			ps->a[0] = 0.;
-			for (i=0; i<arraySize; i++) ps->a[i] = p_aresult[i];
+			ps->a = p_aresult;
 			break;
 
 		case CONST_PI:
@@ -575,6 +1770,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			calcFirstLast(ps, &firstEl, &lastEl, arraySize);
 			j = ps->d; /* get npts */
 			DEC(ps);
+			toArray(ps,1);
 			for (k=firstEl; k<j+firstEl; k++) {
 				d = ps->a[firstEl]; e = ps->a[firstEl+1]; f=ps->a[firstEl+2];
 				for (i=firstEl+2; i<=lastEl-2; i++) {
@@ -621,58 +1817,22 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 		
 			ps1 = ps;
 			DEC(ps);
+			if (isSparse(ps) || isSparse(ps1)) {
+				j = sparse_binary(ctx, ps, ps1, op, arraySize);
+				if (j < 0) {
+					printf("aCalcPerform: Can't allocate array.\n");
+					return(-1);
+				}
+				if (j) break;
+			}
 			if (isArray(ps) || isArray(ps1)) {
 				toArray(ps,1);
 				if (isArray(ps1)) {
-					switch (op) {
-					case ADD: for (i=0; i<arraySize; i++) {ps->a[i] += ps1->a[i];} break;
-					case SUB: for (i=0; i<arraySize; i++) {ps->a[i] -= ps1->a[i];} break;
-					case MULT: for (i=0; i<arraySize; i++) {ps->a[i] *= ps1->a[i];} break;
-					case DIV:
-						for (i=0; i<arraySize; i++) {
-							if (ps1->a[i] == 0) {
-								ps->a[i] = myMAXFLOAT;
-							} else {
-								ps->a[i] /= ps1->a[i];
-							}
-						}
-						break;
-					case MODULO:
-						for (i=0; i<arraySize; i++) {
-							if ((int)ps1->a[i] == 0) {
-								ps->a[i] = myMAXFLOAT;
-							} else {
-								ps->a[i] = (double)((int)ps->a[i] % (int)ps1->a[i]);
-							}
-						}
-						break;
-					}
+					k_binary_aa(op, ps->a, ps1->a, arraySize);
 				} else {
-					switch (op) {
-					case ADD: for (i=0; i<arraySize; i++) {ps->a[i] += ps1->d;} break;
-					case SUB: for (i=0; i<arraySize; i++) {ps->a[i] -= ps1->d;} break;
-					case MULT: for (i=0; i<arraySize; i++) {ps->a[i] *= ps1->d;} break;
-					case DIV:
-						for (i=0; i<arraySize; i++) {
-							if (ps1->d==0) {
-								ps->a[i] = myMAXFLOAT;
-							} else {
-								ps->a[i] /= ps1->d;
-							}
-						}
-						break;
-					case MODULO:
-						for (i=0; i<arraySize; i++) {
-							if ((int)ps1->d == 0) {
-								ps->a[i] = myMAXFLOAT;
-							} else {
-								ps->a[i] = (double)((int)ps->a[i] % (int)ps1->d);
-							}
-						}
-						break;
-					}
+					k_binary_as(op, ps->a, ps1->d, arraySize);
 				}
-				if (aCalcPerformDebug>=20) {
+				if (debug>=20) {
 					printf("aCalcPerform:binary array op result = [\n");
 					for (i=0; i<arraySize; i++) printf("%f ", ps->a[i]);
 					printf("]\n");
@@ -704,18 +1864,16 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			toDouble(ps);
 			d = ps->d;
 			DEC(ps);
-			if (d == 0.0 &&	cond_search(&post, COND_ELSE)) {
-				freeStack(flp, stack);
-				return -1;
+			if (d == 0.0) {
+				if (ip->jump < 0) return -1;
+				pc = lp->prog + ip->jump;
 			}
 			break;
 
 				
 		case COND_ELSE:
-			if (cond_search(&post, COND_END)) {
-				freeStack(flp, stack);
-				return -1;
-			}
+			if (ip->jump < 0) return -1;
+			pc = lp->prog + ip->jump;
 			break;
 
 
@@ -761,13 +1919,41 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 		case ARRSUM:
 		case FITPOLY:
 		case FITMPOLY:
+			if (isSparse(ps)) {
+				j = sparse_unary(ctx, ps, op, arraySize, &status);
+				if (j < 0) {
+					printf("aCalcPerform: Can't allocate array.\n");
+					return(-1);
+				}
+				if (j) break;
+			}
 			if (isArray(ps)) {
 				switch (op) {
-				case ABS_VAL: for (i=0; i<arraySize; i++) {if (ps->a[i] < 0) ps->a[i] *= -1;} break;
-				case ANEG_VAL: for (i=0; i<arraySize; i++) {if (ps->a[i] < 0) ps->a[i] = 0;} break;
-				case APOS_VAL: for (i=0; i<arraySize; i++) {if (ps->a[i] > 0) ps->a[i] = 0;} break;
-				case UNARY_NEG: for (i=0; i<arraySize; i++) {ps->a[i] *= -1;} break;
+				case ABS_VAL:
+				case ANEG_VAL:
+				case APOS_VAL:
+				case UNARY_NEG:
+				case CEIL:
+				case FLOOR:
+				case ISINF:
+				case NINT:
+				case REL_NOT:
+				case BIT_NOT:
+				case EXP:
+				case ACOS:
+				case ASIN:
+				case ATAN:
+				case COS:
+				case SIN:
+				case TAN:
+				case COSH:
+				case SINH:
+				case TANH:
+					toWritable(ps);
+					k_unary(op, ps->a, arraySize);
+					break;
 				case SQU_RT:
+					toWritable(ps);
 					status = 0;
 					for (i=0; i<arraySize; i++) {
 						if (ps->a[i] < 0) {
@@ -780,10 +1966,11 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					if (status)	printf("aCalcPerform: attempt to take sqrt of negative number\n");
 					break;
 				case CUM:
+					toWritable(ps);
 					for (i=1; i<arraySize; i++) {ps->a[i] += ps->a[i-1];}
 					break;
-				case EXP: for (i=0; i<arraySize; i++) {ps->a[i] = exp(ps->a[i]);} break;
 				case LOG_10:
+					toWritable(ps);
 					status = 0;
 					for (i=0; i<arraySize; i++) {
 						if (ps->a[i] < 0) {
@@ -796,6 +1983,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					if (status) printf("aCalcPerform: attempt to take log of negative number\n");
 					break;
 				case LOG_E:
+					toWritable(ps);
 					status = 0;
 					for (i=0; i<arraySize; i++) {
 						if (ps->a[i] < 0)  {
@@ -807,54 +1995,36 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					}
 					if (status) printf("aCalcPerform: attempt to take log of negative number\n");
 					break;
-				case ACOS: for (i=0; i<arraySize; i++) {ps->a[i] = acos(ps->a[i]);} break;
-				case ASIN: for (i=0; i<arraySize; i++) {ps->a[i] = asin(ps->a[i]);} break;
-				case ATAN: for (i=0; i<arraySize; i++) {ps->a[i] = atan(ps->a[i]);} break;
-				case COS: for (i=0; i<arraySize; i++) {ps->a[i] = cos(ps->a[i]);} break;
-				case SIN: for (i=0; i<arraySize; i++) {ps->a[i] = sin(ps->a[i]);} break;
-				case TAN: for (i=0; i<arraySize; i++) {ps->a[i] = tan(ps->a[i]);} break;
-				case COSH: for (i=0; i<arraySize; i++) {ps->a[i] = cosh(ps->a[i]);} break;
-				case SINH: for (i=0; i<arraySize; i++) {ps->a[i] = sinh(ps->a[i]);} break;
-				case TANH: for (i=0; i<arraySize; i++) {ps->a[i] = tanh(ps->a[i]);} break;
-				case CEIL: for (i=0; i<arraySize; i++) {ps->a[i] = ceil(ps->a[i]);} break;
-				case FLOOR: for (i=0; i<arraySize; i++) {ps->a[i] = floor(ps->a[i]);} break;
-				case ISINF: for (i=0; i<arraySize; i++) {ps->a[i] = isinf(ps->a[i]);} break;
-				case NINT: for (i=0; i<arraySize; i++) {
-								ps->a[i] = (double)(long)(ps->a[i] >= 0 ? ps->a[i]+0.5 : ps->a[i]-0.5);
-							}
-							break;
+				/* For an empty range, reductions give what their serial loops used to. */
 				case AMAX:
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-					for (i=firstEl+1, d=ps->a[firstEl]; i<=lastEl; i++) {if (ps->a[i]>d) d = ps->a[i];}
+					d = ps->a[firstEl];
+					if (lastEl >= firstEl) d = array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_MAX)->max;
 					toDouble(ps);
 					ps->d = d;
 					break;
 
 				case AMIN:
-					/* for (i=1, d=ps->a[0]; i<arraySize; i++) {if (ps->a[i]<d) d = ps->a[i];} */
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-					for (i=firstEl+1, d=ps->a[firstEl]; i<=lastEl; i++)  {if (ps->a[i]<d) d = ps->a[i];}
+					d = ps->a[firstEl];
+					if (lastEl >= firstEl) d = array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_MIN)->min;
 					toDouble(ps);
 					ps->d = d;
 					break;
 
 				case IXMAX:
-					/* for (i=1, j=0, d=ps->a[0]; i<arraySize; i++) {if (ps->a[i]>d) {d = ps->a[i]; j = i;}} */
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-					if (aCalcPerformDebug>=10) printf("first=%d, last=%d", firstEl, lastEl);
-					for (i=firstEl+1, j=firstEl, d=ps->a[firstEl]; i<=lastEl; i++) {
-						if (ps->a[i]>d) {d = ps->a[i]; j = i;}
-					}
+					if (debug>=10) printf("first=%d, last=%d", firstEl, lastEl);
+					j = firstEl;
+					if (lastEl >= firstEl) j += array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_MAX)->ixmax;
 					toDouble(ps);
 					ps->d = j;
 					break;
 
 				case IXMIN:
-					/* for (i=1, j=0, d=ps->a[0]; i<arraySize; i++) {if (ps->a[i]<d) {d = ps->a[i]; j = i;}} */
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-					for (i=firstEl+1, j=firstEl, d=ps->a[firstEl]; i<=lastEl; i++) {
-						if (ps->a[i]<d) {d = ps->a[i]; j = i;}
-					}
+					j = firstEl;
+					if (lastEl >= firstEl) j += array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_MIN)->ixmin;
 					toDouble(ps);
 					ps->d = j;
 					break;
@@ -890,7 +2060,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					for (i=firstEl, j=-1; i<=lastEl; i++) {
 						if (fabs(ps->a[i]) > SMALL) {
 							j = i;
-							if (aCalcPerformDebug>1) printf("aCalcPerform:IXNZ at index %d\n", j);
+							if (debug>1) printf("aCalcPerform:IXNZ at index %d\n", j);
 							break;
 						}
 					}
@@ -898,21 +2068,18 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					ps->d = j;
 					break;
 
-				case REL_NOT: for (i=0; i<arraySize; i++) {ps->a[i] = (ps->a[i] ? 0 : 1);} break;
-				case BIT_NOT: for (i=0; i<arraySize; i++) {ps->a[i] = ~(int)(ps->a[i]);} break;
-
 				case AVERAGE:
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-					for (i=firstEl+1, d=ps->a[firstEl]; i<=lastEl; i++) {d += ps->a[i];}
+					d = ps->a[firstEl];
+					if (lastEl >= firstEl) d = array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_SUM)->sum;
 					toDouble(ps);
 					ps->d = d/(1+lastEl-firstEl);
 					break;
 
 				case STD_DEV:
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-					for (i=firstEl+1, d=ps->a[firstEl]; i<=lastEl; i++) {d += ps->a[i];}
-					d /= 1+lastEl-firstEl;
-					for (i=firstEl, e=0.; i<=lastEl; i++) {e += (ps->a[i]-d)*(ps->a[i]-d);}
+					e = 0.;
+					if (lastEl >= firstEl) e = array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_MOMENTS)->m2;
 					toDouble(ps);
 					if (lastEl-firstEl > 0)
 						ps->d = sqrt(e/(lastEl-firstEl)); /* sum(err^2)/(n-1) */
@@ -925,23 +2092,21 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					/* find max (d), min (e) values, and index (j) of max value */
 					d = ps->a[firstEl];
 					e = ps->a[firstEl];
-					for (i=firstEl+1, j=firstEl; i<=lastEl; i++) {
-						if (ps->a[i] > d) {
-							d = ps->a[i];
-							j = i;
-						}
-						if (ps->a[i] < e) {
-							e = ps->a[i];
-						}
+					j = firstEl;
+					if (lastEl >= firstEl) {
+						pst = array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_MAX|ACALC_MIN);
+						d = pst->max;
+						e = pst->min;
+						j += pst->ixmax;
 					}
-					if (aCalcPerformDebug>5) {printf("max=%f, at %d; min=%f\n", d, j, e);}
+					if (debug>5) {printf("max=%f, at %d; min=%f\n", d, j, e);}
 					d = e + (d-e)/2;
 					/* walk forwards from peak */
 					for (i=j+1, found=0; i<=lastEl; i++) {
 						if (ps->a[i] < d) {
 							found = 1;
 							e = (i-1) + (d - ps->a[i-1])/(ps->a[i] - ps->a[i-1]);
-							if (aCalcPerformDebug>5) {printf("halfmax at index %f\n", e);}
+							if (debug>5) {printf("halfmax at index %f\n", e);}
 							break;
 						}
 					}
@@ -951,7 +2116,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 						if (ps->a[i] < d) {
 							found = 1;
 							d = i + (d - ps->a[i])/(ps->a[i+1] - ps->a[i]);
-							if (aCalcPerformDebug>5) {printf("halfmax at index %f\n", d);}
+							if (debug>5) {printf("halfmax at index %f\n", d);}
 							break;
 						}
 					}
@@ -961,6 +2126,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					ps->d = e-d;
 					break;
 				case SMOOTH:
+					toWritable(ps);
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
 					d = ps->a[firstEl]; e = ps->a[firstEl+1]; f=ps->a[firstEl+2];
 					for (i=firstEl+2; i<=lastEl-2; i++) {
@@ -969,6 +2135,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					}
 					break;
 				case DERIV:
+					toWritable(ps);
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
 					ps1 = ps; /* y values */
 					INC(ps);
@@ -985,13 +2152,13 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					break;
 				case ARRSUM:
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-					for (i=firstEl, d=0.0; i<=lastEl; i++) {
-						d += ps->a[i];
-					}
+					d = 0.;
+					if (lastEl >= firstEl) d = array_stats(ctx, lp, ps, firstEl, lastEl, ACALC_SUM)->sum;
 					toDouble(ps);
 					ps->d = d;
 					break;
 				case FITPOLY:
+					toWritable(ps);
 					calcFirstLast(ps, &firstEl, &lastEl, arraySize);
 					ps1 = ps; /* y values */
 					INC(ps);
@@ -1014,6 +2181,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 
 					ps3 = ps; /* mask array */
 					DEC(ps);
+					toArray(ps,1);
 					ps1 = ps; /* y values */
 					INC(ps); INC(ps); /* point to unused value-stack element */
 					toArray(ps,0);
@@ -1093,21 +2261,21 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 				case DERIV: ps->d = 0; break;
 				case ARRSUM: break;
 				case FITPOLY: ps->d = 0; break;
-				case FITMPOLY: ps->d = 0; break;
+				case FITMPOLY: DEC(ps); toDouble(ps); ps->d = 0; break;
 				}
 			}
 			break;
 
-/* begin VARARGS functions: Note that all VARARGS functions must be considered in cond_search(), below. */
+/* begin VARARGS functions: Note that all VARARGS functions must be considered in op_length(), below. */
 
 		case FINITE:
-			nargs = *post++;
+			nargs = ip->nargs;
 			if (isDouble(ps)) {
 				j = finite(ps->d);
 			} else {
 				for (i=0, j=1; i<arraySize; i++) {
 					j = j && finite(ps->a[i]);
-					if (aCalcPerformDebug>=10) printf("j=%d ", j);
+					if (debug>=10) printf("j=%d ", j);
 				}
 			}
 			while (--nargs) {
@@ -1125,7 +2293,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			break;
 
 		case ISNAN:
-			nargs = *post++;
+			nargs = ip->nargs;
 			if (isDouble(ps)) {
 				j = isnan(ps->d);
 			} else {
@@ -1150,7 +2318,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 		case MAX:
 		case MIN:
 			/* for now, don't use array extents for these functions */
-			nargs = *post++;
+			nargs = ip->nargs;
 			for (i=0, j=0; i<nargs; j |= isArray(ps-i), i++);
 			if (j) {
 				ps1 = ps - (nargs-1); /* coerce bottommost stack element to array */
@@ -1189,7 +2357,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			{
 				int argc=-1, argb=-1, arga=-1;
 	
-				nargs = *post++;
+				nargs = ip->nargs;
 				while (nargs>4) {DEC(ps); nargs--;}	/* discard extra arguments */
 				switch (nargs) {
 				case 4:
@@ -1233,7 +2401,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			{
 				int argc=-1, argb=-1, arga=-1;
 	
-				nargs = *post++;
+				nargs = ip->nargs;
 				while (nargs>5) {DEC(ps); nargs--;}	/* discard extra arguments */
 				switch (nargs) {
 				case 5:
@@ -1249,14 +2417,11 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 				default:
 					break;
 				}
-				if (nargs < 2) {
-					printf("aCalcPerform: FITMQ: need at least two arguments\n");
-					return(-1);
-				}
 				toArray(ps, 1);
 				calcFirstLast(ps, &firstEl, &lastEl, arraySize);
 				ps3 = ps; /* mask array */
 				DEC(ps);
+				toArray(ps,1);
 				ps1 = ps; /* y values */
 				INC(ps); INC(ps);
 				toArray(ps,0);
@@ -1283,18 +2448,24 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 		case ARANDOM:
 			INC(ps);
 			toArray(ps,0);
-			for (i=0; i<arraySize; i++) ps->a[i] = local_random();
+			calcRandomFill(&ctx->rng, ps->a, arraySize);
+			break;
+
+		case A_NORMAL_RNDM:
+			INC(ps);
+			toArray(ps,0);
+			calcRandomFillNormal(&ctx->rng, ps->a, arraySize);
 			break;
 
 		case RANDOM:
 			INC(ps);
-			ps->d = local_random();
+			ps->d = calcRandom(&ctx->rng);
 			ps->a = NULL;
 			break;
 
 		case NORMAL_RNDM:				
 			INC(ps);
-			ps->d = sqrt(-2*log(local_random())) * cos(2*PI*local_random());
+			ps->d = calcRandomNormal(&ctx->rng);
 			ps->a = NULL;
 			break;
 
@@ -1303,6 +2474,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			DEC(ps);
 			toDouble(ps1);
 			if (isArray(ps)) {
+				toWritable(ps);
 				for (i=0; i<arraySize; i++) {
 					ps->a[i] = pow(ps->a[i], ps1->d);
 				}
@@ -1329,30 +2501,40 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
  		case CAT:
 			ps1 = ps;
 			DEC(ps);
+			if (isSparse(ps) || isSparse(ps1)) {
+				j = sparse_binary(ctx, ps, ps1, op, arraySize);
+				if (j < 0) {
+					printf("aCalcPerform: Can't allocate array.\n");
+					return(-1);
+				}
+				if (j) break;
+			}
 			if (isArray(ps) || isArray(ps1)) {
 				toArray(ps,1);
 				calcFirstLast(ps, &firstEl, &lastEl, arraySize);
-				if (aCalcPerformDebug>=10) {printf("two-arg: firstEl=%d, lastEl=%d\n", firstEl, lastEl);}
+				if (debug>=10) {printf("two-arg: firstEl=%d, lastEl=%d\n", firstEl, lastEl);}
 
 				if (isArray(ps1)) {
 					calcFirstLast(ps1, &firstEl1, &lastEl1, arraySize);
 					switch (op) {
-					case GR_OR_EQ:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] >= ps1->a[i]; break;
-					case GR_THAN:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] > ps1->a[i]; break;
-					case LESS_OR_EQ:	for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] <= ps1->a[i]; break;
-					case LESS_THAN:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] < ps1->a[i]; break;
-					case NOT_EQ:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] != ps1->a[i]; break;
-					case EQUAL:			for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] == ps1->a[i]; break;
-					case MAX_VAL:		for (i=0; i<arraySize; i++) if (ps->a[i] < ps1->a[i]) ps->a[i] = ps1->a[i]; break;
-					case MIN_VAL:		for (i=0; i<arraySize; i++) if (ps->a[i] > ps1->a[i]) ps->a[i] = ps1->a[i]; break;
-					case REL_OR:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] || ps1->a[i]; break;
-					case REL_AND:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] && ps1->a[i]; break;
-					case BIT_OR:		for (i=0; i<arraySize; i++) ps->a[i] = (int)ps->a[i] | (int)ps1->a[i]; break;
-					case BIT_AND:		for (i=0; i<arraySize; i++) ps->a[i] = (int)ps->a[i] & (int)ps1->a[i]; break;
-					case BIT_EXCL_OR:	for (i=0; i<arraySize; i++) ps->a[i] = (int)ps->a[i] ^ (int)ps1->a[i]; break;
+					case GR_OR_EQ:
+					case GR_THAN:
+					case LESS_OR_EQ:
+					case LESS_THAN:
+					case NOT_EQ:
+					case EQUAL:
+					case MAX_VAL:
+					case MIN_VAL:
+					case REL_OR:
+					case REL_AND:
+					case BIT_OR:
+					case BIT_AND:
+					case BIT_EXCL_OR:
+						k_binary_aa(op, ps->a, ps1->a, arraySize);
+						break;
 			 		case ATAN2:			for (i=0; i<arraySize; i++) ps->a[i] = atan2(ps1->a[i], ps->a[i]); break;
 			 		case CAT:
-						if (aCalcPerformDebug>=10) {
+						if (debug>=10) {
 							printf("CAT(array, array); array[0]=%f, double=%f\n", ps->a[0], ps1->a[0]);
 						}
 						for (i=lastEl+1, j=firstEl1; i<arraySize && j <=lastEl1; i++, j++)
@@ -1362,26 +2544,28 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 					}
 				} else {
 					switch (op) {
-					case GR_OR_EQ:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] >= ps1->d; break;
-					case GR_THAN:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] > ps1->d; break;
-					case LESS_OR_EQ:	for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] <= ps1->d; break;
-					case LESS_THAN:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] < ps1->d; break;
-					case NOT_EQ:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] != ps1->d; break;
-					case EQUAL:			for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] == ps1->d; break;
-					case MAX_VAL:		for (i=0; i<arraySize; i++) if (ps->a[i] < ps1->d) ps->a[i] = ps1->d; break;
-					case MIN_VAL:		for (i=0; i<arraySize; i++) if (ps->a[i] > ps1->d) ps->a[i] = ps1->d; break;
-					case REL_OR:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] || ps1->d; break;
-					case REL_AND:		for (i=0; i<arraySize; i++) ps->a[i] = ps->a[i] && ps1->d; break;
-					case BIT_OR:		for (i=0; i<arraySize; i++) ps->a[i] = (int)ps->a[i] | (int)ps1->d; break;
-					case BIT_AND:		for (i=0; i<arraySize; i++) ps->a[i] = (int)ps->a[i] & (int)ps1->d; break;
-					case BIT_EXCL_OR:	for (i=0; i<arraySize; i++) ps->a[i] = (int)ps->a[i] ^ (int)ps1->d; break;
+					case GR_OR_EQ:
+					case GR_THAN:
+					case LESS_OR_EQ:
+					case LESS_THAN:
+					case NOT_EQ:
+					case EQUAL:
+					case MAX_VAL:
+					case MIN_VAL:
+					case REL_OR:
+					case REL_AND:
+					case BIT_OR:
+					case BIT_AND:
+					case BIT_EXCL_OR:
+						k_binary_as(op, ps->a, ps1->d, arraySize);
+						break;
 			 		case ATAN2:			for (i=0; i<arraySize; i++) ps->a[i] = atan2(ps1->d, ps->a[i]); break;
 			 		case CAT:
-						if (aCalcPerformDebug>=10) {
+						if (debug>=10) {
 							printf("CAT(array, double); array[0]=%f, double=%f\n", ps->a[0], ps1->d);
 						}
 						if (lastEl+1 < arraySize) {ps->a[lastEl+1] = ps1->d; ps->numEl += 1;}
-						if (aCalcPerformDebug>=10) {
+						if (debug>=10) {
 							printf("CAT; array[0]=%f, array[1]=%f\n", ps->a[0], ps->a[1]);
 						}
 						break;
@@ -1422,6 +2606,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 				}
 			} else {
 				/* array variable: shift array elements */
+				toWritable(ps);
 				e = ps1->d;	/* num channels to shift */
 				if (op == LEFT_SHIFT)  e = -e;
 				j = myNINT(e);
@@ -1457,8 +2642,8 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			if (isDouble(ps)) {
 				d = ps->d;
 			} else {
-				d = ps->a[0];
-				ps->a = NULL;
+				to_double(ps);
+				d = ps->d;
 			}
 			i = myNINT(d);
 			if (i >= num_dArgs || i < 0) {
@@ -1474,34 +2659,36 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 		case A_AFETCH:
 			toDouble(ps);
 			d = ps->d;
-			toArray(ps,0);
-			ps->a[0] = '\0';
 			j = myNINT(d);
 			if (j >= num_aArgs || j < 0) {
+				toArray(ps,0);
+				ps->a[0] = '\0';
 				printf("aCalcPerform: fetch index, %d, out of range.\n", j);
+			} else if (pp_aArg[j] && canBorrow(ctx)) {
+				/* borrow, rather than copy, the caller's array */
+				ps->a = pp_aArg[j];
+				ps->numEl = -1;
+			} else if (pp_aArg[j]) {
+				toArray(ps,0);
+				k_widen(ctx->argType, ps->a, pp_aArg[j], arraySize);
+				ps->numEl = -1;
 			} else {
 				/* Careful.  It's possible the record has not allocated the array */
-				if (pp_aArg[j]) {
-					for (i=0; i<arraySize; i++) ps->a[i] = pp_aArg[j][i];
-				} else {
-					for (i=0; i<arraySize; i++) ps->a[i] = 0.0;
-				}
+				toArray(ps,0);
+				for (i=0; i<arraySize; i++) ps->a[i] = 0.0;
 			}
 			break;
 
 		case LITERAL_DOUBLE:
 			INC(ps);
-			memcpy((void *)&(ps->d),post,sizeof(double));
+			ps->d = ip->d;
 			ps->a = NULL;
-			post += sizeof(double);
 			break;
 
 		case LITERAL_INT:
 			INC(ps);
-			memcpy((void *)&i,post,sizeof(int));
-			ps->d = (double)i;
+			ps->d = ip->d;
 			ps->a = NULL;
-			post += sizeof(int);
 			break;
 
 		case TO_DOUBLE:
@@ -1518,7 +2705,7 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			DEC(ps);
 			ps1 = ps;
 			DEC(ps);
-			toArray(ps,1);
+			if (isDouble(ps)) toArray(ps,1);
 			toDouble(ps1);
 			i = (int)ps1->d;
 			if (i < 0) i += arraySize;
@@ -1526,66 +2713,81 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 			j = (int)ps2->d;
 			if (j < 0) j += arraySize;
 			i = myMAX(myMIN(i,arraySize),0);
-			j = myMIN(j,arraySize);
-			if (aCalcPerformDebug > 20) printf("\tSUBRANGE*: ix1=%d, ix2=%d\n", i, j);
+			j = myMIN(j,arraySize-1);
+			if (debug > 20) printf("\tSUBRANGE*: ix1=%d, ix2=%d\n", i, j);
+			/* The elements we keep are stored; those we would zero are left sparse. */
 			if (op == SUBRANGE) {
+				k = myMAX(1+j-i, 0);
+				if (isSparse(ps) && (i+k > ps->stored)) {
+					if (densify(ctx, ps, arraySize)) {
+						printf("aCalcPerform: Can't allocate array.\n");
+						return(-1);
+					}
+				}
+				if (isBorrowed(ps)) {
+					ps->a += i;	/* still borrowed, so no copy */
+				} else if (k) {
+					memmove(ps->a, ps->a+i, k*sizeof(double));
+				}
 				ps->firstEl = 0;
 				ps->numEl = 1+j-i;
-				for (k=0; i<=j; k++, i++) ps->a[k] = ps->a[i];
-				for ( ; k<arraySize; k++) ps->a[k] = 0.;
-				if (aCalcPerformDebug > 20) printf("\tSUBRANGE: firstEl=%d, numEl=%d\n", ps->firstEl, ps->numEl);
+				if (debug > 20) printf("\tSUBRANGE: firstEl=%d, numEl=%d\n", ps->firstEl, ps->numEl);
 			} else {
+				k = myMAX(j+1, 0);
+				if (isSparse(ps) && (k > ps->stored)) {
+					if (densify(ctx, ps, arraySize)) {
+						printf("aCalcPerform: Can't allocate array.\n");
+						return(-1);
+					}
+				}
+				if (i > 0) {
+					toWritable(ps);
+					for (i=(myMIN(i,k))-1; i>=0; i--) ps->a[i] = 0.;
+				}
 				ps->firstEl = 0;
 				ps->numEl = j+1;
-				for (k=0; k<i; k++) ps->a[k] = 0.;
-				for (k=j+1; k<arraySize; k++) ps->a[k] = 0.;
-				if (aCalcPerformDebug > 20) printf("\tSUBRANGE_IP: firstEl=%d, numEl=%d\n", ps->firstEl, ps->numEl);
+				if (debug > 20) printf("\tSUBRANGE_IP: firstEl=%d, numEl=%d\n", ps->firstEl, ps->numEl);
 			}
+			ps->sparse = 1;
+			ps->stored = k;
+			ps->fill = 0.;
+			haveSparse = 1;
 			break;
 
  		case UNTIL:
-			if (aCalcPerformDebug > 20) printf("\tUNTIL:ps->d=%f\n", ps->d);
-			if (aCalcPerformDebug > 20) printf("\tpost-1=%p\n", post-1);
-			for (i=0; i<MAX_UNTIL_OP; i++) {
-				/* find ourselves in post, remembering that post was incremented at loop top */
-				if (aCalcPerformDebug > 20) printf("\tuntil_scratch[i].until_loc=%p\n", until_scratch[i].until_loc);
-				if (until_scratch[i].until_loc == post-1) {
-					until_scratch[i].ps = ps;
-					break;
-				}
-			}
-			if (i==MAX_UNTIL_OP) {
-				printf("aCalcPerform: UNTIL not found\n");
-				freeStack(flp, stack);
-				return(-1);
-			}
+			if (debug > 20) printf("\tUNTIL:ps->d=%f\n", ps->d);
+			ctx->until_ps[ip->jump] = ps;
 			break;
 
 		case UNTIL_END:
-			if (aCalcPerformDebug > 20) printf("\tUNTIL_END:ps->d=%f\n", ps->d);
+			if (debug > 20) printf("\tUNTIL_END:ps->d=%f\n", ps->d);
 			if (++loopsDone > aCalcLoopMax)
 				break;
 			if (ps->d==0) {
-				/* reset postfix to matching UNTIL code, stack to its loc at that time */
-				--post;
-				for (i=0; i<MAX_UNTIL_OP; i++) {
-					if (until_scratch[i].until_end_loc == post) {
-						ps = until_scratch[i].ps;
-						post = until_scratch[i].until_loc;
-						if (aCalcPerformDebug > 20) printf("--loop--\n");
-						break;
-					}
-				}
-				if (i==MAX_UNTIL_OP) {
+				/* reset program to matching UNTIL, stack to its loc at that time */
+				pc = lp->prog + ip->jump;
+				ps = ctx->until_ps[pc->jump];
+				if (ps == NULL) {
 					printf("aCalcPerform: UNTIL not found\n");
-					freeStack(flp, stack);
 					return(-1);
 				}
-				break;
+				if (debug > 20) printf("--loop--\n");
 			}
 			break;
 
-
+		case LINKED_RESULT:
+			/* The first expression of a joint program is done.  The second starts
+			 * with an empty stack, and delivers its result to p_dresult2, p_aresult2.
+			 */
+			status1 = finish_result(ctx, ps, top, status, arraySize, p_dresult, p_aresult, 0);
+			p_dresult = p_dresult2;
+			p_aresult = p_aresult2;
+			reset_stack(ctx);
+			ps = top-1;
+			status = 0;
+			loopsDone = 0;
+			haveSparse = 0;
+			break;
 
 		default:
 			break;
@@ -1593,75 +2795,30 @@ long aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg,
 
 	}
 
-	if (aCalcPerformDebug>=20) printf("aCalcPerform:done with expression, status=%d\n", status);
-	if (status) {
-		freeStack(flp, stack);
-		return(status);
-	}
-
-	/* if everything is peachy,the stack should end at its first position */
-	if (ps != top) {
-#if DEBUG
-		if (aCalcPerformDebug>=1) {
-			printf("aCalcPerform: stack error,ps=%p,top=%p\n", (void *)ps, (void *)top);
-			printf("aCalcPerform: stack error (ps-top=%d)\n", (int)(ps-top));
-			printf("aCalcPerform: ps->d=%f\n", ps->d);
-		}
-#endif
-		freeStack(flp, stack);
-		return(-1);
-	}
-	
-	if (isDouble(ps)) {
-		if (aCalcPerformDebug>=20) printf("aCalcPerform:double result=%f\n", ps->d);
-		if (p_dresult) *p_dresult = ps->d;
-		if (p_aresult) {
-			toArray(ps,1);
-			for (i=0; i<arraySize; i++) p_aresult[i] = ps->a[i];
-		}
-	} else {
-		if (aCalcPerformDebug>=20) printf("aCalcPerform:array result a[0]=%f, a[1]=%f\n",
-			ps->a[0], ps->a[1]);
-
-		if (p_aresult) {
-			for (i=0; i<arraySize; i++) p_aresult[i] = ps->a[i];
-		}
-		if (p_dresult) {
-			to_double(ps);
-			*p_dresult = ps->d;
-		}
-	}
-
-	if (aCalcPerformDebug) printf("aCalcPerform:stack lo=%d, hi=%d\n",
-		aCalcStackLW, aCalcStackHW);
-
-	freeStack(flp, stack);
-	return(((isnan(*p_dresult)||isinf(*p_dresult)) ? -1 : 0));
+	return(finish_result(ctx, ps, top, status, arraySize, p_dresult, p_aresult,
+		lp->postLen1 ? 1 : 0) | status1);
 }
 
 
-/*
- * RAND
- *
- * generates a random number between 0 and 1 using the
- * seed = (multy * seed) + addy         Random Number Generator by Knuth
- *                                              SemiNumerical Algorithms
- *                                              Chapter 1
- * randy = seed / 65535.0          To normalize the number between 0 - 1
- */
-static unsigned short seed = 0xa3bf;
-static unsigned short multy = 191 * 8 + 5;  /* 191 % 8 == 5 */
-static unsigned short addy = 0x3141;
-static double local_random()
+/* Number of bytes used by the operator at post, including any operand. */
+static int op_length(const unsigned char *post)
 {
-        double  randy;
-
-        /* random number */
-        seed = (seed * multy) + addy;
-        randy = (float) seed / 65535.0;
-
-        /* between 0 - 1 */
-        return(randy);
+	switch (*post) {
+	case LITERAL_DOUBLE:
+		return(1+sizeof(double));
+	case LITERAL_INT:
+		return(1+sizeof(int));
+	case MIN:
+	case MAX:
+	case FINITE:
+	case ISNAN:
+	case FITQ:
+	case FITMQ:
+		/* variable argument function.  numArgs follows */
+		return(2);
+	default:
+		return(1);
+	}
 }
 
 /* Search the instruction stream for a matching operator, skipping any
@@ -13,6 +13,7 @@
  *      Date:            12-12-86
  */
 
+#include	<stdlib.h>
 #include	<stdio.h>
 #include	<string.h>
 #include	<ctype.h>
@@ -20,14 +21,19 @@
 #include	<dbDefs.h>
 #include	<epicsStdlib.h>
 #include	<epicsString.h>
+#include	<epicsThread.h>
 #define epicsExportSharedSymbols
 #include	"aCalcPostfix.h"
 #include	"aCalcPostfixPvt.h"
+#include	"calcOptimize.h"
+#include	"calcTrie.h"
 #include <epicsExport.h>
 
 #define DEBUG 1
 volatile int aCalcPostfixDebug=0;
 epicsExportAddress(int, aCalcPostfixDebug);
+volatile int aCalcPostfixOptimize=0;
+epicsExportAddress(int, aCalcPostfixOptimize);
 
 /* declarations for postfix */
 /* element types */
@@ -112,6 +118,7 @@ static const ELEMENT operands[] = {
 {"ACOS",		9, 10,	0,		UNARY_OPERATOR,		ACOS},
 {"ARR",			9, 10,	0,		UNARY_OPERATOR,		TO_ARRAY},   /* convert to array */
 {"ARNDM",		0, 0,	1,		OPERAND,			ARANDOM},
+{"ANRNDM",		0, 0,	1,		OPERAND,			A_NORMAL_RNDM},   /* Array of Normally Distributed Random Numbers */
 {"ASIN",		9, 10,	0,		UNARY_OPERATOR,		ASIN},
 {"ATAN",		9, 10,	0,		UNARY_OPERATOR,		ATAN},
 {"ATAN2",		9, 10,	-1,		UNARY_OPERATOR,		ATAN2},
@@ -241,6 +248,18 @@ static const ELEMENT operators[] = {
 {"<?",			4, 4,	-1,		BINARY_OPERATOR,	MIN_VAL},     /* minimum of 2 args */
 };
 
+/* Tries of the names in operands[] and operators[], built on first use */
+static calcTrie operandTrie, operatorTrie;
+static int haveTries = 0;
+static epicsThreadOnceId trieOnce = EPICS_THREAD_ONCE_INIT;
+
+static void trieInit(void *arg) {
+	haveTries = (calcTrieBuild(&operandTrie, (const char * const *)&operands[0].name,
+			NELEMENTS(operands), sizeof(ELEMENT)) == 0) &&
+		(calcTrieBuild(&operatorTrie, (const char * const *)&operators[0].name,
+			NELEMENTS(operators), sizeof(ELEMENT)) == 0);
+}
+
 /* get_element
  *
  * find the next expression element in the infix expression
@@ -249,6 +268,7 @@ static int
 	get_element(int opnd, const char **ppsrc, const ELEMENT **ppel)
 {
 	const ELEMENT *ptable, *pel;
+	int i, len;
 
 	*ppel = NULL;
 
@@ -263,8 +283,17 @@ static int
 		pel = ptable + NELEMENTS(operators) - 1;
 	}
 
+	epicsThreadOnce(&trieOnce, trieInit, NULL);
+	if (haveTries) {
+		i = calcTrieMatch(opnd ? &operandTrie : &operatorTrie, *ppsrc, &len);
+		if (i < 0) return FALSE;
+		*ppel = ptable + i;
+		*ppsrc += len;
+		return TRUE;
+	}
+
 	while (pel >= ptable) {
-		size_t len = strlen(pel->name);
+		len = (int)strlen(pel->name);
 
 		if (epicsStrnCaseCmp(*ppsrc, pel->name, len) == 0) {
 			*ppel = pel;
@@ -398,9 +427,657 @@ static const char *opcodes[] = {
 	"IXNZ",
 	"FITQ",
 	"FITMQ",
-	"CAT"
+	"CAT",
+	"A_NORMAL_RNDM"
 };
 
+/*** begin optimizer support ***/
+
+/* Set the stack effect and optimizer flags of an aCalc instruction */
+static int opt_describe(calcOptInst *pi)
+{
+	int op = pi->op;
+
+	pi->pops = 0;
+	pi->pushes = 1;
+	pi->flags = CALC_OPT_NUMBER;
+	if ((op >= FETCH_VAL) && (op <= FETCH_LL)) {
+		pi->flags |= CALC_OPT_FETCH;
+		return(0);
+	}
+	if ((op >= STORE_A) && (op <= STORE_LL)) {
+		pi->pops = 1;
+		pi->pushes = 0;
+		pi->flags = CALC_OPT_IMPURE;
+		return(0);
+	}
+	switch (op) {
+	case LITERAL_DOUBLE: case LITERAL_INT:
+	case CONST_PI: case CONST_D2R: case CONST_R2D: case CONST_S2R: case CONST_R2S:
+		pi->flags |= CALC_OPT_CONST;
+		break;
+	case CONST_IX:
+		pi->flags |= CALC_OPT_FETCH;
+		break;
+	case RANDOM: case NORMAL_RNDM: case ARANDOM: case A_NORMAL_RNDM:
+		pi->flags |= CALC_OPT_IMPURE;
+		break;
+
+	case UNARY_NEG: case ABS_VAL: case EXP: case ANEG_VAL: case APOS_VAL:
+	case LOG_10: case LOG_E: case SQU_RT: case ACOS: case ASIN: case ATAN:
+	case COS: case COSH: case SIN: case SINH: case TAN: case TANH:
+	case CEIL: case FLOOR: case ISINF: case NINT: case REL_NOT: case BIT_NOT:
+		pi->pops = 1;
+		pi->flags |= CALC_OPT_FOLD;
+		break;
+	case TO_DOUBLE: case TO_ARRAY: case A_FETCH: case A_AFETCH: case LEN:
+	case AVERAGE: case STD_DEV: case FWHM: case SMOOTH: case DERIV: case ARRSUM:
+	case AMAX: case AMIN: case FITPOLY: case CUM: case IXMAX: case IXMIN:
+	case IXZ: case IXNZ:
+		pi->pops = 1;
+		break;
+
+	case ADD: case SUB: case MULT: case DIV: case POWER: case ATAN2:
+	case REL_OR: case REL_AND: case BIT_OR: case BIT_AND: case BIT_EXCL_OR:
+	case RIGHT_SHIFT: case LEFT_SHIFT: case NOT_EQ: case LESS_THAN: case LESS_OR_EQ:
+	case EQUAL: case GR_OR_EQ: case GR_THAN: case MAX_VAL: case MIN_VAL:
+		pi->pops = 2;
+		pi->flags |= CALC_OPT_FOLD;
+		break;
+	case MODULO:	/* not folded: integer overflow might trap in a branch never taken */
+	case NSMOOTH: case NDERIV: case FITMPOLY: case CAT:
+		pi->pops = 2;
+		break;
+	case SUBRANGE: case SUBRANGE_IP:
+		pi->pops = 3;
+		break;
+
+	case MAX: case MIN: case FINITE: case ISNAN:
+		pi->pops = pi->nargs;
+		pi->flags |= CALC_OPT_FOLD;
+		break;
+	case FITQ: case FITMQ:
+		pi->pops = pi->nargs;
+		break;
+
+	case A_STORE: case A_ASTORE:
+		pi->pops = 2;
+		pi->pushes = 0;
+		pi->flags = CALC_OPT_IMPURE;
+		break;
+	case COND_IF: case COND_ELSE:
+		/* COND_ELSE drops the value of the first branch, as the second makes another */
+		pi->pops = 1;
+		pi->pushes = 0;
+		pi->flags = 0;
+		break;
+	case COND_END:
+		pi->pushes = 0;
+		pi->flags = 0;
+		break;
+	case UNTIL: case UNTIL_END:
+		pi->pushes = 0;
+		pi->flags = CALC_OPT_IMPURE | CALC_OPT_BARRIER;
+		break;
+	default:
+		return(-1);
+	}
+	return(0);
+}
+
+/* Number of postfix bytes used by an instruction */
+static int opt_length(const calcOptInst *pi)
+{
+	switch (pi->op) {
+	case LITERAL_DOUBLE:	return(1+sizeof(double));
+	case LITERAL_INT:		return(1+sizeof(int));
+	case MIN: case MAX: case FINITE: case ISNAN: case FITQ: case FITMQ:
+		return(2);
+	}
+	return(1);
+}
+
+/* Write n instructions as postfix, in at most size bytes.  Return the number of
+ * bytes written, or -1 if they don't fit.
+ */
+static int opt_encode(const calcOptInst *pi, int n, unsigned char *post, int size)
+{
+	unsigned char *pout = post;
+	int i, lit_i;
+
+	for (i=0; i<n; i++) {
+		if ((pout - post) + opt_length(&pi[i]) >= size) return(-1);
+		*pout++ = pi[i].op;
+		switch (pi[i].op) {
+		case LITERAL_DOUBLE:
+			memcpy(pout, (void *)&pi[i].d, sizeof(double));
+			pout += sizeof(double);
+			break;
+		case LITERAL_INT:
+			lit_i = (int)pi[i].d;
+			memcpy(pout, (void *)&lit_i, sizeof(int));
+			pout += sizeof(int);
+			break;
+		case MIN: case MAX: case FINITE: case ISNAN: case FITQ: case FITMQ:
+			*pout++ = pi[i].nargs;
+			break;
+		}
+	}
+	*pout++ = END_EXPRESSION;
+	return((int)(pout - post));
+}
+
+/* Read postfix into at most max instructions.  Return the number read, or -1. */
+static int opt_decode(const unsigned char *post, calcOptInst *pi, int max)
+{
+	int n, lit_i;
+
+	for (n=0; *post != END_EXPRESSION; n++) {
+		if (n >= max) return(-1);
+		memset(&pi[n], 0, sizeof(calcOptInst));
+		pi[n].op = *post++;
+		switch (pi[n].op) {
+		case LITERAL_DOUBLE:
+			memcpy((void *)&pi[n].d, post, sizeof(double));
+			post += sizeof(double);
+			break;
+		case LITERAL_INT:
+			memcpy((void *)&lit_i, post, sizeof(int));
+			pi[n].d = lit_i;
+			post += sizeof(int);
+			break;
+		case MIN: case MAX: case FINITE: case ISNAN: case FITQ: case FITMQ:
+			pi[n].nargs = *post++;
+			break;
+		}
+		if (opt_describe(&pi[n])) return(-1);
+	}
+	return(n);
+}
+
+/* Evaluate constant instructions with aCalcPerform(), so they give what they always did */
+static int opt_eval(const calcOptInst *pi, int n, double *pd)
+{
+	unsigned char post[(ACALC_STACKSIZE+2)*(1+sizeof(double))+1];
+	epicsUInt32 amask;
+
+	*pd = 0.;
+	if (opt_encode(pi, n, post, sizeof(post)) < 0) return(-1);
+	return(aCalcPerform(NULL, 0, NULL, 0, 1, pd, NULL, post, 1, &amask) ? -1 : 0);
+}
+
+static const calcOptLang optLang = {
+	LITERAL_DOUBLE, LITERAL_INT,
+	ADD, MULT, DIV, POWER, MAX_VAL, MIN_VAL,
+	COND_IF, COND_ELSE, COND_END,
+	ACALC_STACKSIZE,
+	opt_describe,
+	opt_eval
+};
+
+/* Replace the postfix expression at ppostfix with an optimized version no longer
+ * than size bytes, or leave it alone.
+ */
+static void optimize(unsigned char *ppostfix, int size)
+{
+	calcOptInst *in, *out;
+	unsigned char *post;
+	int n, len = -1, hadState = aCalcPerformThreadState();
+
+	in = (calcOptInst *)calloc(size, sizeof(calcOptInst));
+	out = (calcOptInst *)calloc(size, sizeof(calcOptInst));
+	post = (unsigned char *)malloc(size);
+	if (in && out && post) {
+		n = opt_decode(ppostfix, in, size);
+		if (n > 0) n = calcOptimize(&optLang, in, n, out, size);
+		if (n > 0) len = opt_encode(out, n, post, size);
+		if (len > 0) memcpy(ppostfix, post, len);
+	}
+	/* opt_eval() used aCalcPerform(), in whatever thread is compiling (e.g., a CA
+	 * server thread that wrote a CALC field, which exits when its client goes away).
+	 * Free the context that made, but not one the thread's own evaluations use.
+	 */
+	if (!hadState) aCalcPerformThreadCleanup();
+	if (aCalcPostfixDebug && (len <= 0)) printf("aCalcPostfix: expression not optimized\n");
+	free(in);
+	free(out);
+	free(post);
+}
+
+/*** end optimizer support ***/
+
+/*** begin static check ***/
+
+/* How the kind (scalar or array) of an instruction's result follows from its operands */
+#define RESULT_SCALAR	0
+#define RESULT_ARRAY	1
+#define RESULT_EITHER	2	/* can't tell when the expression is compiled */
+#define RESULT_ANY		3	/* array if any operand is an array */
+#define RESULT_FIRST	4	/* kind of the first (deepest) operand */
+#define RESULT_LAST		5	/* kind of the last operand */
+
+/* Stack when an instruction is about to run, over every path that gets there */
+typedef struct {
+	int depth;		/* -1 if no path gets there */
+	unsigned char kind[ACALC_STACKSIZE+1];	/* kind[1] is the bottom of the stack */
+} checkState;
+
+/* Set the stack effect of an instruction, exactly as aCalcPerform() has it.  Some
+ * operators use stack elements above their operands as scratch arrays: those from
+ * (depth before the operator)+*lo to +*hi, if *lo <= *hi.  If *arrayOnly, they
+ * do so only if the last operand is an array.  Return CALC_ERR_xxx.
+ */
+static int check_describe(const calcOptInst *pi, int *pops, int *pushes, int *result,
+	int *lo, int *hi, int *arrayOnly)
+{
+	int op = pi->op, nargs = pi->nargs;
+
+	*pops = 0;
+	*pushes = 1;
+	*result = RESULT_SCALAR;
+	*lo = 1;
+	*hi = 0;
+	*arrayOnly = 0;
+	if (((op >= FETCH_A) && (op <= FETCH_P)) || (op == FETCH_VAL)) return(0);
+	if ((op >= FETCH_AA) && (op <= FETCH_LL)) {
+		*result = RESULT_ARRAY;
+		return(0);
+	}
+	if ((op >= STORE_A) && (op <= STORE_LL)) {
+		*pops = 1;
+		*pushes = 0;
+		return(0);
+	}
+	switch (op) {
+	case LITERAL_DOUBLE: case LITERAL_INT: case RANDOM: case NORMAL_RNDM:
+	case CONST_PI: case CONST_D2R: case CONST_R2D: case CONST_S2R: case CONST_R2S:
+		break;
+	case CONST_IX: case ARANDOM: case A_NORMAL_RNDM:
+		*result = RESULT_ARRAY;
+		break;
+	case FETCH_AVAL:	/* the caller need not supply an array result */
+		*result = RESULT_EITHER;
+		break;
+
+	case UNARY_NEG: case ABS_VAL: case EXP: case ANEG_VAL: case APOS_VAL:
+	case LOG_10: case LOG_E: case SQU_RT: case ACOS: case ASIN: case ATAN:
+	case COS: case COSH: case SIN: case SINH: case TAN: case TANH:
+	case CEIL: case FLOOR: case ISINF: case NINT: case REL_NOT: case BIT_NOT:
+	case SMOOTH: case CUM: case LEN:
+		*pops = 1;
+		*result = RESULT_FIRST;
+		break;
+	case DERIV: case FITPOLY:
+		*pops = 1;
+		*result = RESULT_FIRST;
+		*hi = 2;
+		*arrayOnly = 1;
+		break;
+	case TO_DOUBLE: case A_FETCH: case AVERAGE: case STD_DEV: case FWHM: case ARRSUM:
+	case AMAX: case AMIN: case IXMAX: case IXMIN: case IXZ: case IXNZ:
+		*pops = 1;
+		break;
+	case TO_ARRAY: case A_AFETCH:
+		*pops = 1;
+		*result = RESULT_ARRAY;
+		break;
+
+	case ADD: case SUB: case MULT: case DIV: case MODULO: case ATAN2: case CAT:
+	case REL_OR: case REL_AND: case BIT_OR: case BIT_AND: case BIT_EXCL_OR:
+	case NOT_EQ: case LESS_THAN: case LESS_OR_EQ: case EQUAL: case GR_OR_EQ: case GR_THAN:
+	case MAX_VAL: case MIN_VAL:
+		*pops = 2;
+		*result = RESULT_ANY;
+		break;
+	case POWER: case RIGHT_SHIFT: case LEFT_SHIFT:
+		*pops = 2;
+		*result = RESULT_FIRST;
+		break;
+	case NSMOOTH:
+		*pops = 2;
+		*result = RESULT_ARRAY;
+		break;
+	case NDERIV:
+		*pops = 2;
+		*result = RESULT_ARRAY;
+		*lo = 0;
+		*hi = 2;
+		break;
+	case FITMPOLY:
+		*pops = 2;
+		*result = RESULT_LAST;
+		*hi = 2;
+		*arrayOnly = 1;
+		break;
+	case SUBRANGE: case SUBRANGE_IP:
+		*pops = 3;
+		*result = RESULT_ARRAY;
+		break;
+
+	case MAX: case MIN: case FINITE: case ISNAN: case FITQ: case FITMQ:
+		if ((nargs < 1) || ((op == FITMQ) && (nargs < 2))) return(CALC_ERR_UNDERFLOW);
+		*pops = nargs;
+		if ((op == MAX) || (op == MIN)) *result = RESULT_ANY;
+		if (op == FITQ) {
+			*result = RESULT_ARRAY;
+			*lo = *hi = 2-nargs;	/* x values */
+		}
+		if (op == FITMQ) {
+			*result = RESULT_ARRAY;
+			*lo = 2-nargs;			/* mask */
+			*hi = 3-nargs;			/* x values */
+		}
+		break;
+
+	case A_STORE: case A_ASTORE:
+		*pops = 2;
+		*pushes = 0;
+		break;
+	case COND_IF:
+		*pops = 1;
+		*pushes = 0;
+		break;
+	case COND_ELSE: case COND_END: case UNTIL: case UNTIL_END:
+		*pushes = 0;
+		break;
+	default:
+		return(CALC_ERR_INTERNAL);
+	}
+	return(0);
+}
+
+/* Merge state *ps into the state at an instruction.  Return CALC_ERR_xxx. */
+static int check_merge(checkState *to, const checkState *ps, int *changed)
+{
+	int i;
+
+	if (to->depth < 0) {
+		*to = *ps;
+		*changed = 1;
+		return(0);
+	}
+	/* paths that join must leave the same number of values on the stack */
+	if (to->depth != ps->depth) return(CALC_ERR_CONDITIONAL);
+	for (i=1; i<=ps->depth; i++) {
+		if ((to->kind[i] | ps->kind[i]) != to->kind[i]) {
+			to->kind[i] |= ps->kind[i];
+			*changed = 1;
+		}
+	}
+	return(0);
+}
+
+/* aCalcPostfixCheck
+ *
+ * Follow every path through a postfix expression, as aCalcPerform() would run it,
+ * to find how deep its value stack gets (counting the scratch arrays some operators
+ * use), and which stack elements might hold arrays.  If opKinds is not NULL, set
+ * opKinds[i] to the kinds (ACALC_KIND_xxx) the operands of instruction i might
+ * have.  Return CALC_ERR_NONE, or the error that would make evaluation fail: e.g.,
+ * stack underflow or overflow, or a conditional whose branches leave different
+ * numbers of values on the stack.
+ */
+int aCalcPostfixCheck(const unsigned char *postfix, aCalcShape *pshape,
+	unsigned char *opKinds)
+{
+	calcOptInst *pi = NULL, inst;
+	checkState *state = NULL, s;
+	const unsigned char *p;
+	int *next = NULL;	/* instruction at which a jump from each instruction lands */
+	int i, j, k, n, count, changed, target;
+	int pops, pushes, result, lo, hi, arrayOnly, kinds, depth;
+	int numUntils, until_loc[ACALC_STACKSIZE], until_claimed[ACALC_STACKSIZE];
+	int status = CALC_ERR_NONE;
+
+	pshape->maxDepth = 1;
+	pshape->minDepth = 1;
+	pshape->arraySlots = 1<<1;	/* the result might be converted to an array */
+	pshape->numArrays = 0;
+
+	memset(&inst, 0, sizeof(inst));
+	for (p=postfix, n=0; *p != END_EXPRESSION; n++) {
+		inst.op = *p;
+		p += opt_length(&inst);
+	}
+	pi = (calcOptInst *)calloc(n+1, sizeof(calcOptInst));
+	state = (checkState *)calloc(n+1, sizeof(checkState));
+	next = (int *)calloc(n+1, sizeof(int));
+	if (!pi || !state || !next) {
+		status = CALC_ERR_INTERNAL;
+		goto done;
+	}
+	if (opt_decode(postfix, pi, n) != n) {
+		status = CALC_ERR_INTERNAL;
+		goto done;
+	}
+	if (opKinds) memset(opKinds, 0, n);
+
+	/* Find jumps as cond_search() and the UNTIL_END claim order in aCalcPerform() do */
+	for (i=0, numUntils=0; i<n; i++) {
+		next[i] = -1;
+		if ((pi[i].op == COND_IF) || (pi[i].op == COND_ELSE)) {
+			target = (pi[i].op == COND_IF) ? COND_ELSE : COND_END;
+			for (j=i+1, count=1; j<n; j++) {
+				if ((pi[j].op == target) && (--count == 0)) {
+					next[i] = j+1;
+					break;
+				}
+				if (pi[j].op == COND_IF) count++;
+			}
+			if (next[i] < 0) {
+				status = CALC_ERR_CONDITIONAL;
+				goto done;
+			}
+		} else if (pi[i].op == UNTIL) {
+			if (numUntils >= ACALC_STACKSIZE) {
+				status = CALC_ERR_OVERFLOW;
+				goto done;
+			}
+			until_loc[numUntils] = i;
+			until_claimed[numUntils++] = 0;
+		} else if (pi[i].op == UNTIL_END) {
+			for (k=numUntils-1; k>=0 && until_claimed[k]; k--);
+			if (k < 0) {
+				status = CALC_ERR_SYNTAX;
+				goto done;
+			}
+			until_claimed[k] = 1;
+			next[i] = until_loc[k];
+		}
+	}
+
+	for (i=1; i<=n; i++) state[i].depth = -1;
+	state[0].depth = 0;
+
+	/* Kinds only ever get added to a state, so this ends after a few passes */
+	do {
+		changed = 0;
+		for (i=0; i<n; i++) {
+			if ((depth = state[i].depth) < 0) continue;
+			status = check_describe(&pi[i], &pops, &pushes, &result, &lo, &hi, &arrayOnly);
+			if (status) goto done;
+			if (pops > depth) {
+				status = CALC_ERR_UNDERFLOW;
+				goto done;
+			}
+			for (k=depth-pops+1, kinds=0; k<=depth; k++) kinds |= state[i].kind[k];
+			if (opKinds) opKinds[i] |= kinds;
+
+			if (arrayOnly && !(state[i].kind[depth] & ACALC_KIND_ARRAY)) hi = lo-1;
+			for (k=depth+lo; k<=depth+hi; k++) {
+				if (k > ACALC_STACKSIZE) {
+					status = CALC_ERR_OVERFLOW;
+					goto done;
+				}
+				if (k < 1) continue;
+				pshape->arraySlots |= 1<<k;
+				if (k > pshape->maxDepth) pshape->maxDepth = k;
+			}
+
+			s = state[i];
+			s.depth = depth - pops + pushes;
+			if (s.depth > ACALC_STACKSIZE) {
+				status = CALC_ERR_OVERFLOW;
+				goto done;
+			}
+			if (pops && (s.depth < pshape->minDepth)) pshape->minDepth = s.depth;
+			if (s.depth > pshape->maxDepth) pshape->maxDepth = s.depth;
+			if (pushes) {
+				switch (result) {
+				case RESULT_SCALAR:	kinds = ACALC_KIND_SCALAR; break;
+				case RESULT_ARRAY:	kinds = ACALC_KIND_ARRAY; break;
+				case RESULT_EITHER:	kinds = ACALC_KIND_SCALAR|ACALC_KIND_ARRAY; break;
+				case RESULT_ANY:
+					kinds = (kinds & ACALC_KIND_ARRAY) ? kinds : ACALC_KIND_SCALAR;
+					break;
+				case RESULT_FIRST:	kinds = state[i].kind[depth-pops+1]; break;
+				case RESULT_LAST:	kinds = state[i].kind[depth]; break;
+				}
+				s.kind[s.depth] = kinds;
+				if (kinds & ACALC_KIND_ARRAY) pshape->arraySlots |= 1<<s.depth;
+			}
+
+			if (pi[i].op != COND_ELSE) {
+				status = check_merge(&state[i+1], &s, &changed);
+				if (status) goto done;
+			}
+			if ((pi[i].op == COND_IF) || (pi[i].op == COND_ELSE)) {
+				status = check_merge(&state[next[i]], &s, &changed);
+				if (status) goto done;
+			} else if (pi[i].op == UNTIL_END) {
+				/* The loop starts over with the stack pointer where it was at UNTIL */
+				target = next[i];
+				for (k=s.depth+1; k<=state[target].depth; k++)
+					s.kind[k] = ACALC_KIND_SCALAR|ACALC_KIND_ARRAY;
+				s.depth = state[target].depth;
+				status = check_merge(&state[target], &s, &changed);
+				if (status) goto done;
+			}
+		}
+	} while (changed);
+
+	if (state[n].depth != 1) {
+		status = CALC_ERR_INCOMPLETE;
+		goto done;
+	}
+	for (k=1; k<=ACALC_STACKSIZE; k++) {
+		if (pshape->arraySlots & (1<<k)) pshape->numArrays++;
+	}
+
+done:
+	free(pi);
+	free(state);
+	free(next);
+	return(status);
+}
+
+/*** end static check ***/
+
+/*** begin subexpressions common to two expressions ***/
+
+/* Can instruction pi be part of a subexpression that one expression computes for
+ * another?  It must have no side effect, and must give the same value in both
+ * expressions, so VAL and AVAL (each expression's own result) won't do.
+ */
+static int common_ok(const calcOptInst *pi)
+{
+	if ((pi->op == FETCH_VAL) || (pi->op == FETCH_AVAL)) return(0);
+	return(!(pi->flags & CALC_OPT_IMPURE) && (pi->pushes == 1));
+}
+
+static int common_same(const calcOptInst *a, const calcOptInst *b)
+{
+	return((a->op == b->op) && (a->nargs == b->nargs) && !memcmp(&a->d, &b->d, sizeof(double)));
+}
+
+/* Set first[i] to the first of the instructions that compute the value pushed by
+ * instruction i, or to -1 if any of them can't be shared (see common_ok()).
+ */
+static void common_first(const calcOptInst *pi, int n, int *first)
+{
+	int start[ACALC_STACKSIZE+1], depth = 0, lastBad = -1, i, k, s;
+
+	for (i=0; i<n; i++) {
+		if (!common_ok(&pi[i])) lastBad = i;
+		for (k=0, s=i; (k < pi[i].pops) && (depth > 0); k++) s = start[--depth];
+		first[i] = (s > lastBad) ? s : -1;
+		if (pi[i].pushes && (depth <= ACALC_STACKSIZE)) start[depth++] = s;
+	}
+}
+
+/* aCalcCommonExprs
+ *
+ * Find the subexpressions of postfix2 that postfix1 also computes, so that an
+ * evaluation of both can compute each of them once.  For each, fill in an element
+ * of common (at most max) with the instruction numbers (counting from 0) that
+ * follow it in postfix1, and that begin and follow it in postfix2.  We take the
+ * largest such subexpressions of three or more instructions, and none if either
+ * expression stores to an argument.  Return the number found.
+ */
+int aCalcCommonExprs(const unsigned char *postfix1, const unsigned char *postfix2,
+	aCalcCommonExpr *common, int max)
+{
+	calcOptInst *pi1 = NULL, *pi2 = NULL, inst;
+	const unsigned char *p;
+	epicsUInt32 inputs, stores1, stores2;
+	int *first1 = NULL, *first2 = NULL;
+	int n1, n2, i1, i2, s1, s2, len, k, limit, num = 0;
+
+	if (aCalcArgUsage(postfix1, &inputs, &stores1) || aCalcArgUsage(postfix2, &inputs, &stores2) ||
+			stores1 || stores2)
+		return(0);
+
+	memset(&inst, 0, sizeof(inst));
+	for (p=postfix1, n1=0; *p != END_EXPRESSION; n1++) {
+		inst.op = *p;
+		p += opt_length(&inst);
+	}
+	for (p=postfix2, n2=0; *p != END_EXPRESSION; n2++) {
+		inst.op = *p;
+		p += opt_length(&inst);
+	}
+	pi1 = (calcOptInst *)calloc(n1, sizeof(calcOptInst));
+	pi2 = (calcOptInst *)calloc(n2, sizeof(calcOptInst));
+	first1 = (int *)calloc(n1, sizeof(int));
+	first2 = (int *)calloc(n2, sizeof(int));
+	if (!pi1 || !pi2 || !first1 || !first2 ||
+			(opt_decode(postfix1, pi1, n1) != n1) || (opt_decode(postfix2, pi2, n2) != n2))
+		goto done;
+	common_first(pi1, n1, first1);
+	common_first(pi2, n2, first2);
+
+	/* An instruction comes after the instructions that compute its operands, so
+	 * working backward we meet a subexpression before any part of it.
+	 */
+	for (i2=n2-1, limit=n2; (i2 >= 0) && (num < max); i2--) {
+		s2 = first2[i2];
+		len = i2-s2+1;
+		if ((i2 >= limit) || (s2 < 0) || (len < 3)) continue;
+		for (i1=len-1; i1<n1; i1++) {
+			s1 = i1-len+1;
+			if (first1[i1] != s1) continue;
+			for (k=0; (k < len) && common_same(&pi1[s1+k], &pi2[s2+k]); k++);
+			if (k == len) break;
+		}
+		/* A loop jumps back to UNTIL, so it doesn't always follow the subexpression */
+		if ((i1 >= n1) || ((i1+1 < n1) && (pi1[i1+1].op == UNTIL))) continue;
+		common[num].end1 = i1+1;
+		common[num].start2 = s2;
+		common[num].end2 = i2+1;
+		num++;
+		limit = s2;
+	}
+
+done:
+	free(pi1);
+	free(pi2);
+	free(first1);
+	free(first2);
+	return(num);
+}
+
+/*** end subexpressions common to two expressions ***/
+
 /*
  * aCalcPostFix
  *
@@ -420,6 +1097,8 @@ epicsShareFunc long
 	double lit_d;
 	int lit_i;
 	int handled;
+	int srclen;
+	aCalcShape shape;
 
 #if DEBUG
 	if (aCalcPostfixDebug) printf("aCalcPostfix: entry\n");
@@ -434,6 +1113,7 @@ epicsShareFunc long
 		if (pout) *pout = END_EXPRESSION;
 		return 0;
 	}
+	srclen = (int)strlen(psrc);
 
 	/* place the expression elements into postfix */
 	*pout = END_EXPRESSION;
@@ -793,6 +1473,25 @@ epicsShareFunc long
 		*perror = CALC_ERR_INCOMPLETE;
 		goto bad;
 	}
+	if (aCalcPostfixOptimize) {
+		/* the caller's buffer is at least ACALC_INFIX_TO_POSTFIX_SIZE(srclen) */
+		if (aCalcPostfixDebug) {
+			printf("aCalcPostfix: before optimizing:\n");
+			aCalcExprDump(ppostfix);
+		}
+		optimize(ppostfix, ACALC_INFIX_TO_POSTFIX_SIZE(srclen));
+		if (aCalcPostfixDebug) {
+			printf("aCalcPostfix: after optimizing:\n");
+			aCalcExprDump(ppostfix);
+		}
+	}
+	*perror = aCalcPostfixCheck(ppostfix, &shape, NULL);
+	if (*perror) {
+		if (aCalcPostfixDebug) printf("*** aCalcPostfixCheck ***\n");
+		goto bad;
+	}
+	if (aCalcPostfixDebug) printf("aCalcPostfix: stack depth %d, %d array(s)\n",
+		shape.maxDepth, shape.numArrays);
 	if (aCalcPostfixDebug) printf("\naCalcPostfix: returning success\n");
 	return 0;
 
@@ -836,6 +1535,70 @@ epicsShareFunc const char *
 	return errStrs[error];
 }
 
+/* aCalcArgUsage
+ *
+ * Find the arguments the given postfix reads (*pinputs) and stores to (*pstores),
+ * as ACALC_ARG_xxx bits.  An operator that takes the argument's number from the
+ * stack (@, @@) counts as using all of them.  Return -1 if the postfix is empty.
+ */
+epicsShareFunc long
+	aCalcArgUsage(const unsigned char *postfix, epicsUInt32 *pinputs, epicsUInt32 *pstores)
+{
+	const unsigned char *pinst = postfix;
+	epicsUInt32 inputs = 0, stores = 0;
+	int op;
+
+	*pinputs = *pstores = 0;
+	if (*pinst == END_EXPRESSION) return(-1);
+	while ((op = *pinst++) != END_EXPRESSION) {
+		if ((op >= FETCH_A) && (op <= FETCH_P)) {
+			inputs |= ACALC_ARG_A << (op - FETCH_A);
+		} else if ((op >= FETCH_AA) && (op <= FETCH_LL)) {
+			inputs |= ACALC_ARG_AA << (op - FETCH_AA);
+		} else if ((op >= STORE_A) && (op <= STORE_P)) {
+			stores |= ACALC_ARG_A << (op - STORE_A);
+		} else if ((op >= STORE_AA) && (op <= STORE_LL)) {
+			stores |= ACALC_ARG_AA << (op - STORE_AA);
+		}
+		switch (op) {
+		case LITERAL_DOUBLE:
+			pinst += sizeof(double);
+			break;
+		case LITERAL_INT:
+			pinst += sizeof(int);
+			break;
+		case MIN: case MAX: case FINITE: case ISNAN:
+			pinst++;
+			break;
+		case FITQ: case FITMQ:
+			/* fit coefficients are stored to the arguments that were given for them */
+			if (*pinst++ > ((op == FITQ) ? 1 : 2)) stores |= ACALC_ARG_ALL_SCALARS;
+			break;
+		case FETCH_VAL: case FETCH_AVAL:
+			inputs |= ACALC_ARG_VAL;
+			break;
+		case A_FETCH:
+			inputs |= ACALC_ARG_ALL_SCALARS;
+			break;
+		case A_AFETCH:
+			inputs |= ACALC_ARG_ALL_ARRAYS;
+			break;
+		case A_STORE:
+			stores |= ACALC_ARG_ALL_SCALARS;
+			break;
+		case A_ASTORE:
+			stores |= ACALC_ARG_ALL_ARRAYS;
+			break;
+		case RANDOM: case NORMAL_RNDM: case ARANDOM: case A_NORMAL_RNDM:
+			inputs |= ACALC_ARG_RANDOM;
+			break;
+		}
+	}
+	*pinputs = inputs;
+	*pstores = stores;
+	return(0);
+}
+
 /* aCalcExprDump
  *
  * Disassemble the given postfix instructions to stdout
@@ -863,6 +1626,8 @@ epicsShareFunc void
 		case MAX:
 		case FINITE:
 		case ISNAN:
+		case FITQ:
+		case FITMQ:
 			printf("\t%s, %d arg(s)\n", opcodes[(int) op], *++pinst);
 			pinst++;
 			break;
@@ -38,6 +38,20 @@
 #define CALC_ERR_BRACKET_NOT_OPEN 14 /* Close bracket without open */
 #define CALC_ERR_CURLY_NOT_OPEN   15 /* Close curly bracket without open */
 
+/* Bits of *pinputs and *pstores from aCalcArgUsage() */
+#define ACALC_ARG_A				0x00000001	/* A is bit 0, B bit 1, ..., P bit 15 */
+#define ACALC_ARG_AA			0x00010000	/* AA is bit 16, BB bit 17, ..., LL bit 27 */
+#define ACALC_ARG_ALL_SCALARS	0x0000ffff
+#define ACALC_ARG_ALL_ARRAYS	0x0fff0000
+#define ACALC_ARG_VAL			0x10000000	/* VAL or AVAL, the previous result */
+#define ACALC_ARG_RANDOM		0x20000000	/* the random-number generator */
+
+/* Element types of the caller's array arguments (see aCalcContextArgType()) */
+#define ACALC_TYPE_DOUBLE		0
+#define ACALC_TYPE_FLOAT32		1
+#define ACALC_TYPE_INT32		2
+#define ACALC_TYPE_UINT16		3
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,11 +59,79 @@ extern "C" {
 epicsShareFunc long
 	aCalcPostfix(const char *pinfix, unsigned char * const p_postfix, short *perror);
 
+/* Evaluation state (value stack, scratch arrays, etc.) owned by the caller,
+ * so that aCalcPerformCtx() can run without allocating memory or taking a
+ * global lock.  A context may be used by only one thread at a time.
+ */
+typedef struct aCalcContext aCalcContext;
+
+epicsShareFunc aCalcContext *
+	aCalcContextCreate(int arraySize);
+
+epicsShareFunc void
+	aCalcContextFree(aCalcContext *ctx);
+
+epicsShareFunc void
+	aCalcContextReport(const aCalcContext *ctx);
+
+epicsShareFunc void
+	aCalcContextSeed(aCalcContext *ctx, epicsUInt32 seed);
+
+/* Say that the array arguments (pp_aArg) of evaluations with this context hold
+ * elements of the given type, though they're declared double *.  Elements are
+ * converted to double when fetched, and back when stored, and an array the
+ * evaluation must allocate has allocSize elements of that type.  Returns 0, or
+ * -1 if the type is unknown.
+ */
+epicsShareFunc int
+	aCalcContextArgType(aCalcContext *ctx, int type);
+
+/* Bytes in one element of the given type, or 0 if the type is unknown */
+epicsShareFunc int
+	aCalcTypeSize(int type);
+
+/* Elements of the result array that the last aCalcPerformCtx() call changed:
+ * *pnumEl elements, starting at *pfirstEl.  *pnumEl is zero if none changed.
+ */
+epicsShareFunc void
+	aCalcContextResultRange(const aCalcContext *ctx, int *pfirstEl, int *pnumEl);
+
+/* The same, for the second result of the last aCalcPerformJointCtx() call */
+epicsShareFunc void
+	aCalcContextResultRange2(const aCalcContext *ctx, int *pfirstEl, int *pnumEl);
+
+epicsShareFunc long
+	aCalcPerformCtx(aCalcContext *ctx, double *p_dArg, int num_dArgs,
+		double **pp_aArg, int num_aArgs, int arraySize, double *p_dresult,
+		double *p_aresult, const unsigned char *post, const int allocSize,
+		epicsUInt32 *amask);
+
+/* Evaluate post, and then post2, in one pass: values that both expressions
+ * compute are computed once.  Results are as if aCalcPerformCtx() had been called
+ * for each, except that the status returned is nonzero if either fails.
+ */
+epicsShareFunc long
+	aCalcPerformJointCtx(aCalcContext *ctx, double *p_dArg, int num_dArgs,
+		double **pp_aArg, int num_aArgs, int arraySize, double *p_dresult,
+		double *p_aresult, const unsigned char *post, double *p_dresult2,
+		double *p_aresult2, const unsigned char *post2, const int allocSize,
+		epicsUInt32 *amask);
+
 epicsShareFunc long  
 	aCalcPerform(double *p_dArg, int num_dArgs, double **pp_aArg, int num_aArgs,
 		int arraySize, double *p_dresult, double *p_aresult,
 		const unsigned char *post, const int allocSize, epicsUInt32 *amask);
 
+/* aCalcPerform() keeps a context for each thread that calls it.  A thread that
+ * exits should first call this to free its context; otherwise, the context is
+ * never freed.  A later aCalcPerform() call in the thread makes a new one.
+ */
+epicsShareFunc void
+	aCalcPerformThreadCleanup(void);
+
+epicsShareFunc long
+	aCalcArgUsage(const unsigned char *postfix, epicsUInt32 *pinputs, epicsUInt32 *pstores);
+
 epicsShareFunc const char *
 	aCalcErrorStr(short error);
 
@@ -147,8 +147,55 @@ typedef enum {
 	IXNZ,
 	FITQ,
 	FITMQ,
-	CAT
+	CAT,
+	A_NORMAL_RNDM
 } aCalc_rpn_opcode;
 
+/* What aCalcPostfixCheck() (aCalcPostfix.c) finds out about an expression */
+typedef struct {
+	int maxDepth;		/* most values on the stack, counting operators' scratch arrays */
+	int minDepth;		/* fewest values left on the stack by an operator */
+	unsigned long arraySlots;	/* bit i set if stack element i (1 is the bottom) might hold an array */
+	int numArrays;		/* number of bits set in arraySlots */
+} aCalcShape;
+
+/* kinds of value */
+#define ACALC_KIND_SCALAR	1
+#define ACALC_KIND_ARRAY	2
+
+int aCalcPostfixCheck(const unsigned char *postfix, aCalcShape *pshape,
+	unsigned char *opKinds);
+
+/* A subexpression that two expressions both compute, from aCalcCommonExprs() */
+typedef struct {
+	int end1;		/* first expression: instruction that follows it */
+	int start2;		/* second expression: its first instruction */
+	int end2;		/* second expression: instruction that follows it */
+} aCalcCommonExpr;
+
+int aCalcCommonExprs(const unsigned char *postfix1, const unsigned char *postfix2,
+	aCalcCommonExpr *common, int max);
+
+/* Statistics of a range of doubles, from aCalcReduce() (aCalcReduce.c) */
+typedef struct {
+	int n;			/* number of elements */
+	double sum;
+	double m2;		/* sum of squared deviations from the mean */
+	double max;
+	double min;
+	int ixmax;		/* index of first maximum, or -1 if all elements are NaN */
+	int ixmin;		/* index of first minimum, or -1 if all elements are NaN */
+} aCalcStats;
+
+/* what aCalcReduce() should compute */
+#define ACALC_SUM		1	/* sum */
+#define ACALC_MOMENTS	2	/* sum and m2 */
+#define ACALC_MAX		4	/* max, ixmax */
+#define ACALC_MIN		8	/* min, ixmin */
+
+void aCalcReduce(const double *a, int n, int what, aCalcStats *ps);
+
+int aCalcPerformThreadState(void);
+
 #endif /* INC_aCalcPostfixPvth */
 
@@ -0,0 +1,292 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* aCalcReduce.c
+ * Sum, mean, standard deviation, minimum and maximum of a range of doubles, for
+ * the aCalc array reductions (AVG, STD, SUM, AMAX, AMIN, IXMAX, IXMIN, FWHM).
+ *
+ * The range is reduced as a binary tree: it's halved until pieces are no longer
+ * than REDUCE_BLOCK elements, and results are combined on the way back up.  For
+ * the sum, this is pairwise summation, whose rounding error grows as log(n)
+ * rather than n.  The sum of squared deviations from the mean is combined as
+ * Chan, Golub and LeVeque describe, so the standard deviation takes one pass over
+ * the data, without the cancellation of the sum-of-squares formula.  Within a
+ * block, loops keep several independent accumulators, so the compiler can use
+ * SIMD instructions.
+ *
+ * Ranges of at least aCalcReduceThreshold elements are split among the calling
+ * thread and aCalcReduceThreads helper threads.  The pieces are subtrees of the
+ * same tree, so the result doesn't depend on how many threads did the work.
+ */
+#ifdef vxWorks
+#include <vxWorks.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#define epicsExportSharedSymbols
+#include "aCalcPostfix.h"
+#include "aCalcPostfixPvt.h"
+#include <epicsExport.h>
+
+#define REDUCE_BLOCK 256		/* elements */
+#define MAX_REDUCE_THREADS 15
+#define MAX_REDUCE_PARTS 16		/* power of two, > MAX_REDUCE_THREADS */
+
+volatile int aCalcReduceThreads = 3;
+epicsExportAddress(int, aCalcReduceThreads);
+volatile int aCalcReduceThreshold = 1000000;
+epicsExportAddress(int, aCalcReduceThreshold);
+
+/*** begin serial reduction ***/
+
+/* Reduce a[0..n-1], n <= REDUCE_BLOCK */
+static void reduce_block(const double *a, int n, int what, aCalcStats *ps) {
+	double s0, s1, s2, s3, mean, d;
+	double mx0, mx1, mx2, mx3, mn0, mn1, mn2, mn3;
+	int i;
+
+	ps->n = n;
+	if (what & (ACALC_SUM|ACALC_MOMENTS)) {
+		for (i=0, s0=s1=s2=s3=0.; i+3<n; i+=4) {
+			s0 += a[i]; s1 += a[i+1]; s2 += a[i+2]; s3 += a[i+3];
+		}
+		for (; i<n; i++) s0 += a[i];
+		ps->sum = (s0+s1) + (s2+s3);
+	}
+	if (what & ACALC_MOMENTS) {
+		/* The block is in cache, so a second look at it is cheap. */
+		mean = ps->sum/n;
+		for (i=0, s0=s1=s2=s3=0.; i+3<n; i+=4) {
+			d = a[i]-mean; s0 += d*d;
+			d = a[i+1]-mean; s1 += d*d;
+			d = a[i+2]-mean; s2 += d*d;
+			d = a[i+3]-mean; s3 += d*d;
+		}
+		for (; i<n; i++) {d = a[i]-mean; s0 += d*d;}
+		ps->m2 = (s0+s1) + (s2+s3);
+	}
+	/* NaN never compares greater or less, so it's skipped.  If every element is NaN,
+	 * the index is -1.  We report the first element equal to the extreme, and its
+	 * value, rather than the extreme itself, so 0. and -0. come out as a serial
+	 * search finds them.
+	 */
+	if (what & ACALC_MAX) {
+		mx0 = mx1 = mx2 = mx3 = -HUGE_VAL;
+		for (i=0; i+3<n; i+=4) {
+			mx0 = a[i] > mx0 ? a[i] : mx0;
+			mx1 = a[i+1] > mx1 ? a[i+1] : mx1;
+			mx2 = a[i+2] > mx2 ? a[i+2] : mx2;
+			mx3 = a[i+3] > mx3 ? a[i+3] : mx3;
+		}
+		for (; i<n; i++) mx0 = a[i] > mx0 ? a[i] : mx0;
+		mx0 = mx1 > mx0 ? mx1 : mx0; mx2 = mx3 > mx2 ? mx3 : mx2; mx0 = mx2 > mx0 ? mx2 : mx0;
+		for (i=0; i<n && a[i] != mx0; i++);
+		ps->ixmax = (i<n) ? i : -1;
+		ps->max = (i<n) ? a[i] : mx0;
+	}
+	if (what & ACALC_MIN) {
+		mn0 = mn1 = mn2 = mn3 = HUGE_VAL;
+		for (i=0; i+3<n; i+=4) {
+			mn0 = a[i] < mn0 ? a[i] : mn0;
+			mn1 = a[i+1] < mn1 ? a[i+1] : mn1;
+			mn2 = a[i+2] < mn2 ? a[i+2] : mn2;
+			mn3 = a[i+3] < mn3 ? a[i+3] : mn3;
+		}
+		for (; i<n; i++) mn0 = a[i] < mn0 ? a[i] : mn0;
+		mn0 = mn1 < mn0 ? mn1 : mn0; mn2 = mn3 < mn2 ? mn3 : mn2; mn0 = mn2 < mn0 ? mn2 : mn0;
+		for (i=0; i<n && a[i] != mn0; i++);
+		ps->ixmin = (i<n) ? i : -1;
+		ps->min = (i<n) ? a[i] : mn0;
+	}
+}
+
+/* Combine the results for two adjacent pieces, *pl first.  *ps may be *pl. */
+static void reduce_combine(const aCalcStats *pl, const aCalcStats *pr, int what,
+		aCalcStats *ps) {
+	double delta;
+	int n = pl->n + pr->n;
+
+	if (what & ACALC_MOMENTS) {
+		delta = pr->sum/pr->n - pl->sum/pl->n;
+		ps->m2 = pl->m2 + pr->m2 + delta*delta*((double)pl->n*pr->n/n);
+	}
+	if (what & (ACALC_SUM|ACALC_MOMENTS)) ps->sum = pl->sum + pr->sum;
+	/* On a tie, the left piece has the first occurrence. */
+	if (what & ACALC_MAX) {
+		if ((pl->ixmax < 0) || ((pr->ixmax >= 0) && (pr->max > pl->max))) {
+			ps->max = pr->max;
+			ps->ixmax = (pr->ixmax < 0) ? -1 : pl->n + pr->ixmax;
+		} else {
+			ps->max = pl->max;
+			ps->ixmax = pl->ixmax;
+		}
+	}
+	if (what & ACALC_MIN) {
+		if ((pl->ixmin < 0) || ((pr->ixmin >= 0) && (pr->min < pl->min))) {
+			ps->min = pr->min;
+			ps->ixmin = (pr->ixmin < 0) ? -1 : pl->n + pr->ixmin;
+		} else {
+			ps->min = pl->min;
+			ps->ixmin = pl->ixmin;
+		}
+	}
+	ps->n = n;
+}
+
+static void reduce_tree(const double *a, int n, int what, aCalcStats *ps) {
+	aCalcStats right;
+	int h;
+
+	if (n <= REDUCE_BLOCK) {
+		reduce_block(a, n, what, ps);
+		return;
+	}
+	h = n/2;
+	reduce_tree(a, h, what, ps);
+	reduce_tree(a+h, n-h, what, &right);
+	reduce_combine(ps, &right, what, ps);
+}
+
+/*** end serial reduction ***/
+
+/*** begin threaded reduction ***/
+
+typedef struct {
+	epicsEventId	go;
+	epicsEventId	done;
+	const double	*a;
+	int				n;
+	int				what;
+	aCalcStats		stats;
+} reduceWorker;
+
+static epicsThreadOnceId	reducePoolOnce = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId			reducePoolLock = NULL;	/* held while the helpers are in use */
+static reduceWorker			reduceWorkers[MAX_REDUCE_THREADS];
+static int					reduceNumWorkers = 0;
+
+static void reduceWorkerTask(void *parm) {
+	reduceWorker *pw = (reduceWorker *)parm;
+
+	while (1) {
+		epicsEventMustWait(pw->go);
+		reduce_tree(pw->a, pw->n, pw->what, &pw->stats);
+		epicsEventSignal(pw->done);
+	}
+}
+
+static void reducePoolInit(void *arg) {
+	int i, n;
+	char name[20];
+	reduceWorker *pw;
+
+	reducePoolLock = epicsMutexMustCreate();
+	n = aCalcReduceThreads;
+	if (n > MAX_REDUCE_THREADS) n = MAX_REDUCE_THREADS;
+	for (i=0; i<n; i++) {
+		pw = &reduceWorkers[reduceNumWorkers];
+		pw->go = epicsEventMustCreate(epicsEventEmpty);
+		pw->done = epicsEventMustCreate(epicsEventEmpty);
+		sprintf(name, "acalcReduce%d", i);
+		if (epicsThreadCreate(name, epicsThreadPriorityMedium,
+				epicsThreadGetStackSize(epicsThreadStackSmall),
+				(EPICSTHREADFUNC)reduceWorkerTask, pw)) {
+			reduceNumWorkers++;
+		} else {
+			printf("aCalcReduce: Unable to create %s\n", name);
+			epicsEventDestroy(pw->go);
+			epicsEventDestroy(pw->done);
+		}
+	}
+}
+
+/* Split a[0..n-1] into the 2^depth subtrees reduce_tree() would make at that depth. */
+static void split_tree(const double *a, int n, int depth, const double **pa, int *pn, int *pk) {
+	if (depth == 0) {
+		pa[*pk] = a;
+		pn[(*pk)++] = n;
+		return;
+	}
+	split_tree(a, n/2, depth-1, pa, pn, pk);
+	split_tree(a+n/2, n-n/2, depth-1, pa, pn, pk);
+}
+
+/* Combine the results for 2^depth subtrees, starting at part k, as reduce_tree() would. */
+static void combine_tree(aCalcStats **parts, int k, int depth, int what, aCalcStats *ps) {
+	aCalcStats left, right;
+
+	if (depth == 0) {
+		*ps = *parts[k];
+		return;
+	}
+	combine_tree(parts, k, depth-1, what, &left);
+	combine_tree(parts, k + (1<<(depth-1)), depth-1, what, &right);
+	reduce_combine(&left, &right, what, ps);
+}
+
+/* Reduce with the helper threads, if they're available.  Return nonzero if not. */
+static int reduce_threaded(const double *a, int n, int what, aCalcStats *ps) {
+	const double *pa[MAX_REDUCE_PARTS];
+	int pn[MAX_REDUCE_PARTS];
+	aCalcStats first, *parts[MAX_REDUCE_PARTS];
+	int i, k, depth, numParts;
+
+	epicsThreadOnce(&reducePoolOnce, reducePoolInit, NULL);
+	for (depth=0, numParts=1; 2*numParts <= reduceNumWorkers+1; depth++, numParts *= 2);
+	/* Don't split so far that the pieces are smaller than a block. */
+	while ((depth > 0) && ((n >> depth) <= REDUCE_BLOCK)) {depth--; numParts /= 2;}
+	if (depth == 0) return(-1);
+	if (epicsMutexTryLock(reducePoolLock) != epicsMutexLockOK) return(-1);
+
+	k = 0;
+	split_tree(a, n, depth, pa, pn, &k);
+	for (i=1; i<numParts; i++) {
+		reduceWorkers[i-1].a = pa[i];
+		reduceWorkers[i-1].n = pn[i];
+		reduceWorkers[i-1].what = what;
+		epicsEventSignal(reduceWorkers[i-1].go);
+	}
+	reduce_tree(pa[0], pn[0], what, &first);
+	parts[0] = &first;
+	for (i=1; i<numParts; i++) {
+		epicsEventMustWait(reduceWorkers[i-1].done);
+		parts[i] = &reduceWorkers[i-1].stats;
+	}
+	combine_tree(parts, 0, depth, what, ps);
+	epicsMutexUnlock(reducePoolLock);
+	return(0);
+}
+
+/*** end threaded reduction ***/
+
+/* Compute the statistics selected by what (ACALC_SUM, ACALC_MOMENTS, ACALC_MAX, ACALC_MIN)
+ * of a[0..n-1].  The extremes and their indices are those of a serial search that
+ * starts with a[0]: NaN elements are skipped, unless a[0] is NaN, in which case it's
+ * both the maximum and the minimum.
+ */
+void aCalcReduce(const double *a, int n, int what, aCalcStats *ps) {
+	if (n < 1) {
+		ps->n = 0;
+		ps->sum = ps->m2 = 0.;
+		ps->ixmax = ps->ixmin = -1;
+		return;
+	}
+	if ((aCalcReduceThreads < 1) || (n < aCalcReduceThreshold) ||
+			reduce_threaded(a, n, what, ps)) {
+		reduce_tree(a, n, what, ps);
+	}
+	if (isnan(a[0])) {
+		ps->max = ps->min = a[0];
+		ps->ixmax = ps->ixmin = 0;
+	}
+}
@@ -49,6 +49,7 @@
 
 #include	<epicsExport.h>
 #include	"aCalcPostfix.h"
+#include	"calcCache.h"
 #define GEN_SIZE_OFFSET
 #include	"aCalcoutRecord.h"
 #undef  GEN_SIZE_OFFSET
@@ -130,12 +131,49 @@ epicsExportAddress(rset, acalcoutRSET);
 #define CA_LINKS_ALL_OK 1
 #define CA_LINKS_NOT_OK 2
 
+#define MAX_FIELDS 12
+#define ARRAY_MAX_FIELDS 12
+
+/* Elements first..end-1 of an array; empty if first >= end */
+typedef struct elementRange {
+	long	first;
+	long	end;
+} elementRange;
+
+/* Change detection for AVAL and OAV.  monitor() compares only the elements that
+ * changed since it last looked (dirty), and copies to PAVL/POAV only the elements
+ * that may differ from the copy last posted (stale).
+ */
+typedef struct arrayChanges {
+	elementRange	dirty;
+	elementRange	stale;
+} arrayChanges;
+
 typedef struct rpvtStruct {
 	CALLBACK	doOutCb;
 	CALLBACK	checkLinkCb;
 	short		wd_id_1_LOCK;
 	short		caLinkStat; /* NO_CA_LINKS,CA_LINKS_ALL_OK,CA_LINKS_NOT_OK */
 	short		outlink_field_type;
+	aCalcContext	*pctx;	/* aCalcPerformCtx() state, allocated on first use */
+	struct acalcoutRecord	*pcalc;
+	struct rpvtStruct	*nextQueued;	/* asynchronous-calculation queue */
+	epicsTimeStamp	queueTime;
+	arrayChanges	avalChanges;
+	arrayChanges	oavChanges;
+	short		compared;		/* monitor() has compared arrays with the settings below */
+	long		cmpNumElements;
+	double		cmpMdel, cmpAdel;
+	/* For EVAL "On Input Change" (see calcNeeded()) */
+	short		usageKnown;		/* skippable and inputs are for the current CALC, OCAL, DOPT */
+	short		skippable;		/* the expressions' results depend only on their inputs */
+	epicsUInt32	inputs;			/* ACALC_ARG_xxx bits of the arguments they read */
+	short		usageDopt;
+	short		evalValid;		/* the values below are those of the last evaluation */
+	epicsUInt32	evalChanged;	/* ACALC_ARG_xxx bits of arrays written since then */
+	double		evalArgs[MAX_FIELDS];
+	double		evalVal, evalOval;
+	long		evalNumElements;
 } rpvtStruct;
 
 static void checkAlarms();
@@ -147,14 +185,27 @@ static void checkLinksCallback();
 static long writeValue(acalcoutRecord *pcalc);
 static void call_aCalcPerform(acalcoutRecord *pcalc);
 static long doCalc(acalcoutRecord *pcalc);
-static void acalcPerformTask(void *parm);
+static int calcNeeded(acalcoutRecord *pcalc);
+static void acalcPoolInit(void *arg);
+static void acalcWorkerTask(void *parm);
 volatile int aCalcoutRecordDebug = 0;
 epicsExportAddress(int, aCalcoutRecordDebug);
-
-#define MAX_FIELDS 12
-#define ARRAY_MAX_FIELDS 12
+volatile int aCalcoutJointCalc = 1; /* if nonzero, evaluate CALC and OCAL in one pass */
+epicsExportAddress(int, aCalcoutJointCalc);
 
 
+static void addRange(elementRange *pr, long first, long end)
+{
+	if (first >= end) return;
+	if (pr->first >= pr->end) {
+		pr->first = first;
+		pr->end = end;
+	} else {
+		if (first < pr->first) pr->first = first;
+		if (end > pr->end) pr->end = end;
+	}
+}
+
 static long acalcGetNumElements( acalcoutRecord *pcalc )
 {
 	long numElements;
@@ -165,6 +216,32 @@ static long acalcGetNumElements( acalcoutRecord *pcalc )
 	return numElements;
 }
 
+/* Element type of AA..LL (see AFTV), as the database knows it.  (DBR_xxx has
+ * the same value as DBF_xxx.)
+ */
+static short aaFieldType(acalcoutRecord *pcalc)
+{
+	switch (pcalc->aftv) {
+	case acalcoutAFTV_FLOAT:	return(DBF_FLOAT);
+	case acalcoutAFTV_LONG:		return(DBF_LONG);
+	case acalcoutAFTV_USHORT:	return(DBF_USHORT);
+	default:					return(DBF_DOUBLE);
+	}
+}
+
+/* The same, as aCalcPerform() knows it */
+static int aaCalcType(acalcoutRecord *pcalc)
+{
+	switch (pcalc->aftv) {
+	case acalcoutAFTV_FLOAT:	return(ACALC_TYPE_FLOAT32);
+	case acalcoutAFTV_LONG:		return(ACALC_TYPE_INT32);
+	case acalcoutAFTV_USHORT:	return(ACALC_TYPE_UINT16);
+	default:					return(ACALC_TYPE_DOUBLE);
+	}
+}
+
+#define aaElementSize(pcalc) aCalcTypeSize(aaCalcType(pcalc))
+
 
 static long init_record(acalcoutRecord *pcalc, int pass)
 {
@@ -182,6 +259,7 @@ static long init_record(acalcoutRecord *pcalc, int pass)
 	if (pass==0) {
 		pcalc->vers = VERSION;
 		pcalc->rpvt = (void *)calloc(1, sizeof(struct rpvtStruct));
+		((rpvtStruct *)pcalc->rpvt)->pcalc = pcalc;
 		if (pcalc->nuse > pcalc->nelm) {
 			pcalc->nuse = pcalc->nelm;
 			db_post_events(pcalc,&pcalc->nuse,DBE_VALUE|DBE_LOG);
@@ -239,7 +317,7 @@ static long init_record(acalcoutRecord *pcalc, int pass)
 		db_post_events(pcalc,plinkValid,DBE_VALUE);
 	}
 
-	pcalc->clcv = aCalcPostfix(pcalc->calc,pcalc->rpcl,&error_number);
+	pcalc->clcv = calcCachePostfix(CALC_CACHE_ACALC, pcalc->calc, &pcalc->rpcl, &error_number);
 	if (pcalc->clcv) {
 		recGblRecordError(S_db_badField,(void *)pcalc,
 			"acalcout: init_record: Illegal CALC field");
@@ -248,7 +326,7 @@ static long init_record(acalcoutRecord *pcalc, int pass)
 	}
 	db_post_events(pcalc,&pcalc->clcv,DBE_VALUE);
 
-	pcalc->oclv = aCalcPostfix(pcalc->ocal, pcalc->orpc,&error_number);
+	pcalc->oclv = calcCachePostfix(CALC_CACHE_ACALC, pcalc->ocal, &pcalc->orpc, &error_number);
 	if (pcalc->oclv) {
 		recGblRecordError(S_db_badField,(void *)pcalc,
 			"acalcout: init_record: Illegal OCAL field");
@@ -281,9 +359,14 @@ static long afterCalc(acalcoutRecord *pcalc) {
 	long		i, j;
 	double		**panew;
 
+	/* results, so calcNeeded() can tell whether they've been overwritten */
+	prpvt->evalVal = pcalc->val;
+	prpvt->evalOval = pcalc->oval;
+
 	i = acalcGetNumElements( pcalc );
 #if MIND_UNUSED_ELEMENTS
 	if (i < pcalc->nelm) {
+		addRange(&prpvt->avalChanges.dirty, i, pcalc->nelm);
 		for (; i<pcalc->nelm; i++) pcalc->aval[i] = 0;
 	}
 #endif
@@ -398,7 +481,13 @@ static long process(acalcoutRecord *pcalc)
 			if (aCalcoutRecordDebug >= 5) printf("acalcoutRecord(%s):process: queueing aCalcPerform\n", pcalc->name);
 
 			pcalc->cact = 0;
-			stat = doCalc(pcalc);
+			if (calcNeeded(pcalc)) {
+				stat = doCalc(pcalc);
+			} else {
+				if (aCalcoutRecordDebug >= 5)
+					printf("acalcoutRecord(%s):process: inputs unchanged\n", pcalc->name);
+				stat = 0;
+			}
 			if (stat) printf("%s:process: doCalc failed.\n", pcalc->name);
 			if (stat == 0 && pcalc->cact == 1) {
 				pcalc->pact = 1;
@@ -464,7 +553,8 @@ static long special(dbAddr	*paddr, int after)
 	if (!after) return(0);
 	switch (fieldIndex) {
 	case acalcoutRecordCALC:
-		pcalc->clcv = aCalcPostfix(pcalc->calc, pcalc->rpcl, &error_number);
+		pcalc->clcv = calcCachePostfix(CALC_CACHE_ACALC, pcalc->calc, &pcalc->rpcl, &error_number);
+		prpvt->usageKnown = 0;
 		if (pcalc->clcv) {
 			recGblRecordError(S_db_badField,(void *)pcalc,
 				"acalcout: special(): Illegal CALC field");
@@ -476,7 +566,8 @@ static long special(dbAddr	*paddr, int after)
 		break;
 
 	case acalcoutRecordOCAL:
-		pcalc->oclv = aCalcPostfix(pcalc->ocal, pcalc->orpc, &error_number);
+		pcalc->oclv = calcCachePostfix(CALC_CACHE_ACALC, pcalc->ocal, &pcalc->orpc, &error_number);
+		prpvt->usageKnown = 0;
 		if (pcalc->oclv) {
 			recGblRecordError(S_db_badField,(void *)pcalc,
 				"acalcout: special(): Illegal OCAL field");
@@ -588,8 +679,8 @@ static long cvt_dbaddr(dbAddr *paddr)
 		if (ppd[i] == NULL) {
 			if (aCalcoutRecordDebug) printf("acalcoutRecord(%s):cvt_dbaddr: allocating for field %c%c\n",
 				pcalc->name, (int)('A'+i), (int)('A'+i));
-			ppd[i] = (double *)calloc(pcalc->nelm, sizeof(double));
-			pcalc->amem += pcalc->nelm * sizeof(double);
+			ppd[i] = (double *)calloc(pcalc->nelm, aaElementSize(pcalc));
+			pcalc->amem += pcalc->nelm * aaElementSize(pcalc);
 			db_post_events(pcalc, &pcalc->amem, DBE_VALUE|DBE_LOG);
 			pcalc->pmem = pcalc->amem;
 		}
@@ -626,9 +717,14 @@ static long cvt_dbaddr(dbAddr *paddr)
 		paddr->no_elements = pcalc->nelm;
 	}
 
-	paddr->field_type = DBF_DOUBLE;
-	paddr->field_size = sizeof(double);
-	paddr->dbr_field_type = DBF_DOUBLE;
+	if ((fieldIndex>=acalcoutRecordAA) && (fieldIndex<=acalcoutRecordLL)) {
+		paddr->field_type = aaFieldType(pcalc);
+		paddr->field_size = aaElementSize(pcalc);
+	} else {
+		paddr->field_type = DBF_DOUBLE;
+		paddr->field_size = sizeof(double);
+	}
+	paddr->dbr_field_type = paddr->field_type;
 	return(0);
 }
 
@@ -647,8 +743,8 @@ static long get_array_info(struct dbAddr *paddr, long *no_elements, long *offset
 		if (ppd[i] == NULL) {
 			if (aCalcoutRecordDebug) printf("acalcoutRecord(%s):get_array_info: allocating for field %c%c\n",
 				pcalc->name, (int)('A'+i), (int)('A'+i));
-			ppd[i] = (double *)calloc(pcalc->nelm, sizeof(double));
-			pcalc->amem += pcalc->nelm * sizeof(double);
+			ppd[i] = (double *)calloc(pcalc->nelm, aaElementSize(pcalc));
+			pcalc->amem += pcalc->nelm * aaElementSize(pcalc);
 			db_post_events(pcalc, &pcalc->amem, DBE_VALUE|DBE_LOG);
 			pcalc->pmem = pcalc->amem;
 		}
@@ -673,9 +769,11 @@ static long get_array_info(struct dbAddr *paddr, long *no_elements, long *offset
 static long put_array_info(struct dbAddr *paddr, long nNew)
 {
 	acalcoutRecord	*pcalc = (acalcoutRecord *) paddr->precord;
+	rpvtStruct		*prpvt = (rpvtStruct *)pcalc->rpvt;
 	double			**ppd, *pd = NULL;
 	long			i;
 	long			numElements;
+	int				size = sizeof(double);
     int				fieldIndex = dbGetFieldIndex(paddr);
 
 	if (aCalcoutRecordDebug >= 20) {
@@ -689,12 +787,14 @@ static long put_array_info(struct dbAddr *paddr, long nNew)
 		if (ppd[i] == NULL) {
 			if (aCalcoutRecordDebug) printf("acalcoutRecord(%s):put_array_info: allocating for field %c%c\n",
 				pcalc->name, (int)('A'+i), (int)('A'+i));
-			ppd[i] = (double *)calloc(pcalc->nelm, sizeof(double));
-			pcalc->amem += pcalc->nelm * sizeof(double);
+			ppd[i] = (double *)calloc(pcalc->nelm, aaElementSize(pcalc));
+			pcalc->amem += pcalc->nelm * aaElementSize(pcalc);
 			db_post_events(pcalc, &pcalc->amem, DBE_VALUE|DBE_LOG);
 			pcalc->pmem = pcalc->amem;
 		}
 		pd = ppd[i];
+		size = aaElementSize(pcalc);
+		prpvt->evalChanged |= ACALC_ARG_AA << i;
 	} else if (fieldIndex==acalcoutRecordAVAL) {
 		if (pcalc->aval == NULL) {
 			pcalc->aval = (double *)calloc(pcalc->nelm, sizeof(double));
@@ -703,6 +803,8 @@ static long put_array_info(struct dbAddr *paddr, long nNew)
 			pcalc->pmem = pcalc->amem;
 		}
 		pd = pcalc->aval;
+		addRange(&prpvt->avalChanges.dirty, 0, pcalc->nelm);
+		prpvt->evalChanged |= ACALC_ARG_VAL;
 	} else if (fieldIndex==acalcoutRecordOAV) {
 		if (pcalc->oav == NULL) {
 			pcalc->oav = (double *)calloc(pcalc->nelm, sizeof(double));
@@ -711,6 +813,8 @@ static long put_array_info(struct dbAddr *paddr, long nNew)
 			pcalc->pmem = pcalc->amem;
 		}
 		pd = pcalc->oav;
+		addRange(&prpvt->oavChanges.dirty, 0, pcalc->nelm);
+		prpvt->evalChanged |= ACALC_ARG_VAL;
 	}
 
 	if (aCalcoutRecordDebug >= 20) {
@@ -723,8 +827,7 @@ static long put_array_info(struct dbAddr *paddr, long nNew)
 	numElements = acalcGetNumElements( pcalc );
 #endif
 	if ( pd && (nNew < numElements) )
-		for (i=nNew; i<numElements; i++)
-			pd[i] = 0.;
+		memset((char *)pd + nNew*size, 0, (numElements-nNew)*size);
 
 	/* We could set nuse to the number of elements just written, but that would also
 	 * affect the other arrays.  For now, with all arrays sharing a single value of nuse,
@@ -931,13 +1034,77 @@ static void execOutput(acalcoutRecord *pcalc)
 	} 
 }
 
+/* Set *pdiff_mdel (*pdiff_adel) if |new[i]-prev[i]| > mdel (adel) for any element
+ * first <= i < end.  The inner loop keeps an exceeding delta, if any, rather than
+ * branching, so the compiler can vectorize it.  The outer loop stops as soon as
+ * both deadbands are exceeded.
+ */
+#define DELTA_BLOCK 64
+static void compareArray(const double *pnew, const double *pprev, long first, long end,
+	double mdel, double adel, int *pdiff_mdel, int *pdiff_adel)
+{
+	double	dm = -1, da = -1, d;
+	long	i, blockEnd;
+
+	for (; first < end; first = blockEnd) {
+		blockEnd = (end - first > DELTA_BLOCK) ? first + DELTA_BLOCK : end;
+		for (i=first; i<blockEnd; i++) {
+			d = fabs(pnew[i] - pprev[i]);
+			dm = (d > mdel) ? d : dm;
+			da = (d > adel) ? d : da;
+		}
+		if ((dm >= 0) && (da >= 0)) break;
+	}
+	*pdiff_mdel = dm >= 0;
+	*pdiff_adel = da >= 0;
+}
+
+/* Post an array if any element has moved by more than a deadband from the copy last
+ * posted.  Elements that haven't changed since the last comparison need not be
+ * compared again: either that comparison posted the array, and the copy was updated,
+ * or it found them within both deadbands.  If full, compare all elements anyway.
+ */
+static void monitorArray(acalcoutRecord *pcalc, double *pnew, double *pprev,
+	arrayChanges *pch, long numElements, int full, unsigned short monitor_mask)
+{
+	long	first = pch->dirty.first, end = pch->dirty.end;
+	int		diff_mdel, diff_adel;
+
+	if (full) {
+		first = 0;
+		end = numElements;
+	}
+	if (end > numElements) end = numElements;
+	pch->dirty.first = pch->dirty.end = 0;
+	addRange(&pch->stale, first, end);
+
+	compareArray(pnew, pprev, first, end, pcalc->mdel, pcalc->adel, &diff_mdel, &diff_adel);
+
+	if (diff_mdel || diff_adel) {
+		unsigned short mask = monitor_mask;
+
+		if (diff_mdel) mask |= DBE_VALUE;
+		if (diff_adel) mask |= DBE_LOG;
+
+		if (aCalcoutRecordDebug >= 1)
+			printf("acalcoutRecord(%s):posting %s\n", pcalc->name,
+				(pnew == pcalc->aval) ? ".AVAL" : ".OAV");
+		db_post_events(pcalc, pnew, mask);
+		first = pch->stale.first;
+		end = (pch->stale.end > numElements) ? numElements : pch->stale.end;
+		if (first < end) memcpy(&pprev[first], &pnew[first], (end-first)*sizeof(double));
+		pch->stale.first = pch->stale.end = 0;
+	}
+}
+
 static void monitor(acalcoutRecord *pcalc)
 {
+	rpvtStruct		*prpvt = (rpvtStruct *)pcalc->rpvt;
 	unsigned short	monitor_mask;
 	double			delta;
 	double			*pnew, *pprev;
 	double			**panew;
-	int				i, diff_mdel, diff_adel;
+	int				i, full;
 	long			numElements;
 
 	if (aCalcoutRecordDebug >= 10)
@@ -980,41 +1147,21 @@ static void monitor(acalcoutRecord *pcalc)
 	numElements = acalcGetNumElements( pcalc );
 #endif
 
-	for (i=0, diff_mdel=0, diff_adel=0; i<numElements; i++) {
-		delta = fabs(pcalc->pavl[i] - pcalc->aval[i]);
-
-		if (delta > pcalc->mdel) diff_mdel = 1;
-		if (delta > pcalc->adel) diff_adel = 1;
-	}
-
-	if (diff_mdel || diff_adel) {
-		unsigned short mask = monitor_mask;
-
-		if (diff_mdel) mask |= DBE_VALUE;
-		if (diff_adel) mask |= DBE_LOG;
-
-		if (aCalcoutRecordDebug >= 1)
-			printf("acalcoutRecord(%s):posting .AVAL\n", pcalc->name);
-		db_post_events(pcalc, pcalc->aval, mask);
-		for (i=0; i<numElements; i++) pcalc->pavl[i] = pcalc->aval[i];
-	}
-
-	for (i=0, diff_mdel=0, diff_adel=0; i<numElements; i++) {
-		delta = fabs(pcalc->poav[i] - pcalc->oav[i]);
-
-		if (delta > pcalc->mdel) diff_mdel = 1;
-		if (delta > pcalc->adel) diff_adel = 1;
-	}
-
-	if (diff_mdel || diff_adel) {
-		unsigned short mask = monitor_mask;
-
-		if (diff_mdel) mask |= DBE_VALUE;
-		if (diff_adel) mask |= DBE_LOG;
-
-		db_post_events(pcalc, pcalc->oav, mask);
-		for (i=0; i<numElements; i++) pcalc->poav[i] = pcalc->oav[i];
-	}
+	/* Compare all elements if we've nothing to go on, or if the elements that
+	 * haven't changed might nevertheless now be outside a deadband.
+	 */
+	full = !prpvt->compared || (numElements != prpvt->cmpNumElements) ||
+		(pcalc->mdel != prpvt->cmpMdel) || (pcalc->adel != prpvt->cmpAdel) ||
+		(pcalc->mdel < 0) || (pcalc->adel < 0);
+	prpvt->compared = 1;
+	prpvt->cmpNumElements = numElements;
+	prpvt->cmpMdel = pcalc->mdel;
+	prpvt->cmpAdel = pcalc->adel;
+
+	monitorArray(pcalc, pcalc->aval, pcalc->pavl, &prpvt->avalChanges, numElements,
+		full, monitor_mask);
+	monitorArray(pcalc, pcalc->oav, pcalc->poav, &prpvt->oavChanges, numElements,
+		full, monitor_mask);
 
 	/* check all input fields for changes */
 	for (i=0, pnew=&pcalc->a, pprev=&pcalc->pa; i<MAX_FIELDS;  i++, pnew++, pprev++) {
@@ -1046,11 +1193,14 @@ static void monitor(acalcoutRecord *pcalc)
 
 static int fetch_values(acalcoutRecord *pcalc)
 {
+	rpvtStruct	*prpvt = (rpvtStruct *)pcalc->rpvt;
 	DBLINK	*plink;	/* structure of the link field  */
 	double	*pvalue;
 	double	**pavalue;
+	char	*pbyte;
 	long	status = 0;
-	int		i, j;
+	long	j;
+	int		i, size = aaElementSize(pcalc);
 	unsigned short *plinkValid;
 	long numElements;
 
@@ -1078,27 +1228,36 @@ static int fetch_values(acalcoutRecord *pcalc)
 			if (*pavalue == NULL) {
 				if (aCalcoutRecordDebug) printf("acalcoutRecord(%s): allocating for field %c%c\n",
 					pcalc->name, (int)('A'+i), (int)('A'+i));
-				*pavalue = (double *)calloc(pcalc->nelm, sizeof(double));
-				pcalc->amem += pcalc->nelm * sizeof(double);
+				*pavalue = (double *)calloc(pcalc->nelm, size);
+				pcalc->amem += pcalc->nelm * size;
 			}
-			/* save current array value */
+			/* Get the new value into PAA, and copy it to the field only if it
+			 * changed.  (We can't just swap the two buffers, because database
+			 * addresses of the field point to its buffer.)
+			 */
 			if (pcalc->paa == NULL) {
 				if (aCalcoutRecordDebug) printf("acalcoutRecord(%s): allocating for field PAA\n",
 					pcalc->name);
-				pcalc->paa = (double *)calloc(pcalc->nelm, sizeof(double));
-				pcalc->amem += pcalc->nelm * sizeof(double);
+				pcalc->paa = (double *)calloc(pcalc->nelm, size);
+				pcalc->amem += pcalc->nelm * size;
 			}
-			for (j=0; j<numElements; j++) pcalc->paa[j] = (*pavalue)[j];
-			/* get new value */
 			nRequest = acalcGetNumElements( pcalc );
-			status = dbGetLink(plink, DBR_DOUBLE, *pavalue, 0, &nRequest);
+			status = dbGetLink(plink, aaFieldType(pcalc), pcalc->paa, 0, &nRequest);
 			if (!RTN_SUCCESS(status)) return(status);
-			if (nRequest<numElements) {
-				for (j=nRequest; j<numElements; j++) (*pavalue)[j] = 0;
+			if (memcmp(*pavalue, pcalc->paa, nRequest*size)) {
+				memcpy(*pavalue, pcalc->paa, nRequest*size);
+				pcalc->newm |= 1<<i;
+				prpvt->evalChanged |= ACALC_ARG_AA << i;
+			}
+			/* elements the link didn't supply are zero */
+			pbyte = (char *)*pavalue;
+			for (j=nRequest*size; j<numElements*size; j++) {
+				if (pbyte[j]) break;
 			}
-			/* compare new array value with saved value */
-			for (j=0; j<numElements; j++) {
-				if (pcalc->paa[j] != (*pavalue)[j]) {pcalc->newm |= 1<<i; break;}
+			if (j < numElements*size) {
+				memset(&pbyte[j], 0, numElements*size - j);
+				pcalc->newm |= 1<<i;
+				prpvt->evalChanged |= ACALC_ARG_AA << i;
 			}
 		}
 	}
@@ -1223,26 +1382,105 @@ static long writeValue(acalcoutRecord *pcalc)
 }
 
 /************************************************************/
-#include <epicsMessageQueue.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
 #include <epicsThread.h>
+#include <iocsh.h>
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#include <pthread.h>
+#include <sched.h>
+#define ACALC_CPU_AFFINITY 1
+#else
+#define ACALC_CPU_AFFINITY 0
+#endif
 
-static epicsThreadId		acalcThreadId = NULL;
-static epicsMessageQueueId	acalcMsgQueue = NULL;
-
-typedef struct {
-	acalcoutRecord *pcalc;
-} calcMessage;
-
-#define MAX_MSG  100                   /* max # of messages in queue    */
-#define MSG_SIZE sizeof(calcMessage)   /* size in bytes of the messages */
+/* Calculations with array sizes larger than aCalcAsyncThreshold are queued to a pool of
+ * aCalcAsyncWorkers threads.  A queued record is PACT until a worker has evaluated and
+ * processed it, so dbProcess() won't process it, or queue it, again in the meantime.  If
+ * aCalcAsyncCpuMask is nonzero (Linux only), workers run only on the CPUs whose bits are
+ * set.  aCalcAsyncWorkers and aCalcAsyncCpuMask are read when the first calculation is
+ * queued.
+ */
 #define PRIORITY epicsThreadPriorityMedium
+#define MAX_WORKERS 32
 volatile int aCalcAsyncThreshold = 10000; /* array sizes larger than this get queued */
 epicsExportAddress(int, aCalcAsyncThreshold);
+volatile int aCalcAsyncWorkers = 2;
+epicsExportAddress(int, aCalcAsyncWorkers);
+volatile int aCalcAsyncCpuMask = 0;
+epicsExportAddress(int, aCalcAsyncCpuMask);
+
+static epicsThreadOnceId	acalcPoolOnce = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId		acalcQueueLock = NULL;
+static epicsEventId		acalcQueueEvent = NULL;
+static rpvtStruct		*acalcQueueHead = NULL, *acalcQueueTail = NULL;
+static int				acalcNumWorkers = 0;
+
+/* queue statistics, protected by acalcQueueLock */
+static struct {
+	unsigned long	numQueued;	/* calculations queued */
+	unsigned long	numStarted;	/* calculations taken from the queue */
+	int				depth;		/* calculations waiting now */
+	int				maxDepth;
+	int				busy;		/* workers evaluating now */
+	double			waitSum;	/* seconds from queueing to start of evaluation */
+	double			waitMax;
+} acalcQueueStats;
+
+/* Must CALC (and OCAL) be evaluated?  If EVAL is "On Input Change", they needn't
+ * be if they'd give the results they gave last time: none of the arguments they
+ * read has changed since then, and nothing has overwritten the results.  This
+ * can't be known of expressions that store to arguments, read VAL or AVAL, or use
+ * random numbers, so those are always evaluated.
+ */
+static int calcNeeded(acalcoutRecord *pcalc) {
+	rpvtStruct	*prpvt = (rpvtStruct *)pcalc->rpvt;
+	epicsUInt32	inputs, stores, oinputs, ostores;
+	long		numElements = acalcGetNumElements( pcalc );
+	int			i, useOcal = (pcalc->dopt == acalcoutDOPT_Use_OVAL);
+
+	if (pcalc->eval != acalcoutEVAL_On_Change) return(1);
+
+	if (!prpvt->usageKnown || (pcalc->dopt != prpvt->usageDopt)) {
+		prpvt->skippable = (aCalcArgUsage(pcalc->rpcl, &inputs, &stores) == 0) && !stores;
+		if (useOcal) {
+			prpvt->skippable = prpvt->skippable &&
+				(aCalcArgUsage(pcalc->orpc, &oinputs, &ostores) == 0) && !ostores;
+			inputs |= oinputs;
+		}
+		if (inputs & (ACALC_ARG_VAL|ACALC_ARG_RANDOM)) prpvt->skippable = 0;
+		prpvt->inputs = inputs;
+		prpvt->usageDopt = pcalc->dopt;
+		prpvt->usageKnown = 1;
+		prpvt->evalValid = 0;
+	}
+	if (!prpvt->skippable) return(1);
+
+	if (prpvt->evalValid && !(prpvt->evalChanged & (prpvt->inputs|ACALC_ARG_VAL)) &&
+			(numElements == prpvt->evalNumElements) &&
+			!memcmp(&pcalc->val, &prpvt->evalVal, sizeof(double)) &&
+			(!useOcal || !memcmp(&pcalc->oval, &prpvt->evalOval, sizeof(double)))) {
+		for (i=0; i<MAX_FIELDS; i++) {
+			if ((prpvt->inputs & (ACALC_ARG_A << i)) &&
+					memcmp(&pcalc->a + i, &prpvt->evalArgs[i], sizeof(double)))
+				break;
+		}
+		if (i == MAX_FIELDS) return(0);
+	}
+
+	/* Remember what the expressions are evaluated with */
+	memcpy(prpvt->evalArgs, &pcalc->a, sizeof(prpvt->evalArgs));
+	prpvt->evalChanged = 0;
+	prpvt->evalNumElements = numElements;
+	prpvt->evalValid = 1;
+	return(1);
+}
 
 static void call_aCalcPerform(acalcoutRecord *pcalc) {
+	rpvtStruct   *prpvt = (rpvtStruct *)pcalc->rpvt;
 	long numElements;
 	epicsUInt32 amask;
-	int i;
+	int i, firstEl, numEl;
 	long numAllocatedArraysPre=0, numAllocatedArraysPost=0;
 
 	if (aCalcoutRecordDebug >= 10) printf("call_aCalcPerform:entry\n");
@@ -1255,29 +1493,54 @@ static void call_aCalcPerform(acalcoutRecord *pcalc) {
 		if ((pcalc->aa+i) != 0) numAllocatedArraysPre++;
 	}
 
+	if (prpvt->pctx == NULL) {
+		prpvt->pctx = aCalcContextCreate(pcalc->nelm);
+		if (prpvt->pctx == NULL) {
+			printf("acalcoutRecord(%s): Can't allocate calc context\n", pcalc->name);
+			pcalc->cstat = -1;
+			return;
+		}
+		aCalcContextArgType(prpvt->pctx, aaCalcType(pcalc));
+	}
+
 	/* Note that we want to permit nuse == 0 as a way of saying "use nelm". */
 	numElements = acalcGetNumElements( pcalc );
-	pcalc->cstat = aCalcPerform(&pcalc->a, MAX_FIELDS, &pcalc->aa,
-		ARRAY_MAX_FIELDS, numElements, &pcalc->val, pcalc->aval, pcalc->rpcl,
-		pcalc->nelm, &pcalc->amask);
+	if ((pcalc->dopt == acalcoutDOPT_Use_OVAL) && aCalcoutJointCalc) {
+		/* one pass, in which OCAL uses what it has in common with CALC */
+		pcalc->cstat = aCalcPerformJointCtx(prpvt->pctx, &pcalc->a, MAX_FIELDS, &pcalc->aa,
+			ARRAY_MAX_FIELDS, numElements, &pcalc->val, pcalc->aval, pcalc->rpcl,
+			&pcalc->oval, pcalc->oav, pcalc->orpc, pcalc->nelm, &pcalc->amask);
+		aCalcContextResultRange(prpvt->pctx, &firstEl, &numEl);
+		addRange(&prpvt->avalChanges.dirty, firstEl, firstEl+numEl);
+		aCalcContextResultRange2(prpvt->pctx, &firstEl, &numEl);
+		addRange(&prpvt->oavChanges.dirty, firstEl, firstEl+numEl);
+	} else {
+		pcalc->cstat = aCalcPerformCtx(prpvt->pctx, &pcalc->a, MAX_FIELDS, &pcalc->aa,
+			ARRAY_MAX_FIELDS, numElements, &pcalc->val, pcalc->aval, pcalc->rpcl,
+			pcalc->nelm, &pcalc->amask);
+		aCalcContextResultRange(prpvt->pctx, &firstEl, &numEl);
+		addRange(&prpvt->avalChanges.dirty, firstEl, firstEl+numEl);
 	
-	if (pcalc->dopt == acalcoutDOPT_Use_OVAL) {
-		pcalc->cstat |= aCalcPerform(&pcalc->a, MAX_FIELDS, &pcalc->aa,
-			ARRAY_MAX_FIELDS, numElements, &pcalc->oval, pcalc->oav, pcalc->orpc,
-			pcalc->nelm, &amask);
-		pcalc->amask |= amask;
+		if (pcalc->dopt == acalcoutDOPT_Use_OVAL) {
+			pcalc->cstat |= aCalcPerformCtx(prpvt->pctx, &pcalc->a, MAX_FIELDS, &pcalc->aa,
+				ARRAY_MAX_FIELDS, numElements, &pcalc->oval, pcalc->oav, pcalc->orpc,
+				pcalc->nelm, &amask);
+			pcalc->amask |= amask;
+			aCalcContextResultRange(prpvt->pctx, &firstEl, &numEl);
+			addRange(&prpvt->oavChanges.dirty, firstEl, firstEl+numEl);
+		}
 	}
 	for (i=0; i<ARRAY_MAX_FIELDS; i++) {
 		if ((pcalc->aa+i) != 0) numAllocatedArraysPost++;
 	}
 	if (numAllocatedArraysPost > numAllocatedArraysPre) {
-		pcalc->amem += (numAllocatedArraysPost-numAllocatedArraysPre) * pcalc->nelm * sizeof(double);
+		pcalc->amem += (numAllocatedArraysPost-numAllocatedArraysPre) * pcalc->nelm * aaElementSize(pcalc);
 		db_post_events(pcalc,&pcalc->amem, DBE_VALUE|DBE_LOG);
 	}
 }
 
 static long doCalc(acalcoutRecord *pcalc) {
-	calcMessage msg;
+	rpvtStruct   *prpvt = (rpvtStruct *)pcalc->rpvt;
 	int doAsync = 0;
 
 	if (aCalcoutRecordDebug >= 10)
@@ -1287,33 +1550,34 @@ static long doCalc(acalcoutRecord *pcalc) {
 		doAsync = 1;
 
 	/* if required infrastructure doesn't yet exist, create it */
-	if (doAsync && acalcMsgQueue == NULL) {
-		acalcMsgQueue = epicsMessageQueueCreate(MAX_MSG, MSG_SIZE);
-		if (acalcMsgQueue==NULL) {
-			printf("aCalcoutRecord: Unable to create message queue\n");
-			return(-1);
-		}
-
-		acalcThreadId = epicsThreadCreate("acalcPerformTask", PRIORITY,
-			epicsThreadGetStackSize(epicsThreadStackBig),
-			(EPICSTHREADFUNC)acalcPerformTask, (void *)epicsThreadGetIdSelf());
-
-		if (acalcThreadId == NULL) {
-			printf("aCalcoutRecord: Unable to create acalcPerformTask\n");
-			epicsMessageQueueDestroy(acalcMsgQueue);
-			acalcMsgQueue = NULL;
+	if (doAsync) {
+		epicsThreadOnce(&acalcPoolOnce, acalcPoolInit, NULL);
+		if (acalcNumWorkers == 0) {
+			printf("aCalcoutRecord: No acalcWorker threads\n");
 			return(-1);
 		}
 	}
 	
-	/* Ideally, we should do short calculations in this thread, and queue long calculations.
-	 * But aCalcPerform is not reentrant (global value stack), so for now we queue everything.
+	/* Short calculations are done in this thread, and long calculations are queued.  Each
+	 * record has its own aCalcContext, so the two can run at the same time.
 	 */
 	if (doAsync) {
 		if (aCalcoutRecordDebug >= 2) printf("acalcoutRecord(%s):doCalc async\n", pcalc->name);
 		pcalc->cact = 1; /* Tell caller that we went asynchronous */
-		msg.pcalc = pcalc;
-		epicsMessageQueueSend(acalcMsgQueue, (void *)&msg, MSG_SIZE);
+		epicsMutexMustLock(acalcQueueLock);
+		prpvt->nextQueued = NULL;
+		epicsTimeGetCurrent(&prpvt->queueTime);
+		if (acalcQueueTail) {
+			acalcQueueTail->nextQueued = prpvt;
+		} else {
+			acalcQueueHead = prpvt;
+		}
+		acalcQueueTail = prpvt;
+		acalcQueueStats.numQueued++;
+		if (++acalcQueueStats.depth > acalcQueueStats.maxDepth)
+			acalcQueueStats.maxDepth = acalcQueueStats.depth;
+		epicsMutexUnlock(acalcQueueLock);
+		epicsEventSignal(acalcQueueEvent);
 		return(0);
 	} else {
 		if (aCalcoutRecordDebug >= 2) printf("acalcoutRecord(%s):doCalc sync\n", pcalc->name);
@@ -1322,35 +1586,128 @@ static long doCalc(acalcoutRecord *pcalc) {
 	return(0);
 }
 
-static void acalcPerformTask(void *parm) {
-	calcMessage msg;
+static void acalcPoolInit(void *arg) {
+	int i, n;
+	char name[20];
+
+	acalcQueueLock = epicsMutexMustCreate();
+	acalcQueueEvent = epicsEventMustCreate(epicsEventEmpty);
+
+	n = aCalcAsyncWorkers;
+	if (n < 1) n = 1;
+	if (n > MAX_WORKERS) n = MAX_WORKERS;
+	for (i=0; i<n; i++) {
+		sprintf(name, "acalcWorker%d", i);
+		if (epicsThreadCreate(name, PRIORITY, epicsThreadGetStackSize(epicsThreadStackBig),
+				(EPICSTHREADFUNC)acalcWorkerTask, NULL)) {
+			acalcNumWorkers++;
+		} else {
+			printf("aCalcoutRecord: Unable to create %s\n", name);
+		}
+	}
+}
+
+static void acalcWorkerTask(void *parm) {
+	rpvtStruct *prpvt;
 	acalcoutRecord *pcalc;
 	rset *prset;
+	epicsTimeStamp now;
+	double wait;
 
 	if (aCalcoutRecordDebug >= 10)
-		printf("acalcPerformTask:entry\n");
+		printf("acalcWorkerTask:entry\n");
 
-	while (1) {
-		/* waiting for messages */
-		if (epicsMessageQueueReceive(acalcMsgQueue, &msg, MSG_SIZE) != MSG_SIZE) {
-			printf("acalcPerformTask: epicsMessageQueueReceive returned wrong size\n");
-			break;
+#if ACALC_CPU_AFFINITY
+	if (aCalcAsyncCpuMask) {
+		cpu_set_t cpus;
+		int i;
+
+		CPU_ZERO(&cpus);
+		for (i=0; i<32; i++) {
+			if ((unsigned int)aCalcAsyncCpuMask & (1u<<i)) CPU_SET(i, &cpus);
 		}
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+			printf("acalcWorkerTask: Unable to set CPU affinity 0x%x\n", aCalcAsyncCpuMask);
+	}
+#endif
 
-		pcalc = msg.pcalc;
-		prset = pcalc->rset;
+	while (1) {
+		/* wait for a queued record */
+		epicsMutexMustLock(acalcQueueLock);
+		while (acalcQueueHead == NULL) {
+			epicsMutexUnlock(acalcQueueLock);
+			epicsEventMustWait(acalcQueueEvent);
+			epicsMutexMustLock(acalcQueueLock);
+		}
+		prpvt = acalcQueueHead;
+		acalcQueueHead = prpvt->nextQueued;
+		if (acalcQueueHead == NULL) acalcQueueTail = NULL;
+		prpvt->nextQueued = NULL;
+		epicsTimeGetCurrent(&now);
+		wait = epicsTimeDiffInSeconds(&now, &prpvt->queueTime);
+		acalcQueueStats.depth--;
+		acalcQueueStats.busy++;
+		acalcQueueStats.numStarted++;
+		acalcQueueStats.waitSum += wait;
+		if (wait > acalcQueueStats.waitMax) acalcQueueStats.waitMax = wait;
+		/* The event is binary, so pass it on if there's more work. */
+		if (acalcQueueHead) epicsEventSignal(acalcQueueEvent);
+		epicsMutexUnlock(acalcQueueLock);
+
+		pcalc = prpvt->pcalc;
+		prset = (rset *)pcalc->rset;
 
 		dbScanLock((struct dbCommon *)pcalc);
 
 		if (aCalcoutRecordDebug >= 10)
-			printf("acalcPerformTask:message from '%s'\n", pcalc->name);
+			printf("acalcWorkerTask:evaluating '%s' (waited %f s)\n", pcalc->name, wait);
 		call_aCalcPerform(pcalc);
 		if (aCalcoutRecordDebug >= 10)
-			printf("acalcPerformTask:processing '%s'\n", pcalc->name);
+			printf("acalcWorkerTask:processing '%s'\n", pcalc->name);
 
 		prset->process((dbCommon *) pcalc);
 		dbScanUnlock((struct dbCommon *)pcalc);
+
+		epicsMutexMustLock(acalcQueueLock);
+		acalcQueueStats.busy--;
+		epicsMutexUnlock(acalcQueueLock);
+	}
+}
+
+static void aCalcAsyncReport(int reset) {
+	if (acalcQueueLock == NULL) {
+		printf("aCalcAsyncReport: no calculations have been queued\n");
+		return;
+	}
+	epicsMutexMustLock(acalcQueueLock);
+	printf("aCalcAsyncReport: %d workers (%d busy), queue depth %d (max %d)\n",
+		acalcNumWorkers, acalcQueueStats.busy, acalcQueueStats.depth, acalcQueueStats.maxDepth);
+	printf("aCalcAsyncReport: %lu queued, wait mean %f s, max %f s\n",
+		acalcQueueStats.numQueued,
+		acalcQueueStats.numStarted ? acalcQueueStats.waitSum/acalcQueueStats.numStarted : 0.,
+		acalcQueueStats.waitMax);
+	if (reset) {
+		acalcQueueStats.numQueued = 0;
+		acalcQueueStats.numStarted = 0;
+		acalcQueueStats.maxDepth = acalcQueueStats.depth;
+		acalcQueueStats.waitSum = 0.;
+		acalcQueueStats.waitMax = 0.;
 	}
+	epicsMutexUnlock(acalcQueueLock);
+}
+
+static const iocshArg aCalcAsyncReportArg0 = {"reset", iocshArgInt};
+static const iocshArg * const aCalcAsyncReportArgs[1] = {&aCalcAsyncReportArg0};
+static const iocshFuncDef aCalcAsyncReportDef = {"aCalcAsyncReport", 1, aCalcAsyncReportArgs};
+
+static void aCalcAsyncReportCallFunc(const iocshArgBuf *args)
+{
+    aCalcAsyncReport(args[0].ival);
 }
 
+static void aCalcAsyncRegister(void)
+{
+    iocshRegister(&aCalcAsyncReportDef, aCalcAsyncReportCallFunc);
+}
 
+epicsExportRegistrar(aCalcAsyncRegister);
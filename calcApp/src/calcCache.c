@@ -0,0 +1,224 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcCache.c
+ * Compiled expressions shared by all records that use the same expression.
+ *
+ * Records made from the same template have the same CALC, OCAL, CLCx, etc.
+ * strings.  Rather than compile each into a postfix buffer of its own, a record
+ * asks calcCachePostfix() for the compiled expression.  An expression is compiled
+ * only the first time it's seen (for each engine, and each setting of the
+ * engine's compiler variables), and the postfix is shared, read only, by every
+ * record that uses the expression.  Each entry counts the records using it, and
+ * is freed when the last one lets go of it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <iocsh.h>
+#define epicsExportSharedSymbols
+#include "aCalcPostfix.h"
+#include "sCalcPostfix.h"
+#include "sCalcPostfixPvt.h"
+#include "calcCache.h"
+#include <epicsExport.h>
+
+extern volatile int aCalcPostfixOptimize;
+extern volatile int sCalcPostfixOptimize;
+extern volatile int sCalcPostfixLower;
+extern volatile int sCalcPostfixNative;
+
+#define NUM_BUCKETS 4096	/* power of two */
+
+typedef struct cacheEntry {
+	struct cacheEntry *next;	/* next entry in the same bucket */
+	unsigned long hash;
+	int key;			/* engine, and the compiler settings (KEY_xxx) */
+	int refs;			/* number of users */
+	size_t bytes;		/* size of the entry */
+	long status;		/* returned by aCalcPostfix() or sCalcPostfix() */
+	short error;
+	char *infix;
+	unsigned char postfix[1];	/* really longer */
+} cacheEntry;
+
+/* Bits of cacheEntry.key.  An expression compiled with different settings is a
+ * different entry, so changing a setting affects expressions compiled afterward.
+ */
+#define KEY_ACALC		0x1		/* compiled by aCalcPostfix(); otherwise sCalcPostfix() */
+#define KEY_OPTIMIZE	0x2		/* aCalcPostfixOptimize or sCalcPostfixOptimize */
+#define KEY_LOWER		0x4		/* sCalcPostfixLower */
+#define KEY_NATIVE		0x8		/* sCalcPostfixNative */
+
+#define ENTRY(p) ((cacheEntry *)((char *)(p) - offsetof(cacheEntry, postfix)))
+
+static cacheEntry *buckets[NUM_BUCKETS];
+static const unsigned char badPostfix[2] = {BAD_EXPRESSION, BAD_EXPRESSION};	/* if we're out of memory */
+static epicsMutexId cacheLock;
+static epicsThreadOnceId cacheOnce = EPICS_THREAD_ONCE_INIT;
+static struct {
+	unsigned long numEntries, numRefs, numBytes, numCompiled, numShared;
+} cacheStats;
+
+static void cacheInit(void *arg) {
+	cacheLock = epicsMutexMustCreate();
+}
+
+/* FNV-1a */
+static unsigned long hash_string(const char *s) {
+	unsigned long h = 2166136261UL;
+
+	for (; *s; s++) h = ((h ^ (unsigned char)*s) * 16777619UL) & 0xffffffffUL;
+	return(h);
+}
+
+/* Drop a reference to an entry.  Caller holds cacheLock. */
+static void release_entry(cacheEntry *pe) {
+	cacheEntry **ppe;
+
+	if (--pe->refs > 0) return;
+	for (ppe = &buckets[pe->hash & (NUM_BUCKETS-1)]; *ppe; ppe = &(*ppe)->next) {
+		if (*ppe == pe) {
+			*ppe = pe->next;
+			break;
+		}
+	}
+	cacheStats.numEntries--;
+	cacheStats.numBytes -= pe->bytes;
+	if (!(pe->key & KEY_ACALC)) sCalcNativeRelease(pe->postfix);
+	free(pe);
+}
+
+/* calcCachePostfix
+ *
+ * Compile pinfix with aCalcPostfix() or sCalcPostfix(), or find it already
+ * compiled, and set *ppostfix to the shared, read-only result.  If *ppostfix
+ * is not NULL, it must be a previous result of calcCachePostfix(), which is
+ * released.  Returns, and sets *perror to, what the compiler did.
+ */
+long calcCachePostfix(int engine, const char *pinfix, const unsigned char **ppostfix,
+	short *perror)
+{
+	cacheEntry *pe;
+	unsigned long hash;
+	size_t len, size;
+	int key;
+
+	epicsThreadOnce(&cacheOnce, cacheInit, NULL);
+	if (pinfix == NULL) pinfix = "";
+	if (engine == CALC_CACHE_ACALC) {
+		key = KEY_ACALC | (aCalcPostfixOptimize ? KEY_OPTIMIZE : 0);
+	} else {
+		key = (sCalcPostfixOptimize ? KEY_OPTIMIZE : 0) | (sCalcPostfixLower ? KEY_LOWER : 0) |
+			(sCalcPostfixNative ? KEY_NATIVE : 0);
+	}
+	hash = hash_string(pinfix);
+
+	epicsMutexMustLock(cacheLock);
+	if (*ppostfix && (*ppostfix != badPostfix)) {
+		release_entry(ENTRY(*ppostfix));
+		cacheStats.numRefs--;
+		*ppostfix = NULL;
+	}
+	for (pe = buckets[hash & (NUM_BUCKETS-1)]; pe; pe = pe->next) {
+		if ((pe->hash == hash) && (pe->key == key) && (strcmp(pe->infix, pinfix) == 0)) break;
+	}
+	if (pe) {
+		pe->refs++;
+		cacheStats.numShared++;
+	} else {
+		/* The postfix buffer is as large as the compilers require */
+		len = strlen(pinfix);
+		size = ACALC_INFIX_TO_POSTFIX_SIZE(len);
+		if (SCALC_INFIX_TO_POSTFIX_SIZE(len) > size) size = SCALC_INFIX_TO_POSTFIX_SIZE(len);
+		pe = (cacheEntry *)calloc(1, sizeof(cacheEntry) + size + len + 1);
+		if (pe == NULL) {
+			epicsMutexUnlock(cacheLock);
+			printf("calcCachePostfix: can't allocate memory\n");
+			*ppostfix = badPostfix;
+			*perror = CALC_ERR_INTERNAL;
+			return(-1);
+		}
+		pe->infix = (char *)pe->postfix + size;
+		strcpy(pe->infix, pinfix);
+		if (engine == CALC_CACHE_ACALC) {
+			pe->status = aCalcPostfix(pinfix, pe->postfix, &pe->error);
+		} else {
+			pe->status = sCalcPostfix(pinfix, pe->postfix, &pe->error);
+			if ((pe->status == 0) && sCalcPostfixNative)
+				sCalcPostfixCompileNative(pe->postfix, (int)size);
+		}
+		pe->bytes = sizeof(cacheEntry) + size + len + 1;
+		pe->hash = hash;
+		pe->key = key;
+		pe->refs = 1;
+		pe->next = buckets[hash & (NUM_BUCKETS-1)];
+		buckets[hash & (NUM_BUCKETS-1)] = pe;
+		cacheStats.numEntries++;
+		cacheStats.numBytes += pe->bytes;
+		cacheStats.numCompiled++;
+	}
+	cacheStats.numRefs++;
+	*ppostfix = pe->postfix;
+	*perror = pe->error;
+	epicsMutexUnlock(cacheLock);
+	return(pe->status);
+}
+
+/* calcCacheRelease
+ *
+ * Give up a result of calcCachePostfix()
+ */
+void calcCacheRelease(const unsigned char *postfix)
+{
+	if ((postfix == NULL) || (postfix == badPostfix)) return;
+	epicsMutexMustLock(cacheLock);
+	release_entry(ENTRY(postfix));
+	cacheStats.numRefs--;
+	epicsMutexUnlock(cacheLock);
+}
+
+void calcCacheReport(int level)
+{
+	cacheEntry *pe;
+	int i;
+
+	epicsThreadOnce(&cacheOnce, cacheInit, NULL);
+	epicsMutexMustLock(cacheLock);
+	printf("calcCacheReport: %lu expressions (%lu bytes) used %lu times\n",
+		cacheStats.numEntries, cacheStats.numBytes, cacheStats.numRefs);
+	printf("calcCacheReport: %lu compiled, %lu found already compiled\n",
+		cacheStats.numCompiled, cacheStats.numShared);
+	if (level > 0) {
+		for (i=0; i<NUM_BUCKETS; i++) {
+			for (pe = buckets[i]; pe; pe = pe->next) {
+				printf("%6d %s '%s'%s\n", pe->refs, (pe->key & KEY_ACALC) ? "aCalc" : "sCalc",
+					pe->infix, pe->status ? " (error)" : "");
+			}
+		}
+	}
+	epicsMutexUnlock(cacheLock);
+}
+
+static const iocshArg calcCacheReportArg0 = {"level", iocshArgInt};
+static const iocshArg * const calcCacheReportArgs[1] = {&calcCacheReportArg0};
+static const iocshFuncDef calcCacheReportDef = {"calcCacheReport", 1, calcCacheReportArgs};
+
+static void calcCacheReportCallFunc(const iocshArgBuf *args)
+{
+    calcCacheReport(args[0].ival);
+}
+
+static void calcCacheRegister(void)
+{
+    iocshRegister(&calcCacheReportDef, calcCacheReportCallFunc);
+}
+
+epicsExportRegistrar(calcCacheRegister);
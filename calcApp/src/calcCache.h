@@ -0,0 +1,38 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcCache.h
+ * Compiled expressions shared by all records that use the same expression
+ */
+
+#ifndef INC_calcCacheh
+#define INC_calcCacheh
+
+#include <shareLib.h>
+
+/* engines */
+#define CALC_CACHE_SCALC	0
+#define CALC_CACHE_ACALC	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+epicsShareFunc long
+	calcCachePostfix(int engine, const char *pinfix, const unsigned char **ppostfix,
+		short *perror);
+
+epicsShareFunc void
+	calcCacheRelease(const unsigned char *postfix);
+
+epicsShareFunc void
+	calcCacheReport(int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_calcCacheh */
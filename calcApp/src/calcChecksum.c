@@ -0,0 +1,74 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcChecksum.c
+ * Checksums of binary buffers.
+ *
+ * The CRCs are computed a byte at a time, from a table of each byte's effect
+ * on the CRC, rather than a bit at a time.  The tables are built the first time
+ * any CRC is computed.
+ */
+#include <epicsThread.h>
+#define epicsExportSharedSymbols
+#include "calcChecksum.h"
+
+static epicsUInt16 crc16ModbusTable[256];
+static epicsUInt16 crcCcittTable[256];
+static epicsUInt32 crc32Table[256];
+static epicsThreadOnceId tableOnce = EPICS_THREAD_ONCE_INIT;
+
+static void tableInit(void *arg)
+{
+	epicsUInt32 c16, cc, c32;
+	int i, j;
+
+	for (i=0; i<256; i++) {
+		c16 = i;
+		cc = i << 8;
+		c32 = i;
+		for (j=0; j<8; j++) {
+			c16 = (c16 & 1) ? (c16 >> 1) ^ 0xA001 : (c16 >> 1);
+			cc = (cc & 0x8000) ? (cc << 1) ^ 0x1021 : (cc << 1);
+			c32 = (c32 & 1) ? (c32 >> 1) ^ 0xEDB88320UL : (c32 >> 1);
+		}
+		crc16ModbusTable[i] = (epicsUInt16)c16;
+		crcCcittTable[i] = (epicsUInt16)(cc & 0xffff);
+		crc32Table[i] = c32;
+	}
+}
+
+epicsUInt16 calcCrc16Modbus(epicsUInt16 crc, const unsigned char *buf, int len)
+{
+	epicsThreadOnce(&tableOnce, tableInit, NULL);
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc16ModbusTable[(crc ^ *buf++) & 0xff];
+	return(crc);
+}
+
+epicsUInt16 calcCrcCcitt(epicsUInt16 crc, const unsigned char *buf, int len)
+{
+	epicsThreadOnce(&tableOnce, tableInit, NULL);
+	while (len-- > 0)
+		crc = (epicsUInt16)((crc << 8) ^ crcCcittTable[((crc >> 8) ^ *buf++) & 0xff]);
+	return(crc);
+}
+
+/* The CRC is inverted before and after, so that pieces can be chained */
+epicsUInt32 calcCrc32(epicsUInt32 crc, const unsigned char *buf, int len)
+{
+	epicsThreadOnce(&tableOnce, tableInit, NULL);
+	crc = ~crc;
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc32Table[(crc ^ *buf++) & 0xff];
+	return(~crc);
+}
+
+unsigned char calcXor8(unsigned char x, const unsigned char *buf, int len)
+{
+	while (len-- > 0)
+		x ^= *buf++;
+	return(x);
+}
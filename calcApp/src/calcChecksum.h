@@ -0,0 +1,48 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcChecksum.h
+ * Checksums of binary buffers, used by sCalc's checksum operators
+ */
+
+#ifndef INC_calcChecksumh
+#define INC_calcChecksumh
+
+#include <shareLib.h>
+#include <epicsTypes.h>
+
+/* Starting values.  A checksum may be computed a piece at a time, by passing
+ * the result for one piece as the starting value for the next.
+ */
+#define CALC_CRC16_MODBUS_INIT	0xffff
+#define CALC_CRC_CCITT_INIT		0xffff
+#define CALC_CRC32_INIT			0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Modbus/RTU CRC-16 (reflected polynomial 0xA001); sent low byte first */
+epicsShareFunc epicsUInt16
+	calcCrc16Modbus(epicsUInt16 crc, const unsigned char *buf, int len);
+
+/* CRC-16/CCITT (polynomial 0x1021, most significant bit first); sent high byte first */
+epicsShareFunc epicsUInt16
+	calcCrcCcitt(epicsUInt16 crc, const unsigned char *buf, int len);
+
+/* CRC-32 of Ethernet, zip, and PNG (reflected polynomial 0xEDB88320) */
+epicsShareFunc epicsUInt32
+	calcCrc32(epicsUInt32 crc, const unsigned char *buf, int len);
+
+/* XOR of all bytes */
+epicsShareFunc unsigned char
+	calcXor8(unsigned char x, const unsigned char *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_calcChecksumh */
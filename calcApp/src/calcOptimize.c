@@ -0,0 +1,294 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcOptimize.c
+ * Optimizer for the postfix expressions made by aCalcPostfix() and sCalcPostfix().
+ *
+ * The optimizer reads the instructions once, simulating the run-time stack, and
+ * writes the optimized instructions as it goes.  For each value on the stack it
+ * knows which output instructions compute it, so it can rewrite the instructions
+ * that make an operator's operands when it comes to the operator:
+ *   constant folding          2*PI*D2R         -> 0.10966...
+ *   strength reduction        A^2              -> A*A
+ *                             A/4              -> A*0.25
+ *   dead-branch elimination   1?A:B            -> A
+ *   reuse of a subexpression  SIN(A)+SIN(A)    -> SIN(A)*2
+ *                             (A-B)>?(A-B)     -> A-B
+ * Constant operators are evaluated by the language's own engine, so a folded
+ * expression gives exactly the result it gave before.  The postfix format has no
+ * way to keep a value for later use, so a repeated subexpression can be reused
+ * only where one copy of it is enough.  A division becomes a multiplication only
+ * if the divisor is a power of two, whose reciprocal is exact.
+ *
+ * Values computed across a conditional or a loop are treated as unknown, so the
+ * optimizer never moves an instruction past a jump or its target.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "epicsMath.h"
+#include "calcOptimize.h"
+
+#define DUP_MAX 3	/* longest operand we will compute twice to replace x^2 with x*x */
+
+/* One value on the simulated stack */
+typedef struct {
+	int first, last;	/* out[first..last] computes it; first is -1 if that's not known */
+	int flags;			/* VAL_xxx */
+} optValue;
+
+#define VAL_CONST	1	/* constant */
+#define VAL_NUMBER	2	/* never a string */
+#define VAL_PURE	4	/* computing it has no side effect */
+
+/* Find the instruction to which each conditional jumps, exactly as cond_search()
+ * does at run time: COND_IF to its COND_ELSE, and COND_ELSE to its COND_END.
+ */
+static void find_matches(const calcOptLang *lang, const calcOptInst *in, int n, int *match) {
+	int i, j, count, target;
+
+	for (i=0; i<n; i++) {
+		match[i] = -1;
+		if (in[i].op == lang->condIf) target = lang->condElse;
+		else if (in[i].op == lang->condElse) target = lang->condEnd;
+		else continue;
+		for (j=i+1, count=1; j<n; j++) {
+			if (in[j].op == target && --count == 0) {
+				match[i] = j;
+				break;
+			}
+			if (in[j].op == lang->condIf) count++;
+		}
+	}
+}
+
+/* Set *pi to the numeric literal d, in the form aCalcPostfix() would use */
+static void make_literal(const calcOptLang *lang, calcOptInst *pi, double d) {
+	static const double zero = 0.;
+
+	memset(pi, 0, sizeof(calcOptInst));
+	if ((d > -2147483648.) && (d < 2147483648.) && (d == (double)(int)d) &&
+			!((d == 0) && memcmp(&d, &zero, sizeof(double)))) {
+		pi->op = lang->litInt;
+	} else {
+		pi->op = lang->litDouble;
+	}
+	pi->d = d;
+	lang->describe(pi);
+}
+
+static int is_literal(const calcOptLang *lang, const calcOptInst *pi) {
+	return((pi->op == lang->litInt) || (pi->op == lang->litDouble));
+}
+
+/* Do values v[base..top] lie, in order, at the end of out[0..nout-1]? */
+static int at_end(const optValue *v, int base, int top, int nout) {
+	int k;
+
+	if (base > top) return(1);
+	for (k=base; k<=top; k++) {
+		if (v[k].first < 0) return(0);
+		if ((k < top) && (v[k+1].first != v[k].last+1)) return(0);
+	}
+	return(v[top].last == nout-1);
+}
+
+static int same_inst(const calcOptInst *a, const calcOptInst *b) {
+	if ((a->op != b->op) || (a->nargs != b->nargs)) return(0);
+	if (memcmp(&a->d, &b->d, sizeof(double))) return(0);
+	if (a->s || b->s) return(a->s && b->s && (strcmp(a->s, b->s) == 0));
+	return(1);
+}
+
+/* Do a and b compute the same number, with no side effect? */
+static int same_value(const calcOptInst *out, const optValue *a, const optValue *b) {
+	int k, len = a->last - a->first;
+
+	if ((a->first < 0) || (b->first < 0) || (b->last - b->first != len)) return(0);
+	if (!(a->flags & b->flags & VAL_NUMBER) || !(a->flags & b->flags & VAL_PURE)) return(0);
+	for (k=0; k<=len; k++) {
+		if (!same_inst(&out[a->first+k], &out[b->first+k])) return(0);
+	}
+	return(1);
+}
+
+/* Is a short enough, and simple enough, to compute twice? */
+static int cheap_value(const calcOptInst *out, const optValue *a) {
+	int k;
+
+	if ((a->first < 0) || (a->last - a->first >= DUP_MAX)) return(0);
+	if ((a->flags & (VAL_NUMBER|VAL_PURE)) != (VAL_NUMBER|VAL_PURE)) return(0);
+	for (k=a->first; k<=a->last; k++) {
+		if (!(out[k].flags & (CALC_OPT_CONST|CALC_OPT_FETCH|CALC_OPT_FOLD))) return(0);
+	}
+	return(1);
+}
+
+/* Is x/d the same as x*(1/d) for every x? */
+static int exact_reciprocal(double d) {
+	int e;
+	double m;
+
+	if (!finite(d) || (d == 0)) return(0);
+	m = frexp(d, &e);
+	if ((m != 0.5) && (m != -0.5)) return(0);
+	return(finite(1/d) && (1/d != 0));
+}
+
+/* Does in[first..last] contain a loop boundary? */
+static int has_barrier(const calcOptInst *in, int first, int last) {
+	for (; first<=last; first++) {
+		if (in[first].flags & CALC_OPT_BARRIER) return(1);
+	}
+	return(0);
+}
+
+/* Optimize the n instructions in[], writing at most maxOut instructions to out[].
+ * Return the number of instructions written, or -1 if the expression should be
+ * left as it is.
+ */
+int calcOptimize(const calcOptLang *lang, const calcOptInst *in, int n,
+	calcOptInst *out, int maxOut)
+{
+	optValue *v = NULL;
+	int *match = NULL, *resume = NULL;
+	int i, k, top = -1, base, nout = 0, result = -1, contig, allFlags, e, len;
+	calcOptInst inst;
+	double d;
+
+	v = (optValue *)calloc(n+1, sizeof(optValue));
+	match = (int *)calloc(n+1, sizeof(int));
+	resume = (int *)calloc(n+1, sizeof(int));
+	if (!v || !match || !resume) goto done;
+
+	find_matches(lang, in, n, match);
+	for (i=0; i<n; i++) resume[i] = i;
+
+	for (i=0; i<n; i++) {
+		if (resume[i] != i) {
+			/* end of the branch we keep: skip the rest of the conditional */
+			i = resume[i]-1;
+			continue;
+		}
+		inst = in[i];
+
+		/* conditional whose condition is a constant */
+		if ((inst.op == lang->condIf) && (top >= 0) && (v[top].flags & VAL_CONST) &&
+				at_end(v, top, top, nout) && ((e = match[i]) >= 0) && (match[e] >= 0) &&
+				!has_barrier(in, i, match[e]) &&
+				(lang->eval(&out[v[top].first], nout-v[top].first, &d) == 0)) {
+			nout = v[top--].first;
+			if (d != 0.0) {
+				resume[e] = match[e]+1;		/* drop COND_ELSE through COND_END */
+			} else {
+				resume[match[e]] = match[e]+1;	/* drop COND_END */
+				i = e;						/* and everything through COND_ELSE */
+			}
+			continue;
+		}
+
+		if (inst.pops > top+1) goto done;
+		base = top+1 - inst.pops;
+		contig = at_end(v, base, top, nout);
+		for (k=base, allFlags=VAL_CONST|VAL_NUMBER|VAL_PURE; k<=top; k++) allFlags &= v[k].flags;
+		if (nout + DUP_MAX + 2 > maxOut) goto done;
+
+		if ((inst.op == lang->condIf) || (inst.op == lang->condElse) ||
+				(inst.op == lang->condEnd) || (inst.flags & CALC_OPT_BARRIER)) {
+			out[nout++] = inst;
+			top = base-1;
+			for (k=0; k<inst.pushes; k++) {
+				top++;
+				v[top].first = -1;
+				v[top].flags = 0;
+			}
+			/* Nothing computed before a jump or its target may be touched after it */
+			for (k=0; k<=top; k++) v[k].first = -1;
+			continue;
+		}
+
+		/* constant folding */
+		if ((inst.flags & CALC_OPT_FOLD) && inst.pops && contig && (allFlags & VAL_CONST)) {
+			out[nout] = inst;
+			if (lang->eval(&out[v[base].first], nout+1-v[base].first, &d) == 0) {
+				nout = v[base].first;
+				make_literal(lang, &out[nout], d);
+				top = base;
+				v[top].first = v[top].last = nout++;
+				v[top].flags = VAL_CONST|VAL_NUMBER|VAL_PURE;
+				continue;
+			}
+		}
+
+		if (contig && (inst.pops == 2)) {
+			if ((v[top].flags & VAL_CONST) && (v[top].first == v[top].last) &&
+					is_literal(lang, &out[v[top].first]) && (v[base].flags & VAL_NUMBER)) {
+				d = out[v[top].first].d;
+				if ((inst.op == lang->power) && (d == 2) && cheap_value(out, &v[base])) {
+					/* x^2 -> x*x */
+					nout = v[top].first;
+					len = v[base].last - v[base].first + 1;
+					memcpy(&out[nout], &out[v[base].first], len*sizeof(calcOptInst));
+					v[top].first = nout;
+					v[top].last = nout+len-1;
+					v[top].flags = v[base].flags;
+					nout += len;
+					inst.op = lang->mult;
+					lang->describe(&inst);
+				} else if ((inst.op == lang->div) && exact_reciprocal(d)) {
+					/* x/d -> x*(1/d) */
+					make_literal(lang, &out[v[top].first], 1/d);
+					inst.op = lang->mult;
+					lang->describe(&inst);
+				}
+			} else if (((inst.op == lang->add) || (inst.op == lang->maxVal) ||
+					(inst.op == lang->minVal)) && same_value(out, &v[base], &v[top])) {
+				nout = v[top].first;
+				if (inst.op != lang->add) {
+					/* x>?x -> x */
+					top = base;
+					continue;
+				}
+				/* x+x -> x*2 */
+				make_literal(lang, &out[nout], 2);
+				v[top].first = v[top].last = nout++;
+				v[top].flags = VAL_CONST|VAL_NUMBER|VAL_PURE;
+				inst.op = lang->mult;
+				lang->describe(&inst);
+			}
+		}
+
+		/* emit the instruction */
+		out[nout] = inst;
+		top = base-1;
+		for (k=0; k<inst.pushes; k++) {
+			top++;
+			if (contig && (inst.pushes == 1)) {
+				v[top].first = inst.pops ? v[top].first : nout;
+				v[top].last = nout;
+			} else {
+				v[top].first = -1;
+			}
+			v[top].flags = 0;
+			if (inst.flags & CALC_OPT_CONST) v[top].flags |= VAL_CONST;
+			if ((inst.flags & CALC_OPT_NUMBER) ||
+					((inst.flags & CALC_OPT_FOLD) && (allFlags & VAL_NUMBER)))
+				v[top].flags |= VAL_NUMBER;
+			if (!(inst.flags & CALC_OPT_IMPURE) && (allFlags & VAL_PURE))
+				v[top].flags |= VAL_PURE;
+		}
+		nout++;
+		if (top+1 >= lang->stackSize) goto done;
+	}
+	if (top == 0) result = nout;
+
+done:
+	free(v);
+	free(match);
+	free(resume);
+	return(result);
+}
@@ -0,0 +1,57 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcOptimize.h
+ * Optimizer for the postfix expressions made by aCalcPostfix() and sCalcPostfix()
+ */
+
+#ifndef INC_calcOptimizeh
+#define INC_calcOptimizeh
+
+/* calcOptInst flags */
+#define CALC_OPT_CONST		0x01	/* pushes a number known when the expression is compiled */
+#define CALC_OPT_FETCH		0x02	/* pushes an input value, and has no side effect */
+#define CALC_OPT_FOLD		0x04	/* operator with no side effect, which can be done when the
+									 * expression is compiled if its operands are constants */
+#define CALC_OPT_NUMBER		0x08	/* pushes a number (never a string) */
+#define CALC_OPT_IMPURE		0x10	/* has a side effect, or a different result each time */
+#define CALC_OPT_BARRIER	0x20	/* loop boundary: no value is computed across it */
+
+/* One postfix instruction */
+typedef struct {
+	unsigned char op;
+	unsigned char nargs;	/* argument count of a vararg function */
+	unsigned char pops;		/* values taken from the stack */
+	unsigned char pushes;	/* values left on the stack */
+	unsigned char flags;	/* CALC_OPT_xxx */
+	double d;				/* value of a numeric literal */
+	const char *s;			/* value of a string literal */
+} calcOptInst;
+
+/* What the optimizer needs to know about the aCalc or sCalc language */
+typedef struct {
+	unsigned char litDouble, litInt;
+	unsigned char add, mult, div, power, maxVal, minVal;
+	unsigned char condIf, condElse, condEnd;
+	int stackSize;		/* run-time stack depth must stay below this */
+	/* Set pops, pushes and flags of *pi from its op and nargs.  Return -1 if op is unknown. */
+	int (*describe)(calcOptInst *pi);
+	/* Evaluate n instructions that leave one number on the stack.  Return 0 if successful. */
+	int (*eval)(const calcOptInst *pi, int n, double *pd);
+} calcOptLang;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int calcOptimize(const calcOptLang *lang, const calcOptInst *in, int n,
+	calcOptInst *out, int maxOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_calcOptimizeh */
@@ -0,0 +1,191 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcRandom.c
+ * Random numbers for the sCalc and aCalc engines.
+ *
+ * The generator is xoshiro128** (Blackman and Vigna), which has a period of
+ * 2^128-1 and passes the usual statistical tests.  It needs only 32-bit
+ * arithmetic, so it works with every compiler EPICS supports.  Each double takes
+ * 53 random bits from two outputs, and lies in (0,1], so log() of it is finite.
+ *
+ * A state holds CALC_RANDOM_LANES independent generators.  calcRandomFill() steps
+ * them together, in a loop the compiler can turn into SIMD instructions.
+ *
+ * Normal deviates come from the ziggurat method (Marsaglia and Tsang), as Doornik
+ * recommends it: the layer and the position within it come from different bits of
+ * a uniform deviate.  About 99% of deviates cost a multiply and a compare; the
+ * rest need exp() or log().
+ */
+#ifdef vxWorks
+#include <vxWorks.h>
+#endif
+
+#include <math.h>
+
+#include <epicsThread.h>
+#include "calcRandom.h"
+
+#define ROTL(x,k) (((x) << (k)) | ((x) >> (32-(k))))
+#define TWO_M53 (1.0/9007199254740992.0)	/* 2^-53 */
+
+/* Step lane k only, and return its output. */
+static epicsUInt32 step_one(calcRandomState *pr, int k) {
+	epicsUInt32 (*s)[CALC_RANDOM_LANES] = pr->s;
+	epicsUInt32 x, t;
+
+	x = s[1][k] * 5;
+	x = ROTL(x, 7) * 9;
+	t = s[1][k] << 9;
+	s[2][k] ^= s[0][k];
+	s[3][k] ^= s[1][k];
+	s[1][k] ^= s[2][k];
+	s[0][k] ^= s[3][k];
+	s[2][k] ^= t;
+	s[3][k] = ROTL(s[3][k], 11);
+	return(x);
+}
+
+/* ziggurat with ZIG_C layers, the bottom one (0) ending in the tail beyond ZIG_R */
+#define ZIG_C 128
+#define ZIG_R 3.442619855899
+#define ZIG_V 9.91256303526217e-3
+static double zigX[ZIG_C+1];	/* right edge of each layer */
+static double zigRatio[ZIG_C];	/* zigX[i+1]/zigX[i]: fraction of layer i inside the curve */
+static epicsThreadOnceId zigOnce = EPICS_THREAD_ONCE_INIT;
+
+static void zigInit(void *arg) {
+	double f;
+	int i;
+
+	f = exp(-0.5*ZIG_R*ZIG_R);
+	zigX[0] = ZIG_V/f;
+	zigX[1] = ZIG_R;
+	zigX[ZIG_C] = 0;
+	for (i=2; i<ZIG_C; i++) {
+		zigX[i] = sqrt(-2*log(ZIG_V/zigX[i-1] + f));
+		f = exp(-0.5*zigX[i]*zigX[i]);
+	}
+	for (i=0; i<ZIG_C; i++) zigRatio[i] = zigX[i+1]/zigX[i];
+}
+
+/* double in (0,1] from two outputs.  The shifted values fit in a signed int, which
+ * converts to double faster than an unsigned one.
+ */
+#define TO_DOUBLE(a,b) \
+	(((epicsInt32)((a) >> 5) * 67108864.0 + (epicsInt32)((b) >> 6) + 1.0) * TWO_M53)
+
+/* Seed every lane.  Equal seeds give equal sequences. */
+void calcRandomSeed(calcRandomState *pr, epicsUInt32 seed) {
+	static const epicsUInt32 jump[4] = {0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b};
+	epicsUInt32 z, acc[4];
+	int i, j, b, k;
+
+	/* Lane 0 from a hash of successive seeds, so nearby seeds give unrelated states */
+	for (i=0; i<4; i++) {
+		z = (seed += 0x9e3779b9);
+		z ^= z >> 16; z *= 0x85ebca6b;
+		z ^= z >> 13; z *= 0xc2b2ae35;
+		z ^= z >> 16;
+		pr->s[i][0] = z;
+	}
+	if ((pr->s[0][0] | pr->s[1][0] | pr->s[2][0] | pr->s[3][0]) == 0) pr->s[0][0] = 1;
+
+	/* Each other lane is the lane before it, jumped ahead 2^64 steps */
+	for (k=1; k<CALC_RANDOM_LANES; k++) {
+		for (i=0; i<4; i++) pr->s[i][k] = pr->s[i][k-1];
+		acc[0] = acc[1] = acc[2] = acc[3] = 0;
+		for (j=0; j<4; j++) {
+			for (b=0; b<32; b++) {
+				if (jump[j] & (1u << b)) {
+					for (i=0; i<4; i++) acc[i] ^= pr->s[i][k];
+				}
+				step_one(pr, k);
+			}
+		}
+		for (i=0; i<4; i++) pr->s[i][k] = acc[i];
+	}
+}
+
+/* Uniformly distributed in (0,1] */
+double calcRandom(calcRandomState *pr) {
+	epicsUInt32 a = step_one(pr, 0);
+	epicsUInt32 b = step_one(pr, 0);
+
+	return(TO_DOUBLE(a, b));
+}
+
+/* Normal deviate from the uniform deviate d: the top bits of d pick the layer, and
+ * the rest the position within it.  Uncommon cases draw more numbers from pr.
+ */
+static double zig_normal(calcRandomState *pr, double d) {
+	double x, u, f0, f1;
+	int i;
+
+	while (1) {
+		d *= ZIG_C;
+		i = (int)d;
+		if (i >= ZIG_C) i = ZIG_C-1;	/* d was 1 */
+		u = 2*(d-i) - 1;
+		if (fabs(u) < zigRatio[i]) return(u*zigX[i]);
+		if (i == 0) {
+			/* the tail beyond ZIG_R */
+			do {
+				x = log(calcRandom(pr))/ZIG_R;
+				f0 = log(calcRandom(pr));
+			} while (-2*f0 < x*x);
+			return((u < 0) ? x-ZIG_R : ZIG_R-x);
+		}
+		/* the wedge between the layer and the curve */
+		x = u*zigX[i];
+		f0 = exp(-0.5*(zigX[i]*zigX[i] - x*x));
+		f1 = exp(-0.5*(zigX[i+1]*zigX[i+1] - x*x));
+		if (f1 + calcRandom(pr)*(f0-f1) < 1.0) return(x);
+		d = calcRandom(pr);
+	}
+}
+
+/* Normally distributed about zero, with std dev = 1 */
+double calcRandomNormal(calcRandomState *pr) {
+	epicsThreadOnce(&zigOnce, zigInit, NULL);
+	return(zig_normal(pr, calcRandom(pr)));
+}
+
+/* Fill a[0..n-1] with numbers uniformly distributed in (0,1].  Each step of the
+ * outer loop steps every lane: the inner loops have no dependence from one lane
+ * to the next, so the compiler can turn them into SIMD instructions.
+ */
+void calcRandomFill(calcRandomState *pr, double *a, int n) {
+	epicsUInt32 *s0 = pr->s[0], *s1 = pr->s[1], *s2 = pr->s[2], *s3 = pr->s[3];
+	epicsUInt32 r[CALC_RANDOM_LANES], x, t;
+	int i, k;
+
+	for (i=0; i+CALC_RANDOM_LANES/2 <= n; i += CALC_RANDOM_LANES/2) {
+		for (k=0; k<CALC_RANDOM_LANES; k++) {
+			x = s1[k] + (s1[k] << 2);	/* *5 */
+			x = ROTL(x, 7);
+			r[k] = x + (x << 3);		/* *9 */
+			t = s1[k] << 9;
+			s2[k] ^= s0[k];
+			s3[k] ^= s1[k];
+			s1[k] ^= s2[k];
+			s0[k] ^= s3[k];
+			s2[k] ^= t;
+			s3[k] = ROTL(s3[k], 11);
+		}
+		for (k=0; k<CALC_RANDOM_LANES/2; k++) a[i+k] = TO_DOUBLE(r[k], r[k+CALC_RANDOM_LANES/2]);
+	}
+	for (; i<n; i++) a[i] = calcRandom(pr);
+}
+
+/* Fill a[0..n-1] with numbers normally distributed about zero, with std dev = 1 */
+void calcRandomFillNormal(calcRandomState *pr, double *a, int n) {
+	int i;
+
+	epicsThreadOnce(&zigOnce, zigInit, NULL);
+	calcRandomFill(pr, a, n);
+	for (i=0; i<n; i++) a[i] = zig_normal(pr, a[i]);
+}
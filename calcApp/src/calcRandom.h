@@ -0,0 +1,40 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcRandom.h
+ * Random numbers for the sCalc and aCalc engines (RNDM, NRNDM, ARNDM, ANRNDM)
+ */
+
+#ifndef INC_calcRandomh
+#define INC_calcRandomh
+
+#include <epicsTypes.h>
+
+#define CALC_RANDOM_LANES 16
+
+/* Generator state.  Each lane is an xoshiro128** generator, 2^64 steps ahead of
+ * the lane before it.  Single numbers come from lane 0; arrays are filled from all
+ * lanes at once.
+ */
+typedef struct {
+	epicsUInt32 s[4][CALC_RANDOM_LANES];	/* s[word][lane] */
+} calcRandomState;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void calcRandomSeed(calcRandomState *pr, epicsUInt32 seed);
+double calcRandom(calcRandomState *pr);
+double calcRandomNormal(calcRandomState *pr);
+void calcRandomFill(calcRandomState *pr, double *a, int n);
+void calcRandomFillNormal(calcRandomState *pr, double *a, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_calcRandomh */
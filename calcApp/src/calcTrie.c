@@ -0,0 +1,84 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcTrie.c
+ * Case-insensitive lookup of the names in the element tables of aCalcPostfix()
+ * and sCalcPostfix().
+ *
+ * The compilers used to compare the expression with every name in a table,
+ * working from the end of the table to the start, and take the first name that
+ * matched.  A trie finds every name that matches in one pass over the expression,
+ * and calcTrieMatch() takes the one latest in the table, so it returns exactly
+ * what the old search did.
+ */
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "calcTrie.h"
+
+#define NAME(pname, stride, i) (*(const char * const *)((const char *)(pname) + (i)*(stride)))
+
+/* Build a trie of the n names at pname, pname+stride, ...  Return 0 if successful.
+ * The trie is never freed; the tables it indexes are static.
+ */
+int calcTrieBuild(calcTrie *pt, const char * const *pname, int n, size_t stride) {
+	const char *s;
+	short *plink;
+	int i, k, maxNodes;
+
+	for (k=0; k<256; k++) pt->root[k] = -1;
+	for (i=0, maxNodes=0; i<n; i++) {
+		for (s=NAME(pname, stride, i); *s; s++) maxNodes++;
+	}
+	if (maxNodes > 32767) return(-1);
+	pt->nodes = (calcTrieNode *)calloc(maxNodes, sizeof(calcTrieNode));
+	if (pt->nodes == NULL) return(-1);
+	pt->numNodes = 0;
+
+	for (i=0; i<n; i++) {
+		s = NAME(pname, stride, i);
+		if (*s == '\0') continue;
+		plink = &pt->root[toupper((int)(unsigned char)*s)];
+		while (1) {
+			/* find or add the node for *s on the list at *plink */
+			for (k = *plink; k >= 0; k = pt->nodes[k].sibling) {
+				if (pt->nodes[k].c == toupper((int)(unsigned char)*s)) break;
+			}
+			if (k < 0) {
+				k = pt->numNodes++;
+				pt->nodes[k].c = toupper((int)(unsigned char)*s);
+				pt->nodes[k].child = -1;
+				pt->nodes[k].index = -1;
+				pt->nodes[k].sibling = *plink;
+				*plink = k;
+			}
+			if (*++s == '\0') break;
+			plink = &pt->nodes[k].child;
+		}
+		pt->nodes[k].index = i;
+	}
+	return(0);
+}
+
+/* Find the table entry, latest in the table, whose name begins src.  Return its
+ * index and set *plen to its length, or return -1 if no name matches.
+ */
+int calcTrieMatch(const calcTrie *pt, const char *src, int *plen) {
+	int k, len, best = -1;
+	unsigned char c;
+
+	k = pt->root[toupper((int)(unsigned char)*src)];
+	for (len=1; k >= 0; len++) {
+		if (pt->nodes[k].index > best) {
+			best = pt->nodes[k].index;
+			*plen = len;
+		}
+		if ((c = (unsigned char)src[len]) == '\0') break;
+		c = toupper(c);
+		for (k = pt->nodes[k].child; (k >= 0) && (pt->nodes[k].c != c); k = pt->nodes[k].sibling);
+	}
+	return(best);
+}
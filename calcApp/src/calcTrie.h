@@ -0,0 +1,41 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* calcTrie.h
+ * Case-insensitive lookup of the names in the element tables of aCalcPostfix()
+ * and sCalcPostfix()
+ */
+
+#ifndef INC_calcTrieh
+#define INC_calcTrieh
+
+#include <stddef.h>
+
+typedef struct {
+	short child;		/* first node one character longer, or -1 */
+	short sibling;		/* next node with the same parent, or -1 */
+	short index;		/* last table entry whose name ends here, or -1 */
+	unsigned char c;	/* character, in upper case */
+} calcTrieNode;
+
+typedef struct {
+	short root[256];	/* node for each first character, or -1 */
+	calcTrieNode *nodes;
+	int numNodes;
+} calcTrie;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int calcTrieBuild(calcTrie *pt, const char * const *pname, int n, size_t stride);
+int calcTrieMatch(const calcTrie *pt, const char *src, int *plen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_calcTrieh */
@@ -0,0 +1,788 @@
+/*************************************************************************\
+* Copyright (c) 2010 UChicago Argonne LLC, as Operator of Argonne
+*     National Laboratory.
+* EPICS BASE is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+/* sCalcNative.c
+ * Machine code for sCalc register programs.
+ *
+ * A register program that uses only arithmetic, comparisons, logical operators,
+ * math functions, conditionals, and stores to named arguments can be compiled to
+ * x86-64 code that reads and writes the arguments, VAL, and the registers (kept
+ * on the machine stack) directly.  Each operator computes exactly what it does in
+ * sCalcPerform().  Other programs, and programs on other targets, are left to the
+ * interpreter.  Records made from the same template have the same programs, which
+ * share code.  Code is counted by the postfix that refers to it, and freed, with
+ * sCalcNativeRelease(), when calcCache frees the last expression that uses it.
+ * Only calcCache compiles to machine code; sCalcPostfix() itself leaves a
+ * register program, so a caller with its own postfix buffer has nothing to free.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#define epicsExportSharedSymbols
+#include "sCalcPostfix.h"
+#include "sCalcPostfixPvt.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__FreeBSD__))
+#define NATIVE_X86_64 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef NATIVE_X86_64
+
+int sCalcNativeCompile(const unsigned char *prog, sCalcNativeFunc *pfunc)
+{
+	return(-1);
+}
+
+void sCalcNativeRelease(const unsigned char *postfix)
+{
+}
+
+#else
+
+#define SMALL 1.e-11
+#define FRAME (SCALC_REG_NUM*8 + 8)	/* registers, and padding that keeps calls aligned */
+#define NUM_BUCKETS 256			/* power of two */
+#define MAX_POOL (2*SCALC_REG_NUM + 8)
+
+/* x86 condition codes */
+#define CC_B	0x2
+#define CC_AE	0x3
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_BE	0x6
+#define CC_A	0x7
+#define CC_P	0xa
+#define CC_NP	0xb
+
+/* byte registers */
+#define AL	0
+#define CL	1
+#define DL	2
+
+/* things a rel32 may refer to */
+#define FIX_POOL	0
+#define FIX_JUMP	1
+#define FIX_FAIL	2
+
+typedef struct {
+	const unsigned char *prog;
+	unsigned char *buf, *p, *end;
+	int bad;
+	struct {
+		int at, kind, to;
+	} *fix;
+	int numFix, maxFix;
+	double pool[MAX_POOL];
+	int numPool;
+} emitter;
+
+typedef struct nativeEntry {
+	struct nativeEntry *next;
+	sCalcNativeFunc func;
+	size_t codeLen;			/* bytes of machine code at func */
+	int refs;				/* number of postfix expressions that refer to func */
+	int len;
+	unsigned char prog[1];	/* really longer */
+} nativeEntry;
+
+static nativeEntry *buckets[NUM_BUCKETS];
+static epicsMutexId nativeLock;
+static epicsThreadOnceId nativeOnce = EPICS_THREAD_ONCE_INIT;
+
+static void nativeInit(void *arg) {
+	nativeLock = epicsMutexMustCreate();
+}
+
+static void put(emitter *pe, int b)
+{
+	if (pe->p >= pe->end) {
+		pe->bad = 1;
+		return;
+	}
+	*pe->p++ = (unsigned char)b;
+}
+
+static void put32(emitter *pe, long v)
+{
+	put(pe, v & 0xff);
+	put(pe, (v >> 8) & 0xff);
+	put(pe, (v >> 16) & 0xff);
+	put(pe, (v >> 24) & 0xff);
+}
+
+/* rel32 to be filled in when the code is complete */
+static void put_fix(emitter *pe, int kind, int to)
+{
+	if (pe->numFix >= pe->maxFix) {
+		pe->bad = 1;
+		return;
+	}
+	pe->fix[pe->numFix].at = (int)(pe->p - pe->buf);
+	pe->fix[pe->numFix].kind = kind;
+	pe->fix[pe->numFix].to = to;
+	pe->numFix++;
+	put32(pe, 0);
+}
+
+static int pool_index(emitter *pe, double d)
+{
+	int i;
+
+	for (i=0; i<pe->numPool; i++) {
+		if (memcmp(&pe->pool[i], &d, sizeof(double)) == 0) return(i);
+	}
+	if (pe->numPool >= MAX_POOL) {
+		pe->bad = 1;
+		return(0);
+	}
+	pe->pool[pe->numPool] = d;
+	return(pe->numPool++);
+}
+
+/* modrm (and sib and displacement) of [rip+disp32] for pool entry i */
+static void put_pool(emitter *pe, int x, int i)
+{
+	put(pe, 0x05 | (x << 3));
+	put_fix(pe, FIX_POOL, i);
+}
+
+/* SSE2 instruction with xmm register x and operand o of the register program.
+ * Arguments are addressed from rbx, VAL from r12, registers from rsp, and
+ * constants from the pool that follows the code.
+ */
+static void sse_opnd(emitter *pe, int prefix, int opcode, int x, int o)
+{
+	int i = SCALC_REG_INDEX(o), numConst = pe->prog[1];
+	double d;
+
+	put(pe, prefix);
+	if (SCALC_REG_KIND(o) == SCALC_REG_VAL) put(pe, 0x41);
+	put(pe, 0x0f);
+	put(pe, opcode);
+	switch (SCALC_REG_KIND(o)) {
+	case SCALC_REG_ARG:
+		put(pe, 0x83 | (x << 3));
+		put32(pe, 8*i);
+		break;
+	case SCALC_REG_VAL:
+		put(pe, 0x84 | (x << 3));
+		put(pe, 0x24);
+		put32(pe, 0);
+		break;
+	case SCALC_REG_INT:
+		put_pool(pe, x, pool_index(pe, (double)i));
+		break;
+	default:
+		if (i >= SCALC_REG_NUM - numConst) {
+			memcpy((void *)&d, pe->prog+3+(i-(SCALC_REG_NUM-numConst))*sizeof(double),
+				sizeof(double));
+			put_pool(pe, x, pool_index(pe, d));
+		} else {
+			put(pe, 0x84 | (x << 3));
+			put(pe, 0x24);
+			put32(pe, 8*i);
+		}
+	}
+}
+
+static void sse_const(emitter *pe, int prefix, int opcode, int x, double d)
+{
+	put(pe, prefix);
+	put(pe, 0x0f);
+	put(pe, opcode);
+	put_pool(pe, x, pool_index(pe, d));
+}
+
+static void sse_reg(emitter *pe, int prefix, int opcode, int x, int y)
+{
+	put(pe, prefix);
+	put(pe, 0x0f);
+	put(pe, opcode);
+	put(pe, 0xc0 | (x << 3) | y);
+}
+
+#define LOAD(pe, x, o)		sse_opnd(pe, 0xf2, 0x10, x, o)	/* movsd xmmx, o */
+#define STORE(pe, o)		sse_opnd(pe, 0xf2, 0x11, 0, o)	/* movsd o, xmm0 */
+#define RESULT(pe, pc)		STORE(pe, (pc)[1])
+
+static void jcc8(emitter *pe, int cc, int skip)
+{
+	put(pe, 0x70 | cc);
+	put(pe, skip);
+}
+
+static void jcc32(emitter *pe, int cc, int kind, int to)
+{
+	put(pe, 0x0f);
+	put(pe, 0x80 | cc);
+	put_fix(pe, kind, to);
+}
+
+static void setcc(emitter *pe, int cc, int r)
+{
+	put(pe, 0x0f);
+	put(pe, 0x90 | cc);
+	put(pe, 0xc0 | r);
+}
+
+/* xmm0 = (al != 0) */
+static void bool_result(emitter *pe)
+{
+	put(pe, 0x0f); put(pe, 0xb6); put(pe, 0xc0);	/* movzx eax, al */
+	sse_reg(pe, 0xf2, 0x2a, 0, 0);					/* cvtsi2sd xmm0, eax */
+}
+
+/* r = (xmm0 != 0.), as C has it */
+static void nonzero(emitter *pe, int r)
+{
+	sse_const(pe, 0x66, 0x2e, 0, 0.);			/* ucomisd xmm0, 0. */
+	setcc(pe, CC_NE, r);
+	setcc(pe, CC_P, CL);
+	put(pe, 0x08); put(pe, 0xc8 | r);			/* or r, cl */
+}
+
+/* xmm0 = fabs(a - b) */
+static void abs_diff(emitter *pe, int a, int b)
+{
+	static const unsigned char maskBytes[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f};
+	double mask;
+
+	memcpy((void *)&mask, maskBytes, sizeof(double));
+	LOAD(pe, 0, a);
+	sse_opnd(pe, 0xf2, 0x5c, 0, b);			/* subsd xmm0, b */
+	sse_const(pe, 0xf2, 0x10, 1, mask);		/* movsd xmm1, mask */
+	sse_reg(pe, 0x66, 0x54, 0, 1);			/* andpd xmm0, xmm1 */
+}
+
+/* xmm0 = -xmm0 (12 bytes) */
+static void negate(emitter *pe)
+{
+	sse_const(pe, 0xf2, 0x10, 1, -0.);		/* movsd xmm1, -0. */
+	sse_reg(pe, 0x66, 0x57, 0, 1);			/* xorpd xmm0, xmm1 */
+}
+
+static void call(emitter *pe, unsigned long addr)
+{
+	int i;
+
+	put(pe, 0x48); put(pe, 0xb8);			/* mov rax, addr */
+	for (i=0; i<8; i++) put(pe, (addr >> (8*i)) & 0xff);
+	put(pe, 0xff); put(pe, 0xd0);			/* call rax */
+}
+
+static void epilogue(emitter *pe)
+{
+	put(pe, 0x48); put(pe, 0x81); put(pe, 0xc4); put32(pe, FRAME);	/* add rsp, FRAME */
+	put(pe, 0x41); put(pe, 0x5c);			/* pop r12 */
+	put(pe, 0x5b);							/* pop rbx */
+	put(pe, 0xc3);							/* ret */
+}
+
+static unsigned long math_function(int op)
+{
+	double (*f)(double);
+
+	switch (op) {
+	case EXP:	f = exp;	break;
+	case LOG_10:f = log10;	break;
+	case LOG_E:	f = log;	break;
+	case ACOS:	f = acos;	break;
+	case ASIN:	f = asin;	break;
+	case ATAN:	f = atan;	break;
+	case COS:	f = cos;	break;
+	case COSH:	f = cosh;	break;
+	case SIN:	f = sin;	break;
+	case SINH:	f = sinh;	break;
+	case TAN:	f = tan;	break;
+	case TANH:	f = tanh;	break;
+	case CEIL:	f = ceil;	break;
+	case FLOOR:	f = floor;	break;
+	default:	return(0);
+	}
+	return((unsigned long)f);
+}
+
+/* Emit the instruction at pc */
+static void emit(emitter *pe, const unsigned char *pc)
+{
+	double (*f2)(double, double);
+	int op = *pc;
+
+	if ((op >= STORE_A) && (op <= STORE_P)) {
+		LOAD(pe, 0, pc[1]);
+		STORE(pe, SCALC_REG_ARG | (op - STORE_A));
+		return;
+	}
+	switch (op) {
+	case R_MOVE:
+		LOAD(pe, 0, pc[2]);
+		RESULT(pe, pc);
+		break;
+
+	case ADD: case SUB: case MULT:
+		LOAD(pe, 0, pc[2]);
+		sse_opnd(pe, 0xf2, (op == ADD) ? 0x58 : (op == SUB) ? 0x5c : 0x59, 0, pc[3]);
+		RESULT(pe, pc);
+		break;
+	case DIV:
+		LOAD(pe, 0, pc[2]);
+		LOAD(pe, 1, pc[3]);
+		sse_const(pe, 0x66, 0x2e, 1, 0.);	/* ucomisd xmm1, 0. */
+		jcc8(pe, CC_P, 6);
+		jcc32(pe, CC_E, FIX_FAIL, 0);
+		sse_reg(pe, 0xf2, 0x5e, 0, 1);		/* divsd xmm0, xmm1 */
+		RESULT(pe, pc);
+		break;
+	case POWER: case ATAN2:
+		/* sCalc's ATAN2(a,b) is atan2(b,a) */
+		LOAD(pe, 0, pc[(op == POWER) ? 2 : 3]);
+		LOAD(pe, 1, pc[(op == POWER) ? 3 : 2]);
+		f2 = (op == POWER) ? pow : atan2;
+		call(pe, (unsigned long)f2);
+		RESULT(pe, pc);
+		break;
+
+	case GR_THAN: case LESS_THAN:
+		/* (a - b) > SMALL, or (b - a) > SMALL */
+		LOAD(pe, 0, pc[(op == GR_THAN) ? 2 : 3]);
+		sse_opnd(pe, 0xf2, 0x5c, 0, pc[(op == GR_THAN) ? 3 : 2]);
+		sse_const(pe, 0x66, 0x2f, 0, SMALL);	/* comisd xmm0, SMALL */
+		setcc(pe, CC_A, AL);
+		bool_result(pe);
+		RESULT(pe, pc);
+		break;
+	case NOT_EQ:
+		abs_diff(pe, pc[2], pc[3]);
+		sse_const(pe, 0x66, 0x2f, 0, SMALL);	/* comisd xmm0, SMALL */
+		setcc(pe, CC_A, AL);
+		bool_result(pe);
+		RESULT(pe, pc);
+		break;
+	case EQUAL: case GR_OR_EQ: case LESS_OR_EQ:
+		abs_diff(pe, pc[2], pc[3]);
+		sse_const(pe, 0xf2, 0x10, 1, SMALL);	/* movsd xmm1, SMALL */
+		sse_reg(pe, 0x66, 0x2f, 1, 0);			/* comisd xmm1, xmm0 */
+		setcc(pe, CC_A, (op == EQUAL) ? AL : DL);
+		if (op != EQUAL) {
+			/* || (a > b), or || (b > a) */
+			LOAD(pe, 0, pc[(op == GR_OR_EQ) ? 2 : 3]);
+			sse_opnd(pe, 0x66, 0x2f, 0, pc[(op == GR_OR_EQ) ? 3 : 2]);
+			setcc(pe, CC_A, AL);
+			put(pe, 0x08); put(pe, 0xd0);		/* or al, dl */
+		}
+		bool_result(pe);
+		RESULT(pe, pc);
+		break;
+
+	case REL_OR: case REL_AND:
+		LOAD(pe, 0, pc[2]);
+		nonzero(pe, AL);
+		LOAD(pe, 0, pc[3]);
+		nonzero(pe, DL);
+		put(pe, (op == REL_OR) ? 0x08 : 0x20); put(pe, 0xd0);	/* or/and al, dl */
+		bool_result(pe);
+		RESULT(pe, pc);
+		break;
+	case REL_NOT:
+		LOAD(pe, 0, pc[2]);
+		sse_const(pe, 0x66, 0x2e, 0, 0.);		/* ucomisd xmm0, 0. */
+		setcc(pe, CC_E, AL);
+		setcc(pe, CC_NP, CL);
+		put(pe, 0x20); put(pe, 0xc8);			/* and al, cl */
+		bool_result(pe);
+		RESULT(pe, pc);
+		break;
+
+	case MAX_VAL: case MIN_VAL:
+		/* (a < b) ? b : a, or (a > b) ? b : a */
+		LOAD(pe, 0, pc[2]);
+		LOAD(pe, 1, pc[3]);
+		if (op == MAX_VAL) sse_reg(pe, 0x66, 0x2f, 1, 0);	/* comisd xmm1, xmm0 */
+		else sse_reg(pe, 0x66, 0x2f, 0, 1);					/* comisd xmm0, xmm1 */
+		jcc8(pe, CC_BE, 4);
+		sse_reg(pe, 0x66, 0x28, 0, 1);			/* movapd xmm0, xmm1 */
+		RESULT(pe, pc);
+		break;
+
+	case UNARY_NEG:
+		/* C compilers multiply by -1 by flipping the sign, even of a NaN */
+		LOAD(pe, 0, pc[2]);
+		negate(pe);
+		RESULT(pe, pc);
+		break;
+	case ABS_VAL:
+		LOAD(pe, 0, pc[2]);
+		sse_const(pe, 0x66, 0x2f, 0, 0.);		/* comisd xmm0, 0. */
+		jcc8(pe, CC_P, 14);
+		jcc8(pe, CC_AE, 12);
+		negate(pe);
+		RESULT(pe, pc);
+		break;
+	case SQU_RT: case LOG_10: case LOG_E:
+		/* negative arguments are errors */
+		LOAD(pe, 0, pc[2]);
+		sse_const(pe, 0x66, 0x2f, 0, 0.);		/* comisd xmm0, 0. */
+		jcc8(pe, CC_P, 6);
+		jcc32(pe, CC_B, FIX_FAIL, 0);
+		if (op == SQU_RT) sse_reg(pe, 0xf2, 0x51, 0, 0);	/* sqrtsd xmm0, xmm0 */
+		else call(pe, math_function(op));
+		RESULT(pe, pc);
+		break;
+	case EXP: case ACOS: case ASIN: case ATAN: case COS: case COSH: case SIN: case SINH:
+	case TAN: case TANH: case CEIL: case FLOOR:
+		LOAD(pe, 0, pc[2]);
+		call(pe, math_function(op));
+		RESULT(pe, pc);
+		break;
+
+	case COND_IF:
+		LOAD(pe, 0, pc[1]);
+		sse_const(pe, 0x66, 0x2e, 0, 0.);		/* ucomisd xmm0, 0. */
+		jcc8(pe, CC_P, 6);
+		jcc32(pe, CC_E, FIX_JUMP, pc[2] | (pc[3] << 8));
+		break;
+	case COND_ELSE:
+		put(pe, 0xe9);							/* jmp */
+		put_fix(pe, FIX_JUMP, pc[1] | (pc[2] << 8));
+		break;
+
+	case END_EXPRESSION:
+		LOAD(pe, 0, pc[1]);
+		STORE(pe, SCALC_REG_VAL);
+		put(pe, 0x31); put(pe, 0xc0);			/* xor eax, eax */
+		epilogue(pe);
+		break;
+
+	default:
+		pe->bad = 1;
+	}
+}
+
+static int supported(int op)
+{
+	if ((op >= STORE_A) && (op <= STORE_P)) return(1);
+	switch (op) {
+	case R_MOVE: case ADD: case SUB: case MULT: case DIV: case POWER: case ATAN2:
+	case GR_THAN: case LESS_THAN: case NOT_EQ: case EQUAL: case GR_OR_EQ: case LESS_OR_EQ:
+	case REL_OR: case REL_AND: case REL_NOT: case MAX_VAL: case MIN_VAL:
+	case UNARY_NEG: case ABS_VAL: case SQU_RT: case LOG_10: case LOG_E:
+	case EXP: case ACOS: case ASIN: case ATAN: case COS: case COSH: case SIN: case SINH:
+	case TAN: case TANH: case CEIL: case FLOOR:
+	case COND_IF: case COND_ELSE: case END_EXPRESSION:
+		return(1);
+	}
+	return(0);
+}
+
+/*** begin executable memory ***/
+
+/* Translations are packed into arenas of executable memory.  An arena is a shared
+ * memory object mapped twice: code is written through a writable view, and run
+ * through an executable one, so no page is ever both writable and executable, and
+ * no page's protection changes while code on it may be running.  An arena hands
+ * out space GRANULE bytes at a time, and is unmapped when the last translation in
+ * it is freed.  A translation too large for an arena, or any translation if the
+ * system can't map memory twice, gets pages of its own, made executable after the
+ * code is copied.  All of this is protected by nativeLock.
+ */
+#define GRANULE		64
+#define ARENA_SIZE	(64*1024)
+
+typedef struct codeArena {
+	struct codeArena *next;
+	unsigned char *rw;		/* writable view, or NULL if the pages hold one translation */
+	unsigned char *rx;		/* executable view */
+	size_t size;
+	int live;				/* translations in the arena */
+	unsigned char used[ARENA_SIZE/GRANULE];	/* nonzero if the granule is in use */
+} codeArena;
+
+static codeArena *arenas;
+static int noSharedArenas;	/* the system wouldn't map memory twice */
+
+/* Map size bytes of new shared memory twice, writable and executable */
+static int map_twice(size_t size, unsigned char **prw, unsigned char **prx)
+{
+	void *rw, *rx;
+	int fd;
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+	fd = (int)syscall(SYS_memfd_create, "sCalcNative", 0);
+#elif defined(__FreeBSD__)
+	fd = shm_open(SHM_ANON, O_RDWR, 0600);
+#else
+	fd = -1;
+#endif
+	if (fd < 0) return(-1);
+	if (ftruncate(fd, (off_t)size)) {
+		close(fd);
+		return(-1);
+	}
+	rw = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	rx = mmap(NULL, size, PROT_READ|PROT_EXEC, MAP_SHARED, fd, 0);
+	close(fd);
+	if ((rw == MAP_FAILED) || (rx == MAP_FAILED)) {
+		if (rw != MAP_FAILED) munmap(rw, size);
+		if (rx != MAP_FAILED) munmap(rx, size);
+		return(-1);
+	}
+	*prw = (unsigned char *)rw;
+	*prx = (unsigned char *)rx;
+	return(0);
+}
+
+/* Put code at granules first..first+n-1 of arena pa */
+static void *arena_put(codeArena *pa, int first, int n, const unsigned char *code, size_t len)
+{
+	memset(&pa->used[first], 1, n);
+	memcpy(pa->rw + first*GRANULE, code, len);
+	pa->live++;
+	return(pa->rx + first*GRANULE);
+}
+
+/* Copy len bytes of code to memory that may be executed */
+static void *code_alloc(const unsigned char *code, size_t len)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int n = (int)((len + GRANULE - 1) / GRANULE);
+	int i, j;
+	codeArena *pa;
+	void *p;
+
+	if (!noSharedArenas && (len <= ARENA_SIZE)) {
+		for (pa = arenas; pa; pa = pa->next) {
+			if (pa->rw == NULL) continue;
+			/* first fit */
+			for (i=0; i+n <= ARENA_SIZE/GRANULE; i=j+1) {
+				for (j=i; (j < i+n) && !pa->used[j]; j++)
+					;
+				if (j == i+n) return(arena_put(pa, i, n, code, len));
+			}
+		}
+		pa = (codeArena *)calloc(1, sizeof(codeArena));
+		if (pa == NULL) return(NULL);
+		if (map_twice(ARENA_SIZE, &pa->rw, &pa->rx) == 0) {
+			pa->size = ARENA_SIZE;
+			pa->next = arenas;
+			arenas = pa;
+			return(arena_put(pa, 0, n, code, len));
+		}
+		free(pa);
+		noSharedArenas = 1;
+	}
+
+	/* pages of its own */
+	pa = (codeArena *)calloc(1, sizeof(codeArena));
+	if (pa == NULL) return(NULL);
+	pa->size = (len + page - 1) / page * page;
+	p = mmap(NULL, pa->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		free(pa);
+		return(NULL);
+	}
+	memcpy(p, code, len);
+	if (mprotect(p, pa->size, PROT_READ|PROT_EXEC)) {
+		munmap(p, pa->size);
+		free(pa);
+		return(NULL);
+	}
+	pa->rx = (unsigned char *)p;
+	pa->live = 1;
+	pa->next = arenas;
+	arenas = pa;
+	return(p);
+}
+
+/* Free the len bytes of code at p, from code_alloc() */
+static void code_free(void *p, size_t len)
+{
+	unsigned char *pc = (unsigned char *)p;
+	codeArena *pa, **ppa;
+
+	for (ppa = &arenas; (pa = *ppa) != NULL; ppa = &pa->next) {
+		if ((pc >= pa->rx) && (pc < pa->rx + pa->size)) break;
+	}
+	if (pa == NULL) return;
+	if (pa->rw) memset(&pa->used[(pc - pa->rx)/GRANULE], 0, (len + GRANULE - 1) / GRANULE);
+	if (--pa->live > 0) return;
+	*ppa = pa->next;
+	if (pa->rw) munmap(pa->rw, pa->size);
+	munmap(pa->rx, pa->size);
+	free(pa);
+}
+
+/*** end executable memory ***/
+
+/* Compile the code of a register program of codeLen bytes, and set *plen to the
+ * size of the machine code.  Caller holds nativeLock.
+ */
+static void *translate(const unsigned char *prog, int codeLen, size_t *plen)
+{
+	const unsigned char *code = SCALC_REG_CODE(prog), *pc;
+	emitter e;
+	int *map, poolAt, failAt, target;
+	void *p = NULL;
+
+	memset(&e, 0, sizeof(emitter));
+	e.prog = prog;
+	e.maxFix = 2*codeLen;
+	e.fix = calloc(e.maxFix, sizeof(*e.fix));
+	e.buf = e.p = (unsigned char *)malloc(64*codeLen + MAX_POOL*sizeof(double) + 64);
+	e.end = e.buf + 64*codeLen;
+	map = (int *)calloc(codeLen, sizeof(int));
+	if (!e.fix || !e.buf || !map) goto done;
+
+	put(&e, 0x53);								/* push rbx */
+	put(&e, 0x41); put(&e, 0x54);				/* push r12 */
+	put(&e, 0x48); put(&e, 0x81); put(&e, 0xec); put32(&e, FRAME);	/* sub rsp, FRAME */
+	put(&e, 0x48); put(&e, 0x89); put(&e, 0xfb);	/* mov rbx, rdi */
+	put(&e, 0x49); put(&e, 0x89); put(&e, 0xf4);	/* mov r12, rsi */
+	for (pc = code; pc < code + codeLen; pc += sCalcRegLength(pc)) {
+		map[pc - code] = (int)(e.p - e.buf);
+		emit(&e, pc);
+	}
+	failAt = (int)(e.p - e.buf);
+	put(&e, 0xb8); put32(&e, -1);				/* fail: mov eax, -1 */
+	epilogue(&e);
+
+	/* the pool follows the code, aligned */
+	while ((e.p - e.buf) % sizeof(double)) put(&e, 0xcc);
+	if (e.bad) goto done;
+	poolAt = (int)(e.p - e.buf);
+	memcpy(e.p, e.pool, e.numPool*sizeof(double));
+	e.p += e.numPool*sizeof(double);
+
+	for (e.numFix--; e.numFix >= 0; e.numFix--) {
+		switch (e.fix[e.numFix].kind) {
+		case FIX_POOL:
+			target = poolAt + e.fix[e.numFix].to*sizeof(double);
+			break;
+		case FIX_JUMP:
+			if ((e.fix[e.numFix].to >= codeLen) || (map[e.fix[e.numFix].to] <= 0)) goto done;
+			target = map[e.fix[e.numFix].to];
+			break;
+		default:
+			target = failAt;
+		}
+		target -= e.fix[e.numFix].at + 4;
+		e.buf[e.fix[e.numFix].at] = target & 0xff;
+		e.buf[e.fix[e.numFix].at+1] = (target >> 8) & 0xff;
+		e.buf[e.fix[e.numFix].at+2] = (target >> 16) & 0xff;
+		e.buf[e.fix[e.numFix].at+3] = (target >> 24) & 0xff;
+	}
+	*plen = e.p - e.buf;
+	p = code_alloc(e.buf, *plen);
+
+done:
+	free(e.fix);
+	free(e.buf);
+	free(map);
+	return(p);
+}
+
+/* Bytes of register program at prog, which must be supported; sets *phash */
+static int prog_length(const unsigned char *prog, unsigned long *phash)
+{
+	const unsigned char *pc;
+	unsigned long hash = 2166136261UL;
+	int i, len;
+
+	for (pc = SCALC_REG_CODE(prog); *pc != END_EXPRESSION; pc += sCalcRegLength(pc))
+		;
+	pc += sCalcRegLength(pc);
+	len = (int)(pc - prog);
+	for (i=0; i<len; i++) hash = ((hash ^ prog[i]) * 16777619UL) & 0xffffffffUL;
+	*phash = hash;
+	return(len);
+}
+
+/* sCalcNativeCompile
+ *
+ * Compile the register program at prog to machine code, or find it already
+ * compiled.  Returns 0, and sets *pfunc, if it could be.  Each success must be
+ * matched by a call to sCalcNativeRelease().
+ */
+int sCalcNativeCompile(const unsigned char *prog, sCalcNativeFunc *pfunc)
+{
+	const unsigned char *code = SCALC_REG_CODE(prog), *pc;
+	nativeEntry *pn;
+	unsigned long hash;
+	size_t codeLen;
+	void *p;
+	int len;
+
+	if (*prog != REG_PROGRAM) return(-1);
+	for (pc = code; *pc != END_EXPRESSION; pc += sCalcRegLength(pc)) {
+		if (!supported(*pc)) return(-1);
+	}
+	pc += sCalcRegLength(pc);
+	len = prog_length(prog, &hash);
+
+	epicsThreadOnce(&nativeOnce, nativeInit, NULL);
+	epicsMutexMustLock(nativeLock);
+	for (pn = buckets[hash & (NUM_BUCKETS-1)]; pn; pn = pn->next) {
+		if ((pn->len == len) && (memcmp(pn->prog, prog, len) == 0)) break;
+	}
+	if (pn == NULL) {
+		pn = (nativeEntry *)malloc(sizeof(nativeEntry) + len);
+		p = pn ? translate(prog, (int)(pc - code), &codeLen) : NULL;
+		if (p == NULL) {
+			epicsMutexUnlock(nativeLock);
+			free(pn);
+			return(-1);
+		}
+		/* a data pointer to code, as dlsym() has it */
+		*(void **)(&pn->func) = p;
+		pn->codeLen = codeLen;
+		pn->refs = 0;
+		pn->len = len;
+		memcpy(pn->prog, prog, len);
+		pn->next = buckets[hash & (NUM_BUCKETS-1)];
+		buckets[hash & (NUM_BUCKETS-1)] = pn;
+	}
+	pn->refs++;
+	*pfunc = pn->func;
+	epicsMutexUnlock(nativeLock);
+	return(0);
+}
+
+/* sCalcNativeRelease
+ *
+ * If postfix is REG_NATIVE, drop its reference to its machine code, which is
+ * freed when no postfix refers to it.  The postfix must not be evaluated again.
+ */
+void sCalcNativeRelease(const unsigned char *postfix)
+{
+	const unsigned char *prog;
+	nativeEntry *pn, **ppn;
+	unsigned long hash;
+	int len;
+
+	if (*postfix != REG_NATIVE) return;
+	prog = SCALC_NATIVE_PROGRAM(postfix);
+	len = prog_length(prog, &hash);
+
+	epicsThreadOnce(&nativeOnce, nativeInit, NULL);
+	epicsMutexMustLock(nativeLock);
+	for (ppn = &buckets[hash & (NUM_BUCKETS-1)]; (pn = *ppn) != NULL; ppn = &pn->next) {
+		if ((pn->len == len) && (memcmp(pn->prog, prog, len) == 0)) break;
+	}
+	if (pn && (--pn->refs <= 0)) {
+		*ppn = pn->next;
+		code_free(*(void **)(&pn->func), pn->codeLen);
+		free(pn);
+	}
+	epicsMutexUnlock(nativeLock);
+}
+
+#endif /* NATIVE_X86_64 */
@@ -27,13 +27,20 @@
 #include	"cvtFast.h"
 #include	"epicsString.h"
 #include	"epicsStdio.h"	/* for  epicsSnprintf() */
+#include	"epicsStdlib.h"	/* for epicsStrtod() */
 
 #define epicsExportSharedSymbols
 #include	"sCalcPostfix.h"
 #include	"sCalcPostfixPvt.h"
+#include	"calcRandom.h"
+#include	"calcChecksum.h"
+#include <epicsMutex.h>
+#include <epicsThread.h>
 #include <epicsExport.h>
 
-static double	local_random();
+typedef struct strArena strArena;
+static calcRandomState *thread_random(void);
+static strArena *thread_arena(void);
 static int cond_search(const unsigned char **ppinst, int match);
 
 #define myNINT(a) ((int)((a) >= 0 ? (a)+0.5 : (a)-0.5))
@@ -43,6 +50,7 @@ static int cond_search(const unsigned char **ppinst, int match);
 #define myMAX(a,b) (a)>(b)?(a):(b)
 #define myMIN(a,b) (a)<(b)?(a):(b)
 #define SMALL 1.e-11
+#define TMPSTR_SIZE 1000
 
 #define DEBUG 1
 #define INIT_STACK 1
@@ -79,19 +87,262 @@ epicsExportAddress(int, sCalcStackLW);
 #define toDouble(ps) {if (isString(ps)) to_double(ps);}
 
 /* convert string-valued stack element to double */
-#define to_double(ps) {(ps)->d = atof((ps)->s);	(ps)->s = NULL;}
+#define to_double(ps) {(ps)->d = fast_strtod((ps)->s, NULL);	(ps)->s = NULL;}
 
 /* convert stack element of unknown type to string */
 #define toString(ps) {if (isDouble(ps)) to_string(ps);}
 
 /* convert double-valued stack element to string */
+#define to_string(ps) {if (num_to_string(pa, ps)) return(-1);}
+
+/*
+ * Strings built during an evaluation come from a bump allocator.  Each thread
+ * has an arena, whose first block is reused by every evaluation.  If an
+ * evaluation needs more, blocks are malloc'd, and they're freed when the
+ * thread's next evaluation begins.  Nothing on the stack is ever written in
+ * place: an operator that changes a string builds a new one.
+ */
+#define ARENA_SIZE 2048			/* bytes in a thread's first block */
+#define ARENA_MAX (256*1024)	/* most bytes one evaluation may take */
+
+typedef struct arenaBlock {
+	struct arenaBlock *next;
+} arenaBlock;	/* followed by the block's bytes */
+
+struct strArena {
+	char *next, *end;	/* unused part of the current block */
+	arenaBlock *extra;	/* blocks malloc'd by this evaluation */
+	int used;			/* bytes in extra blocks */
+	char *numS;			/* numD, already converted to a string, or NULL */
+	int numLen;
+	double numD;
+	char first[ARENA_SIZE];
+};
+
+static void arena_reset(strArena *pa)
+{
+	arenaBlock *pb;
+
+	while ((pb = pa->extra)) {
+		pa->extra = pb->next;
+		free(pb);
+	}
+	pa->used = 0;
+	pa->numS = NULL;
+	pa->next = pa->first;
+	pa->end = pa->first + ARENA_SIZE;
+}
+
+static char *arena_alloc(strArena *pa, int n)
+{
+	arenaBlock *pb;
+	char *s;
+	int size;
+
+	if (n > pa->end - pa->next) {
+		size = myMAX(n, ARENA_SIZE);
+		if (pa->used + size > ARENA_MAX) {
+			if (sCalcPerformDebug) printf("sCalcPerform: string arena full\n");
+			return(NULL);
+		}
+		pb = (arenaBlock *)malloc(sizeof(arenaBlock) + size);
+		if (pb == NULL) return(NULL);
+		pb->next = pa->extra;
+		pa->extra = pb;
+		pa->used += size;
+		pa->next = (char *)(pb+1);
+		pa->end = pa->next + size;
+	}
+	s = pa->next;
+	pa->next += n;
+	return(s);
+}
+
+/* Make ps a new, null-terminated string of length len, and return it, or NULL. */
+static char *new_string(strArena *pa, struct stackElement *ps, int len)
+{
+	char *s = arena_alloc(pa, len+1);
+
+	if (s == NULL) return(NULL);
+	s[len] = '\0';
+	ps->s = s;
+	ps->len = len;
+	ps->plan = NULL;
+	return(s);
+}
+
+/* Make ps a copy of the first len characters of s */
+static int copy_string(strArena *pa, struct stackElement *ps, const char *s, int len)
+{
+	char *s1 = new_string(pa, ps, len);
+
+	if (s1 == NULL) return(-1);
+	memcpy(s1, s, len);
+	return(0);
+}
+
+/* Make ps a new string: ps followed by the first len characters of s */
+static int append_string(strArena *pa, struct stackElement *ps, const char *s, int len)
+{
+	char *s0 = ps->s, *s1;
+	int len0 = ps->len;
+
+	if ((s1 = new_string(pa, ps, len0 + len)) == NULL) return(-1);
+	memcpy(s1, s0, len0);
+	memcpy(s1 + len0, s, len);
+	return(0);
+}
+
+/* Make ps a view of a caller's string, which may fill its SCALC_STRING_SIZE buffer */
+static int fetch_string(strArena *pa, struct stackElement *ps, char *s)
+{
+	int len;
+
+	if (s == NULL) s = "";
+	for (len=0; len < SCALC_STRING_SIZE && s[len]; len++)
+		;
+	if (len == SCALC_STRING_SIZE) return(copy_string(pa, ps, s, len-1));
+	ps->s = s;
+	ps->len = len;
+	ps->plan = NULL;
+	return(0);
+}
+
+/* A caller's string s is about to be overwritten.  Stack elements from bottom
+ * to ps that are views of it get copies of their own.
+ */
+static int unshare_string(strArena *pa, struct stackElement *bottom,
+	struct stackElement *ps, const char *s)
+{
+	for (; bottom <= ps; bottom++) {
+		if (bottom->s && (bottom->s >= s) && (bottom->s < s+SCALC_STRING_SIZE)) {
+			if (copy_string(pa, bottom, bottom->s, bottom->len)) return(-1);
+		}
+	}
+	return(0);
+}
+
 /* Note cvtDoubleToString(x, x, prec)  results in (slow) sprintf call if prec > 8 */
-#define to_string(ps) {									\
-	(ps)->s = &((ps)->local_string[0]);					\
-	if (isnan((ps)->d))									\
-		strcpy((ps)->s,"NaN");							\
-	else												\
-		(void)cvtDoubleToString((ps)->d, (ps)->s, 8);	\
+static int num_to_string(strArena *pa, struct stackElement *ps)
+{
+	char *s;
+	int len;
+
+	/* Strings are never changed in place, so the last conversion can be reused */
+	if (pa->numS && (memcmp(&pa->numD, &ps->d, sizeof(double)) == 0)) {
+		ps->s = pa->numS;
+		ps->len = pa->numLen;
+		ps->plan = NULL;
+		return(0);
+	}
+	/* convert directly into the arena, and give back what the string didn't use */
+	if ((s = arena_alloc(pa, SCALC_STRING_SIZE)) == NULL) return(-1);
+	if (isnan(ps->d)) {
+		strcpy(s, "NaN");
+		len = 3;
+	} else {
+		len = cvtDoubleToString(ps->d, s, 8);
+	}
+	pa->next = s + len + 1;
+	pa->numD = ps->d;
+	pa->numS = ps->s = s;
+	pa->numLen = ps->len = len;
+	ps->plan = NULL;
+	return(0);
+}
+
+/* Find the first occurrence of the n characters at pat in the len characters at s,
+ * and return a pointer to it, or NULL.  memchr() skips to each candidate for the
+ * pattern's first character, and memcmp() checks the rest.  Lengths are known,
+ * so neither string is scanned for its null.
+ */
+static char *find_string(const char *s, int len, const char *pat, int n)
+{
+	const char *p, *last;
+
+	if (n == 0) return((char *)s);
+	if (n > len) return(NULL);
+	for (p = s, last = s + len - n; p <= last; p++) {
+		if ((p = (const char *)memchr(p, pat[0], last - p + 1)) == NULL) break;
+		if (memcmp(p + 1, pat + 1, n - 1) == 0) return((char *)p);
+	}
+	return(NULL);
+}
+
+/* Find the last occurrence of the n characters at pat in the len characters at s */
+static char *find_last_string(const char *s, int len, const char *pat, int n)
+{
+	const char *p;
+
+	if (n == 0) return((char *)s + len);
+	if (n > len) return(NULL);
+	for (p = s + len - n; p >= s; p--) {
+		if ((*p == pat[0]) && (memcmp(p + 1, pat + 1, n - 1) == 0)) return((char *)p);
+	}
+	return(NULL);
+}
+
+/* Exact powers of ten, for fast_strtod() */
+static const double exactPow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Convert a string to a double, as strtod() would.  A decimal number of up to
+ * 15 significant digits, whose exponent is small enough that the digits times
+ * a power of ten is correctly rounded, is converted here (Clinger's fast path).
+ * Anything else (hex, inf, nan, long mantissas, big exponents) is handed to
+ * epicsStrtod().
+ */
+static double fast_strtod(const char *str, char **pend)
+{
+	const char *s = str;
+	double m = 0;
+	int neg = 0, ndig = 0, nsig = 0, exp10 = 0, e, eneg;
+
+	while (isspace((int)(unsigned char)*s)) s++;
+	if ((*s == '-') || (*s == '+')) neg = (*s++ == '-');
+	for (; isdigit((int)(unsigned char)*s); s++, ndig++) {
+		if ((m == 0) && (*s == '0')) continue;
+		if (++nsig > 15) return(epicsStrtod(str, pend));
+		m = m*10 + (*s - '0');
+	}
+	if (*s == '.') {
+		for (s++; isdigit((int)(unsigned char)*s); s++, ndig++) {
+			exp10--;
+			if ((m == 0) && (*s == '0')) continue;
+			if (++nsig > 15) return(epicsStrtod(str, pend));
+			m = m*10 + (*s - '0');
+		}
+	}
+	/* no digits, or a hex prefix */
+	if ((ndig == 0) || (*s == 'x') || (*s == 'X')) return(epicsStrtod(str, pend));
+	if (((*s == 'e') || (*s == 'E')) &&
+			(isdigit((int)(unsigned char)s[1]) ||
+			(((s[1] == '-') || (s[1] == '+')) && isdigit((int)(unsigned char)s[2])))) {
+		s++;
+		eneg = 0;
+		if ((*s == '-') || (*s == '+')) eneg = (*s++ == '-');
+		for (e=0; isdigit((int)(unsigned char)*s); s++) {
+			if (e > 1000) return(epicsStrtod(str, pend));
+			e = e*10 + (*s - '0');
+		}
+		exp10 += eneg ? -e : e;
+	}
+	if (m == 0) {
+		/* zero, whatever the exponent */
+	} else if ((exp10 >= 0) && (exp10 <= 22)) {
+		m *= exactPow10[exp10];
+	} else if ((exp10 < 0) && (exp10 >= -22)) {
+		m /= exactPow10[-exp10];
+	} else if ((exp10 > 22) && (exp10 <= 22+15) && (m * exactPow10[exp10-22] < 9007199254740992.)) {
+		/* the digits, with some of the zeros, are still exact */
+		m = m * exactPow10[exp10-22] * 1e22;
+	} else {
+		return(epicsStrtod(str, pend));
+	}
+	if (pend) *pend = (char *)s;
+	return(neg ? -m : m);
 }
 
 /*
@@ -188,45 +439,6 @@ static char *findConversionIndicator(char *s)
 	return(retval);
 }
 
-#define POLYNOMIAL 0x0A001;
-int crc16(char *output, char *rawInput)
-{
-	int i, j, len;
-	unsigned int crc;
-	char tranInput[100];
-
-	len = dbTranslateEscape(tranInput, rawInput);
-	if (len == 0) return(-1);
-	if (sCalcPerformDebug>=5) {
-		printf("input string(len=%d): ", len);
-		for (i=0; i<len; i++) printf("0x%02x ", tranInput[i]);
-		printf("\n");
-	}
-	crc = 0xffff;
-	if (sCalcPerformDebug>=10) printf("crc=0x%04x\n", crc);
-	/* Loop through the translated input string */
-	for (i=0; i<len; i++) {
-		/* Exclusive-OR the next input byte with the low byte of the CRC */
-		/* crc = (crc&0x0ff00) | ((crc&0x0ff) ^ (unsigned int)tranInput[i]);*/
-		crc ^= (unsigned int)tranInput[i];
-		if (sCalcPerformDebug>=10) printf("crc=0x%04x\n", crc);
-		/* Loop through all 8 data bits */
-		for (j=0; j<8; j++) {
-			if (crc & 0x0001) {
-				crc >>= 1;
-				/* If the LSB is 1, XOR the polynomial mask with the CRC */
-				crc ^= POLYNOMIAL;
-			} else {
-				crc >>= 1;
-			}
-		if (sCalcPerformDebug>=10) printf("crc=0x%04x\n", crc);
-		}
-	}
-	/* put the CRC (low byte first) into the output string, escaped */
-	sprintf(output, "\\x%02x\\x%02x", crc&0xff, (crc&0xff00)>>8);
-	return(0);
-}
-
 /* try this for modbus/Ascii*/
 int hex(char c) {
 	if (isxdigit((int) c)) {
@@ -238,45 +450,308 @@ int hex(char c) {
 	return(0);
 }
 
-int lrc(char *output, char *rawInput)
+static const char hexDigits[] = "0123456789abcdef";
+
+/* Write byte b to output as "\xhh", and return a pointer past it */
+static char *put_escaped_byte(char *output, unsigned int b)
+{
+	*output++ = '\\';
+	*output++ = 'x';
+	*output++ = hexDigits[(b >> 4) & 0xf];
+	*output++ = hexDigits[b & 0xf];
+	return(output);
+}
+
+/* Compute the checksum of operator op (CRC16, CRC32, etc.) of the len characters
+ * at s, with escape sequences translated, and write it to output, escaped.
+ * Common escapes are translated as the string is checksummed, a piece at a time;
+ * if s has others, it's translated whole by dbTranslateEscape().  Return 0 if
+ * successful, or -1 if the translated string is empty.
+ */
+static int checksum(strArena *pa, int op, const char *s, int len, char *output)
+{
+	unsigned char buf[64], *pb;
+	epicsUInt16 crc16;
+	epicsUInt32 crc32 = CALC_CRC32_INIT;
+	unsigned char x8 = 0;
+	int i, n, total, whole = 0;
+
+	crc16 = ((op == CRC_CCITT) || (op == ADD_CCITT)) ? CALC_CRC_CCITT_INIT : CALC_CRC16_MODBUS_INIT;
+	for (i=0, total=0; i < len; total += n) {
+		pb = buf;
+		for (n=0; (n < (int)sizeof(buf)) && (i < len); n++) {
+			if (s[i] != '\\') {
+				buf[n] = (unsigned char)s[i++];
+			} else if (s[i+1] == '\\') {
+				buf[n] = '\\';
+				i += 2;
+			} else if ((s[i+1] == 'x') && isxdigit((int)(unsigned char)s[i+2]) &&
+					isxdigit((int)(unsigned char)s[i+3]) && !isxdigit((int)(unsigned char)s[i+4])) {
+				buf[n] = (unsigned char)(hex(s[i+2])*0x10 + hex(s[i+3]));
+				i += 4;
+			} else if ((s[i+1] == 'n') || (s[i+1] == 'r') || (s[i+1] == 't')) {
+				buf[n] = (s[i+1] == 'n') ? '\n' : (s[i+1] == 'r') ? '\r' : '\t';
+				i += 2;
+			} else {
+				break;
+			}
+		}
+		if ((n < (int)sizeof(buf)) && (i < len)) {
+			/* an escape sequence we don't translate here */
+			if ((pb = (unsigned char *)arena_alloc(pa, len+1)) == NULL) return(-1);
+			n = dbTranslateEscape((char *)pb, s);
+			crc16 = ((op == CRC_CCITT) || (op == ADD_CCITT)) ? CALC_CRC_CCITT_INIT : CALC_CRC16_MODBUS_INIT;
+			crc32 = CALC_CRC32_INIT;
+			x8 = 0;
+			total = 0;
+			whole = 1;
+		}
+		switch (op) {
+		case CRC16: case MODBUS:		crc16 = calcCrc16Modbus(crc16, pb, n); break;
+		case CRC_CCITT: case ADD_CCITT:	crc16 = calcCrcCcitt(crc16, pb, n); break;
+		case CRC32: case ADD_CRC32:		crc32 = calcCrc32(crc32, pb, n); break;
+		default:						x8 = calcXor8(x8, pb, n); break;
+		}
+		if (whole) {
+			total = n;
+			break;
+		}
+	}
+	if (total == 0) return(-1);
+
+	switch (op) {
+	case CRC16: case MODBUS:
+		/* low byte first */
+		output = put_escaped_byte(output, crc16 & 0xff);
+		output = put_escaped_byte(output, crc16 >> 8);
+		break;
+	case CRC_CCITT: case ADD_CCITT:
+		output = put_escaped_byte(output, crc16 >> 8);
+		output = put_escaped_byte(output, crc16 & 0xff);
+		break;
+	case CRC32: case ADD_CRC32:
+		for (i=0; i<4; i++, crc32 >>= 8)
+			output = put_escaped_byte(output, crc32 & 0xff);
+		break;
+	default:
+		output = put_escaped_byte(output, x8);
+		break;
+	}
+	*output = '\0';
+	return(0);
+}
+
+static int lrc(char *output, const char *rawInput, int len)
 {
 	int i;
 	unsigned int lrc;
 
-	for (i=0, lrc=0; i<strlen(rawInput)-1; i+=2) {
+	for (i=0, lrc=0; i+1 < len; i+=2) {
 		lrc += hex(rawInput[i])*0x10 + hex(rawInput[i+1]);
-		if (sCalcPerformDebug>=20) printf("lrc: adding %d\n", rawInput[i]*0x10 + rawInput[i+1]);
 	}
-	lrc &= 0xff;
-	lrc = -lrc;
+	lrc = (-lrc) & 0xff;
 	if (sCalcPerformDebug>=10) printf("lrc=0x%04x\n", lrc);
-	/* put the LRC into the output string, escaped */
-	sprintf(output, "%02X", lrc&0xff);
+	/* put the LRC into the output string */
+	output[0] = "0123456789ABCDEF"[lrc >> 4];
+	output[1] = "0123456789ABCDEF"[lrc & 0xf];
+	output[2] = '\0';
 	return(0);
 }
 
-int xor8(char *output, char *rawInput)
+/* Is the string at ps a LITERAL_FORMAT, and not just a piece of one?  Every
+ * string but LITERAL_FORMAT's has a NULL plan; the opcode that precedes the
+ * string in the postfix is checked as well.
+ */
+#define HAS_PLAN(ps) ((ps)->plan && \
+	((ps)->plan == (const unsigned char *)(ps)->s + (ps)->len + 1) && \
+	(((const unsigned char *)(ps)->s)[-1] == LITERAL_FORMAT))
+
+/* Append n characters at s, or n copies of c, to the output at pb, as far as it has room */
+#define PUT_CHARS(s, n) {int nn = (n); nn = myMIN(nn, (int)(end-pb)); if (nn > 0) {memcpy(pb, (s), nn); pb += nn;}}
+#define PUT_FILL(c, n) {int nn = (n); nn = myMIN(nn, (int)(end-pb)); if (nn > 0) {memset(pb, (c), nn); pb += nn;}}
+
+/* Print the value at ps1 into buf (TMPSTR_SIZE chars), as the format fmt, whose
+ * plan is pp, would with sprintf().  Integers and %f, when its value is well
+ * away from a rounding boundary, are formatted here; %e and %g by epicsSnprintf().
+ */
+static void format_print(const sCalcFormatPlan *pp, const char *fmt,
+	const struct stackElement *ps1, char *buf)
 {
-	int i, len;
-	unsigned int xor8;
-	char tranInput[100];
-
-	len = dbTranslateEscape(tranInput, rawInput);
-	if (len == 0) return(-1);
-	if (sCalcPerformDebug>=5) {
-		printf("input string(len=%d): ", len);
-		for (i=0; i<len; i++) printf("0x%02x ", tranInput[i]);
-		printf("\n");
+	static const char lower[] = "0123456789abcdef", upper[] = "0123456789ABCDEF";
+	char num[48], *pn = num + sizeof(num), *pb = buf, *end = buf + TMPSTR_SIZE - 1;
+	const char *body, *sign = "";
+	int bodylen, pad, i, prec;
+	unsigned long u, scale;
+	long v;
+	double d, r;
+
+	switch (pp->conv) {
+	case 'd': case 'i':
+		v = myNINT(ps1->d);
+		if (pp->flags & SCALC_FMT_SHORT) v = (short)v;
+		if (v < 0) {
+			sign = "-";
+			u = (unsigned long)(-(v+1)) + 1;
+		} else {
+			u = (unsigned long)v;
+		}
+		do {*--pn = lower[u % 10]; u /= 10;} while (u);
+		break;
+	case 'u': case 'o': case 'x': case 'X':
+		v = myNINT(ps1->d);
+		if (pp->flags & SCALC_FMT_SHORT) u = (unsigned short)v;
+		else if (pp->flags & SCALC_FMT_LONG) u = (unsigned long)v;
+		else u = (unsigned int)v;
+		i = (pp->conv == 'u') ? 10 : (pp->conv == 'o') ? 8 : 16;
+		do {*--pn = (pp->conv == 'X') ? upper[u % i] : lower[u % i]; u /= i;} while (u);
+		break;
+	case 'c':
+		*--pn = (char)myNINT(ps1->d);
+		break;
+	case 's':
+		break;
+	case 'f':
+		d = ps1->d;
+		prec = (pp->prec == SCALC_FMT_NO_PREC) ? 6 : pp->prec;
+		for (i=0, scale=1; i<prec; i++) scale *= 10;
+		r = fabs(d) * scale;
+		/* The product's error is far less than 1e-6, so unless r is that close
+		 * to a rounding boundary, rounding it rounds the exact value.
+		 */
+		if ((prec <= 9) && (r < 1.e9) && (fabs(r - floor(r) - 0.5) > 1.e-6) &&
+				!((d == 0) && (1/d < 0))) {
+			u = (unsigned long)r;
+			if (r - u > 0.5) u++;
+			for (i=0; i<prec; i++) {*--pn = lower[u % 10]; u /= 10;}
+			if (prec) *--pn = '.';
+			do {*--pn = lower[u % 10]; u /= 10;} while (u);
+			if (d < 0) sign = "-";
+			break;
+		}
+		/* fall through */
+	case 'e': case 'E': case 'g': case 'G':
+		epicsSnprintf(buf, TMPSTR_SIZE, fmt, ps1->d);
+		buf[TMPSTR_SIZE-1] = '\0';
+		return;
+	default:
+		/* format_plan() makes no other plans */
+		buf[0] = '\0';
+		return;
 	}
-	xor8 = 0;
-	/* Loop through the translated input string */
-	for (i=0; i<len; i++) {
-		xor8 ^= (unsigned int)tranInput[i];
+	if (pp->conv == 's') {
+		body = ps1->s;
+		bodylen = ps1->len;
+		if ((pp->prec != SCALC_FMT_NO_PREC) && (pp->prec < bodylen)) bodylen = pp->prec;
+	} else {
+		body = pn;
+		bodylen = (int)(num + sizeof(num) - pn);
 	}
-	if (sCalcPerformDebug>=10) printf("xor8=0x%04x\n", xor8);
-	/* put XOR8 into the output string, escaped */
-	sprintf(output, "\\x%02x", xor8&0xff);
-	return(0);
+
+	PUT_CHARS(fmt, pp->start);
+	pad = pp->width - (int)strlen(sign) - bodylen;
+	if ((pad > 0) && !(pp->flags & SCALC_FMT_LEFT)) {
+		if (pp->flags & SCALC_FMT_ZERO) {
+			PUT_CHARS(sign, (int)strlen(sign));
+			PUT_FILL('0', pad);
+		} else {
+			PUT_FILL(' ', pad);
+			PUT_CHARS(sign, (int)strlen(sign));
+		}
+	} else {
+		PUT_CHARS(sign, (int)strlen(sign));
+	}
+	PUT_CHARS(body, bodylen);
+	if ((pad > 0) && (pp->flags & SCALC_FMT_LEFT)) PUT_FILL(' ', pad);
+	PUT_CHARS(fmt + pp->end, (int)strlen(fmt + pp->end));
+	*pb = '\0';
+}
+
+/* Scan the string at ps, as the format fmt, whose plan is pp, would with sscanf(),
+ * and replace ps with the result.  Return 1 if successful, or 0 if the string
+ * doesn't match the format.  Return -1, leaving ps alone, if it's a case the plan
+ * doesn't cover (integers too long to be sure of, 0x prefixes, partial exponents,
+ * and the like), which sscanf() must handle.
+ */
+static int format_scan(strArena *pa, const sCalcFormatPlan *pp, const char *fmt,
+	struct stackElement *ps)
+{
+	const char *in = ps->s, *f;
+	char *pend;
+	int n, ndig, maxdig, base, neg = 0, width;
+	unsigned long u, digit;
+	double d;
+
+	/* literal text before the conversion */
+	for (f = fmt; f < fmt + pp->start; f++) {
+		if (isspace((int)(unsigned char)*f)) {
+			while (isspace((int)(unsigned char)*in)) in++;
+		} else if (*in++ != *f) {
+			return(0);
+		}
+	}
+	if (pp->conv != 'c') {
+		while (isspace((int)(unsigned char)*in)) in++;
+	}
+	if (*in == '\0') return(0);
+	width = pp->width ? pp->width : TMPSTR_SIZE;
+
+	switch (pp->conv) {
+	case 'd': case 'u': case 'x': case 'X': case 'o':
+		base = (pp->conv == 'o') ? 8 : ((pp->conv == 'x') || (pp->conv == 'X')) ? 16 : 10;
+		maxdig = (base == 8) ? 10 : (base == 16) ? 8 : 9;	/* fits in 32 bits */
+		n = 0;
+		if ((*in == '-') || (*in == '+')) {
+			neg = (*in++ == '-');
+			n++;
+		}
+		if (neg && (pp->conv != 'd')) return(-1);
+		if ((base == 16) && (n < width) && (in[0] == '0') && ((in[1] == 'x') || (in[1] == 'X'))) return(-1);
+		for (u=0, ndig=0; n < width; n++, in++, ndig++) {
+			if (isdigit((int)(unsigned char)*in)) digit = *in - '0';
+			else if ((base == 16) && isxdigit((int)(unsigned char)*in)) digit = 10 + toupper((int)(unsigned char)*in) - 'A';
+			else break;
+			if (digit >= (unsigned long)base) break;
+			if (ndig >= maxdig) return(-1);
+			u = u*base + digit;
+		}
+		if (ndig == 0) return(0);
+		if (pp->conv == 'd') {
+			n = neg ? -(int)u : (int)u;
+			ps->d = (pp->flags & SCALC_FMT_SHORT) ? (double)(short)n : (double)n;
+		} else {
+			ps->d = (pp->flags & SCALC_FMT_SHORT) ? (double)(unsigned short)u : (double)u;
+		}
+		ps->s = NULL;
+		return(1);
+
+	case 'e': case 'E': case 'f': case 'g': case 'G':
+		if (pp->width) return(-1);
+		d = fast_strtod(in, &pend);
+		if (pend == in) return(0);
+		/* leave nan, inf, hex, and anything sscanf() might read further, to it */
+		for (f = in; f < pend; f++) {
+			if (isalpha((int)(unsigned char)*f) && (toupper((int)(unsigned char)*f) != 'E')) return(-1);
+		}
+		if (isalnum((int)(unsigned char)*pend) || strchr(".+-", *pend)) return(-1);
+		ps->d = (pp->flags & SCALC_FMT_LONG) ? d : (double)(float)d;
+		ps->s = NULL;
+		return(1);
+
+	case 's':
+		if (ps->len >= TMPSTR_SIZE) return(-1);
+		for (n=0; in[n] && !isspace((int)(unsigned char)in[n]) && (n < width); n++)
+			;
+		return(copy_string(pa, ps, in, n) ? 0 : 1);
+
+	case 'c':
+		if (ps->len >= TMPSTR_SIZE) return(-1);
+		n = pp->width ? pp->width : 1;
+		for (ndig=0; (ndig < n) && in[ndig]; ndig++)
+			;
+		if (ndig < n) return(-1);
+		return(copy_string(pa, ps, in, n) ? 0 : 1);
+	}
+	return(-1);
 }
 
 void showStack_usesString(struct stackElement *ps) {
@@ -307,13 +782,240 @@ struct until_struct {
 	struct stackElement *ps;
 };
 
-#define TMPSTR_SIZE 1000
+static const double smallInts[SCALC_REG_NUM] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+	32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+	48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63
+};
+
+/* Finish with the result of a register program */
+static long reg_result(double *presult, char *psresult, int lenSresult, int precision)
+{
+	if (psresult && (lenSresult > 15)) {
+		if (isnan(*presult))
+			strcpy(psresult,"NaN");
+		else
+			(void)cvtDoubleToString(*presult, psresult, precision);
+	}
+	return(((isnan(*presult)||isinf(*presult)) ? -1 : 0));
+}
+
+/* Run a register program (see sCalcPostfixPvt.h).  Every operator computes
+ * exactly what it does in the numeric part of sCalcPerform().
+ */
+static long reg_perform(double *parg, int numArgs, double *presult, char *psresult,
+	int lenSresult, const unsigned char *prog, int precision)
+{
+	double r[SCALC_REG_NUM], args[16], *pa;
+	const double *base[4];
+	const unsigned char *code = SCALC_REG_CODE(prog), *pc = code;
+	double a, b;
+	int i, n, need = prog[2], loopsDone = 0;
+
+	memcpy((void *)&r[SCALC_REG_NUM-prog[1]], prog+3, prog[1]*sizeof(double));
+	pa = parg;
+	if (numArgs < need) {
+		/* caller didn't supply a large enough array */
+		for (i=0; i<need; i++) args[i] = (i < numArgs) ? parg[i] : 0.;
+		pa = args;
+	}
+	base[0] = pa;
+	base[1] = r;
+	base[2] = presult;
+	base[3] = smallInts;
+
+#define OPND(o) (base[(o) >> 6][(o) & 0x3f])
+#define RES r[pc[1] & 0x3f]
+#define A OPND(pc[2])
+#define B OPND(pc[3])
+#define TARGET(p) (code + ((p)[0] | ((p)[1] << 8)))
+
+	for (;;) {
+		switch (*pc) {
+		case R_MOVE:		RES = A;			pc += 3; break;
+
+		case STORE_A: case STORE_B: case STORE_C: case STORE_D: case STORE_E: case STORE_F:
+		case STORE_G: case STORE_H: case STORE_I: case STORE_J: case STORE_K: case STORE_L:
+		case STORE_M: case STORE_N: case STORE_O: case STORE_P:
+			i = *pc - STORE_A;
+			if (i < numArgs) {
+				parg[i] = pa[i] = OPND(pc[1]);
+			}
+			pc += 2;
+			break;
+
+		case A_STORE:
+			a = OPND(pc[2]);
+			b = OPND(pc[1]);
+			i = myNINT(b);
+			if (i >= numArgs || i < 0) {
+				printf("sCalcPerform: fetch index, %d, out of range.\n", i);
+			} else {
+				parg[i] = pa[i] = a;
+			}
+			pc += 3;
+			break;
+
+		case A_FETCH:
+			a = A;
+			i = myNINT(a);
+			if (i >= numArgs || i < 0) {
+				printf("sCalcPerform: fetch index, %d, out of range.\n", i);
+				RES = 0;
+			} else {
+				RES = parg[i];
+			}
+			pc += 3;
+			break;
+
+		case RANDOM:		RES = calcRandom(thread_random());			pc += 2; break;
+		case NORMAL_RNDM:	RES = calcRandomNormal(thread_random());	pc += 2; break;
+
+		case ADD:			RES = A + B;	pc += 4; break;
+		case SUB:			RES = A - B;	pc += 4; break;
+		case MULT:			RES = A * B;	pc += 4; break;
+		case DIV:
+			b = B;
+			if (b == 0) return(-1);
+			RES = A / b;
+			pc += 4;
+			break;
+		case MODULO:
+			b = B;
+			if ((int)b == 0) return(-1);
+			RES = (double)((int)A % (int)b);
+			pc += 4;
+			break;
+		case POWER:			RES = pow(A, B);				pc += 4; break;
+		case ATAN2:			RES = atan2(B, A);				pc += 4; break;
+		case REL_OR:		RES = A || B;					pc += 4; break;
+		case REL_AND:		RES = A && B;					pc += 4; break;
+		case BIT_OR:		RES = (long)B | (long)A;		pc += 4; break;
+		case BIT_AND:		RES = (long)B & (long)A;		pc += 4; break;
+		case BIT_EXCL_OR:	RES = (long)B ^ (long)A;		pc += 4; break;
+		case RIGHT_SHIFT:	RES = (long)A >> (long)B;		pc += 4; break;
+		case LEFT_SHIFT:	RES = (long)A << (long)B;		pc += 4; break;
+		case GR_OR_EQ:		a = A; b = B; RES = (fabs(a-b) < SMALL) || (a > b);	pc += 4; break;
+		case GR_THAN:		RES = (A - B) > SMALL;			pc += 4; break;
+		case LESS_OR_EQ:	a = A; b = B; RES = (fabs(a-b) < SMALL) || (a < b);	pc += 4; break;
+		case LESS_THAN:		RES = (B - A) > SMALL;			pc += 4; break;
+		case NOT_EQ:		RES = (fabs(A - B) > SMALL);	pc += 4; break;
+		case EQUAL:			RES = (fabs(A - B) < SMALL);	pc += 4; break;
+		case MAX_VAL:		a = A; b = B; RES = (a < b) ? b : a;	pc += 4; break;
+		case MIN_VAL:		a = A; b = B; RES = (a > b) ? b : a;	pc += 4; break;
+
+		case UNARY_NEG:		RES = A * -1;					pc += 3; break;
+		case ABS_VAL:		a = A; RES = (a < 0) ? a * -1 : a;	pc += 3; break;
+		case SQU_RT:
+			a = A;
+			if (a < 0) return(-1);
+			RES = sqrt(a);
+			pc += 3;
+			break;
+		case LOG_10:
+			a = A;
+			if (a < 0) return(-1);
+			RES = log10(a);
+			pc += 3;
+			break;
+		case LOG_E:
+			a = A;
+			if (a < 0) return(-1);
+			RES = log(a);
+			pc += 3;
+			break;
+		case EXP:			RES = exp(A);		pc += 3; break;
+		case ACOS:			RES = acos(A);		pc += 3; break;
+		case ASIN:			RES = asin(A);		pc += 3; break;
+		case ATAN:			RES = atan(A);		pc += 3; break;
+		case COS:			RES = cos(A);		pc += 3; break;
+		case SIN:			RES = sin(A);		pc += 3; break;
+		case TAN:			RES = tan(A);		pc += 3; break;
+		case COSH:			RES = cosh(A);		pc += 3; break;
+		case SINH:			RES = sinh(A);		pc += 3; break;
+		case TANH:			RES = tanh(A);		pc += 3; break;
+		case CEIL:			RES = ceil(A);		pc += 3; break;
+		case FLOOR:			RES = floor(A);		pc += 3; break;
+		case ISINF:			RES = isinf(A);		pc += 3; break;
+		case NINT:
+			a = A;
+			RES = (double)(long)(a >= 0 ? a+0.5 : a-0.5);
+			pc += 3;
+			break;
+		case REL_NOT:		RES = (A ? 0 : 1);	pc += 3; break;
+		case BIT_NOT:		RES = ~(long)A;		pc += 3; break;
+
+		/* The arguments are reduced from the last, as on the stack */
+		case MAX:
+			n = pc[2];
+			a = OPND(pc[2+n]);
+			for (i=n-1; i>0; i--) {
+				b = OPND(pc[2+i]);
+				if (!(b < a || isnan(a))) a = b;
+			}
+			RES = a;
+			pc += 3+n;
+			break;
+		case MIN:
+			n = pc[2];
+			a = OPND(pc[2+n]);
+			for (i=n-1; i>0; i--) {
+				b = OPND(pc[2+i]);
+				if (!(b > a || isnan(a))) a = b;
+			}
+			RES = a;
+			pc += 3+n;
+			break;
+		case FINITE:
+			n = pc[2];
+			a = finite(OPND(pc[2+n]));
+			for (i=n-1; i>0; i--) a = a && finite(OPND(pc[2+i]));
+			RES = a;
+			pc += 3+n;
+			break;
+		case ISNAN:
+			n = pc[2];
+			a = isnan(OPND(pc[2+n]));
+			for (i=n-1; i>0; i--) a = a || isnan(OPND(pc[2+i]));
+			RES = a;
+			pc += 3+n;
+			break;
+
+		case COND_IF:
+			if (OPND(pc[1]) == 0.0) pc = TARGET(pc+2);
+			else pc += 4;
+			break;
+		case COND_ELSE:
+			pc = TARGET(pc+1);
+			break;
+		case UNTIL_END:
+			if ((++loopsDone <= sCalcLoopMax) && (OPND(pc[1]) == 0)) pc = TARGET(pc+2);
+			else pc += 4;
+			break;
+
+		case END_EXPRESSION:
+			*presult = OPND(pc[1]);
+			return(reg_result(presult, psresult, lenSresult, precision));
+
+		default:
+			return(-1);
+		}
+	}
+#undef OPND
+#undef RES
+#undef A
+#undef B
+#undef TARGET
+}
+
 epicsShareFunc long 
 	sCalcPerform(double *parg, int numArgs, char **psarg, int numSArgs, double *presult, char *psresult,
 	int lenSresult, const unsigned char *postfix, int precision)
 {
 	struct stackElement stack[SCALC_STACKSIZE], *top;
 	struct stackElement *ps, *ps1, *ps2;
+	strArena			*pa;
 	char				*s2, tmpstr[TMPSTR_SIZE], tmpstr10[10];
 	char				*s, *s1, c;
 	int					i, j, k;
@@ -328,6 +1030,18 @@ epicsShareFunc long
 	const unsigned char *post = postfix;
 	struct until_struct	until_scratch[10];
 	int					loopsDone = 0;
+	sCalcNativeFunc		func;
+
+	if (*postfix == REG_PROGRAM)
+		return(reg_perform(parg, numArgs, presult, psresult, lenSresult, postfix, precision));
+	if (*postfix == REG_NATIVE) {
+		post = SCALC_NATIVE_PROGRAM(postfix);
+		if (numArgs < post[2])
+			return(reg_perform(parg, numArgs, presult, psresult, lenSresult, post, precision));
+		memcpy((void *)&func, postfix+1, sizeof(func));
+		if (func(parg, presult)) return(-1);
+		return(reg_result(presult, psresult, lenSresult, precision));
+	}
 
 	for (i=0; i<10; i++) {
 		until_scratch[i].until_loc = NULL;
@@ -346,8 +1060,21 @@ epicsShareFunc long
 			post += sizeof(int);
 			break;
 		case LITERAL_STRING:
+			/* leave post at the string's terminating null */
+			++post;
+			post += strlen((char *)post);
+			break;
+		case LITERAL_FORMAT:
+			/* leave post at the last byte of the plan */
 			++post;
-			post += strlen((char *)post)+1;
+			post += strlen((char *)post) + sizeof(sCalcFormatPlan);
+			break;
+		case MIN:
+		case MAX:
+		case FINITE:
+		case ISNAN:
+			/* variable argument function.  Skip numArgs */
+			post++;
 			break;
 		case UNTIL:
 			/*printf("sCalcPerform: UNTIL at index %d\n", (int)(post-postfix));*/
@@ -541,12 +1268,12 @@ epicsShareFunc long
 
 			case RANDOM:	/* Uniformly distributed in (0,1] (i.e., never zero). */
 				++pd;
-				*pd = local_random();
+				*pd = calcRandom(thread_random());
 				break;
 
 			case NORMAL_RNDM:	/* Normally distributed about zero, with std dev = 1. */
 				++pd;
-				*pd = sqrt(-2*log(local_random())) * cos(2*PI*local_random());
+				*pd = calcRandomNormal(thread_random());
 				break;
 
 			case POWER:
@@ -835,6 +1562,9 @@ epicsShareFunc long
 	} else {
 
 		/*** expression requires string operations ***/
+		pa = thread_arena();
+		if (pa == NULL) return(-1);
+		arena_reset(pa);
 #if INIT_STACK
 		for (i=0, ps=stack; i<SCALC_STACKSIZE; i++, ps++) {
 			ps->d = 0;
@@ -865,12 +1595,11 @@ epicsShareFunc long
 			case FETCH_AA: case FETCH_BB: case FETCH_CC: case FETCH_DD: case FETCH_EE: case FETCH_FF:
 			case FETCH_GG: case FETCH_HH: case FETCH_II: case FETCH_JJ: case FETCH_KK: case FETCH_LL:
 				INC(ps);
-				ps->s = &(ps->local_string[0]);
-				ps->s[0] = '\0';
 				if (numSArgs > (op - FETCH_AA)) {
-					strncpy(ps->s, psarg[op - FETCH_AA], SCALC_STRING_SIZE);
+					if (fetch_string(pa, ps, psarg[op - FETCH_AA])) return(-1);
 				} else {
 					/* caller didn't supply a large enough array */
+					ps->s = ""; ps->len = 0; ps->plan = NULL;
 				}
 				break;
 
@@ -888,7 +1617,8 @@ epicsShareFunc long
 			case STORE_GG: case STORE_HH: case STORE_II: case STORE_JJ: case STORE_KK: case STORE_LL:
 				toString(ps);
 				if (numSArgs > (op - STORE_AA)) {
-					strncpy(psarg[op - STORE_AA], ps->s, SCALC_STRING_SIZE);
+					if (unshare_string(pa, top, ps-1, psarg[op - STORE_AA])) return(-1);
+					strNcpy(psarg[op - STORE_AA], ps->s, SCALC_STRING_SIZE);
 				}
 				DEC(ps);
 				break;
@@ -913,7 +1643,8 @@ epicsShareFunc long
 				if (i >= numSArgs || i < 0) {
 					printf("sCalcPerform: fetch index, %d, out of range.\n", i);
 				} else {
-					strncpy(psarg[i], ps1->s, SCALC_STRING_SIZE);
+					if (unshare_string(pa, top, ps, psarg[i])) return(-1);
+					strNcpy(psarg[i], ps1->s, SCALC_STRING_SIZE);
 				}
 				break;
 
@@ -925,9 +1656,7 @@ epicsShareFunc long
 
 			case FETCH_SVAL:
 				INC(ps);
-				ps->s = &(ps->local_string[0]);
-				ps->s[0] = '\0';
-				strncpy(ps->s, psresult, SCALC_STRING_SIZE);
+				if (fetch_string(pa, ps, psresult)) return(-1);
 				break;
 
 			case CONST_PI:
@@ -971,7 +1700,7 @@ epicsShareFunc long
 					ps->d = ps->d + ps1->d;
 				} else {
 					/* concatenate two strings */
-					strncat(ps->s, ps1->s, strlen(ps->s)-SCALC_STRING_SIZE-1);
+					if (append_string(pa, ps, ps1->s, ps1->len)) return(-1);
 				}
 				break;
 
@@ -987,24 +1716,18 @@ epicsShareFunc long
 					ps->d = ps->d - ps1->d;
 				} else {
 					/* subtract ps1->s from ps->s */
-					if (ps1->s[0]) {
+					if (ps1->len) {
 						if (op == SUB) {
-							/* first occurrence of ps1->s */
-							s = strstr(ps->s, ps1->s);
+							s = find_string(ps->s, ps->len, ps1->s, ps1->len);
 						} else {
-							/* last occurrence of ps1->s */
-							s1 = ps->s + strlen(ps->s) - strlen(ps1->s);
-							for (s = NULL; (s == NULL) && (s1 > ps->s); s1--) {
-								printf("comparing '%s' with '%s'\n", s1, ps1->s);
-								if (strncmp(s1, ps1->s, strlen(ps1->s))==0) {
-									s = s1;
-								}
-							}
+							s = find_last_string(ps->s, ps->len, ps1->s, ps1->len);
 						}
 						if (s) {
-							for (s1=s+strlen(ps1->s); *s1; ) 
-								*s++ = *s1++;
-							*s = '\0';
+							s2 = ps->s;
+							i = (int)(s - s2);
+							if ((s1 = new_string(pa, ps, ps->len - ps1->len)) == NULL) return(-1);
+							memcpy(s1, s2, i);
+							memcpy(s1 + i, s + ps1->len, ps->len - i);
 						}
 					}
 				}
@@ -1080,13 +1803,13 @@ epicsShareFunc long
 
 			case RANDOM:
 				INC(ps);
-				ps->d = local_random();
+				ps->d = calcRandom(thread_random());
 				ps->s = NULL;
 				break;
 
 			case NORMAL_RNDM:				
 				INC(ps);
-				ps->d = sqrt(-2*log(local_random())) * cos(2*PI*local_random());
+				ps->d = calcRandomNormal(thread_random());
 				ps->s = NULL;
 				break;
 
@@ -1265,6 +1988,7 @@ epicsShareFunc long
 				toDouble(ps1);
 				j = myNINT(ps1->d);
 				j = myMIN(j,SCALC_STRING_SIZE);
+				j = myMAX(j,0);
 				DEC(ps);
 				if (isDouble(ps)) {
 					/* numeric variable: bit shift by integer amount */
@@ -1274,20 +1998,17 @@ epicsShareFunc long
 						ps->d = (int)(ps->d) << (int)(ps1->d);
 					}
 				} else {
-					/* string variable: shift array elements */
+					/* string variable: shift characters */
 					if (op == RIGHT_SHIFT) {
-						for (i=SCALC_STRING_SIZE-1; i>=0; i--) {
-							ps->s[i] = (i>=j)?ps->s[i-j]:' ';
-						}
-						ps->s[SCALC_STRING_SIZE-1] = '\0';
+						s = ps->s;
+						i = ps->len;
+						if ((s1 = new_string(pa, ps, i + j)) == NULL) return(-1);
+						memset(s1, ' ', j);
+						memcpy(s1 + j, s, i);
 					} else {
-						if (j==SCALC_STRING_SIZE) {
-							ps->s[0] = '\0';
-						} else {
-							for (i=0; i < (SCALC_STRING_SIZE-j); i++) {
-								ps->s[i] = ps->s[i+j];
-							}
-						}
+						j = myMIN(j,ps->len);
+						ps->s += j;
+						ps->len -= j;
 					}
 				}
 				break;
@@ -1304,7 +2025,7 @@ epicsShareFunc long
 				} else {
 					/* compare ps->s to ps1->s */
 					if (strcmp(ps->s, ps1->s) < 0) {
-						strcpy(ps->s, ps1->s);
+						*ps = *ps1;
 					}
 				}
 				break;
@@ -1321,7 +2042,7 @@ epicsShareFunc long
 				} else {
 					/* compare ps->s to ps1->s */
 					if (strcmp(ps->s, ps1->s) > 0) {
-						strcpy(ps->s, ps1->s);
+						*ps = *ps1;
 					}
 				}
 				break;
@@ -1426,7 +2147,7 @@ epicsShareFunc long
 					s = strpbrk(ps->s,"0123456789");
 					if ((s > ps->s) && (s[-1] == '.')) s--;
 					if ((s > ps->s) && (s[-1] == '-')) s--;
-					d = s ? atof(s) : 0.0;
+					d = s ? fast_strtod(s, NULL) : 0.0;
 					ps->s = NULL;
 				}
 				ps->d = (double)(long)(d >= 0 ? d+0.5 : d-0.5);
@@ -1446,7 +2167,7 @@ epicsShareFunc long
 				if (isDouble(ps)) {
 					d = ps->d;
 				} else {
-					d = atof(ps->s);
+					d = fast_strtod(ps->s, NULL);
 					ps->s = NULL;
 				}
 				i = myNINT(d);
@@ -1462,15 +2183,14 @@ epicsShareFunc long
 				if (isDouble(ps)) {
 					d = ps->d;
 				} else {
-					d = atof(ps->s);
+					d = fast_strtod(ps->s, NULL);
 				}
-				ps->s = &(ps->local_string[0]);
-				ps->s[0] = '\0';
 				i = myNINT(d);
 				if (i >= numSArgs || i < 0) {
 					printf("sCalcPerform: fetch index, %d, out of range.\n", i);
+					ps->s = ""; ps->len = 0; ps->plan = NULL;
 				} else {
-					strNcpy(ps->s, psarg[i], SCALC_STRING_SIZE);
+					if (fetch_string(pa, ps, psarg[i])) return(-1);
 				}
 				break;
 
@@ -1491,14 +2211,19 @@ epicsShareFunc long
 
 			case LITERAL_STRING:
 				INC(ps);
-				ps->s = &(ps->local_string[0]);
-				s = ps->s;
-				for (i=0; (i<SCALC_STRING_SIZE-1) && *post; )
-					*s++ = (char)*post++;
-				*s = '\0';
-				/* skip to end of string, if we haven't already */
-				while (*post) post++;
-				post++;
+				ps->s = (char *)post;
+				ps->len = (int)strlen(ps->s);
+				ps->plan = NULL;
+				post += ps->len + 1;
+				break;
+
+			case LITERAL_FORMAT:
+				INC(ps);
+				ps->s = (char *)post;
+				ps->len = (int)strlen(ps->s);
+				post += ps->len + 1;
+				ps->plan = post;
+				post += sizeof(sCalcFormatPlan);
 				break;
 
 			case TO_DOUBLE:
@@ -1507,7 +2232,7 @@ epicsShareFunc long
 					s = strpbrk(ps->s,"0123456789");
 					if ((s > ps->s) && (s[-1] == '.')) s--;
 					if ((s > ps->s) && (s[-1] == '-')) s--;
-					ps->d = s ? atof(s) : 0.0;
+					ps->d = s ? fast_strtod(s, NULL) : 0.0;
 					ps->s = NULL;
 				}
 				break;
@@ -1518,9 +2243,7 @@ epicsShareFunc long
 
 			case LEN:
 				toString(ps);
-				for (i=0; (i < SCALC_STRING_SIZE) && ps->s[i]; i++)
-					;
-				ps->d = (double)i;
+				ps->d = (double)ps->len;
 				ps->s = NULL;
 				break;
 
@@ -1536,12 +2259,22 @@ epicsShareFunc long
 				DEC(ps);
 				if (isDouble(ps))
 					return(-1);
+				if (HAS_PLAN(ps)) {
+					if (((const sCalcFormatPlan *)ps->plan)->conv == 's') {
+						toString(ps1);
+					} else {
+						toDouble(ps1);
+					}
+					format_print((const sCalcFormatPlan *)ps->plan, ps->s, ps1, tmpstr);
+					if (copy_string(pa, ps, tmpstr, (int)strlen(tmpstr))) return(-1);
+					break;
+				}
 				s = ps->s;
 				while ((s1 = strstr(s, "%%"))) {s = s1+2;}
 				if (((s = strpbrk(s, "%")) == NULL) ||
 					((s = strpbrk(s+1, "*cdeEfgGiousxX")) == NULL)) {
 					/* no printf arguments needed */
-					strcpy(tmpstr, ps->s);
+					break;
 				} else {
 					switch (*s) {
 					default: case '*':
@@ -1550,19 +2283,20 @@ epicsShareFunc long
 					case 'u': case 'x': case 'X':
 						toDouble(ps1);
 						l = myNINT(ps1->d);
-	 					sprintf(tmpstr, ps->s, l);
+	 					epicsSnprintf(tmpstr, TMPSTR_SIZE, ps->s, l);
 						break;
 					case 'e': case 'E': case 'f': case 'g': case 'G':
 						toDouble(ps1);
-	 					sprintf(tmpstr, ps->s, ps1->d);
+	 					epicsSnprintf(tmpstr, TMPSTR_SIZE, ps->s, ps1->d);
 						break;
 					case 's':
 						toString(ps1);
-	 					sprintf(tmpstr, ps->s, ps1->s);
+	 					epicsSnprintf(tmpstr, TMPSTR_SIZE, ps->s, ps1->s);
 						break;
 					}
 				}
-				strNcpy(ps->s, tmpstr, SCALC_STRING_SIZE-1);
+				tmpstr[TMPSTR_SIZE-1] = '\0';
+				if (copy_string(pa, ps, tmpstr, (int)strlen(tmpstr))) return(-1);
 				break;
 
 	 		case BIN_WRITE:
@@ -1583,18 +2317,18 @@ epicsShareFunc long
 					case 'c':
 						toDouble(ps1);
 						c = myNINT(ps1->d);
-						memcpy(ps->s, &c, 1);
+						memcpy(tmpstr10, &c, 1);
 						j = 1;
 						break;
 					case 'd': case 'i':
 						toDouble(ps1);
 						if (s[-1] == 'h') {
 							h = myNINT(ps1->d);
-							memcpy(ps->s, &h, 2);
+							memcpy(tmpstr10, &h, 2);
 							j = 2;
 						} else {
 							l = myNINT(ps1->d);
-							memcpy(ps->s, &l, 4);
+							memcpy(tmpstr10, &l, 4);
 							j = 4;
 						}
 						break;
@@ -1602,22 +2336,22 @@ epicsShareFunc long
 						toDouble(ps1);
 						if (s[-1] == 'h') {
 							ui = myNINT(ps1->d);
-							memcpy(ps->s, &ui, 2);
+							memcpy(tmpstr10, &ui, 2);
 							j = 2;
 						} else {
 							ul = myNINT(ps1->d);
-							memcpy(ps->s, &ul, 4);
+							memcpy(tmpstr10, &ul, 4);
 							j = 4;
 						}
 						break;
 					case 'e': case 'E': case 'f': case 'g': case 'G':
 						toDouble(ps1);
 						if (s[-1] == 'l') {
-							memcpy(ps->s, &(ps1->d), 8);
+							memcpy(tmpstr10, &(ps1->d), 8);
 							j = 8;
 						} else {
 							f = ps1->d;
-							memcpy(ps->s, &f, 4);
+							memcpy(tmpstr10, &f, 4);
 							j = 4;
 						}
 						break;
@@ -1625,10 +2359,10 @@ epicsShareFunc long
 						return(-1);
 					}
 				}
-		 		i = epicsStrSnPrintEscaped(tmpstr, SCALC_STRING_SIZE-1, ps->s, j);
-				i = myMIN(i, SCALC_STRING_SIZE);
-				tmpstr[i] = '\0'; /* make sure it's terminated */
-				strNcpy(ps->s, tmpstr, SCALC_STRING_SIZE-1);
+				/* each byte takes at most four characters, escaped */
+				if ((s1 = new_string(pa, ps, 4*j)) == NULL) return(-1);
+		 		(void)epicsStrSnPrintEscaped(s1, 4*j+1, tmpstr10, j);
+				ps->len = (int)strlen(s1);
 				break;
 
 	 		case SSCANF:
@@ -1636,6 +2370,12 @@ epicsShareFunc long
 				DEC(ps);
 				if (isDouble(ps) || isDouble(ps1))
 					return(-1);
+				if (HAS_PLAN(ps1)) {
+					i = format_scan(pa, (const sCalcFormatPlan *)ps1->plan, ps1->s, ps);
+					if (i == 0) return(-1);
+					if (i == 1) break;
+					/* else the plan doesn't cover this input */
+				}
 				s = findConversionIndicator(ps1->s);
 				if (s == NULL)
 					return(-1);
@@ -1679,8 +2419,11 @@ epicsShareFunc long
 					ps->s = NULL;
 					break;
 				case 'c': case '[': case 's':
+					/* the result is no longer than the input, and %c doesn't terminate it */
+					if (ps->len >= TMPSTR_SIZE) return(-1);
+					memset(tmpstr, 0, ps->len+1);
 		 			i = sscanf(ps->s, ps1->s, tmpstr);
-					strNcpy(ps->s, tmpstr, SCALC_STRING_SIZE-1);
+					if (copy_string(pa, ps, tmpstr, (int)strlen(tmpstr))) return(-1);
 					break;
 				}
 				if (i != 1) {
@@ -1696,7 +2439,7 @@ epicsShareFunc long
 					return(-1);
 				/* find first conversion indicator that is not assign suppressed */
 				s = findConversionIndicator(ps1->s);
-				if (s == NULL)
+				if ((s == NULL) || (ps->len >= TMPSTR_SIZE))
 					return(-1);
 		 		i = dbTranslateEscape(tmpstr, ps->s);
 				s1 = tmpstr;
@@ -1796,32 +2539,37 @@ epicsShareFunc long
 
 			case TR_ESC:
 				if (isString(ps)) {
-		 			i = dbTranslateEscape(tmpstr, ps->s);
-					strNcpy(ps->s, tmpstr, SCALC_STRING_SIZE-1);
+					/* translation never lengthens a string */
+					s = ps->s;
+					if ((s1 = new_string(pa, ps, ps->len)) == NULL) return(-1);
+		 			(void)dbTranslateEscape(s1, s);
+					ps->len = (int)strlen(s1);
 				}
 				break;
 
 			case ESC:
 				if (isString(ps)) {
-					/* Find length of input string.  Null terminates string.*/
-					for (j=0; j<SCALC_STRING_SIZE && ps->s[j] != '\0'; j++) {
-						;
-					}
-		 			i = epicsStrSnPrintEscaped(tmpstr, SCALC_STRING_SIZE-1, ps->s, j);
-					i = myMIN(i, SCALC_STRING_SIZE);
-					tmpstr[i] = '\0'; /* make sure it's terminated */
-					strNcpy(ps->s, tmpstr, SCALC_STRING_SIZE-1);
+					/* each character takes at most four, escaped */
+					s = ps->s;
+					j = ps->len;
+					if ((s1 = new_string(pa, ps, 4*j)) == NULL) return(-1);
+		 			(void)epicsStrSnPrintEscaped(s1, 4*j+1, s, j);
+					ps->len = (int)strlen(s1);
 				}
 				break;
 
 			case CRC16:
 			case MODBUS:
+			case CRC32:
+			case ADD_CRC32:
+			case CRC_CCITT:
+			case ADD_CCITT:
 				if (isString(ps)) {
-		 			if (crc16(tmpstr, ps->s) == 0) {
-						if (op==CRC16) {
-							strNcpy(ps->s, tmpstr, SCALC_STRING_SIZE-1);
+		 			if (checksum(pa, op, ps->s, ps->len, tmpstr) == 0) {
+						if ((op==CRC16) || (op==CRC32) || (op==CRC_CCITT)) {
+							if (copy_string(pa, ps, tmpstr, (int)strlen(tmpstr))) return(-1);
 						} else {
-							strncat(ps->s, tmpstr, strlen(ps->s)-SCALC_STRING_SIZE-1);
+							if (append_string(pa, ps, tmpstr, (int)strlen(tmpstr))) return(-1);
 						}
 					}
 				}
@@ -1839,14 +2587,16 @@ epicsShareFunc long
 				 * "3A 46 37 30 33 31 33 38 39 30 30 30 41 36 30 0D 0A"
 				 */
 				if (isString(ps)) {
-		 			if (lrc(tmpstr10, ps->s) == 0) {
+		 			if (lrc(tmpstr10, ps->s, ps->len) == 0) {
 						if (op==LRC) {
-							strNcpy(ps->s, tmpstr10, SCALC_STRING_SIZE-1);
+							if (copy_string(pa, ps, tmpstr10, (int)strlen(tmpstr10))) return(-1);
 						} else {
-							strcpy(tmpstr, ":");
-							strcat(tmpstr, ps->s);
-							strNcpy(ps->s, tmpstr, strlen(ps->s)-SCALC_STRING_SIZE-1);
-							strncat(ps->s, tmpstr10, strlen(ps->s)-SCALC_STRING_SIZE-1);
+							s = ps->s;
+							i = ps->len;
+							if ((s1 = new_string(pa, ps, i+1)) == NULL) return(-1);
+							s1[0] = ':';
+							memcpy(s1+1, s, i);
+							if (append_string(pa, ps, tmpstr10, (int)strlen(tmpstr10))) return(-1);
 						}
 					}
 				}
@@ -1855,11 +2605,11 @@ epicsShareFunc long
 			case XOR8:
 			case ADD_XOR8:
 				if (isString(ps)) {
-		 			if (xor8(tmpstr, ps->s) == 0) {
+		 			if (checksum(pa, op, ps->s, ps->len, tmpstr) == 0) {
 						if (op==XOR8) {
-							strNcpy(ps->s, tmpstr, SCALC_STRING_SIZE-1);
+							if (copy_string(pa, ps, tmpstr, (int)strlen(tmpstr))) return(-1);
 						} else {
-							strncat(ps->s, tmpstr, strlen(ps->s)-SCALC_STRING_SIZE-1);
+							if (append_string(pa, ps, tmpstr, (int)strlen(tmpstr))) return(-1);
 						}
 					}
 				}
@@ -1871,32 +2621,36 @@ epicsShareFunc long
 				ps1 = ps;
 				DEC(ps);
 				toString(ps);
-				k = strlen(ps->s);
+				k = ps->len;
 				if (isDouble(ps1)) {
 					i = (int)ps1->d;
 					if (i < 0) i += k;
 				} else {
-					s = strstr(ps->s, ps1->s);
-					i = s ? (s - ps->s) + strlen(ps1->s) : 0;
+					s = find_string(ps->s, k, ps1->s, ps1->len);
+					i = s ? (int)(s - ps->s) + ps1->len : 0;
 				}
 				if (isDouble(ps2)) {
 					j = (int)ps2->d;
 					if (j < 0) j += k;
 				} else {
 					if (*(ps2->s)) {
-						s = strstr(ps->s, ps2->s);
-						j = s ? (s - ps->s) - 1 : k;
+						s = find_string(ps->s, k, ps2->s, ps2->len);
+						j = s ? (int)(s - ps->s) - 1 : k;
 					} else {
 						j = k;
 					}
 				}
 				i = myMAX(myMIN(i,k),0);
-				j = myMIN(j,k);
-				s = ps->s;
-				for (s1=s+i, s2=s+j ; *s1 && s1 <= s2; ) {
-					*s++ = *s1++;
+				j = myMIN(j,k-1);
+				if (j < i) {
+					ps->s = ""; ps->len = 0; ps->plan = NULL;
+				} else if (j == k-1) {
+					/* the rest of the string: no copy needed */
+					ps->s += i;
+					ps->len = k - i;
+				} else {
+					if (copy_string(pa, ps, ps->s + i, j-i+1)) return(-1);
 				}
-				*s = 0;
 				break;
  
 			case REPLACE:
@@ -1907,19 +2661,15 @@ epicsShareFunc long
 				toString(ps);					/* host string */
 				toString(ps1);					/* text to be replaced */
 				toString(ps2);					/* replacement text */
-				s1 = strstr(ps->s, ps1->s);		/* first char of host to be replaced */
-				if (s1 >= ps->s) {
-					i = s1 - ps->s; 			/* running tab of chars in host string */
-					s = s1 + strlen(ps1->s);	/* first char in host following replaced text */
-					if (strlen(ps2->s) > strlen(ps1->s)) {
-						strcpy(tmpstr, s);
-						s = tmpstr;
-					}
-					for (s2 = ps2->s; *s2 && (i < (SCALC_STRING_SIZE-1)); i++)
-						*s1++ = *s2++;
-					while (*s && (i++ < (SCALC_STRING_SIZE-1)))
-						*s1++ = *s++;
-					*s1 = '\0';
+				s1 = find_string(ps->s, ps->len, ps1->s, ps1->len);	/* first char of host to be replaced */
+				if (s1) {
+					s = ps->s;
+					k = ps->len;
+					i = (int)(s1 - s);			/* chars in host before replaced text */
+					if ((s2 = new_string(pa, ps, k - ps1->len + ps2->len)) == NULL) return(-1);
+					memcpy(s2, s, i);
+					memcpy(s2 + i, ps2->s, ps2->len);
+					memcpy(s2 + i + ps2->len, s1 + ps1->len, k - i - ps1->len);
 				}
 				break;
  
@@ -1943,7 +2693,7 @@ epicsShareFunc long
 						ps1 = ps;
 						DEC(ps);
 						if (strcmp(ps->s, ps1->s) < 0) {
-							strcpy(ps->s, ps1->s);
+							*ps = *ps1;
 						}
 					}
 				}
@@ -1968,7 +2718,7 @@ epicsShareFunc long
 						ps1 = ps;
 						DEC(ps);
 						if (strcmp(ps->s, ps1->s) > 0) {
-							strcpy(ps->s, ps1->s);
+							*ps = *ps1;
 						}
 					}
 				}
@@ -2056,28 +2806,92 @@ epicsShareFunc long
 	} /* if (*post++ != USES_STRING) {} else */
 }
 
-/*
- * RAND
- *
- * generates a random number between 0 and 1 using the
- * seed = (multy * seed) + addy         Random Number Generator by Knuth
- *                                              SemiNumerical Algorithms
- *                                              Chapter 1
- * randy = seed / 65535.0          To normalize the number between 0 - 1
+/* Random numbers: each thread has its own generator, so RNDM and NRNDM need no lock */
+static epicsThreadOnceId randomOnce = EPICS_THREAD_ONCE_INIT;
+static epicsThreadPrivateId randomPrivate = 0;
+static epicsMutexId randomLock = 0;
+static epicsUInt32 randomCount = 0;	/* generators created, for default seeds */
+static calcRandomState randomShared;	/* for threads we can't allocate one for */
+
+static void randomInit(void *arg) {
+	randomLock = epicsMutexMustCreate();
+	randomPrivate = epicsThreadPrivateCreate();
+	calcRandomSeed(&randomShared, 0xa3bf);
+}
+
+static calcRandomState *thread_random(void) {
+	calcRandomState *pr;
+
+	epicsThreadOnce(&randomOnce, randomInit, NULL);
+	pr = (calcRandomState *)epicsThreadPrivateGet(randomPrivate);
+	if (pr == NULL) {
+		pr = (calcRandomState *)calloc(1, sizeof(calcRandomState));
+		if (pr == NULL) return(&randomShared);
+		epicsMutexMustLock(randomLock);
+		calcRandomSeed(pr, 0xa3bf + randomCount++);
+		epicsMutexUnlock(randomLock);
+		epicsThreadPrivateSet(randomPrivate, pr);
+	}
+	return(pr);
+}
+
+/* String arenas: one per thread, like the random-number generators */
+static epicsThreadOnceId arenaOnce = EPICS_THREAD_ONCE_INIT;
+static epicsThreadPrivateId arenaPrivate = 0;
+
+static void arenaInit(void *arg) {
+	arenaPrivate = epicsThreadPrivateCreate();
+}
+
+static strArena *thread_arena(void) {
+	strArena *pa;
+
+	epicsThreadOnce(&arenaOnce, arenaInit, NULL);
+	pa = (strArena *)epicsThreadPrivateGet(arenaPrivate);
+	if (pa == NULL) {
+		pa = (strArena *)calloc(1, sizeof(strArena));
+		if (pa == NULL) {
+			printf("sCalcPerform: can't allocate string arena\n");
+			return(NULL);
+		}
+		epicsThreadPrivateSet(arenaPrivate, pa);
+	}
+	return(pa);
+}
+
+/* Has sCalcPerform() made a random-number generator or string arena for the calling thread? */
+int sCalcPerformThreadState(void) {
+	epicsThreadOnce(&randomOnce, randomInit, NULL);
+	epicsThreadOnce(&arenaOnce, arenaInit, NULL);
+	return((epicsThreadPrivateGet(randomPrivate) != NULL) ||
+		(epicsThreadPrivateGet(arenaPrivate) != NULL));
+}
+
+/* Free the random-number generator and string arena sCalcPerform() made for the
+ * calling thread, if any
  */
-static unsigned short seed = 0xa3bf;
-static unsigned short multy = 191 * 8 + 5;  /* 191 % 8 == 5 */
-static unsigned short addy = 0x3141;
-extern double simple_random(void);
-static double local_random()
-{
-	double  randy;
+epicsShareFunc void sCalcPerformThreadCleanup(void) {
+	calcRandomState *pr;
+	strArena *pa;
+
+	epicsThreadOnce(&randomOnce, randomInit, NULL);
+	epicsThreadOnce(&arenaOnce, arenaInit, NULL);
+	pr = (calcRandomState *)epicsThreadPrivateGet(randomPrivate);
+	if (pr) {
+		epicsThreadPrivateSet(randomPrivate, NULL);
+		free(pr);
+	}
+	pa = (strArena *)epicsThreadPrivateGet(arenaPrivate);
+	if (pa) {
+		epicsThreadPrivateSet(arenaPrivate, NULL);
+		arena_reset(pa);
+		free(pa);
+	}
+}
 
-	/* random number */
-	seed = (seed * multy) + addy;
-	/* randy = (float) seed / 65535.0; */
-	randy = (float) (seed+1) / 65536.0;	/* exclude zero */
-	return(randy);
+/* Restart the calling thread's random-number sequence. */
+epicsShareFunc void sCalcPerformSeed(epicsUInt32 seed) {
+	calcRandomSeed(thread_random(), seed);
 }
 
 /* Search the instruction stream for a matching operator, skipping any
@@ -2120,6 +2934,9 @@ static int cond_search(const unsigned char **ppinst, int match)
 				printf("\t-----\n");
 			}
 			break;
+		case LITERAL_FORMAT:
+			pinst += strlen((char *)pinst)+1+sizeof(sCalcFormatPlan);
+			break;
 		case MIN:
 		case MAX:
 		case FINITE:
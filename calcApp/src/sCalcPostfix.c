@@ -13,6 +13,7 @@
  *      Date:            12-12-86
  */
 
+#include	<stdlib.h>
 #include	<stdio.h>
 #include	<string.h>
 #include	<ctype.h>
@@ -20,9 +21,12 @@
 #include	<dbDefs.h>
 #include	<epicsStdlib.h>
 #include	<epicsString.h>
+#include	<epicsThread.h>
 #define epicsExportSharedSymbols
 #include	"sCalcPostfix.h"
 #include	"sCalcPostfixPvt.h"
+#include	"calcOptimize.h"
+#include	"calcTrie.h"
 #include	<epicsExport.h>
 
 
@@ -32,6 +36,12 @@ long test_sCalcPerform(char *pinfix, int n);
 #define DEBUG 1
 volatile int sCalcPostfixDebug=0;
 epicsExportAddress(int, sCalcPostfixDebug);
+volatile int sCalcPostfixOptimize=0;
+epicsExportAddress(int, sCalcPostfixOptimize);
+volatile int sCalcPostfixLower=1;
+epicsExportAddress(int, sCalcPostfixLower);
+volatile int sCalcPostfixNative=0;
+epicsExportAddress(int, sCalcPostfixNative);
 
 /* declarations for postfix */
 /* element types */
@@ -199,6 +209,10 @@ static const ELEMENT operands[] = {
 {"AMODBUS",	9, 10,	0,		UNARY_OPERATOR,		AMODBUS},     /* Ascii Modbus (append LRC) */
 {"XOR8",	9, 10,	0,		UNARY_OPERATOR,		XOR8},        /* XOR8 checksum */
 {"ADD_XOR8",9, 10,	0,		UNARY_OPERATOR,		ADD_XOR8},    /* Append XOR8 to string */
+{"CRC32",	9, 10,	0,		UNARY_OPERATOR,		CRC32},       /* CRC32 */
+{"ADD_CRC32",9, 10,	0,		UNARY_OPERATOR,		ADD_CRC32},   /* Append CRC32 to string */
+{"CCITT",	9, 10,	0,		UNARY_OPERATOR,		CRC_CCITT},   /* CRC-16/CCITT */
+{"ADD_CCITT",9, 10,	0,		UNARY_OPERATOR,		ADD_CCITT},   /* Append CRC-16/CCITT to string */
 {"LEN",		9, 10,	0,		UNARY_OPERATOR,		LEN},         /* String length */
 {"UNTIL",	0, 10,	0,		UNTIL_OPERATOR,		UNTIL},
 {"~",		9, 10,	0,		UNARY_OPERATOR, 	BIT_NOT},
@@ -246,6 +260,18 @@ static const ELEMENT operators[] = {
 {"<?",		4, 4,	-1,		BINARY_OPERATOR,	MIN_VAL},     /* minimum of 2 args */
 };
 
+/* Tries of the names in operands[] and operators[], built on first use */
+static calcTrie operandTrie, operatorTrie;
+static int haveTries = 0;
+static epicsThreadOnceId trieOnce = EPICS_THREAD_ONCE_INIT;
+
+static void trieInit(void *arg) {
+	haveTries = (calcTrieBuild(&operandTrie, (const char * const *)&operands[0].name,
+			NELEMENTS(operands), sizeof(ELEMENT)) == 0) &&
+		(calcTrieBuild(&operatorTrie, (const char * const *)&operators[0].name,
+			NELEMENTS(operators), sizeof(ELEMENT)) == 0);
+}
+
 /* get_element
  *
  * find the next expression element in the infix expression
@@ -254,6 +280,7 @@ static int
 	get_element(int opnd, const char **ppsrc, const ELEMENT **ppel)
 {
 	const ELEMENT *ptable, *pel;
+	int i, len;
 
 	*ppel = NULL;
 
@@ -268,8 +295,17 @@ static int
 		pel = ptable + NELEMENTS(operators) - 1;
 	}
 
+	epicsThreadOnce(&trieOnce, trieInit, NULL);
+	if (haveTries) {
+		i = calcTrieMatch(opnd ? &operandTrie : &operatorTrie, *ppsrc, &len);
+		if (i < 0) return FALSE;
+		*ppel = ptable + i;
+		*ppsrc += len;
+		return TRUE;
+	}
+
 	while (pel >= ptable) {
-		size_t len = strlen(pel->name);
+		len = (int)strlen(pel->name);
 
 		if (epicsStrnCaseCmp(*ppsrc, pel->name, len) == 0) {
 			*ppel = pel;
@@ -387,6 +423,10 @@ static const char *opcodes[] = {
 	"AMODBUS",
 	"XOR8",
 	"ADD_XOR8",
+	"CRC32",
+	"ADD_CRC32",
+	"CRC_CCITT",
+	"ADD_CCITT",
 	"BIN_READ",
 	"BIN_WRITE",
 	"LEN",
@@ -396,9 +436,765 @@ static const char *opcodes[] = {
 	"UNTIL",
 	"UNTIL_END",
 	"NO_STRING",
-	"USES_STRING"
+	"USES_STRING",
+	"LITERAL_FORMAT",
+	"REG_PROGRAM",
+	"R_MOVE",
+	"REG_NATIVE"
+};
+
+
+/*** begin optimizer support ***/
+
+/* Set the stack effect and optimizer flags of an sCalc instruction.  Operators
+ * that work on strings as well as numbers give numbers only if given numbers.
+ */
+static int opt_describe(calcOptInst *pi)
+{
+	int op = pi->op;
+
+	pi->pops = 0;
+	pi->pushes = 1;
+	pi->flags = 0;
+	if (((op >= FETCH_A) && (op <= FETCH_P)) || (op == FETCH_VAL)) {
+		pi->flags = CALC_OPT_FETCH | CALC_OPT_NUMBER;
+		return(0);
+	}
+	if (((op >= FETCH_AA) && (op <= FETCH_LL)) || (op == FETCH_SVAL)) {
+		pi->flags = CALC_OPT_FETCH;
+		return(0);
+	}
+	if ((op >= STORE_A) && (op <= STORE_LL)) {
+		pi->pops = 1;
+		pi->pushes = 0;
+		pi->flags = CALC_OPT_IMPURE;
+		return(0);
+	}
+	switch (op) {
+	case LITERAL_DOUBLE: case LITERAL_INT:
+	case CONST_PI: case CONST_D2R: case CONST_R2D: case CONST_S2R: case CONST_R2S:
+		pi->flags = CALC_OPT_CONST | CALC_OPT_NUMBER;
+		break;
+	case LITERAL_STRING: case LITERAL_FORMAT:
+		break;
+	case RANDOM: case NORMAL_RNDM:
+		pi->flags = CALC_OPT_IMPURE | CALC_OPT_NUMBER;
+		break;
+
+	case UNARY_NEG: case ABS_VAL: case EXP: case LOG_10: case LOG_E: case SQU_RT:
+	case ACOS: case ASIN: case ATAN: case COS: case COSH: case SIN: case SINH:
+	case TAN: case TANH: case CEIL: case FLOOR: case ISINF: case NINT:
+	case REL_NOT: case BIT_NOT:
+		pi->pops = 1;
+		pi->flags = CALC_OPT_FOLD;
+		break;
+	case TO_DOUBLE: case A_FETCH: case BYTE: case LEN:
+		pi->pops = 1;
+		pi->flags = CALC_OPT_NUMBER;
+		break;
+	case TO_STRING: case A_SFETCH: case TR_ESC: case ESC: case CRC16: case MODBUS:
+	case LRC: case AMODBUS: case XOR8: case ADD_XOR8: case CRC32: case ADD_CRC32:
+	case CRC_CCITT: case ADD_CCITT:
+		pi->pops = 1;
+		break;
+
+	case ADD: case SUB: case MULT: case DIV: case POWER: case ATAN2:
+	case REL_OR: case REL_AND: case BIT_OR: case BIT_AND: case BIT_EXCL_OR:
+	case RIGHT_SHIFT: case LEFT_SHIFT: case NOT_EQ: case LESS_THAN: case LESS_OR_EQ:
+	case EQUAL: case GR_OR_EQ: case GR_THAN: case MAX_VAL: case MIN_VAL:
+		pi->pops = 2;
+		pi->flags = CALC_OPT_FOLD;
+		break;
+	case MODULO:	/* not folded: integer overflow might trap in a branch never taken */
+	case PRINTF: case SSCANF: case BIN_READ: case BIN_WRITE: case SUBLAST:
+		pi->pops = 2;
+		break;
+	case SUBRANGE: case REPLACE:
+		pi->pops = 3;
+		break;
+
+	case MAX: case MIN: case FINITE: case ISNAN:
+		pi->pops = pi->nargs;
+		pi->flags = CALC_OPT_FOLD;
+		break;
+
+	case A_STORE: case A_SSTORE:
+		pi->pops = 2;
+		pi->pushes = 0;
+		pi->flags = CALC_OPT_IMPURE;
+		break;
+	case COND_IF: case COND_ELSE:
+		/* COND_ELSE drops the value of the first branch, as the second makes another */
+		pi->pops = 1;
+		pi->pushes = 0;
+		break;
+	case COND_END:
+		pi->pushes = 0;
+		break;
+	case UNTIL: case UNTIL_END:
+		pi->pushes = 0;
+		pi->flags = CALC_OPT_IMPURE | CALC_OPT_BARRIER;
+		break;
+	default:
+		return(-1);
+	}
+	return(0);
+}
+
+/* Number of postfix bytes used by an instruction */
+static int opt_length(const calcOptInst *pi)
+{
+	switch (pi->op) {
+	case LITERAL_DOUBLE:	return(1+sizeof(double));
+	case LITERAL_INT:		return(1+sizeof(int));
+	case LITERAL_STRING:	return(2+(int)strlen(pi->s));
+	case LITERAL_FORMAT:	return(2+(int)strlen(pi->s)+(int)sizeof(sCalcFormatPlan));
+	case MIN: case MAX: case FINITE: case ISNAN:
+		return(2);
+	}
+	return(1);
+}
+
+/* Write n instructions as postfix, after the string-usage byte, in at most size
+ * bytes.  Return the number of bytes written, or -1 if they don't fit.
+ */
+static int opt_encode(const calcOptInst *pi, int n, int usage, unsigned char *post, int size)
+{
+	unsigned char *pout = post;
+	int i, lit_i;
+
+	*pout++ = usage;
+	for (i=0; i<n; i++) {
+		if ((pout - post) + opt_length(&pi[i]) >= size) return(-1);
+		*pout++ = pi[i].op;
+		switch (pi[i].op) {
+		case LITERAL_DOUBLE:
+			memcpy(pout, (void *)&pi[i].d, sizeof(double));
+			pout += sizeof(double);
+			break;
+		case LITERAL_INT:
+			lit_i = (int)pi[i].d;
+			memcpy(pout, (void *)&lit_i, sizeof(int));
+			pout += sizeof(int);
+			break;
+		case LITERAL_STRING:
+			strcpy((char *)pout, pi[i].s);
+			pout += strlen(pi[i].s)+1;
+			break;
+		case LITERAL_FORMAT:
+			/* the plan follows the string in the original postfix */
+			memcpy(pout, pi[i].s, strlen(pi[i].s)+1+sizeof(sCalcFormatPlan));
+			pout += strlen(pi[i].s)+1+sizeof(sCalcFormatPlan);
+			break;
+		case MIN: case MAX: case FINITE: case ISNAN:
+			*pout++ = pi[i].nargs;
+			break;
+		}
+	}
+	*pout++ = END_EXPRESSION;
+	return((int)(pout - post));
+}
+
+/* Read the postfix after the string-usage byte into at most max instructions.
+ * String literals are left in post.  Return the number read, or -1.
+ */
+static int opt_decode(const unsigned char *post, calcOptInst *pi, int max)
+{
+	int n, lit_i;
+
+	for (n=0; *post != END_EXPRESSION; n++) {
+		if (n >= max) return(-1);
+		memset(&pi[n], 0, sizeof(calcOptInst));
+		pi[n].op = *post++;
+		switch (pi[n].op) {
+		case LITERAL_DOUBLE:
+			memcpy((void *)&pi[n].d, post, sizeof(double));
+			post += sizeof(double);
+			break;
+		case LITERAL_INT:
+			memcpy((void *)&lit_i, post, sizeof(int));
+			pi[n].d = lit_i;
+			post += sizeof(int);
+			break;
+		case LITERAL_STRING:
+			pi[n].s = (const char *)post;
+			post += strlen((const char *)post)+1;
+			break;
+		case LITERAL_FORMAT:
+			pi[n].s = (const char *)post;
+			post += strlen((const char *)post)+1+sizeof(sCalcFormatPlan);
+			break;
+		case MIN: case MAX: case FINITE: case ISNAN:
+			pi[n].nargs = *post++;
+			break;
+		}
+		if (opt_describe(&pi[n])) return(-1);
+	}
+	return(n);
+}
+
+/* Evaluate constant instructions with sCalcPerform(), taking the same path through
+ * it (numeric or string) as the expression being optimized.
+ */
+static int opt_eval(const calcOptInst *pi, int n, int usage, double *pd)
+{
+	unsigned char post[(SCALC_STACKSIZE+2)*(1+sizeof(double))+2];
+
+	*pd = 0.;
+	if (opt_encode(pi, n, usage, post, sizeof(post)) < 0) return(-1);
+	return(sCalcPerform(NULL, 0, NULL, 0, pd, NULL, 0, post, 0) ? -1 : 0);
+}
+
+static int opt_eval_numeric(const calcOptInst *pi, int n, double *pd) {
+	return(opt_eval(pi, n, NO_STRING, pd));
+}
+
+static int opt_eval_string(const calcOptInst *pi, int n, double *pd) {
+	return(opt_eval(pi, n, USES_STRING, pd));
+}
+
+static const calcOptLang optLangNumeric = {
+	LITERAL_DOUBLE, LITERAL_INT,
+	ADD, MULT, DIV, POWER, MAX_VAL, MIN_VAL,
+	COND_IF, COND_ELSE, COND_END,
+	SCALC_STACKSIZE,
+	opt_describe,
+	opt_eval_numeric
+};
+
+static const calcOptLang optLangString = {
+	LITERAL_DOUBLE, LITERAL_INT,
+	ADD, MULT, DIV, POWER, MAX_VAL, MIN_VAL,
+	COND_IF, COND_ELSE, COND_END,
+	SCALC_STACKSIZE,
+	opt_describe,
+	opt_eval_string
 };
 
+/* Replace the postfix expression at ppostfix with an optimized version no longer
+ * than size bytes, or leave it alone.
+ */
+static void optimize(unsigned char *ppostfix, int size)
+{
+	calcOptInst *in, *out;
+	unsigned char *post;
+	int n, len = -1, usage = *ppostfix, hadState = sCalcPerformThreadState();
+
+	in = (calcOptInst *)calloc(size, sizeof(calcOptInst));
+	out = (calcOptInst *)calloc(size, sizeof(calcOptInst));
+	post = (unsigned char *)malloc(size);
+	if (in && out && post) {
+		n = opt_decode(ppostfix+1, in, size);
+		if (n > 0) n = calcOptimize((usage == USES_STRING) ? &optLangString : &optLangNumeric,
+			in, n, out, size);
+		if (n > 0) len = opt_encode(out, n, usage, post, size);
+		if (len > 0) memcpy(ppostfix, post, len);
+	}
+	/* opt_eval() used sCalcPerform(), in whatever thread is compiling (e.g., a CA
+	 * server thread that wrote a CALC field, which exits when its client goes away).
+	 * Free what that made, but not what the thread's own evaluations use.
+	 */
+	if (!hadState) sCalcPerformThreadCleanup();
+	if (sCalcPostfixDebug && (len <= 0)) printf("sCalcPostfix: expression not optimized\n");
+	free(in);
+	free(out);
+	free(post);
+}
+
+/*** end optimizer support ***/
+
+/*** begin register programs ***/
+
+#ifndef PI
+#define PI 3.14159265358979323
+#endif
+#define REG_MAX_NEST 20		/* conditionals and loops open at once */
+
+/* Lowering works through the postfix with a stack of the operands that would
+ * hold each stack element's value.  An operator's result goes to the register
+ * numbered by the stack position it would occupy, so registers needn't be
+ * allocated.
+ */
+typedef struct {
+	unsigned char *code, *pc, *end;		/* code being written */
+	unsigned char opnd[SCALC_REG_NUM];	/* operand holding each stack element */
+	int depth, maxDepth;
+	int floor;							/* depth below which the open conditional or loop can't pop */
+	double konst[SCALC_REG_NUM];		/* konst[k] is in register SCALC_REG_NUM-1-k */
+	int numConst, numArgs;
+} regLower;
+
+#define REG_PUT(pl, b) do { \
+		if ((pl)->pc >= (pl)->end) return(-1); \
+		*(pl)->pc++ = (unsigned char)(b); \
+	} while (0)
+
+static int reg_const(regLower *pl, double d)
+{
+	double e;
+	int k;
+
+	if ((d >= 0) && (d < 64)) {
+		e = (int)d;
+		if (memcmp(&e, &d, sizeof(double)) == 0) return(SCALC_REG_INT | (int)d);
+	}
+	for (k=0; k<pl->numConst; k++) {
+		if (memcmp(&pl->konst[k], &d, sizeof(double)) == 0) break;
+	}
+	if (k == pl->numConst) {
+		if (pl->maxDepth + k >= SCALC_REG_NUM) return(-1);
+		pl->konst[pl->numConst++] = d;
+	}
+	return(SCALC_REG_REG | (SCALC_REG_NUM-1-k));
+}
+
+static int reg_push(regLower *pl, int o)
+{
+	if ((o < 0) || (pl->depth + pl->numConst >= SCALC_REG_NUM)) return(-1);
+	pl->opnd[pl->depth++] = (unsigned char)o;
+	if (pl->depth > pl->maxDepth) pl->maxDepth = pl->depth;
+	return(0);
+}
+
+static int reg_pop(regLower *pl)
+{
+	if (pl->depth <= pl->floor) return(-1);
+	return(pl->opnd[--pl->depth]);
+}
+
+/* Copy stack element i to its own register */
+static int reg_settle(regLower *pl, int i)
+{
+	if (pl->opnd[i] == (SCALC_REG_REG | i)) return(0);
+	REG_PUT(pl, R_MOVE);
+	REG_PUT(pl, SCALC_REG_REG | i);
+	REG_PUT(pl, pl->opnd[i]);
+	pl->opnd[i] = SCALC_REG_REG | i;
+	return(0);
+}
+
+/* Copy stack elements that are argument slot arg (or any slot, if arg < 0) to
+ * their own registers, before the slot is stored to, or before code that might
+ * or might not store to it.
+ */
+static int reg_settle_args(regLower *pl, int arg)
+{
+	int i, o;
+
+	for (i=0; i<pl->depth; i++) {
+		o = pl->opnd[i];
+		if ((SCALC_REG_KIND(o) == SCALC_REG_ARG) && ((arg < 0) || (SCALC_REG_INDEX(o) == arg))) {
+			if (reg_settle(pl, i)) return(-1);
+		}
+	}
+	return(0);
+}
+
+static void reg_patch(regLower *pl, int at)
+{
+	int target = (int)(pl->pc - pl->code);
+
+	pl->code[at] = target & 0xff;
+	pl->code[at+1] = (target >> 8) & 0xff;
+}
+
+/* Write the code for numeric postfix post.  Return -1 if it can't be done. */
+static int reg_lower(regLower *pl, const unsigned char *post)
+{
+	struct {
+		int op;			/* COND_IF, COND_ELSE, or UNTIL */
+		int at;			/* jump target to patch, or loop start */
+		int depth, floor;
+	} nest[REG_MAX_NEST];
+	int numNest = 0, numUntil = 0;
+	int op, a, b, i, n, lit_i;
+	double d;
+
+	while ((op = *post++) != END_EXPRESSION) {
+		if ((op >= FETCH_A) && (op <= FETCH_P)) {
+			i = op - FETCH_A;
+			if (i >= pl->numArgs) pl->numArgs = i+1;
+			if (reg_push(pl, SCALC_REG_ARG | i)) return(-1);
+			continue;
+		}
+		if ((op >= STORE_A) && (op <= STORE_P)) {
+			i = op - STORE_A;
+			if (i >= pl->numArgs) pl->numArgs = i+1;
+			if ((a = reg_pop(pl)) < 0) return(-1);
+			if (reg_settle_args(pl, i)) return(-1);
+			REG_PUT(pl, op);
+			REG_PUT(pl, a);
+			continue;
+		}
+		switch (op) {
+		case FETCH_VAL:
+			if (reg_push(pl, SCALC_REG_VAL)) return(-1);
+			break;
+
+		case LITERAL_DOUBLE:
+			memcpy((void *)&d, post, sizeof(double));
+			post += sizeof(double);
+			if (reg_push(pl, reg_const(pl, d))) return(-1);
+			break;
+		case LITERAL_INT:
+			memcpy((void *)&lit_i, post, sizeof(int));
+			post += sizeof(int);
+			if (reg_push(pl, reg_const(pl, (double)lit_i))) return(-1);
+			break;
+		case CONST_PI:
+			if (reg_push(pl, reg_const(pl, PI))) return(-1);
+			break;
+		case CONST_D2R:
+			if (reg_push(pl, reg_const(pl, PI/180.))) return(-1);
+			break;
+		case CONST_R2D:
+			if (reg_push(pl, reg_const(pl, 180./PI))) return(-1);
+			break;
+		case CONST_S2R:
+			if (reg_push(pl, reg_const(pl, PI/(180.*3600)))) return(-1);
+			break;
+		case CONST_R2S:
+			if (reg_push(pl, reg_const(pl, (180.*3600)/PI))) return(-1);
+			break;
+
+		case RANDOM: case NORMAL_RNDM:
+			REG_PUT(pl, op);
+			REG_PUT(pl, SCALC_REG_REG | pl->depth);
+			if (reg_push(pl, SCALC_REG_REG | pl->depth)) return(-1);
+			break;
+
+		case UNARY_NEG: case ABS_VAL: case EXP: case LOG_10: case LOG_E: case SQU_RT:
+		case ACOS: case ASIN: case ATAN: case COS: case COSH: case SIN: case SINH:
+		case TAN: case TANH: case CEIL: case FLOOR: case ISINF: case NINT:
+		case REL_NOT: case BIT_NOT: case A_FETCH:
+			if ((a = reg_pop(pl)) < 0) return(-1);
+			REG_PUT(pl, op);
+			REG_PUT(pl, SCALC_REG_REG | pl->depth);
+			REG_PUT(pl, a);
+			if (reg_push(pl, SCALC_REG_REG | pl->depth)) return(-1);
+			break;
+
+		case ADD: case SUB: case MULT: case DIV: case MODULO: case POWER: case ATAN2:
+		case REL_OR: case REL_AND: case BIT_OR: case BIT_AND: case BIT_EXCL_OR:
+		case RIGHT_SHIFT: case LEFT_SHIFT: case NOT_EQ: case LESS_THAN: case LESS_OR_EQ:
+		case EQUAL: case GR_OR_EQ: case GR_THAN: case MAX_VAL: case MIN_VAL:
+			if ((b = reg_pop(pl)) < 0) return(-1);
+			if ((a = reg_pop(pl)) < 0) return(-1);
+			REG_PUT(pl, op);
+			REG_PUT(pl, SCALC_REG_REG | pl->depth);
+			REG_PUT(pl, a);
+			REG_PUT(pl, b);
+			if (reg_push(pl, SCALC_REG_REG | pl->depth)) return(-1);
+			break;
+
+		case MAX: case MIN: case FINITE: case ISNAN:
+			n = *post++;
+			if ((n < 1) || (pl->depth - n < pl->floor)) return(-1);
+			pl->depth -= n;
+			REG_PUT(pl, op);
+			REG_PUT(pl, SCALC_REG_REG | pl->depth);
+			REG_PUT(pl, n);
+			for (i=0; i<n; i++) REG_PUT(pl, pl->opnd[pl->depth+i]);
+			if (reg_push(pl, SCALC_REG_REG | pl->depth)) return(-1);
+			break;
+
+		case A_STORE:
+			if ((b = reg_pop(pl)) < 0) return(-1);
+			if ((a = reg_pop(pl)) < 0) return(-1);
+			if (reg_settle_args(pl, -1)) return(-1);
+			REG_PUT(pl, op);
+			REG_PUT(pl, a);
+			REG_PUT(pl, b);
+			break;
+
+		case COND_IF:
+			if ((a = reg_pop(pl)) < 0) return(-1);
+			if ((numNest >= REG_MAX_NEST) || reg_settle_args(pl, -1)) return(-1);
+			REG_PUT(pl, op);
+			REG_PUT(pl, a);
+			nest[numNest].op = op;
+			nest[numNest].at = (int)(pl->pc - pl->code);
+			nest[numNest].depth = pl->depth;
+			nest[numNest].floor = pl->floor;
+			numNest++;
+			pl->floor = pl->depth;
+			REG_PUT(pl, 0);
+			REG_PUT(pl, 0);
+			break;
+
+		case COND_ELSE:
+			/* the first branch's value goes where the second's will */
+			if ((numNest < 1) || (nest[numNest-1].op != COND_IF) ||
+				(pl->depth != nest[numNest-1].depth+1)) return(-1);
+			if (reg_settle(pl, pl->depth-1)) return(-1);
+			pl->depth--;
+			REG_PUT(pl, op);
+			REG_PUT(pl, 0);
+			REG_PUT(pl, 0);
+			reg_patch(pl, nest[numNest-1].at);
+			nest[numNest-1].op = op;
+			nest[numNest-1].at = (int)(pl->pc - pl->code) - 2;
+			break;
+
+		case COND_END:
+			if ((numNest < 1) || (nest[numNest-1].op != COND_ELSE) ||
+				(pl->depth != nest[numNest-1].depth+1)) return(-1);
+			if (reg_settle(pl, pl->depth-1)) return(-1);
+			numNest--;
+			reg_patch(pl, nest[numNest].at);
+			pl->floor = nest[numNest].floor;
+			break;
+
+		case UNTIL:
+			if ((++numUntil > 9) || (numNest >= REG_MAX_NEST) || reg_settle_args(pl, -1))
+				return(-1);
+			nest[numNest].op = op;
+			nest[numNest].at = (int)(pl->pc - pl->code);
+			nest[numNest].depth = pl->depth;
+			nest[numNest].floor = pl->floor;
+			numNest++;
+			pl->floor = pl->depth;
+			break;
+
+		case UNTIL_END:
+			if ((numNest < 1) || (nest[numNest-1].op != UNTIL) ||
+				(pl->depth != nest[numNest-1].depth+1)) return(-1);
+			numNest--;
+			REG_PUT(pl, op);
+			REG_PUT(pl, pl->opnd[pl->depth-1]);
+			REG_PUT(pl, nest[numNest].at & 0xff);
+			REG_PUT(pl, (nest[numNest].at >> 8) & 0xff);
+			pl->floor = nest[numNest].floor;
+			break;
+
+		default:
+			/* anything else isn't worth a register program */
+			return(-1);
+		}
+	}
+	if ((pl->depth != 1) || numNest) return(-1);
+	REG_PUT(pl, END_EXPRESSION);
+	REG_PUT(pl, pl->opnd[0]);
+	return(0);
+}
+
+/* Replace the numeric postfix expression at ppostfix with a register program no
+ * longer than size bytes, or leave it alone.
+ */
+static void lower(unsigned char *ppostfix, int size)
+{
+	regLower l;
+	int i, len = -1;
+
+	if (*ppostfix != NO_STRING) return;
+	memset(&l, 0, sizeof(regLower));
+	l.code = l.pc = (unsigned char *)malloc(size);
+	l.end = l.code + size;
+	if (l.code && (reg_lower(&l, ppostfix+1) == 0)) {
+		len = 3 + l.numConst*sizeof(double) + (int)(l.pc - l.code);
+		if ((len <= size) && (l.pc - l.code <= 0xffff)) {
+			ppostfix[0] = REG_PROGRAM;
+			ppostfix[1] = l.numConst;
+			ppostfix[2] = l.numArgs;
+			for (i=0; i<l.numConst; i++) {
+				memcpy(ppostfix+3+i*sizeof(double), (void *)&l.konst[l.numConst-1-i], sizeof(double));
+			}
+			memcpy(SCALC_REG_CODE(ppostfix), l.code, l.pc - l.code);
+			/* clear what's left of the postfix, so a program's bytes don't depend on it */
+			memset(ppostfix+len, 0, size-len);
+		} else {
+			len = -1;
+		}
+	}
+	if (sCalcPostfixDebug && (len < 0)) printf("sCalcPostfix: expression not lowered\n");
+	free(l.code);
+}
+
+/* Number of bytes of the register instruction at pc */
+int sCalcRegLength(const unsigned char *pc)
+{
+	int op = *pc;
+
+	if ((op >= STORE_A) && (op <= STORE_P)) return(2);
+	switch (op) {
+	case END_EXPRESSION: case RANDOM: case NORMAL_RNDM:
+		return(2);
+	case COND_ELSE:
+		return(3);
+	case COND_IF: case UNTIL_END:
+	case ADD: case SUB: case MULT: case DIV: case MODULO: case POWER: case ATAN2:
+	case REL_OR: case REL_AND: case BIT_OR: case BIT_AND: case BIT_EXCL_OR:
+	case RIGHT_SHIFT: case LEFT_SHIFT: case NOT_EQ: case LESS_THAN: case LESS_OR_EQ:
+	case EQUAL: case GR_OR_EQ: case GR_THAN: case MAX_VAL: case MIN_VAL:
+		return(4);
+	case MAX: case MIN: case FINITE: case ISNAN:
+		return(3+pc[2]);
+	}
+	return(3);
+}
+
+static void reg_dump_operand(const unsigned char *prog, int o)
+{
+	double d;
+	int i = SCALC_REG_INDEX(o);
+
+	switch (SCALC_REG_KIND(o)) {
+	case SCALC_REG_ARG:
+		printf(" %c", 'A'+i);
+		break;
+	case SCALC_REG_VAL:
+		printf(" VAL");
+		break;
+	case SCALC_REG_INT:
+		printf(" %d", i);
+		break;
+	default:
+		if (i >= SCALC_REG_NUM - prog[1]) {
+			memcpy((void *)&d, prog+3+(i-(SCALC_REG_NUM-prog[1]))*sizeof(double), sizeof(double));
+			printf(" %g", d);
+		} else {
+			printf(" r%d", i);
+		}
+	}
+}
+
+/* Disassemble a register program to stdout */
+static void reg_dump(const unsigned char *prog)
+{
+	const unsigned char *code = SCALC_REG_CODE(prog), *pc = code;
+	int op, i, n;
+
+	printf("\tRegister program, %d constant(s), %d argument(s)\n", prog[1], prog[2]);
+	do {
+		op = *pc;
+		printf("\t%4d %s", (int)(pc - code), opcodes[op]);
+		switch (op) {
+		case COND_IF: case UNTIL_END:
+			reg_dump_operand(prog, pc[1]);
+			printf(" -> %d", pc[2] | (pc[3] << 8));
+			pc += 4;
+			break;
+		case COND_ELSE:
+			printf(" -> %d", pc[1] | (pc[2] << 8));
+			pc += 3;
+			break;
+		case MAX: case MIN: case FINITE: case ISNAN:
+			reg_dump_operand(prog, pc[1]);
+			n = pc[2];
+			for (i=0; i<n; i++) reg_dump_operand(prog, pc[3+i]);
+			pc += 3+n;
+			break;
+		default:
+			n = sCalcRegLength(pc);
+			for (i=1; i<n; i++) reg_dump_operand(prog, pc[i]);
+			pc += n;
+		}
+		printf("\n");
+	} while (op != END_EXPRESSION);
+}
+
+/* If ppostfix is a register program, compile it to machine code, if it and the
+ * function's address fit in size bytes.  Only calcCache does this, because the
+ * code must be released with sCalcNativeRelease() when the postfix is freed.
+ */
+void sCalcPostfixCompileNative(unsigned char *ppostfix, int size)
+{
+	sCalcNativeFunc func;
+	const unsigned char *pc;
+	int len;
+
+	if (*ppostfix != REG_PROGRAM) return;
+	for (pc = SCALC_REG_CODE(ppostfix); *pc != END_EXPRESSION; pc += sCalcRegLength(pc))
+		;
+	len = (int)(pc - ppostfix) + sCalcRegLength(pc);
+	if ((len + 1 + (int)sizeof(func) > size) || sCalcNativeCompile(ppostfix, &func)) {
+		if (sCalcPostfixDebug) printf("sCalcPostfix: expression not compiled to machine code\n");
+		return;
+	}
+	memmove(SCALC_NATIVE_PROGRAM(ppostfix), ppostfix, len);
+	ppostfix[0] = REG_NATIVE;
+	memcpy(ppostfix+1, (void *)&func, sizeof(func));
+	if (sCalcPostfixDebug) printf("sCalcPostfix: compiled to machine code\n");
+}
+
+/*** end register programs ***/
+
+/* Plan the format string fmt of PRINTF (scan == 0) or SSCANF (scan == 1).  Only
+ * formats with a single, simple conversion are planned; for others, pp->conv is
+ * left 0, and sCalcPerform() parses the format as it always has.
+ */
+static void format_plan(const char *fmt, int scan, sCalcFormatPlan *pp)
+{
+	const char *pct, *s;
+	int n;
+
+	memset(pp, 0, sizeof(sCalcFormatPlan));
+	pp->prec = SCALC_FMT_NO_PREC;
+	pct = strchr(fmt, '%');
+	if ((pct == NULL) || strchr(pct+1, '%') || (strlen(fmt) > 255)) return;
+	s = pct+1;
+	if (!scan) {
+		for (; (*s == '-') || (*s == '0'); s++)
+			pp->flags |= (*s == '-') ? SCALC_FMT_LEFT : SCALC_FMT_ZERO;
+	} else if (*s == '0') {
+		return;
+	}
+	for (n=0; isdigit((int)*s) && (n < 1000); s++) n = n*10 + *s - '0';
+	if (n > 255) return;
+	pp->width = n;
+	if (!scan && (*s == '.')) {
+		for (n=0, s++; isdigit((int)*s) && (n < 1000); s++) n = n*10 + *s - '0';
+		if (n >= SCALC_FMT_NO_PREC) return;
+		pp->prec = n;
+	}
+	if (*s == 'h') {
+		pp->flags |= SCALC_FMT_SHORT;
+		s++;
+	} else if (*s == 'l') {
+		pp->flags |= SCALC_FMT_LONG;
+		s++;
+	}
+	switch (*s) {
+	case 'd': case 'u': case 'x': case 'X': case 'o':
+		if (pp->prec != SCALC_FMT_NO_PREC) return;
+		break;
+	case 'i':
+		/* sscanf's %i takes 0x and 0 prefixes */
+		if (scan || (pp->prec != SCALC_FMT_NO_PREC)) return;
+		break;
+	case 'e': case 'E': case 'f': case 'g': case 'G':
+		if (pp->flags & SCALC_FMT_SHORT) return;
+		break;
+	case 'c':
+		if (!scan && (pp->prec != SCALC_FMT_NO_PREC)) return;
+		/* fall through */
+	case 's':
+		if (pp->flags & (SCALC_FMT_ZERO | SCALC_FMT_SHORT | SCALC_FMT_LONG)) return;
+		break;
+	default:
+		return;
+	}
+	pp->start = (unsigned char)(pct - fmt);
+	pp->end = (unsigned char)(s+1 - fmt);
+	pp->len = (unsigned char)strlen(fmt);
+	pp->conv = *s;
+}
+
+/* The string constant at plit, the last thing put to the postfix, is the format
+ * of PRINTF or SSCANF.  If the format can be planned, make it a LITERAL_FORMAT,
+ * and return the new end of the postfix.
+ */
+static unsigned char *add_format_plan(unsigned char *plit, unsigned char *pout, int scan)
+{
+	sCalcFormatPlan plan;
+
+	format_plan((const char *)plit+1, scan, &plan);
+	if (plan.conv == 0) return(pout);
+	*plit = LITERAL_FORMAT;
+	memcpy(pout, &plan, sizeof(sCalcFormatPlan));
+	if (sCalcPostfixDebug>=5) printf("planned format '%s'\n", (const char *)plit+1);
+	return(pout + sizeof(sCalcFormatPlan));
+}
 
 /* sCalcPostfix
  *
@@ -414,11 +1210,13 @@ epicsShareFunc long
 	int runtime_depth = 0;
 	int cond_count = 0;
 	unsigned char *pout = ppostfix;
+	unsigned char *plit = NULL, *plit_end = NULL;	/* last string constant */
 	char *pnext;
 	double lit_d;
 	int lit_i;
 	char c;
 	int handled;
+	int srclen;
 
 	if (psrc == NULL || pout == NULL || perror == NULL) {
 		if (perror) *perror = CALC_ERR_NULL_ARG;
@@ -429,6 +1227,7 @@ epicsShareFunc long
 		if (pout) *pout = END_EXPRESSION;
 		return 0;
 	}
+	srclen = (int)strlen(psrc);
 
 	/* place the expression elements into postfix */
 	*pout++ = NO_STRING;
@@ -463,6 +1262,10 @@ epicsShareFunc long
 			case AMODBUS:
 			case XOR8:
 			case ADD_XOR8:
+			case CRC32:
+			case ADD_CRC32:
+			case CRC_CCITT:
+			case ADD_CCITT:
 			case LEN:
 				*ppostfix = USES_STRING;
 				break;
@@ -623,6 +1426,12 @@ epicsShareFunc long
 				runtime_depth += pstacktop->runtime_effect;
 				pstacktop--;
 			}
+			/* a string constant that is all of PRINTF's first argument is its format */
+			if ((pout == plit_end) && (pstacktop->runtime_effect == 0) &&
+					(pstacktop-1 > stack) && ((pstacktop-1)->code == PRINTF)) {
+				pout = add_format_plan(plit, pout, 0);
+				plit_end = NULL;
+			}
 			operand_needed = TRUE;
 			pstacktop->runtime_effect -= 1;
 			break;
@@ -645,6 +1454,12 @@ epicsShareFunc long
 				pstacktop--;
 			}
 			pstacktop--;	/* remove ( from stack */
+			/* a string constant that is all of SSCANF's second argument is its format */
+			if ((pout == plit_end) && ((pstacktop+1)->runtime_effect == -1) &&
+					(pstacktop > stack) && (pstacktop->code == SSCANF)) {
+				pout = add_format_plan(plit, pout, 1);
+				plit_end = NULL;
+			}
 			/* if there is a vararg operator before the opening paren,
 			   it inherits the (opening) paren's stack effect */
 			if ((pstacktop > stack) &&
@@ -798,11 +1613,13 @@ epicsShareFunc long
 
 		case STRING_OPERAND:
 			runtime_depth += pel->runtime_effect;
+			plit = pout;
 			*pout++ = pel->code;
 			if (sCalcPostfixDebug>=5) printf("put %s to postfix\n", opcodes[(int) pel->code]);
 			c = psrc[-1]; /* " or ' character */
 			while (*psrc != c && *psrc) *pout++ = *psrc++;
 			*pout++ = '\0';
+			plit_end = pout;
 			if (*psrc) psrc++;
 			operand_needed = FALSE;
 			break;
@@ -865,6 +1682,23 @@ epicsShareFunc long
 		*perror = CALC_ERR_INCOMPLETE;
 		goto bad;
 	}
+	if (sCalcPostfixOptimize) {
+		/* the caller's buffer is at least SCALC_INFIX_TO_POSTFIX_SIZE(srclen) */
+		if (sCalcPostfixDebug) {
+			printf("sCalcPostfix: before optimizing:\n");
+			sCalcExprDump(ppostfix);
+		}
+		optimize(ppostfix, SCALC_INFIX_TO_POSTFIX_SIZE(srclen));
+		if (sCalcPostfixDebug) {
+			printf("sCalcPostfix: after optimizing:\n");
+			sCalcExprDump(ppostfix);
+		}
+	}
+	if (sCalcPostfixLower) lower(ppostfix, SCALC_INFIX_TO_POSTFIX_SIZE(srclen));
+	if (sCalcPostfixDebug && (*ppostfix == REG_PROGRAM)) {
+		printf("sCalcPostfix: register program:\n");
+		sCalcExprDump(ppostfix);
+	}
 	if (sCalcPostfixDebug) printf("\nsCalcPostfix: returning success\n");
 	return 0;
 
@@ -909,6 +1743,114 @@ epicsShareFunc const char *
 	return errStrs[error];
 }
 
+/* Bit for the register-program operand o, if it names an argument or VAL */
+static epicsUInt32 reg_operand_usage(int o)
+{
+	switch (SCALC_REG_KIND(o)) {
+	case SCALC_REG_ARG:	return(SCALC_ARG_A << SCALC_REG_INDEX(o));
+	case SCALC_REG_VAL:	return(SCALC_ARG_VAL);
+	}
+	return(0);
+}
+
+/* sCalcArgUsage
+ *
+ * Find the arguments the given postfix reads (*pinputs) and stores to (*pstores),
+ * as SCALC_ARG_xxx bits.  An operator that takes the argument's number from the
+ * stack (@, @@) counts as using all of them.  Return -1 if the postfix is empty.
+ */
+epicsShareFunc long
+	sCalcArgUsage(const unsigned char *postfix, epicsUInt32 *pinputs, epicsUInt32 *pstores)
+{
+	const unsigned char *pinst = postfix;
+	epicsUInt32 inputs = 0, stores = 0;
+	int op, i, n;
+
+	*pinputs = *pstores = 0;
+	if (*pinst == END_EXPRESSION) return(-1);
+	if (*pinst == REG_NATIVE) pinst = SCALC_NATIVE_PROGRAM(pinst);
+	if (*pinst == REG_PROGRAM) {
+		pinst = SCALC_REG_CODE(pinst);
+		do {
+			op = *pinst;
+			n = sCalcRegLength(pinst);
+			if ((op >= STORE_A) && (op <= STORE_P)) stores |= SCALC_ARG_A << (op - STORE_A);
+			switch (op) {
+			case COND_IF: case UNTIL_END: case END_EXPRESSION:
+				inputs |= reg_operand_usage(pinst[1]);
+				break;
+			case COND_ELSE:
+				break;
+			case MAX: case MIN: case FINITE: case ISNAN:
+				for (i=3; i<n; i++) inputs |= reg_operand_usage(pinst[i]);
+				break;
+			case RANDOM: case NORMAL_RNDM:
+				inputs |= SCALC_ARG_RANDOM;
+				break;
+			case A_FETCH:
+				inputs |= SCALC_ARG_ALL_SCALARS;
+				break;
+			case A_STORE:
+				stores |= SCALC_ARG_ALL_SCALARS;
+				/* fall through */
+			default:
+				for (i=1; i<n; i++) inputs |= reg_operand_usage(pinst[i]);
+			}
+			pinst += n;
+		} while (op != END_EXPRESSION);
+	} else {
+		while ((op = *pinst++) != END_EXPRESSION) {
+			if ((op >= FETCH_A) && (op <= FETCH_P)) {
+				inputs |= SCALC_ARG_A << (op - FETCH_A);
+			} else if ((op >= FETCH_AA) && (op <= FETCH_LL)) {
+				inputs |= SCALC_ARG_AA << (op - FETCH_AA);
+			} else if ((op >= STORE_A) && (op <= STORE_P)) {
+				stores |= SCALC_ARG_A << (op - STORE_A);
+			} else if ((op >= STORE_AA) && (op <= STORE_LL)) {
+				stores |= SCALC_ARG_AA << (op - STORE_AA);
+			}
+			switch (op) {
+			case LITERAL_DOUBLE:
+				pinst += sizeof(double);
+				break;
+			case LITERAL_INT:
+				pinst += sizeof(int);
+				break;
+			case LITERAL_STRING:
+				pinst += strlen((char *)pinst)+1;
+				break;
+			case LITERAL_FORMAT:
+				pinst += strlen((char *)pinst)+1+sizeof(sCalcFormatPlan);
+				break;
+			case MIN: case MAX: case FINITE: case ISNAN:
+				pinst++;
+				break;
+			case FETCH_VAL: case FETCH_SVAL:
+				inputs |= SCALC_ARG_VAL;
+				break;
+			case A_FETCH:
+				inputs |= SCALC_ARG_ALL_SCALARS;
+				break;
+			case A_SFETCH:
+				inputs |= SCALC_ARG_ALL_STRINGS;
+				break;
+			case A_STORE:
+				stores |= SCALC_ARG_ALL_SCALARS;
+				break;
+			case A_SSTORE:
+				stores |= SCALC_ARG_ALL_STRINGS;
+				break;
+			case RANDOM: case NORMAL_RNDM:
+				inputs |= SCALC_ARG_RANDOM;
+				break;
+			}
+		}
+	}
+	*pinputs = inputs;
+	*pstores = stores;
+	return(0);
+}
+
 /* sCalcExprDump
  *
  * Disassemble the given postfix instructions to stdout
@@ -920,6 +1862,14 @@ epicsShareFunc void
 	double lit_d;
 	int lit_i;
 	
+	if (*pinst == REG_NATIVE) {
+		printf("\tMachine code, for:\n");
+		pinst = SCALC_NATIVE_PROGRAM(pinst);
+	}
+	if (*pinst == REG_PROGRAM) {
+		reg_dump(pinst);
+		return;
+	}
 	while ((op = *pinst) != END_EXPRESSION) {
 		switch (op) {
 		case LITERAL_DOUBLE:
@@ -937,6 +1887,11 @@ epicsShareFunc void
 			printf("\tString \"%s\"\n", pinst);
 			pinst += strlen((char *)pinst)+1;
 			break;
+		case LITERAL_FORMAT:
+			++pinst;
+			printf("\tFormat \"%s\" (%%%c)\n", pinst, *(pinst+strlen((char *)pinst)+1));
+			pinst += strlen((char *)pinst)+1+sizeof(sCalcFormatPlan);
+			break;
 		case MIN:
 		case MAX:
 		case FINITE:
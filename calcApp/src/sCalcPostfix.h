@@ -15,6 +15,7 @@
 #define INCsCalcPostfixh
 
 #include <shareLib.h>
+#include <epicsTypes.h>
 #define SCALC_STRING_SIZE 40
 
 /* lifted from postfix.h in base, and adapted for sCalc */
@@ -41,6 +42,14 @@
 #define CALC_ERR_BRACKET_NOT_OPEN 14 /* Close bracket without open */
 #define CALC_ERR_CURLY_NOT_OPEN   15 /* Close curly bracket without open */
 
+/* Bits of *pinputs and *pstores from sCalcArgUsage() */
+#define SCALC_ARG_A				0x00000001	/* A is bit 0, B bit 1, ..., P bit 15 */
+#define SCALC_ARG_AA			0x00010000	/* AA is bit 16, BB bit 17, ..., LL bit 27 */
+#define SCALC_ARG_ALL_SCALARS	0x0000ffff
+#define SCALC_ARG_ALL_STRINGS	0x0fff0000
+#define SCALC_ARG_VAL			0x10000000	/* VAL or SVAL, the previous result */
+#define SCALC_ARG_RANDOM		0x20000000	/* the random-number generator */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -52,6 +61,20 @@ epicsShareFunc long
 	sCalcPerform(double *parg, int numArgs, char **psarg, int numSArgs, double *presult,
 	char *psresult, int lenSresult, const unsigned char *post, const int precision);
 
+epicsShareFunc void
+	sCalcPerformSeed(epicsUInt32 seed);
+
+/* sCalcPerform() keeps a random-number generator and a string arena for each
+ * thread that calls it.  A thread that exits should first call this to free
+ * them; otherwise, they're never freed.  A later sCalcPerform() call in the
+ * thread makes new ones, and the generator's sequence starts over.
+ */
+epicsShareFunc void
+	sCalcPerformThreadCleanup(void);
+
+epicsShareFunc long
+	sCalcArgUsage(const unsigned char *postfix, epicsUInt32 *pinputs, epicsUInt32 *pstores);
+
 epicsShareFunc const char *
 	sCalcErrorStr(short error);
 
@@ -19,12 +19,37 @@
 
 
 #define SCALC_STACKSIZE 30
+/* A string value is a view: s points to a null-terminated string, which may
+ * belong to the caller or the postfix, or may have been built during this
+ * evaluation, and len is its length.  s is NULL if the value is a number.
+ */
 struct stackElement {
 	double d;
 	char *s;
-	char local_string[SCALC_STRING_SIZE];
+	int len;
+	const unsigned char *plan;	/* format plan, valid only if it follows s (see LITERAL_FORMAT) */
 };
 
+/* A string constant that is the format of PRINTF or SSCANF is compiled as
+ * LITERAL_FORMAT, followed by the string, its null, and a plan of the format's
+ * one conversion, so sCalcPerform() needn't parse the format each time.
+ */
+typedef struct {
+	unsigned char conv;		/* conversion character, or 0 if the format has no plan */
+	unsigned char flags;	/* SCALC_FMT_xxx */
+	unsigned char width;	/* 0 if none */
+	unsigned char prec;		/* SCALC_FMT_NO_PREC if none */
+	unsigned char start;	/* offset of the conversion's '%' in the format */
+	unsigned char end;		/* offset of the character following the conversion */
+	unsigned char len;		/* length of the format */
+} sCalcFormatPlan;
+
+#define SCALC_FMT_LEFT		0x01	/* '-' */
+#define SCALC_FMT_ZERO		0x02	/* '0' */
+#define SCALC_FMT_SHORT		0x04	/* 'h' */
+#define SCALC_FMT_LONG		0x08	/* 'l' */
+#define SCALC_FMT_NO_PREC	255
+
 epicsShareFunc void
 	sCalcExprDump(const unsigned char *pinst);
 
@@ -136,6 +161,10 @@ typedef enum {
 	AMODBUS,
 	XOR8,
 	ADD_XOR8,
+	CRC32,
+	ADD_CRC32,
+	CRC_CCITT,
+	ADD_CCITT,
 	BIN_READ,
 	BIN_WRITE,
 	LEN,
@@ -145,8 +174,62 @@ typedef enum {
 	UNTIL,
 	UNTIL_END,
 	NO_STRING,
-	USES_STRING
+	USES_STRING,
+	LITERAL_FORMAT,
+	REG_PROGRAM,
+	R_MOVE,
+	REG_NATIVE
 } sCalc_rpn_opcode;
 
+/* A numeric expression is lowered, if it can be, from postfix to a register
+ * program, which sCalcPerform() runs without a stack:
+ *
+ *	REG_PROGRAM, number of constants, number of argument slots used,
+ *	the constants (doubles), the code
+ *
+ * The constants are loaded into the last registers.  Each instruction is an
+ * opcode followed by operand bytes, which name a register, an argument slot,
+ * VAL, or a small integer (SCALC_REG_xxx), and results go to the register named
+ * by the first operand byte.  Most opcodes are those of postfix:
+ *
+ *	unary operator, A_FETCH, R_MOVE		op result a
+ *	binary operator						op result a b		(a was pushed first)
+ *	RANDOM, NORMAL_RNDM					op result
+ *	MAX, MIN, FINITE, ISNAN				op result n a1 ... an
+ *	STORE_A ... STORE_P					op a
+ *	A_STORE								op index a
+ *	COND_IF								op a target		(jump if a is zero)
+ *	COND_ELSE							op target		(jump)
+ *	UNTIL_END							op a target		(jump if a is zero and the loop limit isn't reached)
+ *	END_EXPRESSION						op a			(a is the result)
+ *
+ * Jump targets are two bytes, low byte first, counted from the start of the code.
+ */
+#define SCALC_REG_NUM	64		/* registers, including constants */
+#define SCALC_REG_ARG	0x00	/* operand is argument slot (0-15) */
+#define SCALC_REG_REG	0x40	/* operand is register */
+#define SCALC_REG_VAL	0x80	/* operand is VAL */
+#define SCALC_REG_INT	0xc0	/* operand is integer (0-63) */
+#define SCALC_REG_KIND(o)	((o) & 0xc0)
+#define SCALC_REG_INDEX(o)	((o) & 0x3f)
+#define SCALC_REG_CODE(p)	((p) + 3 + (p)[1]*sizeof(double))
+
+int sCalcRegLength(const unsigned char *pc);
+
+/* If sCalcPostfixNative is set, calcCache may also compile a register program
+ * to machine code (see sCalcNative.c).  The postfix is then REG_NATIVE, the
+ * function's address, and the register program, which is run instead if the
+ * caller supplies fewer arguments than the program uses.  The function returns
+ * nonzero, without setting *presult, if the expression can't be evaluated.
+ */
+typedef int (*sCalcNativeFunc)(double *parg, double *presult);
+#define SCALC_NATIVE_PROGRAM(p)	((p) + 1 + sizeof(sCalcNativeFunc))
+
+int sCalcNativeCompile(const unsigned char *prog, sCalcNativeFunc *pfunc);
+void sCalcNativeRelease(const unsigned char *postfix);
+void sCalcPostfixCompileNative(unsigned char *ppostfix, int size);
+
+int sCalcPerformThreadState(void);
+
 #endif /* INCpostfixPvth */
 
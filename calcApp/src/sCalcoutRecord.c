@@ -79,6 +79,7 @@
 
 #include	<epicsExport.h>
 #include	"sCalcPostfix.h"
+#include	"calcCache.h"
 #define GEN_SIZE_OFFSET
 #include	"sCalcoutRecord.h"
 #undef  GEN_SIZE_OFFSET
@@ -173,6 +174,7 @@ typedef struct rpvtStruct {
 	short		wd_id_1_LOCK;
 	short		caLinkStat; /* NO_CA_LINKS,CA_LINKS_ALL_OK,CA_LINKS_NOT_OK */
 	short		outlink_field_type;
+	struct evalState	*peval;	/* allocated if EVAL is ever "On Input Change" */
 } rpvtStruct;
 
 static void checkAlarms();
@@ -198,6 +200,22 @@ epicsExportAddress(int, sCalcoutRecordDebug);
 static char sFldnames[MAX_FIELDS][3] =
 {"AA","BB","CC","DD","EE","FF","GG","HH","II","JJ","KK","LL"};
 
+/* For EVAL "On Input Change" (see calcNeeded()) */
+typedef struct evalState {
+	short		usageKnown;		/* skippable and inputs are for the current CALC */
+	short		skippable;		/* CALC's result depends only on its inputs */
+	epicsUInt32	inputs;			/* SCALC_ARG_xxx bits of the arguments it reads */
+	short		valid;			/* the values below are those of the last evaluation */
+	long		stat;
+	short		prec;
+	double		args[MAX_FIELDS];
+	char		strs[STRING_MAX_FIELDS][STRING_SIZE];
+	double		val;
+	char		sval[STRING_SIZE];
+} evalState;
+
+static int calcNeeded(scalcoutRecord *pcalc);
+
 static long init_record(scalcoutRecord *pcalc, int pass)
 {
 	DBLINK *plink;
@@ -284,7 +302,7 @@ static long init_record(scalcoutRecord *pcalc, int pass)
 		db_post_events(pcalc,plinkValid,DBE_VALUE);
 	}
 
-	pcalc->clcv = sCalcPostfix(pcalc->calc,pcalc->rpcl,&error_number);
+	pcalc->clcv = calcCachePostfix(CALC_CACHE_SCALC, pcalc->calc, &pcalc->rpcl, &error_number);
 	if (pcalc->clcv) {
 		recGblRecordError(S_db_badField,(void *)pcalc,
 			"scalcout: init_record: Illegal CALC field");
@@ -292,7 +310,7 @@ static long init_record(scalcoutRecord *pcalc, int pass)
 	}
 	db_post_events(pcalc,&pcalc->clcv,DBE_VALUE);
 
-	pcalc->oclv = sCalcPostfix(pcalc->ocal,pcalc->orpc,&error_number);
+	pcalc->oclv = calcCachePostfix(CALC_CACHE_SCALC, pcalc->ocal, &pcalc->orpc, &error_number);
 	if (pcalc->oclv) {
 		recGblRecordError(S_db_badField,(void *)pcalc,
 			"scalcout: init_record: Illegal OCAL field");
@@ -350,16 +368,28 @@ static long process(scalcoutRecord *pcalc)
 		}
 
 		if (fetch_values(pcalc)==0) {
-			stat = sCalcPerform(&pcalc->a, MAX_FIELDS, (char **)(pcalc->strs),
-					STRING_MAX_FIELDS, &pcalc->val, pcalc->sval, STRING_SIZE,
-					pcalc->rpcl, pcalc->prec);
-			if (stat) {
-				pcalc->val = -1;
-				/* strcpy(pcalc->sval,"***ERROR***"); */
-				strNcpy(pcalc->sval, "***ERROR***", STRING_SIZE);
-				recGblSetSevr(pcalc,CALC_ALARM,INVALID_ALARM);
+			if (calcNeeded(pcalc)) {
+				stat = sCalcPerform(&pcalc->a, MAX_FIELDS, (char **)(pcalc->strs),
+						STRING_MAX_FIELDS, &pcalc->val, pcalc->sval, STRING_SIZE,
+						pcalc->rpcl, pcalc->prec);
+				if (stat) {
+					pcalc->val = -1;
+					/* strcpy(pcalc->sval,"***ERROR***"); */
+					strNcpy(pcalc->sval, "***ERROR***", STRING_SIZE);
+					recGblSetSevr(pcalc,CALC_ALARM,INVALID_ALARM);
+				} else {
+					pcalc->udf = FALSE;
+				}
+				if (prpvt->peval) {
+					/* results, so calcNeeded() can tell whether they've been overwritten */
+					prpvt->peval->stat = stat;
+					prpvt->peval->val = pcalc->val;
+					strNcpy(prpvt->peval->sval, pcalc->sval, STRING_SIZE);
+				}
 			} else {
-				pcalc->udf = FALSE;
+				if (sCalcoutRecordDebug)
+					printf("sCalcoutRecord(%s):process: inputs unchanged\n", pcalc->name);
+				if (prpvt->peval->stat) recGblSetSevr(pcalc,CALC_ALARM,INVALID_ALARM);
 			}
 		}
 
@@ -457,7 +487,8 @@ static long special(dbAddr	*paddr, int after)
 	if (!after) return(0);
 	switch (fieldIndex) {
 	case scalcoutRecordCALC:
-		pcalc->clcv = sCalcPostfix(pcalc->calc, pcalc->rpcl, &error_number);
+		pcalc->clcv = calcCachePostfix(CALC_CACHE_SCALC, pcalc->calc, &pcalc->rpcl, &error_number);
+		if (prpvt->peval) prpvt->peval->usageKnown = 0;
 		if (pcalc->clcv) {
 			recGblRecordError(S_db_badField,(void *)pcalc,
 				"scalcout: special(): Illegal CALC field");
@@ -467,7 +498,7 @@ static long special(dbAddr	*paddr, int after)
 		return(0);
 
 	case scalcoutRecordOCAL:
-		pcalc->oclv = sCalcPostfix(pcalc->ocal, pcalc->orpc, &error_number);
+		pcalc->oclv = calcCachePostfix(CALC_CACHE_SCALC, pcalc->ocal, &pcalc->orpc, &error_number);
 		if (pcalc->oclv) {
 			recGblRecordError(S_db_badField,(void *)pcalc,
 				"scalcout: special(): Illegal OCAL field");
@@ -866,6 +897,62 @@ static void monitor(scalcoutRecord *pcalc)
 	return;
 }
 
+/* Must CALC be evaluated?  If EVAL is "On Input Change", it needn't be if it
+ * would give the result it gave last time: none of the arguments it reads, nor
+ * PREC, has changed since then, and nothing has overwritten VAL or SVAL.  This
+ * can't be known of expressions that store to arguments, read VAL or SVAL, or use
+ * random numbers, so those are always evaluated.
+ */
+static int calcNeeded(scalcoutRecord *pcalc)
+{
+	rpvtStruct	*prpvt = (rpvtStruct *)pcalc->rpvt;
+	evalState	*pe = prpvt->peval;
+	char		**pstrs = (char **)pcalc->strs;
+	epicsUInt32	stores;
+	int			i;
+
+	if (pcalc->eval != scalcoutEVAL_On_Change) return(1);
+	if (pe == NULL) {
+		pe = prpvt->peval = (evalState *)calloc(1, sizeof(evalState));
+		if (pe == NULL) return(1);
+	}
+
+	if (!pe->usageKnown) {
+		pe->skippable = (sCalcArgUsage(pcalc->rpcl, &pe->inputs, &stores) == 0) && !stores &&
+			!(pe->inputs & (SCALC_ARG_VAL|SCALC_ARG_RANDOM));
+		pe->usageKnown = 1;
+		pe->valid = 0;
+	}
+	if (!pe->skippable) return(1);
+
+	if (pe->valid && (pcalc->prec == pe->prec) &&
+			!memcmp(&pcalc->val, &pe->val, sizeof(double)) &&
+			(strncmp(pcalc->sval, pe->sval, STRING_SIZE) == 0)) {
+		for (i=0; i<MAX_FIELDS; i++) {
+			if ((pe->inputs & (SCALC_ARG_A << i)) &&
+					memcmp(&pcalc->a + i, &pe->args[i], sizeof(double)))
+				break;
+		}
+		if (i == MAX_FIELDS) {
+			for (i=0; i<STRING_MAX_FIELDS; i++) {
+				if ((pe->inputs & (SCALC_ARG_AA << i)) &&
+						strncmp(pstrs[i], pe->strs[i], STRING_SIZE))
+					break;
+			}
+			if (i == STRING_MAX_FIELDS) return(0);
+		}
+	}
+
+	/* Remember what CALC is evaluated with */
+	memcpy(pe->args, &pcalc->a, sizeof(pe->args));
+	for (i=0; i<STRING_MAX_FIELDS; i++) {
+		if (pe->inputs & (SCALC_ARG_AA << i)) strNcpy(pe->strs[i], pstrs[i], STRING_SIZE);
+	}
+	pe->prec = pcalc->prec;
+	pe->valid = 1;
+	return(1);
+}
+
 static int fetch_values(scalcoutRecord *pcalc)
 {
 	DBLINK	*plink;	/* structure of the link field  */
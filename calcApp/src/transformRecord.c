@@ -118,6 +118,7 @@
 #include "epicsExport.h"
 #include "sCalcPostfix.h"
 #include "sCalcPostfixPvt.h"	/* define BAD_EXPRESSION */
+#include "calcCache.h"
 #define GEN_SIZE_OFFSET
 #include "transformRecord.h"
 #undef GEN_SIZE_OFFSET
@@ -205,7 +206,6 @@ static void checkLinks();
 
 /* These must agree with the .dbd file. */
 #define INFIX_SIZE 120
-#define POSTFIX_SIZE SCALC_INFIX_TO_POSTFIX_SIZE(INFIX_SIZE)
 #define MAX_FIELDS 16
 #define COMMENT_SIZE 39
 /* Fldnames should have MAX_FIELDS elements */
@@ -401,9 +401,9 @@ init_record(dbCommon *pcommon, int pass)
 	struct link		*pinlink, *poutlink;
 	double			*pvalue, *plvalue;
 	short			error_number;
-	/* buffers holding infix, postfix expressions */
+	/* buffers holding infix expressions, pointers to postfix expressions */
 	char			*pclcbuf;
-	unsigned char	*prpcbuf;	
+	const unsigned char	**pprpc;
 	unsigned short	*pInLinkValid, *pOutLinkValid;
 	struct dbAddr	dbAddr;
 	struct rpvtStruct	*prpvt;
@@ -432,11 +432,11 @@ init_record(dbCommon *pcommon, int pass)
 	pvalue = &ptran->a;
 	plvalue = &ptran->la;
 	pclcbuf = ptran->clca;	/* infix expressions */
-	prpcbuf = ptran->rpca;	/* postfix expressions */
+	pprpc = &ptran->rpca;	/* postfix expressions */
 	pcalcInvalid = &ptran->cav;
 	for (i = 0; i < MAX_FIELDS;
 		i++, pinlink++, poutlink++, pvalue++, plvalue++, pInLinkValid++,
-		pOutLinkValid++, pclcbuf += INFIX_SIZE, prpcbuf += POSTFIX_SIZE,
+		pOutLinkValid++, pclcbuf += INFIX_SIZE, pprpc++,
 		pcalcInvalid++) {
 
 		Debug(25, "init_record: ...field %s\n", Fldnames[i]);
@@ -479,8 +479,7 @@ init_record(dbCommon *pcommon, int pass)
 			pclcbuf[INFIX_SIZE - 1] = (char) 0;
 			Debug(19, "init_record: infix expression: '%s'\n", pclcbuf);
 			(void)convertExpression(ptran, convertBuf, pclcbuf);
-			*pcalcInvalid = sCalcPostfix(convertBuf, prpcbuf, &error_number);
-			/* *pcalcInvalid = sCalcPostfix(pclcbuf, prpcbuf, &error_number); */
+			*pcalcInvalid = calcCachePostfix(CALC_CACHE_SCALC, convertBuf, pprpc, &error_number);
 			if (*pcalcInvalid) {
 				recGblRecordError(S_db_badField,(void *)ptran,
 					"transform: init_record: Illegal CALC field");
@@ -511,7 +510,7 @@ process(dbCommon *pcommon)
 	long			status;
 	struct link		*plink;
 	double			*pval, *plval;
-	unsigned char	*prpcbuf;
+	const unsigned char	**pprpc;
 	char			*pclcbuf;
 	struct rpvtStruct	*prpvt = (struct rpvtStruct *)ptran->rpvt;
 	int				*pu, *plu;
@@ -563,11 +562,11 @@ process(dbCommon *pcommon)
 	plink = &ptran->inpa;
 	pval = &ptran->a;
 	plval = &ptran->la;
-	prpcbuf = ptran->rpca;
+	pprpc = &ptran->rpca;
 	pclcbuf = ptran->clca;
 	for (i=0; i < MAX_FIELDS;
 			i++, plink++, pval++, plval++,
-			prpcbuf+=POSTFIX_SIZE, pclcbuf+=INFIX_SIZE) {
+			pprpc++, pclcbuf+=INFIX_SIZE) {
 		no_inlink = plink->type == CONSTANT;
 		/* if value is same as last time, and bitmap is unmarked, don't calc */
 		pu = (int *)pval;
@@ -582,7 +581,7 @@ process(dbCommon *pcommon)
 					*pval,*plval,pu[0],pu[1],plu[0],plu[1]);
 		}
 		new_value = (!same || ((ptran->map&(1<<i)) != 0));
-		postfix_ok = *pclcbuf && (*prpcbuf != BAD_EXPRESSION);
+		postfix_ok = *pclcbuf && *pprpc && (**pprpc != BAD_EXPRESSION);
 		Debug(15, "process: %s input link; \n", no_inlink ? "NO" : "");
 		Debug(15, "process: value is %s\n", new_value ? "NEW" : "OLD");
 		Debug(15, "process: expression is%s ok\n", postfix_ok ? " " : " NOT");
@@ -590,7 +589,7 @@ process(dbCommon *pcommon)
 		if (((no_inlink && !new_value) || ptran->copt==transformCOPT_ALWAYS)
 				&& postfix_ok) {
 			Debug(15, "process: calculating for field %s\n", Fldnames[i]);
-			if (sCalcPerform(&ptran->a, 16, NULL,0, pval, NULL,0, prpcbuf, ptran->prec)) {
+			if (sCalcPerform(&ptran->a, 16, NULL,0, pval, NULL,0, *pprpc, ptran->prec)) {
 				recGblSetSevr(ptran, CALC_ALARM, INVALID_ALARM);
 				ptran->udf = TRUE;
 			}
@@ -632,7 +631,7 @@ special(const DBADDR *paddr, int after)
 	int				special_type = paddr->special;
 	short			error_number;
 	char			*pclcbuf;
-	unsigned char	*prpcbuf;
+	const unsigned char	**pprpc;
 	struct link		*plink = &ptran->inpa;
 	int				fieldIndex = dbGetFieldIndex(paddr);
 	/* link-check stuff */
@@ -667,11 +666,11 @@ special(const DBADDR *paddr, int after)
 		if ((fieldIndex >= transformRecordCLCA) &&
 			(fieldIndex <= transformRecordCLCP)) {
 			pclcbuf = ptran->clca;
-			prpcbuf = ptran->rpca;
+			pprpc = &ptran->rpca;
 			pcalcInvalid = &ptran->cav;
 			for (i = 0;
 				i < MAX_FIELDS && paddr->pfield != (void *) pclcbuf;
-				i++, pclcbuf+=INFIX_SIZE, prpcbuf+=POSTFIX_SIZE, pcalcInvalid++);
+				i++, pclcbuf+=INFIX_SIZE, pprpc++, pcalcInvalid++);
 			if (i < MAX_FIELDS) {
 				status = 0; /* empty expression is valid */
 				if (*pclcbuf) {
@@ -681,12 +680,14 @@ special(const DBADDR *paddr, int after)
 					/* search comment fields for macros */
 					(void)getMacros(ptran);
 					(void)convertExpression(ptran, convertBuf, pclcbuf);
-					status = sCalcPostfix(convertBuf, prpcbuf, &error_number);
-					/* status = sCalcPostfix(pclcbuf, prpcbuf, &error_number); */
+					status = calcCachePostfix(CALC_CACHE_SCALC, convertBuf, pprpc, &error_number);
 					if (status) {
 						recGblRecordError(S_db_badField,(void *)ptran,
 							"transform:special: Illegal CALC field");
 					}
+				} else {
+					calcCacheRelease(*pprpc);
+					*pprpc = NULL;
 				}
 				if (*pcalcInvalid != status) {
 					*pcalcInvalid = status;
@@ -1,6 +1,7 @@
 #include <cmath>
 #include <algorithm>
 #include <vector>
+#include <limits>
 
 #include <epicsTypes.h>
 #include <epicsMath.h>
@@ -10,6 +11,17 @@
 #include <stdio.h>
 
 #include "aCalcPostfix.h"
+#include "calcCache.h"
+
+extern "C" volatile int aCalcPostfixOptimize;
+extern "C" volatile int sCalcPostfixLower;
+extern "C" volatile int sCalcPostfixNative;
+
+/* aCalc's division by zero */
+static double myDiv(double a, double b)
+{
+	return (b == 0) ? (double) ((float) 1e+35) : a / b;
+}
 
 static void testValExpr(const char* expr, double* args, double** aargs, double expected)
 {	
@@ -92,6 +104,182 @@ static void testAValExpr(const char* expr, double* args, double** aargs, double*
 	//free(rpn);
 }
 
+/* Evaluate expr with a caller-owned context (sized too small, so it must grow),
+ * and then again with the same context, and compare with aCalcPerform().
+ */
+static void testCtxExpr(const char* expr, double* args, double** aargs)
+{
+	unsigned char rpn[255];
+	short err;
+	
+	double val = 0.0, cval = 0.0;
+	double aval[12] = {0.0};
+	double caval[12] = {0.0};
+	
+	epicsUInt32 amask;
+	
+	if (aCalcPostfix(expr, rpn, &err))
+	{
+		testDiag("postfix: %s in expression '%s'", aCalcErrorStr(err), expr);
+		return;
+	}
+	
+	aCalcContext *ctx = aCalcContextCreate(1);
+	
+	bool pass = (aCalcPerform(args, 12, aargs, 12, 12, &val, aval, rpn, 12, &amask) == 0);
+	
+	for (int n = 0; n < 2 && pass; n++)
+	{
+		pass = (aCalcPerformCtx(ctx, args, 12, aargs, 12, 12, &cval, caval, rpn, 12, &amask) == 0);
+		pass = pass && (cval == val) && (memcmp(aval, caval, sizeof(aval)) == 0);
+	}
+	
+	aCalcContextFree(ctx);
+	
+	if(!testOk(pass, "context: %s", expr))
+	{
+		testDiag("Expected: %f, Got: %f", val, cval);
+	}
+}
+
+/* Evaluate expr with array arguments of type T, and compare with evaluating it
+ * with the same values as doubles.  Arrays the expression stores must hold what
+ * the evaluation with doubles stored, converted to T.
+ */
+template <class T>
+static void testTypedExpr(const char* expr, int type, double* args, double** aargs)
+{
+	unsigned char rpn[255];
+	short err;
+	
+	double val[2] = {0.0}, dargs[2][12];
+	double aval[2][12] = {{0.0}};
+	std::vector<double> darr(12*12);
+	std::vector<T> tarr(12*12);
+	double *dp[12], *tp[12];
+	
+	epicsUInt32 amask[2];
+	
+	if (aCalcPostfix(expr, rpn, &err))
+	{
+		testDiag("postfix: %s in expression '%s'", aCalcErrorStr(err), expr);
+		return;
+	}
+	
+	for (int i = 0; i < 12; i++)
+	{
+		for (int j = 0; j < 12; j++)
+		{
+			double x = std::numeric_limits<T>::is_signed ? aargs[i][j] : fabs(aargs[i][j]);
+			tarr[i*12+j] = (T) x;
+			darr[i*12+j] = tarr[i*12+j];
+		}
+		dp[i] = &darr[i*12];
+		tp[i] = (double*) &tarr[i*12];
+	}
+	memcpy(dargs[0], args, sizeof(dargs[0]));
+	memcpy(dargs[1], args, sizeof(dargs[1]));
+	
+	aCalcContext *ctx = aCalcContextCreate(12);
+	
+	long stat = aCalcPerformCtx(ctx, dargs[0], 12, dp, 12, 12, &val[0], aval[0], rpn, 12, &amask[0]);
+	bool pass = (aCalcContextArgType(ctx, type) == 0);
+	long tstat = aCalcPerformCtx(ctx, dargs[1], 12, tp, 12, 12, &val[1], aval[1], rpn, 12, &amask[1]);
+	
+	aCalcContextFree(ctx);
+	
+	pass = pass && (stat == tstat) && (val[0] == val[1]) && (amask[0] == amask[1]) &&
+		(memcmp(aval[0], aval[1], sizeof(aval[0])) == 0) &&
+		(memcmp(dargs[0], dargs[1], sizeof(dargs[0])) == 0);
+	for (int i = 0; i < 12*12; i++)
+		pass = pass && ((T) darr[i] == tarr[i]);
+	
+	if(!testOk(pass, "type %d: %s", type, expr))
+	{
+		testDiag("Expected: %f, Got: %f", val[0], val[1]);
+	}
+}
+
+/* Evaluate calc and ocal together, and compare with evaluating them one at a time */
+static void testJointExpr(const char* calc, const char* ocal, double* args, double** aargs)
+{
+	unsigned char rpn[255], orpn[255];
+	short err;
+	
+	double val[2] = {0.0}, oval[2] = {0.0};
+	double aval[2][12] = {{0.0}}, oav[2][12] = {{0.0}};
+	int first[2][2], num[2][2];
+	
+	epicsUInt32 amask;
+	
+	if (aCalcPostfix(calc, rpn, &err) || aCalcPostfix(ocal, orpn, &err))
+	{
+		testDiag("postfix: %s in expression '%s' or '%s'", aCalcErrorStr(err), calc, ocal);
+		return;
+	}
+	
+	aCalcContext *ctx = aCalcContextCreate(12);
+	
+	long stat = aCalcPerformCtx(ctx, args, 12, aargs, 12, 12, &val[0], aval[0], rpn, 12, &amask);
+	aCalcContextResultRange(ctx, &first[0][0], &num[0][0]);
+	stat |= aCalcPerformCtx(ctx, args, 12, aargs, 12, 12, &oval[0], oav[0], orpn, 12, &amask);
+	aCalcContextResultRange(ctx, &first[0][1], &num[0][1]);
+	
+	long jstat = aCalcPerformJointCtx(ctx, args, 12, aargs, 12, 12, &val[1], aval[1], rpn,
+		&oval[1], oav[1], orpn, 12, &amask);
+	aCalcContextResultRange(ctx, &first[1][0], &num[1][0]);
+	aCalcContextResultRange2(ctx, &first[1][1], &num[1][1]);
+	
+	aCalcContextFree(ctx);
+	
+	bool pass = (stat == jstat) && (val[0] == val[1]) && (oval[0] == oval[1]) &&
+		(memcmp(aval[0], aval[1], sizeof(aval[0])) == 0) &&
+		(memcmp(oav[0], oav[1], sizeof(oav[0])) == 0) &&
+		(memcmp(first[0], first[1], sizeof(first[0])) == 0) &&
+		(memcmp(num[0], num[1], sizeof(num[0])) == 0);
+	
+	if(!testOk(pass, "joint: %s and %s", calc, ocal))
+	{
+		testDiag("Expected: %f %f, Got: %f %f", val[0], oval[0], val[1], oval[1]);
+	}
+}
+
+/* Does expr, optimized, compile to the postfix that plain does unoptimized?
+ * plain must end with an operator, so that its postfix ends with its last
+ * nonzero byte.
+ */
+static void testOptExpr(const char* expr, const char* plain)
+{
+	unsigned char rpn[255], rpnPlain[255];
+	short err;
+	int n;
+	
+	memset(rpnPlain, 0, sizeof(rpnPlain));
+	aCalcPostfixOptimize = 0;
+	aCalcPostfix(plain, rpnPlain, &err);
+	aCalcPostfixOptimize = 1;
+	aCalcPostfix(expr, rpn, &err);
+	aCalcPostfixOptimize = 0;
+	
+	for (n = sizeof(rpnPlain); n > 0 && rpnPlain[n-1] == 0; n--);
+	testOk(n > 0 && memcmp(rpn, rpnPlain, n+1) == 0, "%s optimizes to %s", expr, plain);
+}
+
+
+/* Does expr read, and store to, the arguments given? */
+static void testArgUsage(const char* expr, epicsUInt32 inputs, epicsUInt32 stores)
+{
+	unsigned char rpn[255];
+	short err;
+	epicsUInt32 in, st;
+	
+	aCalcPostfix(expr, rpn, &err);
+	aCalcArgUsage(rpn, &in, &st);
+	if (!testOk(in == inputs && st == stores, "arguments of %s", expr))
+	{
+		testDiag("Expected: %#x %#x, Got: %#x %#x", inputs, stores, in, st);
+	}
+}
 
 MAIN(acalcTest)
 {
@@ -125,7 +313,7 @@ MAIN(acalcTest)
 	double* aargs[12] = {AA, BB, CC, DD, EE, FF, GG, HH, II, JJ, KK, LL};
 	
 	
-	testPlan(121);
+	testPlan(173);
 
 	testValExpr("finite(1)", args, aargs, 1);
 	testValExpr("finite(AA)", args, aargs, 1);
@@ -280,5 +468,194 @@ MAIN(acalcTest)
 	testAValExpr("@@0:=BB;AA;aa:=aa-3[0,2]", args, aargs, exp_13, 3);
 	testAValExpr("a:=-7;@@-a:=BB;HH;a:=1;hh:=ii", args, aargs, BB, 3);
 
+	// Elementwise array operators
+	double exp_14[3] = { myDiv(AA[0], DD[0]), myDiv(AA[1], DD[1]), myDiv(AA[2], DD[2]) };
+	testAValExpr("AA/DD", args, aargs, exp_14, 3);
+
+	double exp_15[3] = { fabs(DD[0]), fabs(DD[1]), fabs(DD[2]) };
+	testAValExpr("ABS(DD)", args, aargs, exp_15, 3);
+
+	double exp_16[3] = { (double) (DD[0] >= EE[0]), (double) (DD[1] >= EE[1]), (double) (DD[2] >= EE[2]) };
+	testAValExpr("DD>=EE", args, aargs, exp_16, 3);
+
+	double exp_17[3] = { (double) ((int) BB[0] & 5), (double) ((int) BB[1] & 5), (double) ((int) BB[2] & 5) };
+	testAValExpr("BB&5", args, aargs, exp_17, 3);
+
+	// Fused elementwise expressions
+	double exp_18[3];
+	for (int i = 0; i < 3; i++) exp_18[i] = myDiv((AA[i] - BB[i]) * C, DD[i]) + E;
+	testAValExpr("(AA-BB)*C/DD+E", args, aargs, exp_18, 3);
+
+	double exp_19[3];
+	for (int i = 0; i < 3; i++) exp_19[i] = (A + B) - fabs(BB[i] - 5) * i;
+	testAValExpr("(A+B)-ABS(BB-5)*IX", args, aargs, exp_19, 3);
+
+	double exp_20[3];
+	for (int i = 0; i < 3; i++) exp_20[i] = (AA[i] > 1) * (BB[i] - 4) + AA[i];
+	testAValExpr("(AA>1)*(BB-4)+AA", args, aargs, exp_20, 3);
+
+	// Array arguments are read in place, and copied only when modified
+	double exp_21[3] = { AA[0], AA[0] + AA[1], AA[0] + AA[1] + AA[2] };
+	testAValExpr("CUM(AA)", args, aargs, exp_21, 3);
+	testOk(AA[0] == 1.0 && AA[1] == 2.0 && AA[2] == 3.0, "CUM(AA) leaves AA unchanged");
+
+	double KK_save[12];
+	memcpy(KK_save, KK, sizeof(KK));
+	double exp_22[3] = { KK[0] + 1, KK[1] + 1, KK[2] + 1 };
+	testAValExpr("KK+(KK:=BB;1)", args, aargs, exp_22, 3);
+	memcpy(KK, KK_save, sizeof(KK));
+
+	// Operators on a subrange cost only as much as the subrange
+	double exp_23[3] = { cos(AA[1]), 1, 1 };
+	testAValExpr("COS(AA[1,1])", args, aargs, exp_23, 3);
+	double exp_24[3] = { 1, AA[1] * 2 + 1, 1 };
+	testAValExpr("AA{1,1}*2+1", args, aargs, exp_24, 3);
+	testValExpr("AVG(BB[1,2])", args, aargs, (BB[1] + BB[2]) / 2);
+
+	// Reductions; several of the same array share a pass over it
+	testValExpr("STD(DD)", args, aargs, sqrt(2.0 / 11));
+	testValExpr("AMAX(BB)-IXMIN(BB)+AVG(BB)", args, aargs, 6 - 3 + 15.0 / 12);
+	testValExpr("STD(EE[0,2])+SUM(EE[0,2])+IXMAX(EE[0,2])", args, aargs, 1 + 3 + 2);
+
+	// Loops and nested conditionals
+	testValExpr("a:=0;until(a:=a+1;a>5)*a", args, aargs, 6);
+	testValExpr("a:=1;a>0?until(a:=a+1;a>3)*a:7", args, aargs, 4);
+	testValExpr("D?(C>3?1:C?2:3):4", args, aargs, 2);
+
+	// Caller-owned evaluation context
+	testCtxExpr("AA+BB*C", args, aargs);
+	testCtxExpr("sum(CUM(AA)[0,2])", args, aargs);
+	testCtxExpr("nderiv(AA,1)+fitpoly(BB)", args, aargs);
+
+	// Random numbers
+	testValExpr("(AMIN(ARNDM)>0)&&(AMAX(ARNDM)<=1)", args, aargs, 1);
+	testValExpr("FINITE(ANRNDM)&&(AMAX(ABS(ANRNDM))<10)", args, aargs, 1);
+	{
+		unsigned char rpn[255];
+		short err;
+		double val[2];
+		double aval[2][12];
+		epicsUInt32 amask;
+		aCalcContext *ctx = aCalcContextCreate(12);
+
+		aCalcPostfix("ANRNDM+RNDM", rpn, &err);
+		for (int n = 0; n < 2; n++)
+		{
+			aCalcContextSeed(ctx, 1234);
+			aCalcPerformCtx(ctx, args, 12, aargs, 12, 12, &val[n], aval[n], rpn, 12, &amask);
+		}
+		aCalcContextFree(ctx);
+		testOk(memcmp(aval[0], aval[1], sizeof(aval[0])) == 0, "aCalcContextSeed repeats the sequence");
+	}
+	{
+		unsigned char rpn[2][255];
+		short err;
+		double val, aval[12] = {0};
+		epicsUInt32 amask;
+		int first[3], num[3];
+		aCalcContext *ctx = aCalcContextCreate(12);
+
+		aCalcPostfix("IX", rpn[0], &err);
+		aCalcPostfix("IX+(IX>3&&IX<7)", rpn[1], &err);
+		for (int n = 0; n < 3; n++)
+		{
+			aCalcPerformCtx(ctx, args, 12, aargs, 12, 12, &val, aval, rpn[n > 0], 12, &amask);
+			aCalcContextResultRange(ctx, &first[n], &num[n]);
+		}
+		aCalcContextFree(ctx);
+		testOk(first[1] == 4 && num[1] == 3 && num[2] == 0 && aval[5] == 6,
+			"aCalcContextResultRange reports the elements changed");
+	}
+
+	// Two expressions evaluated in one pass, sharing subexpressions
+	testJointExpr("NSMOO(AA-BB,2)*C", "AMAX(NSMOO(AA-BB,2)*C)", args, aargs);
+	testJointExpr("CUM(AA)[0,2]", "A?(CUM(AA)[0,2]+BB):SUM(CUM(AA)[0,2])", args, aargs);
+	testJointExpr("AA*2+VAL", "AVG(AA*2)+VAL", args, aargs);
+
+	// Array arguments that hold floats or integers
+	testTypedExpr<epicsFloat32>("AVG(AA*C-BB)+SUM(FF/4)", ACALC_TYPE_FLOAT32, args, aargs);
+	testTypedExpr<epicsInt32>("CC:=AA*2+BB;@@2-DD", ACALC_TYPE_INT32, args, aargs);
+	testTypedExpr<epicsUInt16>("@@(A+1):=AA*E;BB:=3;BB*CC+DD", ACALC_TYPE_UINT16, args, aargs);
+
+	// Arguments an expression uses
+	testArgUsage("B:=AA[C,D]+VAL;E", ACALC_ARG_A << 2 | ACALC_ARG_A << 3 | ACALC_ARG_A << 4 |
+		ACALC_ARG_AA | ACALC_ARG_VAL, ACALC_ARG_A << 1);
+	testArgUsage("@@2+ARNDM*@(A)", ACALC_ARG_ALL_SCALARS | ACALC_ARG_ALL_ARRAYS | ACALC_ARG_RANDOM, 0);
+	
+	// Optimized postfix
+	testOptExpr("10^3+A", "1000+A");
+	testOptExpr("0?B:A^2", "A*A");
+	testOptExpr("AA/4", "AA*0.25");
+	testOptExpr("SIN(A)+SIN(A)", "SIN(A)*2");
+	aCalcPostfixOptimize = 1;
+	testValExpr("2*PI*R2D*B", args, aargs, 360 * B);
+	testValExpr("(C>2?D:E)+MAX(1,2)+((C-B)>?(C-B))", args, aargs, D + 2 + (C - B));
+	double exp_25[3] = { (AA[0] - 1) * (AA[0] - 1) + BB[0] / 2,
+		(AA[1] - 1) * (AA[1] - 1) + BB[1] / 2, (AA[2] - 1) * (AA[2] - 1) + BB[2] / 2 };
+	testAValExpr("(AA-1)^2+BB/2", args, aargs, exp_25, 3);
+	aCalcPostfixOptimize = 0;
+
+	// Stack checked when the expression is compiled
+	{
+		unsigned char rpn[255];
+		short err;
+		testOk(aCalcPostfix("FITMQ(AA)", rpn, &err) && err == CALC_ERR_UNDERFLOW, "FITMQ(AA) rejected: %s", aCalcErrorStr(err));
+	}
+	testValExpr("NSMOO(B,1)", args, aargs, args[1]);
+	testCtxExpr("FITMPOLY(AA,1)+A*B", args, aargs);
+
+	// Names that begin other names, in either case
+	testValExpr("ln(1)+Loge(1)+LOG(10)+sqr(4)+Sqrt(9)+(C>?B)", args, aargs, 1 + 2 + 3 + (args[2] > args[1] ? args[2] : args[1]));
+
+	// Compiled expressions shared among records
+	{
+		const unsigned char *p1 = NULL, *p2 = NULL, *p3 = NULL, *p4 = NULL;
+		short err;
+		double val, aval[12];
+		epicsUInt32 amask;
+
+		calcCachePostfix(CALC_CACHE_ACALC, "A+B", &p1, &err);
+		calcCachePostfix(CALC_CACHE_ACALC, "A+B", &p2, &err);
+		calcCachePostfix(CALC_CACHE_SCALC, "A+B", &p3, &err);
+		testOk(p1 && p1 == p2 && p1 != p3, "calcCachePostfix shares a compiled expression");
+		calcCachePostfix(CALC_CACHE_ACALC, "B-C", &p2, &err);
+		aCalcPerform(args, 12, aargs, 12, 12, &val, aval, p2, 12, &amask);
+		testOk(p1 != p2 && val == args[1] - args[2], "calcCachePostfix replaces an expression");
+		sCalcPostfixLower = 0;
+		calcCachePostfix(CALC_CACHE_SCALC, "A+B", &p4, &err);
+		sCalcPostfixLower = 1;
+		testOk(p4 && p4 != p3, "calcCachePostfix recompiles when a compiler setting changes");
+		sCalcPostfixNative = 1;
+		calcCachePostfix(CALC_CACHE_SCALC, "A+B", &p4, &err);
+		sCalcPostfixNative = 0;
+		calcCachePostfix(CALC_CACHE_SCALC, "A+B", &p2, &err);
+		testOk(p4 && p4 != p3 && p2 == p3, "sCalcPostfixNative selects a different compiled expression");
+		calcCacheRelease(p1);
+		calcCacheRelease(p2);
+		calcCacheRelease(p3);
+		calcCacheRelease(p4);
+	}
+
+	// The context aCalcPerform() keeps for this thread can be freed
+	{
+		double val, aval[12];
+		epicsUInt32 amask;
+		unsigned char rpn[255];
+		short err;
+		long before = acalcTotalAllocatedMemory();
+		
+		aCalcPerformThreadCleanup();
+		testOk(acalcTotalAllocatedMemory() < before, "aCalcPerformThreadCleanup frees the thread's context");
+		aCalcPostfix("SUM(AA)", rpn, &err);
+		aCalcPerform(args, 12, aargs, 12, 12, &val, aval, rpn, 12, &amask);
+		testOk(val == AA[0] + AA[1] + AA[2], "aCalcPerform makes a new context after cleanup");
+		before = acalcTotalAllocatedMemory();
+		aCalcPostfixOptimize = 1;
+		aCalcPostfix("2^3+A", rpn, &err);
+		aCalcPostfixOptimize = 0;
+		testOk(acalcTotalAllocatedMemory() == before, "optimizing keeps the thread's context");
+		aCalcPerformThreadCleanup();
+	}
+
 	return testDone();
 }
@@ -9,6 +9,11 @@
 #include <testMain.h>
 
 #include "sCalcPostfix.h"
+#include "calcCache.h"
+
+extern "C" volatile int sCalcPostfixOptimize;
+extern "C" volatile int sCalcPostfixLower;
+extern "C" volatile int sCalcPostfixNative;
 
 
 static void testValExpr(const char* expr, double* args, const char** sargs, double expected)
@@ -75,6 +80,97 @@ static void testSValExpr(const char* expr, double* args, const char** sargs, con
 }
 
 
+/* Does expr, optimized, compile to the postfix that plain does unoptimized?
+ * plain must end with an operator, so that its postfix ends with its last
+ * nonzero byte.  Whether postfix is lowered to a register program depends on
+ * the length of the expression, so it isn't.
+ */
+static void testOptExpr(const char* expr, const char* plain)
+{
+	unsigned char rpn[255], rpnPlain[255];
+	short err;
+	int n;
+	
+	memset(rpnPlain, 0, sizeof(rpnPlain));
+	sCalcPostfixLower = 0;
+	sCalcPostfixOptimize = 0;
+	sCalcPostfix(plain, rpnPlain, &err);
+	sCalcPostfixOptimize = 1;
+	sCalcPostfix(expr, rpn, &err);
+	sCalcPostfixOptimize = 0;
+	sCalcPostfixLower = 1;
+	
+	for (n = sizeof(rpnPlain); n > 0 && rpnPlain[n-1] == 0; n--);
+	testOk(n > 0 && memcmp(rpn, rpnPlain, n+1) == 0, "%s optimizes to %s", expr, plain);
+}
+
+
+/* Does expr read, and store to, the arguments given? */
+static void testArgUsage(const char* expr, epicsUInt32 inputs, epicsUInt32 stores)
+{
+	unsigned char rpn[255];
+	short err;
+	epicsUInt32 in, st;
+	
+	sCalcPostfix(expr, rpn, &err);
+	sCalcArgUsage(rpn, &in, &st);
+	if (!testOk(in == inputs && st == stores, "arguments of %s", expr))
+	{
+		testDiag("Expected: %#x %#x, Got: %#x %#x", inputs, stores, in, st);
+	}
+}
+
+/* Value of expr, compiled by the expression cache (which alone makes machine code) */
+static void testCachedValExpr(const char* expr, double* args, const char** sargs, double expected)
+{
+	const unsigned char *rpn = NULL;
+	short err;
+	double val = 0.;
+	char sval[256];
+	
+	if (calcCachePostfix(CALC_CACHE_SCALC, expr, &rpn, &err) == 0)
+		sCalcPerform(args, 12, (char**) sargs, 12, &val, sval, 256, rpn, 3);
+	if (!testOk(fabs(expected - val) < 1e-8, "%s, cached", expr))
+	{
+		testDiag("Expected: %f, Got: %f", expected, val);
+	}
+	calcCacheRelease(rpn);
+}
+
+/* Is expr's string value expected when it's compiled into a buffer that held,
+ * and evaluated, first?
+ */
+static void testRecompile(const char* first, const char* expr, double* args, const char** sargs, const char* expected)
+{
+	unsigned char rpn[255];
+	short err;
+	double val;
+	char sval[256];
+	
+	sCalcPostfix(first, rpn, &err);
+	sCalcPerform(args, 12, (char**) sargs, 12, &val, sval, 256, rpn, 3);
+	sCalcPostfix(expr, rpn, &err);
+	sCalcPerform(args, 12, (char**) sargs, 12, &val, sval, 256, rpn, 3);
+	if (!testOk(strcmp(sval, expected) == 0, "%s after %s", expr, first))
+	{
+		testDiag("Expected: %s, Got: %s", expected, sval);
+	}
+}
+
+/* Value of an NRNDM expression, which differs from call to call */
+static double sCalcRandom(double* args, const char** sargs)
+{
+	unsigned char rpn[255];
+	short err;
+	double val = 0.0;
+	char sval[256];
+	
+	sCalcPostfix("NRNDM+RNDM", rpn, &err);
+	sCalcPerform(args, 12, (char**) sargs, 12, &val, sval, 256, rpn, 3);
+	return val;
+}
+
+
 MAIN(scalcTest)
 {
 	double A = 1.0;
@@ -106,7 +202,7 @@ MAIN(scalcTest)
 	double args[12] = {A, B, C, D, E, F, G, H, I, J, K, L};
 	const char* sargs[12] = {AA, BB, CC, DD, EE, FF, GG, HH, II, JJ, KK, LL};
 	
-	testPlan(113);
+	testPlan(145);
 
 	testValExpr("finite(1)", args, sargs, 1);
 	testValExpr("isnan(1)", args, sargs, 0);
@@ -225,6 +321,19 @@ MAIN(scalcTest)
 	testSValExpr("LL[0,'.']", args, sargs, sLL.substr(0, sLL.find_first_of(".")).c_str());
 	testSValExpr("A>B?BB:AA[A,A]", args, sargs, A>B ? BB : sAA.substr((int) A, 1).c_str());
 	testSValExpr("'abcdef'{'bc','gh'}", args, sargs, "aghdef");
+	testValExpr("(RNDM>0)&&(RNDM<=1)", args, sargs, 1);
+	sCalcPerformSeed(1234);
+	double r = sCalcRandom(args, sargs);
+	sCalcPerformSeed(1234);
+	testOk(sCalcRandom(args, sargs) == r, "sCalcPerformSeed repeats the sequence");
+	sCalcPerformSeed(1234);
+	sCalcPostfixOptimize = 1;
+	testSValExpr("AA+STR(2^3)", args, sargs, (std::string(AA) + "8.00000000").c_str());
+	sCalcPostfixOptimize = 0;
+	testOk(sCalcRandom(args, sargs) == r, "optimizing keeps the thread's sequence");
+	sCalcPerformThreadCleanup();
+	testSValExpr("AA+STR(2^3)", args, sargs, (std::string(AA) + "8.00000000").c_str());
+
 	testSValExpr("'yyy:'+'xxx:abc'-'xxx:'", args, sargs, "yyy:abc");
 	testSValExpr("@@0:=BB;AA;aa:='string 1'", args, sargs, BB);
 	testSValExpr("a:=-1;@@-a:=AA;BB;a:=1;bb:='string 2'", args, sargs, AA);
@@ -253,5 +362,64 @@ MAIN(scalcTest)
 	sprintf(temp, "%s%s%s%s", DD, AA, EE, BB);
 	testSValExpr("DD+AA+EE+BB", args, sargs, temp);
 	
+	// Optimized postfix
+	testOptExpr("10^3+A", "1000+A");
+	testOptExpr("A/4+B", "A*0.25+B");
+	testOptExpr("1?A^2:B", "A*A");
+	sCalcPostfixOptimize = 1;
+	testValExpr("(C-B)^2+D/4", args, sargs, (args[2] - args[1]) * (args[2] - args[1]) + args[3] / 4);
+	sprintf(temp, "%s%s", sargs[0], sargs[0]);
+	testSValExpr("AA+AA", args, sargs, temp);
+	sCalcPostfixOptimize = 0;
+	
+	// Names that begin other names, in either case
+	testValExpr("ln(1)+Loge(1)+LOG(10)+sqr(4)+Sqrt(9)+(C>?B)", args, sargs, 1 + 2 + 3 + (args[2] > args[1] ? args[2] : args[1]));
+	
+	// Intermediate strings aren't limited to 40 characters
+	sprintf(temp, "%s%s%s%s%s%s", AA, BB, CC, DD, EE, FF);
+	testSValExpr("AA+BB+CC+DD+EE+FF", args, sargs, temp);
+	
+	// Storing to a string argument doesn't change a value already fetched from it
+	sprintf(temp, "%sy", AA);
+	testSValExpr("AA+(AA:='y';AA)", args, sargs, temp);
+	
+	// Formats compiled into plans
+	sprintf(temp, "A=%-9.3f|", A);
+	testSValExpr("$P('A=%-9.3f|',A)", args, sargs, temp);
+	sprintf(temp, "%06X", 1234567);
+	testSValExpr("$P('%06X',1234567)", args, sargs, temp);
+	testValExpr("SSCANF('x= 1f;','x=%x')", args, sargs, 31);
+	testValExpr("SSCANF('-4.5e2 q','%lf')", args, sargs, -450);
+	sprintf(temp, "ab%.2o", 1);
+	testRecompile("$P('ab %4o',A)", "$P('ab%.2o',A)", args, sargs, temp);
+	
+	// Conversions between numbers and strings
+	testValExpr("-' -1.25e2x'", args, sargs, 125);
+	testSValExpr("STR(A)+'|'+STR(A)+'|'+STR(B)", args, sargs, "1.00000000|1.00000000|2.00000000");
+	
+	// Substring search
+	testSValExpr("'V=12.5 mA'['=',' ']+'a,b,c,b'|-',b'+'x-y-z'-'-'", args, sargs, "12.5a,b,cxy-z");
+	testSValExpr("'a,b,c,b'{',b',';'}", args, sargs, "a;,c,b");
+	
+	// Checksums
+	testSValExpr("MODBUS('123456789')", args, sargs, "123456789\\x37\\x4b");
+	testSValExpr("CRC16('\\x80\\xff\\x01')", args, sargs, "\\xf0\\x18");
+	testSValExpr("CCITT('123456789')+ADD_CRC32('')", args, sargs, "\\x29\\xb1");
+	testSValExpr("CRC32('123456789')", args, sargs, "\\x26\\x39\\xf4\\xcb");
+	
+	// Register programs
+	testValExpr("L+(L:=0;UNTIL(L:=L+1;L>=5))+L*10;L:=12", args, sargs, 12 + 1 + 50);
+	testValExpr("N:=3;N+M+(A>B?@0:@(B+1))", args, sargs, D);
+	sCalcPostfixNative = 1;
+	testValExpr("A<B?(SQRT(C*C+D*D)-F>?-A)+(-E<=-5)*ATAN2(0,1):L", args, sargs, -1 + atan2(1., 0.));
+	testCachedValExpr("A<B?(SQRT(C*C+D*D)-F>?-A)+(-E<=-5)*ATAN2(0,1):L", args, sargs, -1 + atan2(1., 0.));
+	sCalcPostfixNative = 0;
+	
+	// Arguments an expression uses
+	testArgUsage("B:=A+C*VAL;RNDM>D", SCALC_ARG_A | SCALC_ARG_A << 2 | SCALC_ARG_A << 3 |
+		SCALC_ARG_VAL | SCALC_ARG_RANDOM, SCALC_ARG_A << 1);
+	testArgUsage("BB:=AA+SVAL;CC+printf('%d',E)", SCALC_ARG_AA | SCALC_ARG_AA << 2 |
+		SCALC_ARG_A << 4 | SCALC_ARG_VAL, SCALC_ARG_AA << 1);
+	
 	return testDone();
 }